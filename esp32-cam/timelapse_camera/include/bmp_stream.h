@@ -0,0 +1,33 @@
+#ifndef BMP_STREAM_H
+#define BMP_STREAM_H
+
+// Frame export as an uncompressed 24-bit BMP without a full-frame output
+// buffer. The header goes out first, then the pixel rows, converted from the
+// frame (or decoded from its JPEG) into a small band buffer that is sent and
+// reused BMP_BAND_ROWS rows at a time. The BMP is stored top-down, so rows
+// leave in the order the frame holds them.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_camera.h"
+#include "img_converters.h"
+
+// Rows converted per send. At least 16, the tallest JPEG MCU.
+#define BMP_BAND_ROWS 16
+
+#define BMP_HEADER_SIZE 54
+
+// Size of the BMP of a width x height frame
+size_t bmp_stream_size(uint16_t width, uint16_t height);
+
+// Converts a frame to BMP and hands it to cb piece by piece, the same way
+// frame2jpg_cb() does. For PIXFORMAT_JPEG the size comes from the JPEG and
+// width/height are ignored; RGB565, YUV422 and GRAYSCALE are converted
+// directly. Returns false on an unsupported format, decode error or when cb
+// does not accept a piece.
+bool bmp_stream_frame(const uint8_t *buf, size_t len, uint16_t width,
+                      uint16_t height, pixformat_t format, jpg_out_cb cb,
+                      void *arg);
+
+#endif
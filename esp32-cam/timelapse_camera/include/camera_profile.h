@@ -0,0 +1,88 @@
+#ifndef CAMERA_PROFILE_H
+#define CAMERA_PROFILE_H
+
+// Preview and archival capture profiles. /stream only needs enough detail to
+// aim the camera, so it runs at a smaller frame size and a higher JPEG
+// compression than the timelapse shots. Switching goes through the sensor's
+// set_framesize/set_quality registers instead of a driver re-init; the frame
+// buffers are allocated once for the archival size, which must be the larger
+// of the two.
+
+#include <stdint.h>
+
+#include "esp_camera.h"
+
+#ifndef PREVIEW_FRAMESIZE
+#define PREVIEW_FRAMESIZE FRAMESIZE_VGA // 640x480
+#endif
+#ifndef PREVIEW_JPEG_QUALITY
+#define PREVIEW_JPEG_QUALITY 30 // 0-63, lower means higher quality
+#endif
+#ifndef ARCHIVAL_FRAMESIZE
+#define ARCHIVAL_FRAMESIZE FRAMESIZE_SVGA // 800x600
+#endif
+#ifndef ARCHIVAL_JPEG_QUALITY
+#define ARCHIVAL_JPEG_QUALITY 12
+#endif
+
+// Pixel format the sensor delivers. JPEG comes straight from the sensor; the
+// raw formats keep uncompressed pixels available for analysis and are
+// software-encoded (see jpeg_stream.h) wherever a JPEG is sent or stored.
+// Raw frame buffers are 2 bytes per pixel (1 for grayscale), so keep
+// ARCHIVAL_FRAMESIZE at SVGA or below with them.
+#define _FRAME_FORMAT_JPEG 1
+#define _FRAME_FORMAT_RGB565 2
+#define _FRAME_FORMAT_YUV422 3
+#define _FRAME_FORMAT_GRAYSCALE 4
+
+#ifndef CAMERA_FRAME_FORMAT
+#define CAMERA_FRAME_FORMAT _FRAME_FORMAT_JPEG
+#endif
+
+#if CAMERA_FRAME_FORMAT == _FRAME_FORMAT_JPEG
+#define CAMERA_PIXEL_FORMAT PIXFORMAT_JPEG
+#elif CAMERA_FRAME_FORMAT == _FRAME_FORMAT_RGB565
+#define CAMERA_PIXEL_FORMAT PIXFORMAT_RGB565
+#elif CAMERA_FRAME_FORMAT == _FRAME_FORMAT_YUV422
+#define CAMERA_PIXEL_FORMAT PIXFORMAT_YUV422
+#elif CAMERA_FRAME_FORMAT == _FRAME_FORMAT_GRAYSCALE
+#define CAMERA_PIXEL_FORMAT PIXFORMAT_GRAYSCALE
+#else
+#error "Unknown CAMERA_FRAME_FORMAT. Must be 1 (JPEG), 2 (RGB565), 3 (YUV422) or 4 (GRAYSCALE)."
+#endif
+
+typedef enum {
+  CAMERA_PROFILE_NONE = 0, // camera not initialized
+  CAMERA_PROFILE_PREVIEW,
+  CAMERA_PROFILE_ARCHIVAL,
+} camera_profile_t;
+
+typedef struct {
+  uint32_t switches;
+  uint32_t failures;
+  uint32_t last_switch_us; // register writes plus discarded stale frames
+  uint32_t max_switch_us;
+  uint32_t discarded;      // stale frames thrown away over all switches
+} camera_profile_stats_t;
+
+// Fills the pixel format and the archival profile's frame size and quality
+// into a driver config, so esp_camera_init() sizes the frame buffers for it
+void camera_profile_configure(camera_config_t *config);
+
+// Call after every successful esp_camera_init() with the config it was given:
+// the sensor then runs the archival profile
+void camera_profile_begin(const camera_config_t *config);
+
+// Call after esp_camera_deinit()
+void camera_profile_end();
+
+// Switches the sensor to a profile unless it already runs it, discarding
+// frames captured with the old settings. Safe to call from several tasks.
+// Returns false if the camera is not initialized or the sensor refused.
+bool camera_profile_apply(camera_profile_t profile);
+
+camera_profile_t camera_profile_current();
+const char *camera_profile_name(camera_profile_t profile);
+void camera_profile_get_stats(camera_profile_stats_t *stats);
+
+#endif
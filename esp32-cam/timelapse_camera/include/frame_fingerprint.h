@@ -0,0 +1,35 @@
+#ifndef FRAME_FINGERPRINT_H
+#define FRAME_FINGERPRINT_H
+
+// Fingerprint of a frame for skipping near-duplicate timelapse shots: the
+// mean luma of an 8x8 grid of cells, taken from the 1/8-scale thumbnail
+// (see jpeg_dc.h), so each cell averages 1/64 of the image and sensor noise
+// cancels out. Two frames are as far apart as their most different cell, so
+// a change confined to one corner still counts in full.
+//
+// No platform dependencies: the host tools build this file as well.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_FINGERPRINT_GRID 8
+
+// Largest cell difference, in luma levels, at which a frame still counts as
+// a duplicate of the last stored one
+#ifndef TIMELAPSE_DEDUP_DISTANCE
+#define TIMELAPSE_DEDUP_DISTANCE 4
+#endif
+
+typedef struct {
+  uint8_t cells[FRAME_FINGERPRINT_GRID * FRAME_FINGERPRINT_GRID];
+} frame_fingerprint_t;
+
+// Fills out from a thumbnail of at least 8x8. Returns false if it is smaller.
+bool frame_fingerprint_from_thumb(const uint8_t *thumb, uint16_t width,
+                                  uint16_t height, frame_fingerprint_t *out);
+
+// Largest absolute cell difference, 0-255
+uint8_t frame_fingerprint_distance(const frame_fingerprint_t *a,
+                                   const frame_fingerprint_t *b);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef FRAME_QUALITY_H
+#define FRAME_QUALITY_H
+
+// Cheap quality score for picking the best frame of a burst, measured in the
+// JPEG domain from what jpeg_dc_decode() gives: fine detail from the count of
+// nonzero luma AC coefficients (blur and camera shake zero them out), exposure
+// from the share of thumbnail blocks that are near black or white.
+//
+// Only comparable between frames of the same size and JPEG quality, which is
+// the case within a burst.
+//
+// No platform dependencies; host tests in test/test_frame_quality.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Block means at or beyond these count as clipped
+#define FRAME_QUALITY_DARK 16
+#define FRAME_QUALITY_BRIGHT 240
+
+typedef struct {
+  uint32_t detail;  // nonzero luma AC coefficients per 100 blocks
+  uint16_t clipped; // permille of the thumbnail near black or white
+  uint32_t score;   // detail, scaled down by the clipped share
+} frame_quality_t;
+
+void frame_quality_measure(const uint8_t *thumb, uint16_t width,
+                           uint16_t height, uint32_t ac_nonzero,
+                           frame_quality_t *out);
+
+#endif
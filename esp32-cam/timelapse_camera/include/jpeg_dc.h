@@ -0,0 +1,30 @@
+#ifndef JPEG_DC_H
+#define JPEG_DC_H
+
+// Reads the DC coefficients of a baseline JPEG without decoding any pixels.
+// The DC term of an 8x8 block is the block's mean, so the luma DCs form a
+// 1/8-scale grayscale thumbnail at the cost of one pass over the Huffman-
+// coded data, a fraction of a full decode. Counting the nonzero luma AC
+// coefficients on the way gives a measure of fine detail for free.
+//
+// No platform dependencies: the host tools build this file as well.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  uint8_t *luma;       // caller's buffer of max_blocks bytes, row-major
+  size_t max_blocks;
+  uint16_t width;      // thumbnail size: the image size / 8, rounded up
+  uint16_t height;
+  uint16_t image_width;
+  uint16_t image_height;
+  uint32_t ac_nonzero; // nonzero luma AC coefficients in the whole image
+} jpeg_dc_t;
+
+// Fills out->luma and the sizes from a baseline (SOF0/SOF1) JPEG. Returns
+// false for progressive or otherwise unsupported JPEGs, corrupt data, or a
+// thumbnail larger than out->max_blocks.
+bool jpeg_dc_decode(const uint8_t *jpeg, size_t len, jpeg_dc_t *out);
+
+#endif
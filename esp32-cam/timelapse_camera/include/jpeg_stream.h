@@ -0,0 +1,39 @@
+#ifndef JPEG_STREAM_H
+#define JPEG_STREAM_H
+
+// Software JPEG encoding of raw (CAMERA_FRAME_FORMAT other than JPEG) frames
+// straight into their destination. The encoder hands out its output a couple
+// of KB at a time, which goes to the socket or the card as it comes, so no
+// full-frame output buffer is allocated and the first bytes leave before the
+// last MCU row is encoded.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "camera_profile.h"
+#include "esp_camera.h"
+
+// Encoder quality (1-100) for raw frames
+#ifndef SOFT_JPEG_QUALITY
+#define SOFT_JPEG_QUALITY 80
+#endif
+
+// Extra stack for tasks that may run the encoder
+#if CAMERA_FRAME_FORMAT == _FRAME_FORMAT_JPEG
+#define JPEG_ENCODE_STACK_EXTRA 0
+#else
+#define JPEG_ENCODE_STACK_EXTRA 4096
+#endif
+
+// Encodes a raw frame into fd at its current position, through the SD
+// writer's staging buffer. Writer task only. Sets *len to the JPEG size and,
+// if crc is not NULL, *crc to its segment_crc32().
+bool jpeg_stream_to_fd(camera_fb_t *fb, int fd, size_t *len, uint32_t *crc);
+
+// Makes a jpeg_stream_to_fd() of fb, running or yet to start, fail at the
+// encoder's next output instead of finishing, until lifted with
+// jpeg_stream_cancel(NULL). For giving up on a write that a slow card holds
+// up. Any task; one frame at a time.
+void jpeg_stream_cancel(const camera_fb_t *fb);
+
+#endif
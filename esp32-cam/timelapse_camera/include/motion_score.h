@@ -0,0 +1,90 @@
+#ifndef MOTION_SCORE_H
+#define MOTION_SCORE_H
+
+// Motion score of a frame against a running background, computed on a
+// 1/8-scale luma thumbnail (see jpeg_dc.h), and the controller that turns the
+// scores into a timelapse interval.
+//
+// The kernels are plain integer loops over contiguous arrays without
+// data-dependent branches, so the compiler can unroll or vectorize them.
+// No platform dependencies: the host tools build this file as well.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Luma difference (0-255) at which a thumbnail pixel counts as changed
+#ifndef MOTION_PIXEL_THRESHOLD
+#define MOTION_PIXEL_THRESHOLD 16
+#endif
+
+// The background moves 1/2^shift of the way towards each new frame
+#ifndef MOTION_BACKGROUND_SHIFT
+#define MOTION_BACKGROUND_SHIFT 2
+#endif
+
+// Changed share of the thumbnail, in permille, that counts as motion
+#ifndef MOTION_THRESHOLD_PERMILLE
+#define MOTION_THRESHOLD_PERMILLE 20
+#endif
+
+typedef struct {
+  uint16_t width;
+  uint16_t height;
+  size_t max_pixels;
+  uint16_t *background; // luma << 4, so slow drift is not lost to rounding
+  uint32_t frames;      // frames folded into the background
+  uint8_t pixel_threshold;
+  uint8_t background_shift;
+} motion_detector_t;
+
+// Allocates the background for thumbnails of up to max_pixels
+bool motion_detector_init(motion_detector_t *det, size_t max_pixels);
+void motion_detector_free(motion_detector_t *det);
+
+// Scores a thumbnail against the background, then folds it in. A uniform
+// brightness change (a cloud, auto exposure) is subtracted before comparing.
+// Returns the changed share of the thumbnail in permille; 0 for the first
+// frame and whenever the thumbnail size changes, which restarts the
+// background.
+uint16_t motion_detector_update(motion_detector_t *det, const uint8_t *thumb,
+                                uint16_t width, uint16_t height);
+
+// Kernels. bg holds luma << 4; offset is in the same unit.
+uint32_t motion_sum_u8(const uint8_t *px, size_t n);
+uint32_t motion_sum_u16(const uint16_t *px, size_t n);
+uint32_t motion_count_changed(const uint8_t *px, const uint16_t *bg, size_t n,
+                              int32_t offset, int32_t threshold);
+void motion_blend(uint16_t *bg, const uint8_t *px, size_t n, int shift);
+
+// Builds a 1/8-scale luma thumbnail from a raw frame by averaging 8x8 blocks,
+// matching what jpeg_dc_decode() gives for a JPEG. YUV422 carries luma in the
+// even bytes; RGB565 is high byte first, as the camera driver stores it.
+// Returns false if the thumbnail would exceed max_pixels.
+typedef enum {
+  MOTION_RAW_GRAYSCALE,
+  MOTION_RAW_YUV422,
+  MOTION_RAW_RGB565,
+} motion_raw_format_t;
+
+bool motion_thumb_from_raw(const uint8_t *buf, uint16_t width, uint16_t height,
+                           motion_raw_format_t format, uint8_t *thumb,
+                           size_t max_pixels, uint16_t *thumb_width,
+                           uint16_t *thumb_height);
+
+// Adaptive timelapse interval: drops to min_ms as soon as a frame shows
+// motion and grows by half per motionless frame back up to max_ms. Scores
+// between half the threshold and the threshold keep the current interval.
+typedef struct {
+  uint32_t interval_ms;
+  uint32_t min_ms;
+  uint32_t max_ms;
+  uint16_t threshold; // permille
+} motion_rate_t;
+
+void motion_rate_init(motion_rate_t *rate, uint32_t min_ms, uint32_t max_ms,
+                      uint16_t threshold);
+
+// Returns the interval until the next frame
+uint32_t motion_rate_update(motion_rate_t *rate, uint16_t score);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef SD_BENCH_H
+#define SD_BENCH_H
+
+// SD card benchmark: sequential writes, random small writes, file open/close
+// rate and fsync latency, each run with the card mounted in 1-bit and/or
+// 4-bit SD_MMC mode. Meant for telling good cards from ones that will stall
+// the timelapse writes, so the numbers are latency percentiles rather than
+// just averages.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SD_BENCH_DIR "/sd_bench"
+#define SD_BENCH_RESULT_PATH "/sd_bench.json"
+#define SD_BENCH_JSON_MAX 2048 // room for a two-mode report
+
+#define SD_BENCH_BUS_1BIT 0x01
+#define SD_BENCH_BUS_4BIT 0x02
+
+// Sequential write: SD_BENCH_SEQ_BYTES in SD_BENCH_SEQ_CHUNK writes
+#ifndef SD_BENCH_SEQ_BYTES
+#define SD_BENCH_SEQ_BYTES (2 * 1024 * 1024)
+#endif
+#define SD_BENCH_SEQ_CHUNK (16 * 1024)
+// Random writes: SD_BENCH_RANDOM_OPS aligned 4 KB writes into the sequential file
+#define SD_BENCH_RANDOM_OPS 200
+#define SD_BENCH_RANDOM_SIZE 4096
+// Open/close: create, write one byte and close this many files
+#define SD_BENCH_OPEN_CLOSE_FILES 50
+// fsync: append a log-line-sized record and fsync this many times
+#define SD_BENCH_FSYNC_OPS 100
+#define SD_BENCH_FSYNC_SIZE 64
+
+typedef struct {
+  uint32_t samples;
+  uint32_t p50_us;
+  uint32_t p90_us;
+  uint32_t p99_us;
+  uint32_t max_us;
+  uint32_t rate; // KB/s for the write tests, operations/s otherwise
+} sd_bench_result_t;
+
+typedef struct {
+  uint8_t bus_width; // 1 or 4
+  bool mounted;      // false if the card would not mount in this mode
+  sd_bench_result_t seq_write;
+  sd_bench_result_t random_write;
+  sd_bench_result_t open_close;
+  sd_bench_result_t fsync;
+} sd_bench_mode_t;
+
+typedef struct {
+  uint8_t count;
+  sd_bench_mode_t modes[2];
+} sd_bench_report_t;
+
+// Runs the benchmark on the SD writer task for each bus mode in bus_modes
+// (SD_BENCH_BUS_*), then remounts the card in its configured bus width and
+// stores the JSON report at SD_BENCH_RESULT_PATH. Blocks until done; queued
+// writes wait.
+bool sd_bench_run(uint8_t bus_modes, sd_bench_report_t *report);
+
+// State of the background run started by sd_bench_start()
+#define SD_BENCH_IDLE 0 // none since boot
+#define SD_BENCH_RUNNING 1
+#define SD_BENCH_DONE 2
+#define SD_BENCH_FAILED 3
+
+// Queues the same run without waiting for it, e.g. from an HTTP handler.
+// Returns false if a background run is still in progress.
+bool sd_bench_start(uint8_t bus_modes);
+
+// Returns the background run's SD_BENCH_* state, copying its report once it is
+// SD_BENCH_DONE
+uint8_t sd_bench_status(sd_bench_report_t *report);
+
+// Formats a report as JSON. Returns the length, like snprintf().
+int sd_bench_to_json(const sd_bench_report_t *report, char *buf, size_t len);
+
+// Fills in a result's percentiles from its latency samples (sorted in place)
+void sd_bench_summarize(uint32_t *samples_us, uint32_t count,
+                        sd_bench_result_t *result);
+
+#endif
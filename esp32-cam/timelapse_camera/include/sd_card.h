@@ -0,0 +1,35 @@
+#ifndef SD_CARD_H
+#define SD_CARD_H
+
+// SD_MMC mounting with a selectable bus width. 4-bit mode moves roughly four
+// times the data per clock, but on the AI Thinker board DATA1 shares GPIO 4
+// with the flash LED (which then flickers during writes) and some boards or
+// cards do not work with it at all, so a failed 4-bit mount falls back to
+// 1-bit.
+
+#include <stdint.h>
+
+#define SD_MOUNT_POINT "/sdcard"
+
+// Bus width tried first: 4 or 1
+#ifndef SD_BUS_WIDTH
+#define SD_BUS_WIDTH 1
+#endif
+
+// Mounts the card with the requested bus width, falling back to 1-bit
+bool sd_card_mount();
+
+// Unmounts and mounts again, e.g. after the card dropped off the bus
+bool sd_card_remount();
+
+// Bus width used by future mounts; starts out as SD_BUS_WIDTH
+void sd_card_set_bus_width(uint8_t bus_width);
+uint8_t sd_card_requested_bus_width();
+
+// Bus width of the current mount, 0 when the card is not mounted
+uint8_t sd_card_bus_width();
+
+// Mounts that had to fall back from 4-bit to 1-bit since boot
+uint32_t sd_card_fallbacks();
+
+#endif
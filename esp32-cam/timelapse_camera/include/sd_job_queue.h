@@ -0,0 +1,83 @@
+#ifndef SD_JOB_QUEUE_H
+#define SD_JOB_QUEUE_H
+
+// Platform-independent core of the SD writer: a bounded ring of write jobs,
+// the write step itself and its statistics. Locking, blocking and the real
+// filesystem live in sd_writer.cpp, so this part builds on the host against a
+// fake sd_fs_ops_t.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SD_JOB_PATH_MAX 64
+
+struct sd_job;
+
+// Called once per job after it was written, failed or dropped. Must release
+// the job's buffer.
+typedef void (*sd_job_done_cb)(const struct sd_job *job, bool ok);
+
+// Replaces the plain open/write/close sequence for jobs that need more than
+// one buffer written to one file (e.g. appending to a container file).
+typedef bool (*sd_job_write_cb)(const struct sd_job *job);
+
+typedef struct sd_job {
+  char path[SD_JOB_PATH_MAX];
+  const uint8_t *buf;
+  size_t len;
+  bool append;     // append instead of truncating the file
+  bool droppable;  // may be evicted when the queue is full
+  uint32_t epoch;  // capture time of the data, for custom write steps
+  sd_job_write_cb write; // optional custom write step, NULL for a plain write
+  sd_job_done_cb done;
+  void *ctx;
+} sd_job_t;
+
+typedef struct {
+  void *(*open)(const char *path, bool append);
+  size_t (*write)(void *file, const uint8_t *buf, size_t len);
+  void (*close)(void *file);
+  int64_t (*now_us)();
+} sd_fs_ops_t;
+
+typedef struct {
+  uint32_t depth;        // jobs currently queued
+  uint32_t max_depth;    // high-water mark of depth
+  uint32_t written;      // jobs written successfully
+  uint32_t failed;       // jobs whose open or write failed
+  uint32_t dropped;      // jobs evicted or rejected because the queue was full
+  uint64_t bytes;        // bytes written successfully
+  uint64_t write_us;     // time spent in open/write/close
+  uint32_t max_write_us; // slowest single job
+  uint64_t stall_us;     // time producers spent waiting for queue space
+} sd_writer_stats_t;
+
+typedef struct {
+  sd_job_t *slots;
+  size_t capacity;
+  size_t head;  // index of the oldest job
+  size_t count;
+  sd_writer_stats_t stats;
+} sd_job_queue_t;
+
+void sd_job_queue_init(sd_job_queue_t *q, sd_job_t *slots, size_t capacity);
+bool sd_job_queue_push(sd_job_queue_t *q, const sd_job_t *job);
+bool sd_job_queue_pop(sd_job_queue_t *q, sd_job_t *out);
+
+// Removes the oldest droppable job, keeping the order of the others.
+// Returns false when no queued job is droppable.
+bool sd_job_queue_drop_oldest(sd_job_queue_t *q, sd_job_t *out);
+
+static inline bool sd_job_queue_full(const sd_job_queue_t *q) {
+  return q->count == q->capacity;
+}
+
+// Writes one job through fs (or its custom write step), updates stats and
+// calls the job's done callback. Returns whether the write succeeded.
+bool sd_job_run(const sd_job_t *job, const sd_fs_ops_t *fs,
+                sd_writer_stats_t *stats);
+
+// Average write throughput while the card was busy, in bytes per second
+uint32_t sd_writer_stats_bytes_per_s(const sd_writer_stats_t *stats);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef SD_WRITER_H
+#define SD_WRITER_H
+
+// Dedicated SD card writer task. Capture and HTTP code queue (path, buffer,
+// length, done-callback) jobs instead of writing inline, so a slow card stalls
+// only this task.
+
+#include <stdarg.h>
+#include <sys/types.h>
+
+#include "sd_card.h"
+#include "sd_job_queue.h"
+
+// Number of jobs the writer queue holds
+#ifndef SD_WRITER_QUEUE_LEN
+#define SD_WRITER_QUEUE_LEN 8
+#endif
+
+#define SD_SECTOR_SIZE 512
+
+// Internal, DMA-capable buffer frame data is staged through on its way to
+// the card. A multiple of SD_SECTOR_SIZE; larger means fewer, longer SDMMC
+// multi-block writes at the cost of internal RAM.
+#ifndef SD_WRITE_STAGING_SIZE
+#define SD_WRITE_STAGING_SIZE 16384
+#endif
+
+// Flags for sd_writer_printf()
+#define SD_WRITE_APPEND 0x01    // append instead of overwriting the file
+#define SD_WRITE_DROPPABLE 0x02 // may be evicted when the queue is full
+
+bool sd_writer_start();
+
+// Queues a job and takes ownership of its buffer: job->done is always called
+// exactly once, from the writer task after the write or from here if the job
+// is rejected. When the queue is full the oldest droppable job is evicted to
+// make room; if there is none, a droppable job is rejected and any other job
+// waits up to timeout_ms for space. Called from the writer task itself (e.g. a
+// done callback logging an error) the job is written inline.
+bool sd_writer_submit(const sd_job_t *job, uint32_t timeout_ms);
+
+// Formats a small text file or log line and queues it
+bool sd_writer_printf(const char *path, int flags, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Waits until every queued job has been written. Returns false on timeout.
+bool sd_writer_flush(uint32_t timeout_ms);
+
+void sd_writer_get_stats(sd_writer_stats_t *stats);
+
+typedef struct {
+  uint32_t files;       // files written
+  uint32_t bytes_per_s; // over the open/write/close time of all files
+  uint32_t min_us;      // per-file open+write+close latency
+  uint32_t avg_us;
+  uint32_t max_us;
+} sd_frame_bench_t;
+
+#define SD_FRAME_BENCH_DIR "/sd_bench_frames"
+
+// Writes `files` synthetic files of file_size bytes from PSRAM through the
+// same path timelapse frames take, then deletes them. Blocks until done.
+bool sd_writer_frame_bench(uint32_t files, size_t file_size,
+                           sd_frame_bench_t *result);
+
+// State of the bus width change started by sd_writer_start_bus_switch()
+#define SD_BUS_SWITCH_IDLE 0 // none since boot
+#define SD_BUS_SWITCH_RUNNING 1
+#define SD_BUS_SWITCH_DONE 2
+#define SD_BUS_SWITCH_FAILED 3 // queue full, or the card did not remount
+
+// Queues a remount of the card with a new bus width (1 or 4, see sd_card.h)
+// behind the writes already queued, without waiting for it. The choice lasts
+// until the next reboot. Returns false if a change is still in progress.
+bool sd_writer_start_bus_switch(uint8_t bus_width);
+
+// Returns the SD_BUS_SWITCH_* state of the last change
+uint8_t sd_writer_bus_switch_status();
+
+// Frame-data files for custom write steps, which run on the writer task.
+// Opens path (relative to the card) for writing, remounting the card once if
+// the open fails. Returns a POSIX file descriptor, or -1. Close it with close().
+int sd_writer_open_fd(const char *path, bool append);
+
+// Writes buf in large, sector-aligned pieces through the staging buffer
+bool sd_writer_write_fd(int fd, const uint8_t *buf, size_t len);
+
+// For data produced a little at a time (e.g. encoder output): the pieces are
+// collected in the staging buffer, which is written out whenever it fills up
+// to a sector boundary, so the card still sees large aligned writes. Writer
+// task only, one stream at a time, and no sd_writer_write_fd() in between.
+typedef struct {
+  int fd;
+  off_t pos;    // file position the staged bytes start at
+  size_t used;  // bytes waiting in the staging buffer
+  size_t total; // bytes accepted since sd_writer_stream_begin()
+  bool ok;
+} sd_fd_stream_t;
+
+void sd_writer_stream_begin(sd_fd_stream_t *stream, int fd);
+bool sd_writer_stream_write(sd_fd_stream_t *stream, const uint8_t *buf,
+                            size_t len);
+// Writes what is still staged. Returns false if any write failed.
+bool sd_writer_stream_end(sd_fd_stream_t *stream);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef STAGE_TIMER_H
+#define STAGE_TIMER_H
+
+// Latency histograms of the stages of a timelapse shot and of the HTTP
+// handlers, measured with esp_timer. Each stage keeps count, sum, min, max and
+// fixed log-spaced buckets, from which p95 is estimated. The heartbeat file
+// carries a summary; /metrics serves them in Prometheus text format, but only
+// while the web server runs in the focus window after boot.
+//
+// Recording takes a spinlock for a few dozen instructions, so any task may
+// record. Totals run since boot.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+  // Timelapse shot, in pipeline order
+  STAGE_PWDN_CYCLE,    // OV2640 power cycle before a cold init
+  STAGE_CAMERA_INIT,   // esp_camera_init()
+  STAGE_STABILIZE,     // AWB/AEC settling frames
+  STAGE_FB_GET,        // esp_camera_fb_get() of a kept frame
+  STAGE_JPEG_ENCODE,   // Raw frame to JPEG, streamed to the card as it goes
+  STAGE_SD_OPEN,       // Opening the photo or segment file
+  STAGE_SD_WRITE,      // Writing a JPEG
+  STAGE_SD_CLOSE,      // close(), or the fsync() that commits a segment frame
+  STAGE_CAMERA_DEINIT, // esp_camera_deinit()
+  STAGE_SHOT,          // Whole shot, wake or power-up to frame queued
+  // HTTP handlers on the control port
+  STAGE_HTTP_INDEX,
+  STAGE_HTTP_CAPTURE,
+  STAGE_HTTP_BMP,
+  STAGE_HTTP_STATUS,
+  STAGE_HTTP_TIMELAPSE,
+  STAGE_HTTP_SD_BENCH,
+  STAGE_HTTP_SD_BUS,
+  STAGE_HTTP_METRICS,
+  STAGE_COUNT
+} stage_t;
+
+// Upper bounds of the buckets, 100 us to 20 s in 1-2-5 steps; one more bucket
+// counts everything above
+#define STAGE_TIMER_BUCKETS 17
+
+typedef struct {
+  uint32_t count;
+  uint32_t min_us;
+  uint32_t max_us;
+  uint64_t sum_us;
+  uint32_t buckets[STAGE_TIMER_BUCKETS + 1]; // not cumulative
+} stage_timer_stats_t;
+
+const char *stage_timer_name(stage_t stage);
+
+int64_t stage_timer_start();
+
+// Records the time since start (from stage_timer_start())
+void stage_timer_record(stage_t stage, int64_t start_us);
+void stage_timer_add(stage_t stage, uint32_t us);
+
+void stage_timer_get(stage_t stage, stage_timer_stats_t *stats);
+
+// Estimated duration below which permille of the samples fall, interpolated
+// within its bucket and kept between min and max; 0 without samples
+uint32_t stage_timer_percentile(const stage_timer_stats_t *stats,
+                                uint32_t permille);
+
+// Writes the Prometheus text exposition a line at a time; stops and returns
+// false as soon as write() does
+typedef bool (*stage_timer_write_fn)(void *arg, const char *line);
+bool stage_timer_prometheus(stage_timer_write_fn write, void *arg);
+
+// One "name n=N min/avg/p95/max a/b/c/d ms" line per stage with samples, for
+// the heartbeat. Returns the length written.
+size_t stage_timer_summary(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef STREAM_BROADCASTER_H
+#define STREAM_BROADCASTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "esp_camera.h"
+#include "esp_http_server.h"
+#include "sdkconfig.h"
+
+// Maximum number of simultaneous /stream viewers on the port-81 server
+#ifndef STREAM_MAX_CLIENTS
+#define STREAM_MAX_CLIENTS 3
+#endif
+
+// Run the stream senders on the core the camera driver task is not pinned to,
+// so sensor DMA and the Wi-Fi send overlap instead of taking turns.
+#if defined(CONFIG_CAMERA_CORE1)
+#define STREAM_SEND_CORE 0
+#else
+#define STREAM_SEND_CORE 1
+#endif
+
+// Longest multipart boundary plus part header of one frame
+#define STREAM_PART_MAX 128
+
+// One captured frame, shared by every client it is handed to. A JPEG frame is
+// copied to buf; a raw frame keeps the driver's buffer in fb and every
+// consumer encodes it on the way out (see jpeg_stream.h). The buffer is freed
+// or returned to the driver when the last reference is released.
+typedef struct {
+  uint8_t *buf;
+  size_t len;
+  camera_fb_t *fb;            // raw frame, NULL for JPEG frames
+  char part[STREAM_PART_MAX]; // boundary and part header, formatted once
+  size_t part_len;
+  struct timeval timestamp; // sensor timestamp from the frame buffer
+  int64_t captured_us;      // esp_timer time the frame was taken
+  uint32_t seq;
+  int refs;
+} stream_frame_t;
+
+// /status reports these as sends_per_frame (send_calls / frames_sent) and
+// stream_kb_per_s (bytes_sent over send_us). To measure a send path at a
+// resolution, build with PREVIEW_FRAMESIZE=FRAMESIZE_SVGA or FRAMESIZE_UXGA,
+// keep one /stream client open for a minute and read /status. No figures
+// have been recorded for the writev() path yet: it has not been run on a
+// board.
+typedef struct {
+  uint32_t clients;
+  uint32_t frames;        // frames captured by the producer
+  uint32_t dropped;       // frames a slow client never got to send
+  uint32_t avg_frame_ms;  // averaged producer frame interval
+  uint32_t avg_send_ms;   // averaged time to send one frame to one client
+  uint32_t frames_sent;   // frames sent, summed over all clients
+  uint32_t send_calls;    // socket writes needed for those frames
+  uint64_t bytes_sent;
+  uint64_t send_us;       // time spent in those socket writes
+} stream_stats_t;
+
+void stream_frame_retain(stream_frame_t *frame);
+void stream_frame_release(stream_frame_t *frame);
+
+void stream_broadcaster_init();
+
+// Takes over the socket of a /stream request: sends the multipart response
+// header and starts a sender task for it. Returns ESP_ERR_NO_MEM when
+// STREAM_MAX_CLIENTS viewers are already connected. The stream server must
+// have stream_broadcaster_close_fn as its close_fn.
+esp_err_t stream_broadcaster_add_client(httpd_req_t *req);
+
+// httpd_config_t.close_fn of the stream server. When httpd closes the session
+// of a viewer (disconnect, purge, server stop) the viewer's sender is told to
+// stop and closes the socket itself once it is done writing to it; other
+// sockets are closed right away.
+void stream_broadcaster_close_fn(httpd_handle_t hd, int sockfd);
+
+// Disconnects all clients and waits for the producer task to stop using the
+// camera and for every raw frame to be back with the driver. Must be called
+// before the stream server or the camera is shut down.
+void stream_broadcaster_stop();
+
+void stream_broadcaster_get_stats(stream_stats_t *stats);
+
+// Last-good-frame cache. Returns a reference to the newest frame if it is at
+// most max_age_ms old, otherwise NULL. Release it with stream_frame_release().
+stream_frame_t *stream_broadcaster_cached_frame(uint32_t max_age_ms);
+
+// Returns a frame taken after this call: the producer's next frame while a
+// stream is running, or a direct capture otherwise. The result also becomes
+// the cached frame. NULL on capture failure or timeout.
+stream_frame_t *stream_broadcaster_fresh_frame(uint32_t timeout_ms);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef TASK_MONITOR_H
+#define TASK_MONITOR_H
+
+// Stack high-water marks and busy time of the firmware's own tasks, for the
+// heartbeat. Busy time is the wall time each task accounts for itself around
+// its units of work (task_monitor_begin/end), so it needs no FreeRTOS
+// run-time stats support from the Arduino core's prebuilt sdkconfig. It is
+// not CPU time: waits within a unit of work, such as the sensor settling
+// during a timelapse shot or a flush of the SD writer, count as busy.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#ifndef TASK_MONITOR_MAX_TASKS
+#define TASK_MONITOR_MAX_TASKS 8
+#endif
+
+typedef struct {
+  const char *name;
+  uint32_t stack_size;     // bytes
+  uint32_t stack_free_min; // bytes never used so far
+  uint64_t busy_us;        // time spent in accounted work
+  uint32_t busy_permille;  // busy_us against the time since registration
+  bool running;            // false once the task has exited
+} task_monitor_entry_t;
+
+// Registers a task, typically right after xTaskCreate(). Safe from any task.
+void task_monitor_register(TaskHandle_t task, const char *name,
+                           uint32_t stack_size);
+
+// Brackets a unit of work in the calling task for its busy time
+int64_t task_monitor_begin();
+void task_monitor_end(int64_t start_us);
+
+// Records the final high-water mark of the calling task before it deletes
+// itself. Waits for a task_monitor_snapshot() in progress.
+void task_monitor_exit();
+
+// Copies up to max entries with fresh high-water marks; returns the count
+size_t task_monitor_snapshot(task_monitor_entry_t *out, size_t max);
+
+// One line for the heartbeat: "name free/size B free, busy x.y%; ..."
+void task_monitor_format(char *buf, size_t len);
+
+#endif
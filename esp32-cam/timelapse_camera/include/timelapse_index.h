@@ -0,0 +1,61 @@
+#ifndef TIMELAPSE_INDEX_H
+#define TIMELAPSE_INDEX_H
+
+// Date-sharded timelapse files plus a binary index of every stored frame, so
+// recent frames or a time range can be found without listing FAT directories.
+//
+// The index (/timelapse.idx) is an append-only array of fixed-size records in
+// capture order. A frame's path is derived from its epoch and flags, so the
+// record only keeps where the JPEG starts inside that file: 0 for a plain
+// file, the chunk offset for a segment. Finding the newest N frames is one
+// seek; a time range is a binary search. Both assume the clock never steps
+// backwards, which holds once NTP has synced.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sd_job_queue.h"
+
+#define TIMELAPSE_INDEX_PATH "/timelapse.idx"
+
+#define TIMELAPSE_INDEX_IN_SEGMENT 0x01 // frame is a chunk of a segment file
+
+typedef struct {
+  uint32_t epoch;
+  uint32_t offset; // chunk offset in a segment, 0 for a plain file
+  uint32_t size;   // JPEG bytes
+  uint32_t flags;  // TIMELAPSE_INDEX_*
+} timelapse_index_record_t;
+
+// Writes the sharded path of a frame taken at epoch, /YYYY/MM/DD/HH-MM-SS.jpg
+void timelapse_file_path(uint32_t epoch, char *path, size_t len);
+
+// Writes the path of the file holding the frame a record describes
+void timelapse_index_record_path(const timelapse_index_record_t *record,
+                                 char *path, size_t len);
+
+// sd_job_t write step for one-file-per-frame storage: creates the day's
+// directory if needed, writes the JPEG to job->path and indexes it.
+bool timelapse_file_write(const sd_job_t *job);
+
+// Same for a raw frame: job->ctx is the camera_fb_t, encoded into the file as
+// it is written (see jpeg_stream.h)
+bool timelapse_file_encode(const sd_job_t *job);
+
+// Appends a record to the index. Writer task only.
+bool timelapse_index_append(uint32_t epoch, uint32_t offset, uint32_t size,
+                            uint32_t flags);
+
+// Number of indexed frames
+uint32_t timelapse_index_count();
+
+// Copies up to max of the newest records to out, newest first.
+// Returns the number copied.
+size_t timelapse_index_recent(timelapse_index_record_t *out, size_t max);
+
+// Copies up to max records with from <= epoch <= to to out, oldest first.
+// Returns the number copied.
+size_t timelapse_index_range(uint32_t from, uint32_t to,
+                             timelapse_index_record_t *out, size_t max);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef TIMELAPSE_SEGMENT_H
+#define TIMELAPSE_SEGMENT_H
+
+// Appends timelapse frames to segment files (see timelapse_segment_format.h)
+// instead of creating one FAT file per frame. Runs as a write step of the SD
+// writer, so the open segment is only touched from the writer task.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sd_job_queue.h"
+
+#define SEGMENT_ROLL_HOURLY 1
+#define SEGMENT_ROLL_DAILY 2
+
+// How often a new segment file is started
+#ifndef TIMELAPSE_SEGMENT_ROLL
+#define TIMELAPSE_SEGMENT_ROLL SEGMENT_ROLL_HOURLY
+#endif
+
+#define TIMELAPSE_SEGMENT_DIR "/segments"
+
+// Frames listed per index chunk; a longer segment gets several index chunks
+#ifndef TIMELAPSE_SEGMENT_MAX_INDEX
+#define TIMELAPSE_SEGMENT_MAX_INDEX 1024
+#endif
+
+// Writes the path of the segment a frame taken at epoch belongs to,
+// e.g. /segments/2024-05-01_13.tls (hourly) or /segments/2024-05-01.tls
+void timelapse_segment_path(uint32_t epoch, char *path, size_t len);
+
+// sd_job_t write step: appends job->buf as a frame taken at job->epoch to the
+// segment named by job->path, closing the previous segment when it differs.
+bool timelapse_segment_append(const sd_job_t *job);
+
+// Same for a raw frame: job->ctx is the camera_fb_t, encoded into the segment
+// as it is written (see jpeg_stream.h). job->buf and job->len are unused.
+bool timelapse_segment_encode(const sd_job_t *job);
+
+// Queues closing the open segment, which appends its index. Call before deep
+// sleep or a restart, followed by sd_writer_flush().
+bool timelapse_segment_close(uint32_t timeout_ms);
+
+// Closes the open segment right away, appending its index. Writer task only:
+// every path that unmounts the card calls it first, so the segment's FAT entry
+// is not left pointing at a handle of the old mount.
+void timelapse_segment_close_now();
+
+#endif
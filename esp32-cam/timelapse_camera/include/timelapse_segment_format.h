@@ -0,0 +1,83 @@
+#ifndef TIMELAPSE_SEGMENT_FORMAT_H
+#define TIMELAPSE_SEGMENT_FORMAT_H
+
+// On-card layout of timelapse segment files (*.tls). Shared by the firmware
+// and tools/segment_extract.cpp, so it only uses standard headers.
+//
+// A segment is a sequence of chunks, each a segment_chunk_t header followed
+// by `len` payload bytes:
+//
+//   'TLFR' frame  payload is one JPEG, epoch is its capture time
+//   'TLIX' index  payload is segment_index_entry_t[n] followed by a
+//                 segment_index_tail_t; it lists the frames written since
+//                 the previous index chunk and is appended when a segment is
+//                 closed, so a cleanly closed file ends with the tail
+//
+// Frames are appended as they are taken, so a file cut short by a reset is
+// still readable up to its last complete frame: readers walk the chunks from
+// the start and use the CRC to reject a torn final frame. The index lets a
+// reader that only has the end of the file find every frame without a scan.
+// All fields are little-endian.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(ESP_PLATFORM)
+#include "esp_rom_crc.h"
+#endif
+
+#define SEGMENT_FILE_EXT ".tls"
+
+#define SEGMENT_CHUNK_FRAME 0x52464c54u // "TLFR"
+#define SEGMENT_CHUNK_INDEX 0x58494c54u // "TLIX"
+#define SEGMENT_INDEX_TAIL 0x444e4554u  // "TEND"
+
+#pragma pack(push, 1)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t epoch; // capture time (frame) or close time (index), UTC seconds
+  uint32_t len;   // payload bytes following this header
+  uint32_t crc;   // segment_crc32() of the payload
+} segment_chunk_t;
+
+typedef struct {
+  uint32_t epoch;
+  uint32_t offset; // file offset of the frame's segment_chunk_t
+  uint32_t len;    // JPEG bytes
+} segment_index_entry_t;
+
+typedef struct {
+  uint32_t count;        // entries before this tail
+  uint32_t chunk_offset; // file offset of this index chunk's header
+  uint32_t magic;        // SEGMENT_INDEX_TAIL
+} segment_index_tail_t;
+
+#pragma pack(pop)
+
+static_assert(sizeof(segment_chunk_t) == 16, "segment_chunk_t layout");
+static_assert(sizeof(segment_index_entry_t) == 12, "index entry layout");
+static_assert(sizeof(segment_index_tail_t) == 12, "index tail layout");
+
+// Standard CRC-32 (IEEE 802.3, as used by zlib). Pass 0 to start and the
+// previous result to continue over several buffers.
+static inline uint32_t segment_crc32(uint32_t crc, const uint8_t *buf,
+                                     size_t len) {
+#if defined(ESP_PLATFORM)
+  return esp_rom_crc32_le(crc, buf, len);
+#else
+  static const uint32_t nibble_table[16] = {
+      0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+      0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+      0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= buf[i];
+    crc = (crc >> 4) ^ nibble_table[crc & 0x0f];
+    crc = (crc >> 4) ^ nibble_table[crc & 0x0f];
+  }
+  return ~crc;
+#endif
+}
+
+#endif
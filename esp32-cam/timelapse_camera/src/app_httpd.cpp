@@ -1,13 +1,20 @@
 // Copyright BSD
-#include "FS.h"
-#include "SD_MMC.h"
+#include "bmp_stream.h"
+#include "camera_profile.h"
 #include "esp_camera.h"
 #include "esp_http_server.h"
 #include "esp_timer.h"
 #include "fb_gfx.h"
 #include "img_converters.h"
 #include "index_ov2640.h"
+#include "jpeg_stream.h"
+#include "sd_bench.h"
+#include "sd_writer.h"
 #include "sdkconfig.h"
+#include "stage_timer.h"
+#include "stream_broadcaster.h"
+#include "timelapse_index.h"
+#include <unistd.h>
 
 #if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
 #include "esp32-hal-log.h"
@@ -21,82 +28,42 @@ typedef struct {
   size_t len;
 } jpg_chunking_t;
 
-#define PART_BOUNDARY "123456789000000000000987654321"
-static const char *_STREAM_CONTENT_TYPE =
-    "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
-static const char *_STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-static const char *_STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: "
-                                  "%u\r\nX-Timestamp: %d.%06d\r\n\r\n";
-
 httpd_handle_t stream_httpd = NULL;
 httpd_handle_t camera_httpd = NULL;
 
-typedef struct {
-  size_t size;  // number of values used for filtering
-  size_t index; // current value index
-  size_t count; // value count
-  int sum;
-  int *values; // array to be filled with values
-} ra_filter_t;
-
-bool writeFile(const char *path, const unsigned char *data, unsigned long len) {
-  Serial.printf("Writing file: %s\n", path);
-  File file = SD_MMC.open(path, FILE_WRITE);
-  if (!file) {
-    Serial.println("Failed to open file for writing");
-    return false;
-  }
-  if (file.write(data, len)) {
-    Serial.println("File written");
-  } else {
-    Serial.println("Write failed");
-    file.close();
-    return false;
-  }
-  file.close();
-  return true;
-}
+// Camera configuration (defined in camera_webserver.ino)
+extern camera_config_t global_cam_config;
 
-static ra_filter_t ra_filter;
+// /capture serves the cached frame when it is at most this old
+#define CAPTURE_CACHE_MAX_AGE_MS 1000
+// How long /capture?fresh=1 waits for the running stream's next frame
+#define CAPTURE_FRESH_TIMEOUT_MS 2000
+// Most frames one /timelapse query returns
+#define TIMELAPSE_QUERY_MAX 100
 
-static ra_filter_t *ra_filter_init(ra_filter_t *filter, size_t sample_size) {
-  memset(filter, 0, sizeof(ra_filter_t));
-
-  filter->values = (int *)malloc(sample_size * sizeof(int));
-  if (!filter->values) {
-    return NULL;
+static size_t jpg_encode_stream(void *arg, size_t index, const void *data,
+                                size_t len) {
+  jpg_chunking_t *j = (jpg_chunking_t *)arg;
+  if (!index) {
+    j->len = 0;
   }
-  memset(filter->values, 0, sample_size * sizeof(int));
-
-  filter->size = sample_size;
-  return filter;
-}
-
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-static int ra_filter_run(ra_filter_t *filter, int value) {
-  if (!filter->values) {
-    return value;
-  }
-  filter->sum -= filter->values[filter->index];
-  filter->values[filter->index] = value;
-  filter->sum += filter->values[filter->index];
-  filter->index++;
-  filter->index = filter->index % filter->size;
-  if (filter->count < filter->size) {
-    filter->count++;
-  }
-  return filter->sum / filter->count;
+  if (httpd_resp_send_chunk(j->req, (const char *)data, len) != ESP_OK) {
+    return 0;
+  }
+  j->len += len;
+  return len;
 }
-#endif
 
+// Serves a fresh frame as an uncompressed BMP for calibration tools. The BMP
+// is converted on the fly and sent in chunks, a band of rows at a time,
+// instead of being built in memory first.
 static esp_err_t bmp_handler(httpd_req_t *req) {
-  camera_fb_t *fb = NULL;
-  esp_err_t res = ESP_OK;
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   uint64_t fr_start = esp_timer_get_time();
 #endif
-  fb = esp_camera_fb_get();
-  if (!fb) {
+  stream_frame_t *frame =
+      stream_broadcaster_fresh_frame(CAPTURE_FRESH_TIMEOUT_MS);
+  if (!frame) {
     log_e("Camera capture failed");
     httpd_resp_send_500(req);
     return ESP_FAIL;
@@ -108,44 +75,107 @@ static esp_err_t bmp_handler(httpd_req_t *req) {
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
 
   char ts[32];
-  snprintf(ts, 32, "%lld.%06ld", fb->timestamp.tv_sec, fb->timestamp.tv_usec);
+  snprintf(ts, 32, "%lld.%06ld", frame->timestamp.tv_sec,
+           frame->timestamp.tv_usec);
   httpd_resp_set_hdr(req, "X-Timestamp", (const char *)ts);
 
-  uint8_t *buf = NULL;
-  size_t buf_len = 0;
-  bool converted = frame2bmp(fb, &buf, &buf_len);
-  esp_camera_fb_return(fb);
+  jpg_chunking_t jchunk = {req, 0};
+  bool converted;
+  if (frame->fb) {
+    camera_fb_t *fb = frame->fb;
+    converted = bmp_stream_frame(fb->buf, fb->len, fb->width, fb->height,
+                                 fb->format, jpg_encode_stream, &jchunk);
+  } else {
+    converted = bmp_stream_frame(frame->buf, frame->len, 0, 0, PIXFORMAT_JPEG,
+                                 jpg_encode_stream, &jchunk);
+  }
+  stream_frame_release(frame);
   if (!converted) {
+    // Only an empty response can still be turned into an error
     log_e("BMP Conversion failed");
-    httpd_resp_send_500(req);
+    if (jchunk.len == 0) {
+      httpd_resp_send_500(req);
+    }
     return ESP_FAIL;
   }
-  res = httpd_resp_send(req, (const char *)buf, buf_len);
-  free(buf);
+  esp_err_t res = httpd_resp_send_chunk(req, NULL, 0);
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
   uint64_t fr_end = esp_timer_get_time();
 #endif
-  log_i("BMP: %llums, %uB", (uint64_t)((fr_end - fr_start) / 1000), buf_len);
+  log_i("BMP: %llums, %uB", (uint64_t)((fr_end - fr_start) / 1000),
+        jchunk.len);
   return res;
 }
 
-static size_t jpg_encode_stream(void *arg, size_t index, const void *data,
-                                size_t len) {
-  jpg_chunking_t *j = (jpg_chunking_t *)arg;
-  if (!index) {
-    j->len = 0;
+// seq of the frame last queued for /capture.jpg, 0 for none. Frame seqs
+// start at 1. A /capture served from the cache often hands out the same
+// frame again, which is then not written a second time.
+static uint32_t capture_saved_seq = 0;
+
+static void capture_saved(const sd_job_t *job, bool ok) {
+  stream_frame_t *frame = (stream_frame_t *)job->ctx;
+  if (!ok) {
+    log_e("Failed to save /capture.jpg to SD");
+    // Dropped or failed: let the next request for this frame try again
+    uint32_t seq = frame->seq;
+    __atomic_compare_exchange_n(&capture_saved_seq, &seq, 0, false,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
   }
-  if (httpd_resp_send_chunk(j->req, (const char *)data, len) != ESP_OK) {
-    return 0;
+  stream_frame_release(frame);
+}
+
+// Write step for a raw frame: encodes it straight into /capture.jpg
+static bool capture_encode_step(const sd_job_t *job) {
+  int fd = sd_writer_open_fd(job->path, false);
+  if (fd < 0) {
+    return false;
   }
-  j->len += len;
-  return len;
+  size_t len = 0;
+  bool ok = jpeg_stream_to_fd(((stream_frame_t *)job->ctx)->fb, fd, &len, NULL);
+  return close(fd) == 0 && ok;
 }
 
-// The capture_handler that serves /capture
+// Queues the frame for /capture.jpg without waiting on the card, unless it
+// is the frame already saved there. Droppable: if the writer is behind, an
+// older pending copy is replaced by this one.
+static void capture_save_async(stream_frame_t *frame) {
+  if (__atomic_exchange_n(&capture_saved_seq, frame->seq, __ATOMIC_SEQ_CST) ==
+      frame->seq) {
+    return;
+  }
+  sd_job_t job = {};
+  strlcpy(job.path, "/capture.jpg", sizeof(job.path));
+  if (frame->fb) {
+    job.write = capture_encode_step;
+  }
+  job.buf = frame->buf;
+  job.len = frame->len;
+  job.droppable = true;
+  job.done = capture_saved;
+  job.ctx = frame;
+  stream_frame_retain(frame);
+  sd_writer_submit(&job, 0);
+}
+
+// The capture_handler that serves /capture. Returns the cached newest frame
+// when one is recent enough; /capture?fresh=1 always waits for a new frame.
 static esp_err_t capture_handler(httpd_req_t *req) {
-  camera_fb_t *fb = esp_camera_fb_get(); // Grab a frame
-  if (!fb) {
+  bool fresh = false;
+  char query[32];
+  char value[8];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+      httpd_query_key_value(query, "fresh", value, sizeof(value)) == ESP_OK) {
+    fresh = strcmp(value, "1") == 0;
+  }
+
+  stream_frame_t *frame = NULL;
+  if (!fresh) {
+    frame = stream_broadcaster_cached_frame(CAPTURE_CACHE_MAX_AGE_MS);
+  }
+  if (!frame) {
+    frame = stream_broadcaster_fresh_frame(CAPTURE_FRESH_TIMEOUT_MS);
+  }
+  if (!frame) {
     log_e("Camera capture failed");
     httpd_resp_send_500(req);
     return ESP_FAIL;
@@ -158,142 +188,305 @@ static esp_err_t capture_handler(httpd_req_t *req) {
 
   // This is optional, but sets a custom timestamp header
   char ts[32];
-  snprintf(ts, 32, "%lld.%06ld", fb->timestamp.tv_sec, fb->timestamp.tv_usec);
+  snprintf(ts, 32, "%lld.%06ld", frame->timestamp.tv_sec,
+           frame->timestamp.tv_usec);
   httpd_resp_set_hdr(req, "X-Timestamp", (const char *)ts);
+  char age[16];
+  snprintf(age, sizeof(age), "%u",
+           (unsigned)((esp_timer_get_time() - frame->captured_us) / 1000));
+  httpd_resp_set_hdr(req, "X-Frame-Age-Ms", (const char *)age);
+
+  // 1) Send to the browser. A raw frame is encoded into chunks as it is sent.
+  esp_err_t res;
+  if (frame->fb) {
+    jpg_chunking_t jchunk = {req, 0};
+    res = frame2jpg_cb(frame->fb, SOFT_JPEG_QUALITY, jpg_encode_stream, &jchunk)
+              ? httpd_resp_send_chunk(req, NULL, 0)
+              : ESP_FAIL;
+  } else {
+    res = httpd_resp_send(req, (const char *)frame->buf, frame->len);
+  }
 
-  esp_err_t res = ESP_OK;
-  size_t out_len = 0;
-  uint8_t *out_buf = NULL;
-
-  if (fb->format == PIXFORMAT_JPEG) {
-    // The camera buffer is already JPEG
-    out_buf = fb->buf;
-    out_len = fb->len;
-
-    // 1) Send to the browser
-    res = httpd_resp_send(req, (const char *)out_buf, out_len);
-
-    // 2) Write to SD card. (Use a unique filename if you like!)
-    Serial.printf("httpd_resp_send returned: %d\n", (int)res);
-    if (res == ESP_OK) {
-      bool success = writeFile("/capture.jpg", out_buf, out_len);
-      if (!success) {
-        Serial.println("Failed to save photo to SD");
-      }
-    }
+  // 2) Copy to SD card off the request path
+  if (res == ESP_OK) {
+    capture_save_async(frame);
+  }
 
-    // Return the framebuffer to the driver
-    esp_camera_fb_return(fb);
-  } else {
-    // The buffer is raw (e.g. RGB565). Convert to JPEG in software.
-    bool converted = frame2jpg(fb, 80, &out_buf, &out_len);
-    // Return the fb first, since we've made our own JPEG copy
-    esp_camera_fb_return(fb);
+  stream_frame_release(frame);
+  return res;
+}
 
-    if (!converted) {
-      httpd_resp_send_500(req);
-      return ESP_FAIL;
-    }
+// Hands the connection over to the stream broadcaster, which shares one
+// capture between all viewers
+static esp_err_t stream_handler(httpd_req_t *req) {
+  esp_err_t res = stream_broadcaster_add_client(req);
+  if (res == ESP_ERR_NO_MEM) {
+    log_i("Stream client rejected, %d viewers connected", STREAM_MAX_CLIENTS);
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_sendstr(req, "Too many stream clients");
+  }
+  return res;
+}
 
-    // 1) Send the JPEG to the browser
-    res = httpd_resp_send(req, (const char *)out_buf, out_len);
+// Reports the frame pipeline configuration and the averaged stream timings
+static esp_err_t status_handler(httpd_req_t *req) {
+  stream_stats_t st;
+  stream_broadcaster_get_stats(&st);
+  sd_writer_stats_t sd;
+  sd_writer_get_stats(&sd);
+  camera_profile_stats_t cp;
+  camera_profile_get_stats(&cp);
+  char json[1024];
+  int len = snprintf(json, sizeof(json),
+                     "{\"fb_count\":%u,\"grab_latest\":%s,"
+                     "\"stream_clients\":%u,\"max_stream_clients\":%d,"
+                     "\"frames\":%u,\"dropped\":%u,"
+                     "\"avg_frame_ms\":%u,\"fps\":%.1f,\"avg_send_ms\":%u,"
+                     "\"sends_per_frame\":%.2f,\"stream_kb_per_s\":%u,"
+                     "\"sd_queue_depth\":%u,\"sd_queue_max_depth\":%u,"
+                     "\"sd_written\":%u,\"sd_failed\":%u,\"sd_dropped\":%u,"
+                     "\"sd_bytes_per_s\":%u,\"sd_avg_write_ms\":%u,"
+                     "\"sd_max_write_ms\":%u,"
+                     "\"sd_stall_ms\":%u,\"sd_bus_width\":%u,"
+                     "\"sd_bus_width_requested\":%u,\"sd_bus_fallbacks\":%u,"
+                     "\"camera_profile\":\"%s\",\"profile_switches\":%u,"
+                     "\"profile_switch_failures\":%u,"
+                     "\"profile_last_switch_ms\":%u,"
+                     "\"profile_max_switch_ms\":%u}",
+                     (unsigned)global_cam_config.fb_count,
+                     global_cam_config.grab_mode == CAMERA_GRAB_LATEST ? "true"
+                                                                       : "false",
+                     st.clients, STREAM_MAX_CLIENTS, st.frames, st.dropped,
+                     st.avg_frame_ms,
+                     st.avg_frame_ms ? 1000.0 / st.avg_frame_ms : 0.0,
+                     st.avg_send_ms,
+                     st.frames_sent ? (double)st.send_calls / st.frames_sent
+                                    : 0.0,
+                     st.send_us ? (unsigned)(st.bytes_sent * 1000000 / 1024 /
+                                             st.send_us)
+                                : 0,
+                     sd.depth, sd.max_depth, sd.written,
+                     sd.failed, sd.dropped, sd_writer_stats_bytes_per_s(&sd),
+                     sd.written ? (unsigned)(sd.write_us / sd.written / 1000)
+                                : 0,
+                     sd.max_write_us / 1000, (unsigned)(sd.stall_us / 1000),
+                     sd_card_bus_width(), sd_card_requested_bus_width(),
+                     sd_card_fallbacks(),
+                     camera_profile_name(camera_profile_current()),
+                     cp.switches, cp.failures, cp.last_switch_us / 1000,
+                     cp.max_switch_us / 1000);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json, len);
+}
 
-    // 2) Write the JPEG to SD (if sending succeeded)
-    if (res == ESP_OK) {
-      bool success = writeFile("/capture.jpg", out_buf, out_len);
-      if (!success) {
-        Serial.println("Failed to save photo to SD");
-      }
-    }
+static bool query_u32(const char *query, const char *key, uint32_t *out) {
+  char value[16];
+  if (httpd_query_key_value(query, key, value, sizeof(value)) != ESP_OK) {
+    return false;
+  }
+  *out = strtoul(value, NULL, 10);
+  return true;
+}
 
-    // Must free the buffer we allocated with frame2jpg()
-    free(out_buf);
+// Lists stored timelapse frames from the on-card index as JSON.
+// /timelapse?n=N returns the N newest frames (default 10), newest first;
+// /timelapse?from=EPOCH&to=EPOCH returns a time range, oldest first.
+static esp_err_t timelapse_handler(httpd_req_t *req) {
+  uint32_t n = 10, from = 0, to = UINT32_MAX;
+  bool range = false;
+  char query[64];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    query_u32(query, "n", &n);
+    range = query_u32(query, "from", &from);
+    range = query_u32(query, "to", &to) || range;
+  }
+  if (n > TIMELAPSE_QUERY_MAX) {
+    n = TIMELAPSE_QUERY_MAX;
   }
 
+  timelapse_index_record_t *records = (timelapse_index_record_t *)malloc(
+      n * sizeof(timelapse_index_record_t));
+  if (!records) {
+    return httpd_resp_send_500(req);
+  }
+  size_t count = range ? timelapse_index_range(from, to, records, n)
+                       : timelapse_index_recent(records, n);
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  char line[160];
+  snprintf(line, sizeof(line), "{\"total\":%u,\"frames\":[",
+           timelapse_index_count());
+  esp_err_t res = httpd_resp_sendstr_chunk(req, line);
+  for (size_t i = 0; i < count && res == ESP_OK; i++) {
+    char path[SD_JOB_PATH_MAX];
+    timelapse_index_record_path(&records[i], path, sizeof(path));
+    snprintf(line, sizeof(line),
+             "%s{\"epoch\":%u,\"path\":\"%s\",\"offset\":%u,\"size\":%u}",
+             i ? "," : "", records[i].epoch, path, records[i].offset,
+             records[i].size);
+    res = httpd_resp_sendstr_chunk(req, line);
+  }
+  free(records);
+  if (res == ESP_OK) {
+    res = httpd_resp_sendstr_chunk(req, "]}");
+  }
+  if (res == ESP_OK) {
+    res = httpd_resp_sendstr_chunk(req, NULL);
+  }
   return res;
 }
 
-static esp_err_t stream_handler(httpd_req_t *req) {
-  camera_fb_t *fb = NULL;
-  struct timeval _timestamp;
-  esp_err_t res = ESP_OK;
-  size_t _jpg_buf_len = 0;
-  uint8_t *_jpg_buf = NULL;
-  char part_buf[128];
+static esp_err_t send_bench_state(httpd_req_t *req, const char *status,
+                                  const char *state) {
+  char json[32];
+  int len = snprintf(json, sizeof(json), "{\"state\":\"%s\"}", state);
+  httpd_resp_set_status(req, status);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json, len);
+}
 
-  static int64_t last_frame = 0;
-  if (!last_frame) {
-    last_frame = esp_timer_get_time();
+// Starts the SD card benchmark in the background and replies 202 right away:
+// it takes tens of seconds, which would tie up this server's only worker.
+// /sd_bench?bus=1 or ?bus=4 limits it to one bus mode. /sd_bench?result=1
+// returns the last report once it is done; it is also written to
+// SD_BENCH_RESULT_PATH.
+static esp_err_t sd_bench_handler(httpd_req_t *req) {
+  uint8_t bus_modes = SD_BENCH_BUS_1BIT | SD_BENCH_BUS_4BIT;
+  char query[32];
+  uint32_t value;
+  bool result = false;
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    if (query_u32(query, "bus", &value)) {
+      bus_modes = value == 4 ? SD_BENCH_BUS_4BIT : SD_BENCH_BUS_1BIT;
+    }
+    result = query_u32(query, "result", &value) && value;
   }
 
-  res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-  if (res != ESP_OK) {
-    return res;
+  if (!result) {
+    if (!sd_bench_start(bus_modes)) {
+      return send_bench_state(req, "409 Conflict", "running");
+    }
+    log_i("Started SD benchmark");
+    return send_bench_state(req, "202 Accepted", "running");
   }
 
+  sd_bench_report_t report;
+  switch (sd_bench_status(&report)) {
+  case SD_BENCH_IDLE:
+    return send_bench_state(req, "404 Not Found", "idle");
+  case SD_BENCH_RUNNING:
+    return send_bench_state(req, "202 Accepted", "running");
+  case SD_BENCH_FAILED:
+    return send_bench_state(req, "500 Internal Server Error", "failed");
+  }
+
+  char *json = (char *)malloc(SD_BENCH_JSON_MAX);
+  if (!json) {
+    return httpd_resp_send_500(req);
+  }
+  int len = sd_bench_to_json(&report, json, SD_BENCH_JSON_MAX);
+  httpd_resp_set_type(req, "application/json");
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-  httpd_resp_set_hdr(req, "X-Framerate", "60");
+  esp_err_t res = len > 0 && len < SD_BENCH_JSON_MAX
+                      ? httpd_resp_send(req, json, len)
+                      : httpd_resp_send_500(req);
+  free(json);
+  return res;
+}
 
-  while (true) {
-    fb = esp_camera_fb_get();
-    if (!fb) {
-      log_e("Camera capture failed");
-      res = ESP_FAIL;
-    } else {
-      _timestamp.tv_sec = fb->timestamp.tv_sec;
-      _timestamp.tv_usec = fb->timestamp.tv_usec;
-      if (fb->format != PIXFORMAT_JPEG) {
-        bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-        esp_camera_fb_return(fb);
-        fb = NULL;
-        if (!jpeg_converted) {
-          log_e("JPEG compression failed");
-          res = ESP_FAIL;
-        }
-      } else {
-        _jpg_buf_len = fb->len;
-        _jpg_buf = fb->buf;
-      }
-    }
-    if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY,
-                                  strlen(_STREAM_BOUNDARY));
-    }
-    if (res == ESP_OK) {
-      size_t hlen =
-          snprintf(part_buf, sizeof(part_buf), _STREAM_PART, _jpg_buf_len,
-                   _timestamp.tv_sec, _timestamp.tv_usec);
-      res = httpd_resp_send_chunk(req, part_buf, hlen);
-    }
-    if (res == ESP_OK) {
-      res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
-    }
-    if (fb) {
-      esp_camera_fb_return(fb);
-      fb = NULL;
-      _jpg_buf = NULL;
-    } else if (_jpg_buf) {
-      free(_jpg_buf);
-      _jpg_buf = NULL;
+// Switches the SD bus width at runtime: /sd_bus?width=4 or /sd_bus?width=1.
+// The remount waits behind the queued writes, so it is started in the
+// background and answered with 202, like /sd_bench. /sd_bus without a query
+// reports the current mode and the state of the last switch: 202 while it is
+// running, 500 if it failed. A 4-bit request the card cannot do ends up in
+// 1-bit mode, which bus_width then shows.
+static esp_err_t sd_bus_handler(httpd_req_t *req) {
+  static const char *const states[] = {"idle", "running", "done", "failed"};
+  char query[32];
+  uint32_t width;
+  const char *status = NULL; // set when this request starts a switch
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+      query_u32(query, "width", &width)) {
+    if (width != 1 && width != 4) {
+      httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "width must be 1 or 4");
+      return ESP_FAIL;
     }
-    if (res != ESP_OK) {
-      log_e("Send frame failed");
-      break;
+    if (sd_writer_start_bus_switch(width)) {
+      log_i("Switching SD bus to %u-bit", width);
+      status = "202 Accepted";
+    } else {
+      status = "409 Conflict";
     }
-    int64_t fr_end = esp_timer_get_time();
+  }
 
-    int64_t frame_time = fr_end - last_frame;
-    frame_time /= 1000;
-#if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_INFO
-    uint32_t avg_frame_time = ra_filter_run(&ra_filter, frame_time);
-#endif
-    log_i("MJPG: %uB %ums (%.1ffps), AVG: %ums (%.1ffps)",
-          (uint32_t)(_jpg_buf_len), (uint32_t)frame_time,
-          1000.0 / (uint32_t)frame_time, avg_frame_time,
-          1000.0 / avg_frame_time);
+  uint8_t state = sd_writer_bus_switch_status();
+  if (!status) {
+    status = state == SD_BUS_SWITCH_RUNNING  ? "202 Accepted"
+             : state == SD_BUS_SWITCH_FAILED ? "500 Internal Server Error"
+                                             : "200 OK";
   }
+  char json[128];
+  int len = snprintf(json, sizeof(json),
+                     "{\"state\":\"%s\",\"bus_width\":%u,\"requested\":%u,"
+                     "\"fallbacks\":%u}",
+                     states[state], sd_card_bus_width(),
+                     sd_card_requested_bus_width(), sd_card_fallbacks());
+  httpd_resp_set_status(req, status);
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  return httpd_resp_send(req, json, len);
+}
 
-  return res;
+// Collects the exposition's short lines into chunks of about a KB
+typedef struct {
+  httpd_req_t *req;
+  size_t used;
+  char buf[1024];
+} metrics_chunk_t;
+
+static bool metrics_flush(metrics_chunk_t *chunk) {
+  if (chunk->used == 0) {
+    return true;
+  }
+  esp_err_t res = httpd_resp_send_chunk(chunk->req, chunk->buf, chunk->used);
+  chunk->used = 0;
+  return res == ESP_OK;
+}
+
+static bool metrics_write(void *arg, const char *line) {
+  metrics_chunk_t *chunk = (metrics_chunk_t *)arg;
+  size_t len = strlen(line);
+  if (chunk->used + len > sizeof(chunk->buf) && !metrics_flush(chunk)) {
+    return false;
+  }
+  if (len > sizeof(chunk->buf)) {
+    return httpd_resp_send_chunk(chunk->req, line, len) == ESP_OK;
+  }
+  memcpy(chunk->buf + chunk->used, line, len);
+  chunk->used += len;
+  return true;
+}
+
+// Stage latency histograms in Prometheus text format. Only reachable during
+// the focus window after boot: the web server and WiFi are stopped when it
+// ends, before the first timelapse shot, so the shot stages are usually still
+// empty here. They are summarized in /heartbeat.txt instead.
+static esp_err_t metrics_handler(httpd_req_t *req) {
+  metrics_chunk_t *chunk = (metrics_chunk_t *)malloc(sizeof(metrics_chunk_t));
+  if (!chunk) {
+    return httpd_resp_send_500(req);
+  }
+  chunk->req = req;
+  chunk->used = 0;
+  httpd_resp_set_type(req, "text/plain; version=0.0.4");
+  httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+  bool ok = stage_timer_prometheus(metrics_write, chunk) && metrics_flush(chunk);
+  free(chunk);
+  return ok ? httpd_resp_send_chunk(req, NULL, 0) : ESP_FAIL;
 }
 
 // Removed all handlers and functions related to changing camera settings
@@ -316,15 +509,76 @@ static esp_err_t index_handler(httpd_req_t *req) {
                          index_ov2640_html_gz_len);
 }
 
+// Handlers on the control port run through timed_handler(), which records
+// their latency under the stage in user_ctx
+typedef struct {
+  esp_err_t (*handler)(httpd_req_t *req);
+  stage_t stage;
+} timed_handler_t;
+
+static esp_err_t timed_handler(httpd_req_t *req) {
+  const timed_handler_t *timed = (const timed_handler_t *)req->user_ctx;
+  int64_t start = stage_timer_start();
+  esp_err_t res = timed->handler(req);
+  stage_timer_record(timed->stage, start);
+  return res;
+}
+
+static const timed_handler_t timed_index = {index_handler, STAGE_HTTP_INDEX};
+static const timed_handler_t timed_capture = {capture_handler,
+                                              STAGE_HTTP_CAPTURE};
+static const timed_handler_t timed_bmp = {bmp_handler, STAGE_HTTP_BMP};
+static const timed_handler_t timed_status = {status_handler,
+                                             STAGE_HTTP_STATUS};
+static const timed_handler_t timed_timelapse = {timelapse_handler,
+                                                STAGE_HTTP_TIMELAPSE};
+static const timed_handler_t timed_sd_bench = {sd_bench_handler,
+                                               STAGE_HTTP_SD_BENCH};
+static const timed_handler_t timed_sd_bus = {sd_bus_handler,
+                                             STAGE_HTTP_SD_BUS};
+static const timed_handler_t timed_metrics = {metrics_handler,
+                                              STAGE_HTTP_METRICS};
+
 void startCameraServer() {
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-  config.max_uri_handlers = 4; // Reduced since fewer handlers are used
+  config.stack_size += JPEG_ENCODE_STACK_EXTRA; // /capture encodes raw frames
+  config.max_uri_handlers = 12; // 8 registered below, with room for more
 
   // Define URI handlers for streaming and capturing images
   httpd_uri_t capture_uri = {.uri = "/capture",
                              .method = HTTP_GET,
-                             .handler = capture_handler,
-                             .user_ctx = NULL};
+                             .handler = timed_handler,
+                             .user_ctx = (void *)&timed_capture};
+
+  httpd_uri_t bmp_uri = {.uri = "/bmp",
+                         .method = HTTP_GET,
+                         .handler = timed_handler,
+                         .user_ctx = (void *)&timed_bmp};
+
+  httpd_uri_t status_uri = {.uri = "/status",
+                            .method = HTTP_GET,
+                            .handler = timed_handler,
+                            .user_ctx = (void *)&timed_status};
+
+  httpd_uri_t timelapse_uri = {.uri = "/timelapse",
+                               .method = HTTP_GET,
+                               .handler = timed_handler,
+                               .user_ctx = (void *)&timed_timelapse};
+
+  httpd_uri_t sd_bench_uri = {.uri = "/sd_bench",
+                              .method = HTTP_GET,
+                              .handler = timed_handler,
+                              .user_ctx = (void *)&timed_sd_bench};
+
+  httpd_uri_t sd_bus_uri = {.uri = "/sd_bus",
+                            .method = HTTP_GET,
+                            .handler = timed_handler,
+                            .user_ctx = (void *)&timed_sd_bus};
+
+  httpd_uri_t metrics_uri = {.uri = "/metrics",
+                             .method = HTTP_GET,
+                             .handler = timed_handler,
+                             .user_ctx = (void *)&timed_metrics};
 
   httpd_uri_t stream_uri = {.uri = "/stream",
                             .method = HTTP_GET,
@@ -335,8 +589,8 @@ void startCameraServer() {
   // If you keep it, ensure the served page does not include settings controls
   httpd_uri_t index_uri = {.uri = "/",
                            .method = HTTP_GET,
-                           .handler = index_handler,
-                           .user_ctx = NULL
+                           .handler = timed_handler,
+                           .user_ctx = (void *)&timed_index
 #ifdef CONFIG_HTTPD_WS_SUPPORT
                            ,
                            .is_websocket = true,
@@ -345,15 +599,28 @@ void startCameraServer() {
 #endif
   };
 
+  stream_broadcaster_init();
+
   // Initialize the web server
   log_i("Starting web server on port: '%d'", config.server_port);
   if (httpd_start(&camera_httpd, &config) == ESP_OK) {
     httpd_register_uri_handler(camera_httpd, &index_uri);
     httpd_register_uri_handler(camera_httpd, &capture_uri);
+    httpd_register_uri_handler(camera_httpd, &bmp_uri);
+    httpd_register_uri_handler(camera_httpd, &status_uri);
+    httpd_register_uri_handler(camera_httpd, &timelapse_uri);
+    httpd_register_uri_handler(camera_httpd, &sd_bench_uri);
+    httpd_register_uri_handler(camera_httpd, &sd_bus_uri);
+    httpd_register_uri_handler(camera_httpd, &metrics_uri);
   }
 
   config.server_port += 1;
   config.ctrl_port += 1;
+  config.core_id = STREAM_SEND_CORE;
+  // One socket per viewer plus one to answer a rejected viewer
+  config.max_open_sockets = STREAM_MAX_CLIENTS + 1;
+  // Viewer sockets are closed by their sender, not under its feet
+  config.close_fn = stream_broadcaster_close_fn;
 
   log_i("Starting stream server on port: '%d'", config.server_port);
   if (httpd_start(&stream_httpd, &config) == ESP_OK) {
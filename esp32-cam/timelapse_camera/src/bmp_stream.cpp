@@ -0,0 +1,187 @@
+#include "bmp_stream.h"
+
+#include "esp_jpg_decode.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  jpg_out_cb cb;
+  void *arg;
+  size_t index; // bytes handed to cb so far
+  uint16_t width;
+  uint16_t height;
+  size_t stride; // row bytes, padded to a multiple of 4
+  uint8_t *band;
+  const uint8_t *jpeg;
+  bool ok;
+} bmp_stream_t;
+
+static size_t row_stride(uint16_t width) {
+  return ((size_t)width * 3 + 3) & ~(size_t)3;
+}
+
+size_t bmp_stream_size(uint16_t width, uint16_t height) {
+  return BMP_HEADER_SIZE + row_stride(width) * height;
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  put_u16(p, v);
+  put_u16(p + 2, v >> 16);
+}
+
+static bool emit(bmp_stream_t *s, const uint8_t *data, size_t len) {
+  if (s->ok && s->cb(s->arg, s->index, data, len) == len) {
+    s->index += len;
+  } else {
+    s->ok = false;
+  }
+  return s->ok;
+}
+
+// Allocates the band buffer and sends the file and info headers
+static bool begin(bmp_stream_t *s, uint16_t width, uint16_t height) {
+  s->width = width;
+  s->height = height;
+  s->stride = row_stride(width);
+  // Zeroed once, so the row padding stays zero
+  s->band = (uint8_t *)calloc(BMP_BAND_ROWS, s->stride);
+  if (!s->band) {
+    s->ok = false;
+    return false;
+  }
+
+  uint8_t header[BMP_HEADER_SIZE] = {'B', 'M'};
+  put_u32(header + 2, bmp_stream_size(width, height)); // file size
+  put_u32(header + 10, BMP_HEADER_SIZE);               // pixel data offset
+  put_u32(header + 14, 40);                            // info header size
+  put_u32(header + 18, width);
+  put_u32(header + 22, (uint32_t)-(int32_t)height); // negative: top-down
+  put_u16(header + 26, 1);                          // planes
+  put_u16(header + 28, 24);                         // bits per pixel
+  put_u32(header + 34, s->stride * height);         // pixel data size
+  return emit(s, header, sizeof(header));
+}
+
+static inline uint8_t clamp_u8(int v) {
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline void yuv_to_bgr(int y, int u, int v, uint8_t *dst) {
+  y <<= 8;
+  u -= 128;
+  v -= 128;
+  dst[0] = clamp_u8((y + 454 * u) >> 8);
+  dst[1] = clamp_u8((y - 88 * u - 183 * v) >> 8);
+  dst[2] = clamp_u8((y + 359 * v) >> 8);
+}
+
+// Converts one row of a raw frame to BGR
+static void convert_row(pixformat_t format, const uint8_t *src, uint8_t *dst,
+                        uint16_t width) {
+  switch (format) {
+  case PIXFORMAT_RGB565:
+    // The driver stores RGB565 high byte first
+    for (uint16_t x = 0; x < width; x++, src += 2, dst += 3) {
+      dst[0] = (src[1] & 0x1f) << 3;
+      dst[1] = (src[0] & 0x07) << 5 | (src[1] & 0xe0) >> 3;
+      dst[2] = src[0] & 0xf8;
+    }
+    break;
+  case PIXFORMAT_YUV422:
+    // Y0 U Y1 V: two pixels share one U/V pair
+    for (uint16_t x = 0; x + 1 < width; x += 2, src += 4, dst += 6) {
+      yuv_to_bgr(src[0], src[1], src[3], dst);
+      yuv_to_bgr(src[2], src[1], src[3], dst + 3);
+    }
+    break;
+  default: // PIXFORMAT_GRAYSCALE
+    for (uint16_t x = 0; x < width; x++, dst += 3) {
+      dst[0] = dst[1] = dst[2] = src[x];
+    }
+    break;
+  }
+}
+
+static bool stream_raw(bmp_stream_t *s, const uint8_t *buf, size_t len,
+                       pixformat_t format) {
+  size_t bpp = format == PIXFORMAT_GRAYSCALE ? 1 : 2;
+  if ((size_t)s->width * s->height * bpp > len) {
+    return false;
+  }
+  for (uint16_t y = 0; y < s->height; y += BMP_BAND_ROWS) {
+    uint16_t rows = s->height - y < BMP_BAND_ROWS ? s->height - y
+                                                  : BMP_BAND_ROWS;
+    for (uint16_t r = 0; r < rows; r++) {
+      convert_row(format, buf + (size_t)(y + r) * s->width * bpp,
+                  s->band + r * s->stride, s->width);
+    }
+    if (!emit(s, s->band, rows * s->stride)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static size_t jpeg_read(void *arg, size_t index, uint8_t *buf, size_t len) {
+  bmp_stream_t *s = (bmp_stream_t *)arg;
+  if (buf) {
+    memcpy(buf, s->jpeg + index, len);
+  }
+  return len;
+}
+
+// Receives the decoder's RGB888 blocks MCU by MCU. A band is complete, and
+// sent, once the rightmost block of an MCU row is in.
+static bool jpeg_write(void *arg, uint16_t x, uint16_t y, uint16_t w,
+                       uint16_t h, uint8_t *data) {
+  bmp_stream_t *s = (bmp_stream_t *)arg;
+  if (!data) {
+    // Called with the image size before the first block and with no data
+    // after the last one
+    return x != 0 || y != 0 || begin(s, w, h);
+  }
+  if (h > BMP_BAND_ROWS) {
+    return false;
+  }
+  for (uint16_t r = 0; r < h; r++) {
+    uint8_t *dst = s->band + r * s->stride + (size_t)x * 3;
+    for (uint16_t i = 0; i < w; i++, data += 3, dst += 3) {
+      dst[0] = data[2];
+      dst[1] = data[1];
+      dst[2] = data[0];
+    }
+  }
+  if (x + w >= s->width) {
+    return emit(s, s->band, h * s->stride);
+  }
+  return true;
+}
+
+bool bmp_stream_frame(const uint8_t *buf, size_t len, uint16_t width,
+                      uint16_t height, pixformat_t format, jpg_out_cb cb,
+                      void *arg) {
+  bmp_stream_t s = {};
+  s.cb = cb;
+  s.arg = arg;
+  s.ok = true;
+
+  bool ok;
+  if (format == PIXFORMAT_JPEG) {
+    s.jpeg = buf;
+    ok = esp_jpg_decode(len, JPG_SCALE_NONE, jpeg_read, jpeg_write, &s) ==
+             ESP_OK &&
+         s.ok;
+  } else if (format == PIXFORMAT_RGB565 || format == PIXFORMAT_YUV422 ||
+             format == PIXFORMAT_GRAYSCALE) {
+    ok = begin(&s, width, height) && stream_raw(&s, buf, len, format);
+  } else {
+    ok = false;
+  }
+  free(s.band);
+  return ok;
+}
@@ -0,0 +1,113 @@
+#include "camera_profile.h"
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <string.h>
+
+static SemaphoreHandle_t profile_lock = NULL;
+static camera_profile_t current = CAMERA_PROFILE_NONE;
+// Frames that may still hold the old settings after a switch: every buffer
+// the driver can have filled in advance, plus the one the sensor was
+// exposing while its window registers changed
+static uint8_t stale_frames = 2;
+static camera_profile_stats_t stats;
+
+static_assert(PREVIEW_FRAMESIZE <= ARCHIVAL_FRAMESIZE,
+              "the frame buffers are sized for ARCHIVAL_FRAMESIZE");
+
+void camera_profile_configure(camera_config_t *config) {
+  config->pixel_format = CAMERA_PIXEL_FORMAT;
+  config->frame_size = ARCHIVAL_FRAMESIZE;
+  config->jpeg_quality = ARCHIVAL_JPEG_QUALITY;
+}
+
+void camera_profile_begin(const camera_config_t *config) {
+  if (!profile_lock) {
+    profile_lock = xSemaphoreCreateMutex();
+  }
+  stale_frames = config->fb_count + 1;
+  current = CAMERA_PROFILE_ARCHIVAL;
+}
+
+void camera_profile_end() {
+  current = CAMERA_PROFILE_NONE;
+}
+
+bool camera_profile_apply(camera_profile_t profile) {
+  if (!profile_lock) {
+    return false;
+  }
+  xSemaphoreTake(profile_lock, portMAX_DELAY);
+  if (current == profile || current == CAMERA_PROFILE_NONE) {
+    bool ok = current == profile;
+    xSemaphoreGive(profile_lock);
+    return ok;
+  }
+
+  int64_t start = esp_timer_get_time();
+  bool preview = profile == CAMERA_PROFILE_PREVIEW;
+  sensor_t *s = esp_camera_sensor_get();
+  bool ok = s != NULL &&
+            s->set_framesize(s, preview ? PREVIEW_FRAMESIZE
+                                        : ARCHIVAL_FRAMESIZE) == 0 &&
+            s->set_quality(s, preview ? PREVIEW_JPEG_QUALITY
+                                      : ARCHIVAL_JPEG_QUALITY) == 0;
+  if (ok) {
+    for (uint8_t i = 0; i < stale_frames; i++) {
+      camera_fb_t *fb = esp_camera_fb_get();
+      if (!fb) {
+        break;
+      }
+      esp_camera_fb_return(fb);
+      stats.discarded++;
+    }
+    current = profile;
+  }
+
+  uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+  if (ok) {
+    stats.switches++;
+    stats.last_switch_us = elapsed;
+    if (elapsed > stats.max_switch_us) {
+      stats.max_switch_us = elapsed;
+    }
+  } else {
+    stats.failures++;
+  }
+  xSemaphoreGive(profile_lock);
+
+  if (ok) {
+    Serial.printf("Camera: Switched to %s profile in %u ms\n",
+                  camera_profile_name(profile), (unsigned)(elapsed / 1000));
+  } else {
+    Serial.printf("Camera: Failed to switch to %s profile\n",
+                  camera_profile_name(profile));
+  }
+  return ok;
+}
+
+camera_profile_t camera_profile_current() {
+  return current;
+}
+
+const char *camera_profile_name(camera_profile_t profile) {
+  switch (profile) {
+  case CAMERA_PROFILE_PREVIEW:
+    return "preview";
+  case CAMERA_PROFILE_ARCHIVAL:
+    return "archival";
+  default:
+    return "none";
+  }
+}
+
+void camera_profile_get_stats(camera_profile_stats_t *out) {
+  if (!profile_lock) {
+    memset(out, 0, sizeof(*out));
+    return;
+  }
+  xSemaphoreTake(profile_lock, portMAX_DELAY);
+  *out = stats;
+  xSemaphoreGive(profile_lock);
+}
@@ -7,11 +7,74 @@
 #include "esp_task_wdt.h"  // For watchdog timer
 #include "esp_http_server.h" // For httpd_handle_t and httpd_stop
 #include "esp_sleep.h"     // For light sleep
+#include "esp_sntp.h"      // NTP sync notification
+#include "freertos/semphr.h" // For waiting on raw frame writes
+#include "stream_broadcaster.h" // For stopping /stream viewers before the camera
+#include "sd_writer.h"      // Queued SD card writes
+#include "timelapse_segment.h" // Segment file storage for timelapse frames
+#include "timelapse_index.h"   // Date-sharded timelapse files and frame index
+#include "sd_bench.h"         // SD card benchmark
+#include "jpeg_stream.h"      // Cancelling a raw frame's encode to the card
+#include "sd_card.h"          // SD_MMC bus width selection
+#include "camera_profile.h"   // Preview (/stream) and archival (timelapse) capture settings
+#include "jpeg_dc.h"          // JPEG thumbnails for the motion score
+#include "motion_score.h"     // Motion-adaptive timelapse interval
+#include "frame_fingerprint.h" // Skipping near-duplicate timelapse frames
+#include "frame_quality.h"     // Best-of-burst timelapse frame selection
+#include "coop_scheduler.h"   // Housekeeping timers and capture-path waits (shared/)
+#include "task_monitor.h"     // Per-task stack and busy time reporting
+#include "stage_timer.h"      // Per-stage latency histograms
+#include "freertos/event_groups.h" // Focus mode and capture state shared between tasks
 
 #ifndef VERTICAL_FLIP
 #define VERTICAL_FLIP 0  // Default to false if not defined
 #endif
 
+#ifndef CAMERA_FB_COUNT
+#define CAMERA_FB_COUNT 1  // Default to a single frame buffer if not defined
+#endif
+
+#ifndef SD_FRAME_BENCH_ON_BOOT
+#define SD_FRAME_BENCH_ON_BOOT 0  // Default to no SD write benchmark at boot if not defined
+#endif
+
+#ifndef SD_BENCH_ON_BOOT
+#define SD_BENCH_ON_BOOT 0  // Default to no full SD card benchmark at boot if not defined
+#endif
+
+#ifndef CAMERA_WARM_STANDBY
+#define CAMERA_WARM_STANDBY 0  // Default to a full init/deinit per timelapse shot if not defined
+#endif
+
+#ifndef TIMELAPSE_MOTION
+#define TIMELAPSE_MOTION 0  // Default to a fixed timelapse interval if not defined
+#endif
+
+#ifndef TIMELAPSE_MIN_INTERVAL_MS
+#define TIMELAPSE_MIN_INTERVAL_MS 5000  // Timelapse interval while the scene is moving
+#endif
+
+#ifndef TIMELAPSE_DEDUP
+#define TIMELAPSE_DEDUP 0  // Default to storing every timelapse frame if not defined
+#endif
+
+#ifndef TIMELAPSE_DEDUP_MAX_AGE_S
+#define TIMELAPSE_DEDUP_MAX_AGE_S 600  // Store a frame at least this often, duplicate or not
+#endif
+
+#ifndef TIMELAPSE_BURST_FRAMES
+#define TIMELAPSE_BURST_FRAMES 1  // Default to storing the one frame after AWB/AEC stabilization
+#endif
+
+// Timelapse storage: one JPEG file per frame under /YYYY/MM/DD/, or frames
+// appended to segment files. Either way every frame is added to /timelapse.idx.
+#define _STORAGE_MODE_FILES 1
+#define _STORAGE_MODE_SEGMENTS 2
+
+#ifndef TIMELAPSE_STORAGE_MODE
+#define TIMELAPSE_STORAGE_MODE _STORAGE_MODE_FILES  // Default to one file per frame if not defined
+#endif
+
 // =======================================================================
 // Camera Model Selection
 // Camera Model Selection is now controlled by -DCAMERA_MODEL in platformio.ini
@@ -87,19 +150,76 @@ const int DAILY_RESET_START_OFFSET_MINUTES = 5; // Wait 5 mins after NIGHT_WAKE_
 #define WDT_TIMEOUT_SECONDS 30      // Watchdog timeout in seconds
 #define WIFI_RECONNECT_INTERVAL 60000 // Try to reconnect every 60 seconds
 #define HEARTBEAT_INTERVAL 300000   // Update heartbeat file every 5 minutes
+#define HEARTBEAT_STAGE_STATS_MAX 1536 // Room for a latency line per stage
 #define AUTO_RESET_INTERVAL 86400000 // Auto reset every 24 hours (86400000 ms)
 #define FOCUS_MODE_DURATION_MS (30 * 1000) // 30 seconds for focus mode
 
+// Warm standby: frames discarded after waking the sensor. The first one is the
+// frame the driver buffered before standby, the second lets AEC/AWB catch up.
+#define WARM_STANDBY_DISCARD_FRAMES 2
+
+// OV2640 COM2 register (sensor bank, hence bit 8 set for set_reg()).
+// Bit 4 enables soft standby; register contents are retained while asleep.
+#define OV2640_REG_COM2 0x109
+#define OV2640_COM2_STANDBY 0x10
+
+// Longest time a timelapse shot waits for room in the SD writer queue, and the
+// longest time to wait for queued writes before sleeping or restarting.
+#define TIMELAPSE_SD_SUBMIT_TIMEOUT_MS 5000
+#define SD_FLUSH_TIMEOUT_MS 5000
+// Longest time a timelapse shot waits for a raw frame's encode to the card
+// before cancelling it
+#define RAW_TIMELAPSE_SAVE_TIMEOUT_MS 20000
+
+// Boot-time SD write benchmark: files of a typical SVGA JPEG's size
+#define SD_FRAME_BENCH_FILES 10
+#define SD_FRAME_BENCH_FILE_SIZE (64 * 1024)
+
 // Global camera configuration
 camera_config_t global_cam_config;
 
+// Firmware tasks. Capture takes the timelapse shots and owns the night and
+// light sleep decisions; network runs focus mode and its WiFi checks;
+// housekeeping runs the heartbeat and daily reset timers. Storage is the SD
+// writer task (sd_writer.h), fed through its job queue. A slow SD write or
+// WiFi reconnect therefore only holds up its own task. Arduino's loop() task
+// is not used.
+#define CAPTURE_TASK_STACK 8192
+#define NETWORK_TASK_STACK 6144
+#define HOUSEKEEPING_TASK_STACK 4096
+#define CAPTURE_TASK_CORE 1       // Away from the WiFi stack
+#define NETWORK_TASK_CORE 0
+#define HOUSEKEEPING_TASK_CORE 0
+#define DAILY_RESET_CHECK_INTERVAL_MS 60000
+#define CAPTURE_IDLE_TIMEOUT_MS 20000 // Longest a daily reset waits for a shot to finish
+
+// Bits of firmwareEvents
+#define EVENT_FOCUS_MODE_DONE (1 << 0) // Web server and WiFi stopped, timelapse may run
+#define EVENT_CAPTURE_IDLE (1 << 1)    // No timelapse shot in progress
+#define EVENT_WIFI_CONNECTED (1 << 2)  // Station has an IP address
+#define EVENT_WIFI_DISCONNECTED (1 << 3) // Station lost or left the AP
+#define EVENT_TIME_SYNCED (1 << 4)     // SNTP set the clock
+
+static EventGroupHandle_t firmwareEvents = NULL;
+
+// Housekeeping timers, run by the housekeeping task only
+static coop_scheduler_t scheduler;
+static coop_task_t heartbeatTask;
+static coop_task_t dailyResetTask;
+// millis() at which the housekeeping task next wakes, published by that task
+// for the capture task's light sleep decision (only read with __atomic_*)
+static uint32_t housekeepingWakeMs = 0;
+// Sensor waits within a timelapse shot, run by the capture task only
+static coop_scheduler_t captureScheduler;
+
 // Global variables for reliability and focus mode
-unsigned long lastWifiCheck = 0;
-unsigned long lastHeartbeat = 0;
 unsigned long startTime = 0;
 unsigned long photosCount = 0;
 bool focusModeActive = true; // Start in focus mode
 unsigned long focusModeEndTime = 0;
+bool cameraInitialized = false; // True while esp_camera_init() is in effect
+unsigned long lastShotLatencyMs = 0; // Wall time of the last timelapse shot
+bool lastShotWarm = false; // Whether the last shot reused a warm camera
 
 // HTTP server handles (defined in app_httpd.cpp)
 extern httpd_handle_t camera_httpd;
@@ -109,6 +229,20 @@ void startCameraServer();
 void setupLedFlash(int pin);
 void checkWiFiConnection();
 void updateHeartbeat();
+void cameraDeinit();
+void cameraSetStandby(bool standby);
+
+void checkDailyReset();
+void startFirmwareTasks();
+
+// The camera did not come up at boot: skip WiFi and focus mode and go straight
+// to the timelapse, whose shots retry the init. Heartbeat and daily reset run
+// as usual.
+static void startWithoutCamera() {
+  Serial.println("Starting without focus mode, timelapse shots will retry the camera init.");
+  focusModeActive = false;
+  startFirmwareTasks();
+}
 
 void setup() {
   Serial.begin(115200);
@@ -122,6 +256,11 @@ void setup() {
   // Record the start time
   startTime = millis();
 
+  firmwareEvents = xEventGroupCreate();
+  WiFi.onEvent(onWiFiEvent);
+  sntp_set_time_sync_notification_cb(onTimeSynced);
+
+
   // Print WiFi credentials
   Serial.print("Using WiFi SSID: ");
   Serial.println(WIFI_SSID);
@@ -130,7 +269,7 @@ void setup() {
 
   // Initialize SD card - critical for operation
   int sdRetries = 0;
-  while(!SD_MMC.begin("/sdcard", true)) {
+  while(!sd_card_mount()) { // SD_BUS_WIDTH first, falling back to 1-bit
     Serial.println("SD Card Mount Failed, retrying...");
     delay(1000);
     if(++sdRetries >= 5) {
@@ -138,7 +277,26 @@ void setup() {
       ESP.restart();
     }
   }
-  Serial.println("SD Card Initialized");
+  Serial.printf("SD Card Initialized (%u-bit bus)\n", sd_card_bus_width());
+  if (!sd_writer_start()) {
+    Serial.println("SD writer task failed to start, SD writes will be done inline");
+  }
+#if SD_FRAME_BENCH_ON_BOOT
+  runSdFrameBench();
+#endif
+#if SD_BENCH_ON_BOOT
+  {
+    Serial.println("Running SD card benchmark in 1-bit and 4-bit mode...");
+    esp_task_wdt_delete(NULL); // The benchmark takes longer than the watchdog allows
+    sd_bench_report_t report;
+    if (sd_bench_run(SD_BENCH_BUS_1BIT | SD_BENCH_BUS_4BIT, &report)) {
+      Serial.println("SD card benchmark results written to " SD_BENCH_RESULT_PATH);
+    } else {
+      Serial.println("SD card benchmark failed");
+    }
+    esp_task_wdt_add(NULL);
+  }
+#endif
   
   // Create a startup marker file
   File startupFile = SD_MMC.open("/startup.txt", FILE_WRITE);
@@ -201,13 +359,27 @@ void setup() {
   // FRAMESIZE_XGA (1024x768)
   // FRAMESIZE_SVGA (800x600) - Good balance of quality and performance
   // FRAMESIZE_VGA (640x480) - Lower quality, faster
-  global_cam_config.frame_size = FRAMESIZE_SVGA; // 800x600 resolution
-  global_cam_config.pixel_format = PIXFORMAT_JPEG; // Set pixel format to JPEG for OV5640
+  // The driver starts in the archival profile (ARCHIVAL_FRAMESIZE, ARCHIVAL_JPEG_QUALITY);
+  // /stream switches the sensor to the smaller preview profile while it runs.
+  // CAMERA_FRAME_FORMAT picks JPEG from the sensor (default) or a raw format.
+  camera_profile_configure(&global_cam_config);
   global_cam_config.grab_mode = CAMERA_GRAB_WHEN_EMPTY;
   global_cam_config.fb_location = CAMERA_FB_IN_PSRAM;
-  global_cam_config.jpeg_quality = 12; // Lower number means higher quality (0-63)
   global_cam_config.fb_count = 1;
 
+  // With more than one PSRAM frame buffer the driver fills the next frame while the
+  // previous one is still being sent, and CAMERA_GRAB_LATEST hands out the newest.
+  if (CAMERA_FB_COUNT > 1) {
+    if (psramFound()) {
+      global_cam_config.fb_count = CAMERA_FB_COUNT;
+      global_cam_config.grab_mode = CAMERA_GRAB_LATEST;
+    } else {
+      Serial.println("PSRAM not found, using a single frame buffer.");
+    }
+  }
+  Serial.printf("Frame buffers: %u (%s)\n", (unsigned)global_cam_config.fb_count,
+                global_cam_config.grab_mode == CAMERA_GRAB_LATEST ? "grab latest" : "grab when empty");
+
   // Debugging: Initialize camera and print errors
   esp_err_t err = esp_camera_init(&global_cam_config);
   if (err != ESP_OK) {
@@ -217,13 +389,17 @@ void setup() {
   } else if (err == 0x106) { // Replace ESP_ERR_CAMERA_FAILED_TO_INIT with its value
     Serial.println("Camera initialization failed. Check configuration or power supply.");
   }
+    startWithoutCamera();
     return;
   }
-  
+  cameraInitialized = true;
+  camera_profile_begin(&global_cam_config);
 
   sensor_t *s = esp_camera_sensor_get();
   if (s == NULL) {
     Serial.println("Failed to get camera sensor.");
+    cameraDeinit();
+    startWithoutCamera();
     return;
   }
 
@@ -248,17 +424,9 @@ void setup() {
   WiFi.setSleep(false);
 
   Serial.print("WiFi connecting");
-  unsigned long wifiStartTime = millis();
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-    esp_task_wdt_reset(); // Reset watchdog while waiting
-    
-    // If WiFi connection takes too long, continue anyway
-    if (millis() - wifiStartTime > 20000) {
-      Serial.println("\nWiFi connection timeout. Continuing without WiFi.");
-      break;
-    }
+  // If WiFi connection takes too long, continue anyway
+  if (!waitForFirmwareEvent(EVENT_WIFI_CONNECTED, 20000)) {
+    Serial.println("\nWiFi connection timeout. Continuing without WiFi.");
   }
   
   if (WiFi.status() == WL_CONNECTED) {
@@ -275,9 +443,15 @@ void setup() {
   } else {
     Serial.println("\nOperating without WiFi connection. Focus mode disabled.");
     focusModeActive = false;
+#if CAMERA_WARM_STANDBY
+    // Keep the driver initialized for timelapse; park the sensor until the first shot
+    Serial.println("Putting camera into standby as WiFi connection failed.");
+    cameraSetStandby(true);
+#else
     // De-initialize camera as web server won't start and focus mode is off
     Serial.println("De-initializing camera as WiFi connection failed.");
-    esp_camera_deinit();
+    cameraDeinit();
+#endif
   }
 
   // Load last daily reset time after SD and NTP are up (if WiFi connected)
@@ -328,11 +502,14 @@ void setup() {
 
   focusModeEndTime = millis() + FOCUS_MODE_DURATION_MS;
   Serial.printf("Focus mode will be active for %lu minutes.\n", FOCUS_MODE_DURATION_MS / (60 * 1000));
+
+  startFirmwareTasks();
 }
 
 
 void stopWebServerAndWiFi() {
     Serial.println("Stopping web server...");
+    stream_broadcaster_stop(); // Release the camera and the stream sockets first
     if (camera_httpd) {
         httpd_stop(camera_httpd);
         camera_httpd = NULL; // Mark as stopped
@@ -349,6 +526,37 @@ void stopWebServerAndWiFi() {
     Serial.println("WiFi turned off.");
 }
 
+// Waits for all of bits in firmwareEvents, for at most timeout_ms. Wakes as
+// soon as they are set; meanwhile prints a dot and feeds the watchdog every
+// 500 ms. Returns whether they were set.
+static bool waitForFirmwareEvent(EventBits_t bits, uint32_t timeout_ms) {
+  unsigned long start = millis();
+  while ((xEventGroupWaitBits(firmwareEvents, bits, pdFALSE, pdTRUE, pdMS_TO_TICKS(500)) & bits) != bits) {
+    Serial.print(".");
+    esp_task_wdt_reset(); // Reset watchdog while waiting
+    if (millis() - start > timeout_ms) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs on the WiFi event task
+static void onWiFiEvent(arduino_event_id_t event) {
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+    xEventGroupClearBits(firmwareEvents, EVENT_WIFI_DISCONNECTED);
+    xEventGroupSetBits(firmwareEvents, EVENT_WIFI_CONNECTED);
+  } else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED || event == ARDUINO_EVENT_WIFI_STA_LOST_IP) {
+    xEventGroupClearBits(firmwareEvents, EVENT_WIFI_CONNECTED);
+    xEventGroupSetBits(firmwareEvents, EVENT_WIFI_DISCONNECTED);
+  }
+}
+
+// Runs on the lwIP task when SNTP sets the clock
+static void onTimeSynced(struct timeval *tv) {
+  xEventGroupSetBits(firmwareEvents, EVENT_TIME_SYNCED);
+}
+
 void setupTimeViaNTP() {
   Serial.printf("Setting Timezone to: %s\n", timeZone);
   setenv("TZ", timeZone, 1); // Set the TZ environment variable
@@ -356,22 +564,18 @@ void setupTimeViaNTP() {
 
   // When using setenv/tzset, gmtOffset_sec and daylightOffset_sec in configTime should be 0
   // as the timezone information is now handled by the TZ environment variable.
+  xEventGroupClearBits(firmwareEvents, EVENT_TIME_SYNCED);
   configTime(0, 0, ntpServer);
   
   // Wait until time is set, but with a timeout
   time_t now = 0;
-  unsigned long ntpStartTime = millis();
-  while (now < 1672531200) { // some date in 2023 or later
-    delay(500);
-    Serial.print(".");
-    time(&now);
-    esp_task_wdt_reset(); // Reset watchdog while waiting
-    
+  time(&now);
+  if (now < 1672531200) { // some date in 2023 or later
     // If NTP sync takes too long, continue anyway
-    if (millis() - ntpStartTime > 10000) {
+    if (!waitForFirmwareEvent(EVENT_TIME_SYNCED, 10000)) {
       Serial.println("\nNTP sync timeout. Using system time.");
-      break;
     }
+    time(&now);
   }
   
   if (now > 1672531200) {
@@ -381,68 +585,486 @@ void setupTimeViaNTP() {
   }
 }
 
-// 5-second timelapse interval
+// De-initialize the camera driver and record that it is no longer available
+void cameraDeinit() {
+    int64_t deinit_start = stage_timer_start();
+    esp_camera_deinit();
+    stage_timer_record(STAGE_CAMERA_DEINIT, deinit_start);
+    cameraInitialized = false;
+    camera_profile_end();
+}
+
+// Put the sensor into (or take it out of) soft standby without touching the driver.
+// Only the OV2640 is handled; other sensors simply stay awake between shots.
+void cameraSetStandby(bool standby) {
+    sensor_t *s = esp_camera_sensor_get();
+    if (s == NULL || s->id.PID != OV2640_PID) {
+        return;
+    }
+    if (s->set_reg(s, OV2640_REG_COM2, OV2640_COM2_STANDBY, standby ? OV2640_COM2_STANDBY : 0) != 0) {
+        Serial.printf("Camera: Failed to %s sensor standby\n", standby ? "enter" : "leave");
+    }
+}
+
+// 40-second timelapse interval; with TIMELAPSE_MOTION the interval of a static
+// scene, shortened down to TIMELAPSE_MIN_INTERVAL_MS while there is motion
 static const unsigned long TIMELAPSE_INTERVAL_MS = 40000;
 static unsigned long lastTimelapse = 0;
+static unsigned long timelapseIntervalMs = TIMELAPSE_INTERVAL_MS;
+
+// 1/8-scale luma thumbnail of the current timelapse frame, shared by the motion
+// score and the duplicate check. JPEG frames get it from their DC coefficients,
+// raw frames from 8x8 box averages.
+static uint8_t *timelapseThumb = NULL;
+static size_t timelapseThumbMax = 0;
+static uint16_t timelapseThumbWidth = 0;
+static uint16_t timelapseThumbHeight = 0;
+static uint32_t timelapseThumbAcNonzero = 0; // Nonzero luma AC coefficients, JPEG frames only
+
+static bool buildTimelapseThumb(const uint8_t *buf, size_t len, uint16_t width, uint16_t height, pixformat_t format) {
+    size_t thumb_pixels = (size_t)((width + 7) / 8) * ((height + 7) / 8);
+    if (thumb_pixels > timelapseThumbMax) {
+        // First shot, or a larger archival frame size
+        free(timelapseThumb);
+        timelapseThumb = (uint8_t *)malloc(thumb_pixels);
+        timelapseThumbMax = timelapseThumb ? thumb_pixels : 0;
+        if (!timelapseThumb) {
+            Serial.println("Timelapse: No memory for the frame thumbnail");
+            return false;
+        }
+    }
+
+    bool ok;
+    if (format == PIXFORMAT_JPEG) {
+        jpeg_dc_t dc = {};
+        dc.luma = timelapseThumb;
+        dc.max_blocks = timelapseThumbMax;
+        ok = jpeg_dc_decode(buf, len, &dc);
+        timelapseThumbWidth = dc.width;
+        timelapseThumbHeight = dc.height;
+        timelapseThumbAcNonzero = dc.ac_nonzero;
+    } else {
+        motion_raw_format_t raw_format = format == PIXFORMAT_RGB565 ? MOTION_RAW_RGB565
+                                       : format == PIXFORMAT_YUV422 ? MOTION_RAW_YUV422
+                                       : MOTION_RAW_GRAYSCALE;
+        ok = motion_thumb_from_raw(buf, width, height, raw_format, timelapseThumb, timelapseThumbMax,
+                                   &timelapseThumbWidth, &timelapseThumbHeight);
+        timelapseThumbAcNonzero = 0;
+    }
+    if (!ok) {
+        Serial.println("Timelapse: Could not build a frame thumbnail");
+    }
+    return ok;
+}
+
+#if TIMELAPSE_MOTION
+static motion_detector_t motionDetector = {};
+static motion_rate_t motionRate;
+#endif
+static uint16_t lastMotionScore = 0;     // Permille of the thumbnail that changed
+static unsigned long motionShots = 0;    // Shots that scored as motion
+
+// Scores the thumbnail against the running background and sets the interval
+// to the next shot
+static void scoreTimelapseMotion() {
+#if TIMELAPSE_MOTION
+    if (motionDetector.max_pixels < timelapseThumbMax) {
+        // Sized like the thumbnail buffer; a larger frame size starts over
+        motion_detector_free(&motionDetector);
+        if (!motion_detector_init(&motionDetector, timelapseThumbMax)) {
+            Serial.println("Motion: No memory for the background, keeping a fixed interval");
+            motion_detector_free(&motionDetector);
+            motionDetector.max_pixels = 0;
+            return;
+        }
+        motion_rate_init(&motionRate, TIMELAPSE_MIN_INTERVAL_MS, TIMELAPSE_INTERVAL_MS, MOTION_THRESHOLD_PERMILLE);
+    }
+
+    lastMotionScore = motion_detector_update(&motionDetector, timelapseThumb, timelapseThumbWidth, timelapseThumbHeight);
+    if (lastMotionScore >= MOTION_THRESHOLD_PERMILLE) {
+        motionShots++;
+    }
+    timelapseIntervalMs = motion_rate_update(&motionRate, lastMotionScore);
+    Serial.printf("Motion: Score %u permille, next shot in %lu ms\n", lastMotionScore, timelapseIntervalMs);
+#endif
+}
+
+#if TIMELAPSE_DEDUP
+static frame_fingerprint_t lastStoredFingerprint;
+static time_t lastStoredEpoch = 0; // 0 until a fingerprinted frame was stored
+#endif
+static unsigned long dedupSkipped = 0; // Shots not stored as duplicates
+
+// Decides whether the shot taken at `now` duplicates the last stored frame. A
+// skipped shot is logged to /timelapse_skipped.txt with the frame it matched;
+// otherwise its fingerprint becomes the one later shots are compared to.
+static bool isDuplicateTimelapseFrame(time_t now) {
+#if TIMELAPSE_DEDUP
+    frame_fingerprint_t fingerprint;
+    if (!frame_fingerprint_from_thumb(timelapseThumb, timelapseThumbWidth, timelapseThumbHeight, &fingerprint)) {
+        return false;
+    }
+    uint8_t distance = 255;
+    if (lastStoredEpoch != 0 && now - lastStoredEpoch < TIMELAPSE_DEDUP_MAX_AGE_S) {
+        distance = frame_fingerprint_distance(&fingerprint, &lastStoredFingerprint);
+    }
+    if (distance > TIMELAPSE_DEDUP_DISTANCE) {
+        lastStoredFingerprint = fingerprint;
+        lastStoredEpoch = now;
+        return false;
+    }
+
+    dedupSkipped++;
+    char ref_path[64];
+#if TIMELAPSE_STORAGE_MODE == _STORAGE_MODE_SEGMENTS
+    timelapse_segment_path(lastStoredEpoch, ref_path, sizeof(ref_path));
+#else
+    timelapse_file_path(lastStoredEpoch, ref_path, sizeof(ref_path));
+#endif
+    char shot_time[20], ref_time[20];
+    struct tm timeinfo;
+    localtime_r(&now, &timeinfo);
+    strftime(shot_time, sizeof(shot_time), "%Y-%m-%d %H:%M:%S", &timeinfo);
+    localtime_r(&lastStoredEpoch, &timeinfo);
+    strftime(ref_time, sizeof(ref_time), "%Y-%m-%d %H:%M:%S", &timeinfo);
+    Serial.printf("Timelapse: Skipped duplicate frame (distance %u), same as %s\n", distance, ref_time);
+    sd_writer_printf("/timelapse_skipped.txt", SD_WRITE_APPEND,
+        "%s skipped, distance %u to %s in %s\n", shot_time, distance, ref_time, ref_path);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Runs the thumbnail-based stages on a frame taken at `now`. Returns false if
+// the frame duplicates the last stored one and should not be written.
+static bool analyzeTimelapseFrame(const uint8_t *buf, size_t len, uint16_t width, uint16_t height, pixformat_t format, time_t now) {
+#if TIMELAPSE_MOTION || TIMELAPSE_DEDUP
+    unsigned long start_us = micros();
+    if (!buildTimelapseThumb(buf, len, width, height, format)) {
+        return true; // Store it, and keep the interval
+    }
+    scoreTimelapseMotion();
+    bool duplicate = isDuplicateTimelapseFrame(now);
+    Serial.printf("Timelapse: Frame analysis took %lu us (%ux%u thumbnail)\n",
+                  micros() - start_us, timelapseThumbWidth, timelapseThumbHeight);
+    return !duplicate;
+#else
+    return true;
+#endif
+}
+
+// Finish a timelapse shot: park the sensor when warm standby is enabled, otherwise
+// release the driver as before. Also reports how long the shot took.
+static void finishTimelapseShot(unsigned long shot_start_ms, bool warm_shot) {
+    lastShotLatencyMs = millis() - shot_start_ms;
+    lastShotWarm = warm_shot;
+    stage_timer_add(STAGE_SHOT, lastShotLatencyMs * 1000);
+    Serial.printf("Timelapse: Shot latency %lu ms (%s start)\n", lastShotLatencyMs, warm_shot ? "warm" : "cold");
+
+#if CAMERA_WARM_STANDBY
+    if (cameraInitialized) {
+        Serial.println("Timelapse: Putting camera into standby after capture attempt.");
+        cameraSetStandby(true);
+        return;
+    }
+#endif
+    Serial.println("Timelapse: De-initializing camera after capture attempt.");
+    cameraDeinit();
+}
+
+// Called by the SD writer once a timelapse photo was written (or failed to be).
+// Runs on the writer task, so SD writes from here are done inline.
+static void onTimelapseSaved(const sd_job_t *job, bool ok) {
+    bool encoded = job->buf == NULL; // a raw frame, encoded by the writer
+    free((void *)job->buf);
+
+    if (ok) {
+        photosCount++;
+        if (!encoded) {
+            Serial.printf("Timelapse saved: %s (%u bytes)\n", job->path, (unsigned)job->len);
+        } else {
+            Serial.printf("Timelapse saved: %s (encoded from raw frame)\n", job->path);
+        }
 
+        if (photosCount % 10 == 0) {
+            unsigned long uptime = millis() / 1000; // seconds
+            Serial.printf("System uptime: %u days, %u hours, %u minutes, %u seconds\n", 
+                        uptime / 86400, (uptime % 86400) / 3600, 
+                        (uptime % 3600) / 60, uptime % 60);
+            Serial.printf("Photos taken since boot: %u\n", photosCount);
+        }
+        return;
+    }
+
+    Serial.println("An SD operation error occurred while trying to save the photo.");
+    time_t now_log; time(&now_log);
+    sd_writer_printf("/sd_errors.txt", SD_WRITE_APPEND, "SD write failed at %s for file %s (%u bytes)\n", ctime(&now_log), job->path, (unsigned)job->len);
+
+    // Attempt to write a minimal diagnostic file to test basic SD write functionality
+    if (sd_writer_printf("/sd_diag_write_test.txt", 0, "Minimal write test at %s after photo save failure for %s.\n", ctime(&now_log), job->path)) {
+        Serial.println("Successfully wrote diagnostic file: /sd_diag_write_test.txt");
+    } else {
+        Serial.println("CRITICAL: Failed to write diagnostic file /sd_diag_write_test.txt. SD card may be fully unwritable.");
+        sd_writer_printf("/sd_errors.txt", SD_WRITE_APPEND, "CRITICAL: Failed to write sd_diag_write_test.txt at %s\n", ctime(&now_log));
+    }
+}
+
+// Given by onRawTimelapseSaved() once a raw frame has been encoded to the card
+static SemaphoreHandle_t rawTimelapseSaved = NULL;
+
+static void onRawTimelapseSaved(const sd_job_t *job, bool ok) {
+    onTimelapseSaved(job, ok);
+    xSemaphoreGive(rawTimelapseSaved);
+}
+
+// Waits until the writer task is done with the raw frame in fb, feeding the
+// watchdog. An encode still unfinished after RAW_TIMELAPSE_SAVE_TIMEOUT_MS is
+// cancelled. If the writer does not let go of fb even then, the card is hung
+// inside a write: fb can neither go back to the driver nor be freed under it,
+// so restart, which also remounts the card.
+static void waitForRawTimelapseSave(camera_fb_t *fb) {
+    unsigned long start = millis();
+    bool cancelled = false;
+    while (xSemaphoreTake(rawTimelapseSaved, pdMS_TO_TICKS(1000)) != pdTRUE) {
+        esp_task_wdt_reset();
+        unsigned long waited = millis() - start;
+        if (!cancelled && waited >= RAW_TIMELAPSE_SAVE_TIMEOUT_MS) {
+            Serial.println("Timelapse: Raw frame write too slow, cancelling it.");
+            jpeg_stream_cancel(fb);
+            cancelled = true;
+        } else if (cancelled && waited >= RAW_TIMELAPSE_SAVE_TIMEOUT_MS + SD_FLUSH_TIMEOUT_MS) {
+            Serial.println("Timelapse: SD writer still holds the raw frame buffer. Restarting...");
+            ESP.restart();
+        }
+    }
+    jpeg_stream_cancel(NULL);
+}
+
+// Queues the timelapse write for a frame taken at `now`: either the JPEG in
+// buf, which the job takes over, or a raw frame the writer task encodes
+// straight into the file
+static void queueTimelapseFrame(time_t now, uint8_t *buf, size_t len, camera_fb_t *raw_fb) {
+    sd_job_t job = {};
+#if TIMELAPSE_STORAGE_MODE == _STORAGE_MODE_SEGMENTS
+    timelapse_segment_path(now, job.path, sizeof(job.path));
+    job.write = raw_fb ? timelapse_segment_encode : timelapse_segment_append;
+#else
+    timelapse_file_path(now, job.path, sizeof(job.path));
+    job.write = raw_fb ? timelapse_file_encode : timelapse_file_write;
+#endif
+    job.epoch = now;
+    job.buf = buf;
+    job.len = len;
+    job.ctx = raw_fb;
+    job.done = raw_fb ? onRawTimelapseSaved : onTimelapseSaved;
+
+    // A full queue blocks here for a while rather than dropping a timelapse
+    // photo; the outcome is reported by onTimelapseSaved().
+    sd_writer_submit(&job, TIMELAPSE_SD_SUBMIT_TIMEOUT_MS);
+}
+
+// Scores a JPEG we own for motion and drops it if it duplicates the last
+// stored frame, otherwise hands it to the writer task
+static void storeTimelapseJpeg(time_t now, uint8_t *buf, size_t len, uint16_t width, uint16_t height) {
+    if (!analyzeTimelapseFrame(buf, len, width, height, PIXFORMAT_JPEG, now)) {
+        free(buf);
+        return;
+    }
+    queueTimelapseFrame(now, buf, len, NULL);
+}
+
+// Idle hook of captureScheduler. Light sleep stops XCLK and the frame DMA, so
+// it is only taken while the driver is down -- the PWDN power cycle of a cold
+// shot -- with WiFi off, no SD write in flight and no housekeeping timer due
+// before the wait ends. The stabilization and burst waits, with the sensor
+// streaming, block only this task.
+static void captureIdle(uint32_t ms) {
+    int32_t housekeeping_in_ms = coop_until(__atomic_load_n(&housekeepingWakeMs, __ATOMIC_SEQ_CST), millis());
+    if (cameraInitialized || focusModeActive || housekeeping_in_ms < (int32_t)ms || !sd_writer_flush(0)) {
+        delay(ms);
+        return;
+    }
+    coop_idle_light_sleep(ms);
+}
+
+// Waits ms within a timelapse shot. Capture task only.
+static void captureWait(uint32_t ms) {
+    coop_wait(&captureScheduler, ms);
+}
+
+// Burst capture: instead of throwing the AWB/AEC stabilization frames away,
+// the last `candidates` of `frames` are copied to PSRAM and scored as they
+// come in (detail and exposure, see frame_quality.h). Only the best so far
+// and the current one are held at any time. The first frame is never a
+// candidate: after a warm wake it is the one buffered before standby.
+// Returns the best frame in *out_buf, which the caller owns.
+static bool captureTimelapseBurst(int frames, int candidates, bool warm_shot, uint8_t **out_buf,
+                                  size_t *out_len, uint16_t *out_width, uint16_t *out_height) {
+    *out_buf = NULL;
+    uint32_t best_score = 0;
+    int best_index = -1;
+    int64_t stage_start = stage_timer_start();
+    for (int i = 0; i < frames; i++) {
+        bool candidate = i >= frames - candidates;
+        if (i == frames - candidates) {
+            stage_timer_record(STAGE_STABILIZE, stage_start);
+        }
+        if (candidate) {
+            stage_start = stage_timer_start();
+        }
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (fb && candidate) {
+            stage_timer_record(STAGE_FB_GET, stage_start);
+        }
+        esp_task_wdt_reset();
+        if (!fb) {
+            Serial.printf("Timelapse: Burst frame %d capture failed.\n", i);
+            continue;
+        }
+        if (!candidate) {
+            esp_camera_fb_return(fb); // Still settling, as before
+            if (!warm_shot) {
+                captureWait(100);
+            }
+            continue;
+        }
+
+        uint8_t *copy = (uint8_t *)ps_malloc(fb->len);
+        if (!copy) {
+            copy = (uint8_t *)malloc(fb->len);
+        }
+        size_t len = fb->len;
+        uint16_t width = fb->width, height = fb->height;
+        if (copy) {
+            memcpy(copy, fb->buf, fb->len);
+        }
+        esp_camera_fb_return(fb);
+        if (!copy) {
+            Serial.printf("Timelapse: No memory to copy burst frame %d\n", i);
+            continue;
+        }
+
+        frame_quality_t quality = {};
+        if (buildTimelapseThumb(copy, len, width, height, PIXFORMAT_JPEG)) {
+            frame_quality_measure(timelapseThumb, timelapseThumbWidth, timelapseThumbHeight,
+                                  timelapseThumbAcNonzero, &quality);
+        }
+        Serial.printf("Timelapse: Burst frame %d: detail %u, clipped %u permille, score %u\n",
+                      i, quality.detail, quality.clipped, quality.score);
+        if (*out_buf && quality.score <= best_score) {
+            free(copy);
+            continue;
+        }
+        free(*out_buf);
+        *out_buf = copy;
+        *out_len = len;
+        *out_width = width;
+        *out_height = height;
+        best_score = quality.score;
+        best_index = i;
+    }
+    if (*out_buf) {
+        Serial.printf("Timelapse: Keeping burst frame %d\n", best_index);
+    }
+    return *out_buf != NULL;
+}
+
+// Runs on the capture task. The sensor waits in here (PWDN power cycle,
+// stabilization and burst frames) go through captureWait().
 void captureAndSaveTimelapse() {
     esp_task_wdt_reset(); // Reset watchdog
+    unsigned long shot_start_ms = millis();
+    bool warm_shot = CAMERA_WARM_STANDBY && cameraInitialized;
 
+    if (warm_shot) {
+        Serial.println("Timelapse: Waking camera from standby...");
+        cameraSetStandby(false);
+    } else {
 #if CAMERA_MODEL == _MODEL_SELECT_GENERIC_OV2640
-    Serial.println("Timelapse (OV2640 specific logic): Power cycling camera and adding delay...");
-    #if defined(PWDN_GPIO_NUM) && PWDN_GPIO_NUM != -1
-        Serial.printf("Toggling PWDN pin: %d\n", PWDN_GPIO_NUM);
-        pinMode(PWDN_GPIO_NUM, OUTPUT);
-        digitalWrite(PWDN_GPIO_NUM, HIGH); // Power down camera
-        delay(100);                       // Keep it powered down for a moment
-        digitalWrite(PWDN_GPIO_NUM, LOW);  // Power up camera
-        delay(100);                       // Wait for camera to power up
-    #else
-        Serial.println("PWDN_GPIO_NUM not defined or -1, skipping PWDN toggle.");
-    #endif
-    delay(300); // Additional delay for OV2640 to stabilize after power-up, before init
-#endif
-
-    Serial.println("Timelapse: Initializing camera...");
-    esp_err_t init_err = esp_camera_init(&global_cam_config);
-    if (init_err != ESP_OK) {
-        Serial.printf("Timelapse: Camera init failed with error 0x%x\n", init_err);
-        File errorLog = SD_MMC.open("/camera_errors.txt", FILE_APPEND);
-        if (errorLog) {
+        Serial.println("Timelapse (OV2640 specific logic): Power cycling camera and adding delay...");
+        int64_t pwdn_start = stage_timer_start();
+        #if defined(PWDN_GPIO_NUM) && PWDN_GPIO_NUM != -1
+            Serial.printf("Toggling PWDN pin: %d\n", PWDN_GPIO_NUM);
+            pinMode(PWDN_GPIO_NUM, OUTPUT);
+            digitalWrite(PWDN_GPIO_NUM, HIGH); // Power down camera
+            captureWait(100);                 // Keep it powered down for a moment
+            digitalWrite(PWDN_GPIO_NUM, LOW);  // Power up camera
+            captureWait(100);                 // Wait for camera to power up
+        #else
+            Serial.println("PWDN_GPIO_NUM not defined or -1, skipping PWDN toggle.");
+        #endif
+        captureWait(300); // Additional delay for OV2640 to stabilize after power-up, before init
+        stage_timer_record(STAGE_PWDN_CYCLE, pwdn_start);
+#endif
+
+        Serial.println("Timelapse: Initializing camera...");
+        int64_t init_start = stage_timer_start();
+        esp_err_t init_err = esp_camera_init(&global_cam_config);
+        stage_timer_record(STAGE_CAMERA_INIT, init_start);
+        if (init_err != ESP_OK) {
+            Serial.printf("Timelapse: Camera init failed with error 0x%x\n", init_err);
             time_t now_log;
             time(&now_log);
-            errorLog.printf("Timelapse: Camera init error at %s: 0x%x\n", ctime(&now_log), init_err);
-            errorLog.close();
+            sd_writer_printf("/camera_errors.txt", SD_WRITE_APPEND, "Timelapse: Camera init error at %s: 0x%x\n", ctime(&now_log), init_err);
+            return;
         }
-        return;
+        cameraInitialized = true;
+        camera_profile_begin(&global_cam_config);
+        Serial.println("Timelapse: Camera initialized successfully.");
+
+        // Re-apply sensor settings as they might be reset after deinit/init
+        sensor_t *s = esp_camera_sensor_get();
+        if (s == NULL) {
+            Serial.println("Timelapse: Failed to get camera sensor after init.");
+            time_t now_log;
+            time(&now_log);
+            sd_writer_printf("/camera_errors.txt", SD_WRITE_APPEND, "Timelapse: Failed to get sensor at %s\n", ctime(&now_log));
+            cameraDeinit(); // Deinit if sensor get fails
+            Serial.println("Timelapse: De-initialized camera due to sensor get failure.");
+            return;
+        }
+        s->set_vflip(s, VERTICAL_FLIP == 1);
+        if (s->id.PID == OV3660_PID) { // Re-apply specific sensor settings
+            s->set_brightness(s, 1);
+            s->set_saturation(s, -2);
+        }
+        Serial.println("Timelapse: Sensor settings re-applied.");
     }
-    Serial.println("Timelapse: Camera initialized successfully.");
 
-    // Re-apply sensor settings as they might be reset after deinit/init
-    sensor_t *s = esp_camera_sensor_get();
-    if (s == NULL) {
-        Serial.println("Timelapse: Failed to get camera sensor after init.");
-        File errorLog = SD_MMC.open("/camera_errors.txt", FILE_APPEND);
-        if (errorLog) {
+    // A warm sensor may still be in the preview profile from focus mode
+    camera_profile_apply(CAMERA_PROFILE_ARCHIVAL);
+
+    // A warm sensor kept its AEC/AWB state, so fewer frames need to settle
+    int discard_frames = warm_shot ? WARM_STANDBY_DISCARD_FRAMES : 3;
+
+    // Burst: keep the best of the last TIMELAPSE_BURST_FRAMES frames. Raw frame
+    // buffers are too large to hold several, so only JPEG frames are burst.
+    if (TIMELAPSE_BURST_FRAMES > 1 && CAMERA_PIXEL_FORMAT == PIXFORMAT_JPEG) {
+        int frames = max(discard_frames + 1, TIMELAPSE_BURST_FRAMES + 1);
+        Serial.printf("Timelapse: Capturing a burst of %d frames...\n", frames);
+        uint8_t *out_buf;
+        size_t out_len;
+        uint16_t out_width, out_height;
+        if (!captureTimelapseBurst(frames, TIMELAPSE_BURST_FRAMES, warm_shot, &out_buf, &out_len, &out_width, &out_height)) {
+            Serial.println("Timelapse: No burst frame could be captured.");
             time_t now_log;
             time(&now_log);
-            errorLog.printf("Timelapse: Failed to get sensor at %s\n", ctime(&now_log));
-            errorLog.close();
+            sd_writer_printf("/camera_errors.txt", SD_WRITE_APPEND, "Timelapse: Burst capture failed at %s\n", ctime(&now_log));
+            cameraDeinit(); // De-initialize camera, the next shot starts cold
+            return;
         }
-        esp_camera_deinit(); // Deinit if sensor get fails
-        Serial.println("Timelapse: De-initialized camera due to sensor get failure.");
+        time_t now;
+        time(&now);
+        storeTimelapseJpeg(now, out_buf, out_len, out_width, out_height);
+        finishTimelapseShot(shot_start_ms, warm_shot);
         return;
     }
-    s->set_vflip(s, VERTICAL_FLIP == 1);
-    if (s->id.PID == OV3660_PID) { // Re-apply specific sensor settings
-        s->set_brightness(s, 1);
-        s->set_saturation(s, -2);
-    }
-    Serial.println("Timelapse: Sensor settings re-applied.");
 
-    // Allow AWB (Auto White Balance) and AEC (Auto Exposure Control) to stabilize
+    // Allow AWB (Auto White Balance) and AEC (Auto Exposure Control) to stabilize.
     Serial.println("Timelapse: Allowing AWB/AEC to stabilize...");
-    for (int i = 0; i < 3; i++) { // Discard 3 frames
+    int64_t stabilize_start = stage_timer_start();
+    for (int i = 0; i < discard_frames; i++) {
         camera_fb_t *stab_fb = esp_camera_fb_get();
         if (!stab_fb) {
             Serial.println("Timelapse: AWB/AEC stabilization frame capture failed.");
@@ -451,171 +1073,81 @@ void captureAndSaveTimelapse() {
             break; 
         }
         esp_camera_fb_return(stab_fb); // Return frame to free buffer
-        delay(100); // Small delay to allow processing
+        if (!warm_shot) {
+            captureWait(100); // Small delay to allow processing
+        }
         esp_task_wdt_reset(); // Reset watchdog during stabilization
     }
+    stage_timer_record(STAGE_STABILIZE, stabilize_start);
     Serial.println("Timelapse: AWB/AEC stabilization complete.");
 
-    bool success = false;
     esp_task_wdt_reset(); // Reset watchdog before capture
     
     // 1) Grab a frame
     Serial.println("Timelapse: Attempting to capture frame...");
+    int64_t fb_start = stage_timer_start();
     camera_fb_t *fb = esp_camera_fb_get();
     if (!fb) {
         Serial.println("Timelapse: Frame capture failed (esp_camera_fb_get returned NULL).");
-        File errorLog = SD_MMC.open("/camera_errors.txt", FILE_APPEND);
-        if (errorLog) {
-            time_t now_log;
-            time(&now_log);
-            errorLog.printf("Timelapse: Frame capture failed at %s\n", ctime(&now_log));
-            errorLog.close();
-        }
-        esp_camera_deinit(); // De-initialize camera
+        time_t now_log;
+        time(&now_log);
+        sd_writer_printf("/camera_errors.txt", SD_WRITE_APPEND, "Timelapse: Frame capture failed at %s\n", ctime(&now_log));
+        cameraDeinit(); // De-initialize camera, the next shot starts cold
         Serial.println("Timelapse: De-initialized camera due to frame capture failure.");
         return; // Exit function
     }
+    stage_timer_record(STAGE_FB_GET, fb_start);
     Serial.println("Timelapse: Frame captured successfully.");
 
-    // 2) Convert to JPEG if needed
-    size_t out_len = 0;
-    uint8_t *out_buf = NULL;
-
-    if (fb->format == PIXFORMAT_JPEG) {
-        // Already JPEG
-        out_buf = fb->buf;
-        out_len = fb->len;
-    } else {
-        // Convert from e.g. RGB565 to JPEG
-        bool converted = frame2jpg(fb, 80, &out_buf, &out_len);
-        if (!converted) {
-            esp_camera_fb_return(fb);
-            Serial.println("JPEG conversion failed");
-            esp_camera_deinit(); // De-initialize camera
-            Serial.println("Timelapse: De-initialized camera due to JPEG conversion failure.");
-            return;
-        }
-    }
-
-    // 3) Build a unique filename
+    // 2) The file name comes from the capture time
     // Use real NTP-based timestamps, if your device has internet & you have set time.
-    
-    // Now get the real time
     time_t now;
     time(&now);
-    struct tm timeinfo;
-    localtime_r(&now, &timeinfo);
 
-    char filename[64];
-    strftime(filename, sizeof(filename), "/%Y-%m-%d_%H-%M-%S.jpg", &timeinfo);
-
-    // 4) Write file
-    File f = SD_MMC.open(filename, FILE_WRITE);
-    bool sd_operation_failed = false;
-
-    if (!f) {
-        Serial.printf("Failed to open file for writing: %s (Attempt 1)\n", filename);
-        sd_operation_failed = true;
-
-        SD_MMC.end(); // End current SD session
-        delay(500);   // Short delay
-        Serial.println("Attempting SD card remount...");
-        if (!SD_MMC.begin("/sdcard", true)) {
-            Serial.println("SD remount failed.");
-            File errorLog = SD_MMC.open("/sd_errors.txt", FILE_APPEND);
-            if (errorLog) {
-                time_t now_log; time(&now_log);
-                errorLog.printf("SD remount failed at %s for file %s\n", ctime(&now_log), filename);
-                errorLog.close();
-            }
-            // f remains NULL, sd_operation_failed is true
+    if (fb->format != PIXFORMAT_JPEG) {
+        // 3) Raw frame: the writer task encodes it straight into the file, no
+        // JPEG buffer in between. The frame buffer must be back with the driver
+        // before the camera is parked or de-initialized, so wait for the write.
+        if (!rawTimelapseSaved) {
+            rawTimelapseSaved = xSemaphoreCreateBinary();
+        }
+        if (!analyzeTimelapseFrame(fb->buf, fb->len, fb->width, fb->height, fb->format, now)) {
+            // Duplicate of the last stored frame, nothing to write
+        } else if (rawTimelapseSaved) {
+            queueTimelapseFrame(now, NULL, 0, fb);
+            waitForRawTimelapseSave(fb); // given even if the job is rejected
         } else {
-            Serial.println("SD remount successful. Retrying file open...");
-            f = SD_MMC.open(filename, FILE_WRITE); // Attempt to open again
-            if (!f) {
-                Serial.printf("Still can't open file for writing after remount: %s (Attempt 2)\n", filename);
-                // sd_operation_failed is already true
-                File errorLog = SD_MMC.open("/sd_errors.txt", FILE_APPEND);
-                if (errorLog) {
-                    time_t now_log; time(&now_log);
-                    errorLog.printf("SD open failed (Attempt 2) at %s for file %s\n", ctime(&now_log), filename);
-                    errorLog.close();
-                }
-            } else {
-                Serial.printf("Successfully opened file after remount: %s\n", filename);
-                sd_operation_failed = false; // Clear error as open succeeded
-            }
+            Serial.println("Timelapse: No memory to save raw frame");
         }
+        esp_camera_fb_return(fb);
+        finishTimelapseShot(shot_start_ms, warm_shot);
+        return;
     }
 
-    if (f) { // If file was successfully opened (either first or second attempt)
-        size_t bytes_written = f.write(out_buf, out_len);
-        if (bytes_written != out_len) {
-            Serial.printf("File write error: expected %u, wrote %u bytes to %s\n", (unsigned)out_len, (unsigned)bytes_written, filename);
-            sd_operation_failed = true;
-            File errorLog = SD_MMC.open("/sd_errors.txt", FILE_APPEND);
-            if (errorLog) {
-                time_t now_log; time(&now_log);
-                errorLog.printf("SD actual write failed at %s for file %s (wrote %u/%u)\n", ctime(&now_log), filename, (unsigned)bytes_written, (unsigned)out_len);
-                errorLog.close();
-            }
-        }
-
-        // File::close() returns void, so we cannot check its return value directly.
-        // The success of f.write() is the primary indicator of a successful save.
-        f.close(); 
-
-        if (!sd_operation_failed) {
-            success = true; // Mark overall success for this capture
-            photosCount++;
-            Serial.printf("Timelapse saved: %s (%u bytes)\n", filename, (unsigned)out_len);
-            
-            if (photosCount % 10 == 0) {
-                unsigned long uptime = millis() / 1000; // seconds
-                Serial.printf("System uptime: %u days, %u hours, %u minutes, %u seconds\n", 
-                            uptime / 86400, (uptime % 86400) / 3600, 
-                            (uptime % 3600) / 60, uptime % 60);
-                Serial.printf("Photos taken since boot: %u\n", photosCount);
-            }
-        }
-    } else { // f is NULL, meaning all attempts to open it failed.
-        Serial.printf("File %s could not be opened for writing. No write attempt made.\n", filename);
-        sd_operation_failed = true; // Ensure it's marked as failed
-    }
-
-    if (sd_operation_failed) {
-        Serial.println("An SD operation error occurred while trying to save the photo.");
-        // Attempt to write a minimal diagnostic file to test basic SD write functionality
-        File diagFile = SD_MMC.open("/sd_diag_write_test.txt", FILE_WRITE); // Overwrite each time
-        if (diagFile) {
-            time_t now_diag; time(&now_diag);
-            diagFile.printf("Minimal write test at %s after photo save failure for %s.\n", ctime(&now_diag), filename);
-            diagFile.close();
-            Serial.println("Successfully wrote diagnostic file: /sd_diag_write_test.txt");
-        } else {
-            Serial.println("CRITICAL: Failed to write diagnostic file /sd_diag_write_test.txt. SD card may be fully unwritable.");
-            File errorLog = SD_MMC.open("/sd_errors.txt", FILE_APPEND); // Final attempt to log this critical failure
-            if (errorLog) {
-                time_t now_log; time(&now_log);
-                errorLog.printf("CRITICAL: Failed to write sd_diag_write_test.txt at %s\n", ctime(&now_log));
-                errorLog.close();
-            }
-        }
+    // 3) Copy the JPEG into a buffer we own, so the frame buffer goes back to
+    // the driver right away and the SD write happens on the writer task
+    uint8_t *out_buf = (uint8_t *)ps_malloc(fb->len);
+    if (!out_buf) {
+        out_buf = (uint8_t *)malloc(fb->len);
+    }
+    size_t out_len = fb->len;
+    uint16_t out_width = fb->width, out_height = fb->height;
+    if (out_buf) {
+        memcpy(out_buf, fb->buf, fb->len);
     }
+    esp_camera_fb_return(fb);
 
-    // 5) Cleanup
-    if (fb->format == PIXFORMAT_JPEG) {
-        // Return frame buffer to driver
-        esp_camera_fb_return(fb);
-    } else {
-        // We allocated our own out_buf
-        free(out_buf);
-        // Also return the original frame buffer
-        esp_camera_fb_return(fb);
+    if (!out_buf) {
+        Serial.println("Timelapse: No memory to copy frame");
+        cameraDeinit(); // De-initialize camera
+        Serial.println("Timelapse: De-initialized camera due to frame copy failure.");
+        return;
     }
 
-    Serial.println("Timelapse: De-initializing camera after capture attempt.");
-    esp_camera_deinit();
+    // 4) Score it, then queue the write
+    storeTimelapseJpeg(now, out_buf, out_len, out_width, out_height);
+
+    finishTimelapseShot(shot_start_ms, warm_shot);
 }
 
 
@@ -624,17 +1156,14 @@ void captureAndSaveTimelapse() {
 void checkWiFiConnection() {
   if (WiFi.status() != WL_CONNECTED) {
     Serial.println("WiFi connection lost, attempting to reconnect...");
+    xEventGroupClearBits(firmwareEvents, EVENT_WIFI_DISCONNECTED);
     WiFi.disconnect();
-    delay(1000);
+    // Let the driver finish leaving the AP (up to a second) before reconnecting
+    xEventGroupWaitBits(firmwareEvents, EVENT_WIFI_DISCONNECTED, pdFALSE, pdTRUE, pdMS_TO_TICKS(1000));
     WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
     
     // Wait up to 10 seconds for reconnection
-    unsigned long reconnectStart = millis();
-    while (WiFi.status() != WL_CONNECTED && millis() - reconnectStart < 10000) {
-      delay(500);
-      Serial.print(".");
-      esp_task_wdt_reset(); // Reset watchdog while waiting
-    }
+    waitForFirmwareEvent(EVENT_WIFI_CONNECTED, 10000);
     
     if (WiFi.status() == WL_CONNECTED) {
       Serial.println("\nWiFi reconnected");
@@ -647,139 +1176,156 @@ void checkWiFiConnection() {
   }
 }
 
-// Update heartbeat file to track last successful operation
-void updateHeartbeat() {
-  File heartbeat = SD_MMC.open("/heartbeat.txt", FILE_WRITE);
-  if (heartbeat) {
-    time_t now;
-    time(&now);
-    
-    heartbeat.printf("Last heartbeat: %s", ctime(&now));
-    heartbeat.printf("Uptime: %lu seconds\n", millis() / 1000);
-    heartbeat.printf("Photos taken: %lu\n", photosCount);
-    heartbeat.printf("WiFi status: %s\n", WiFi.status() == WL_CONNECTED ? "Connected" : "Disconnected");
-    
-    heartbeat.close();
-  }
+#if SD_FRAME_BENCH_ON_BOOT
+// Measure how fast this card takes timelapse-sized files and keep the result
+// on the card, so cards can be compared across the fleet.
+void runSdFrameBench() {
+  sd_frame_bench_t bench;
+  bool ok = sd_writer_frame_bench(SD_FRAME_BENCH_FILES, SD_FRAME_BENCH_FILE_SIZE, &bench);
+  Serial.printf("SD frame bench: %u/%u files of %u bytes, %u KB/s, per file min %u / avg %u / max %u ms\n",
+                bench.files, SD_FRAME_BENCH_FILES, SD_FRAME_BENCH_FILE_SIZE, bench.bytes_per_s / 1024,
+                bench.min_us / 1000, bench.avg_us / 1000, bench.max_us / 1000);
+
+  time_t now;
+  time(&now);
+  sd_writer_printf("/sd_card_info.txt", SD_WRITE_APPEND,
+    "Frame write bench at %s"
+    "Card: type %d, %llu MB\n"
+    "Files: %u/%u of %u bytes%s\n"
+    "Throughput: %u KB/s\n"
+    "Per-file latency: min %u ms, avg %u ms, max %u ms\n",
+    ctime(&now),
+    (int)SD_MMC.cardType(), SD_MMC.cardSize() / (1024 * 1024),
+    bench.files, SD_FRAME_BENCH_FILES, SD_FRAME_BENCH_FILE_SIZE, ok ? "" : " (failed)",
+    bench.bytes_per_s / 1024,
+    bench.min_us / 1000, bench.avg_us / 1000, bench.max_us / 1000);
 }
+#endif
 
-void loop() {
-  // Reset watchdog timer in main loop
-  esp_task_wdt_reset();
-
-  // Manage focus mode
-  if (focusModeActive && millis() >= focusModeEndTime) {
-    Serial.println("Focus mode duration elapsed.");
-    stopWebServerAndWiFi();
-    Serial.println("De-initializing camera after focus mode.");
-    esp_camera_deinit(); // De-initialize camera as web server is no longer needed
-    focusModeActive = false;
-    // Ensure lastTimelapse is set so the first sleep cycle after focus mode calculates correctly
-    // or the first timelapse capture occurs promptly.
+// Update heartbeat file to track last successful operation.
+// Droppable: a newer heartbeat replaces one the card has not caught up with.
+void updateHeartbeat() {
+  time_t now;
+  time(&now);
+  sd_writer_stats_t sd_stats;
+  sd_writer_get_stats(&sd_stats);
+  camera_profile_stats_t profile_stats;
+  camera_profile_get_stats(&profile_stats);
+  char task_stats[256];
+  task_monitor_format(task_stats, sizeof(task_stats));
+  char *stage_stats = (char *)malloc(HEARTBEAT_STAGE_STATS_MAX);
+  if (stage_stats) {
+    stage_timer_summary(stage_stats, HEARTBEAT_STAGE_STATS_MAX);
   }
 
-  // Timelapse and Power Saving Logic (only when not in focus mode)
-  if (!focusModeActive) {
-    time_t now_ts;
-    time(&now_ts);
-    bool perform_night_deep_sleep = false;
+  sd_writer_printf("/heartbeat.txt", SD_WRITE_DROPPABLE,
+    "Last heartbeat: %s"
+    "Uptime: %lu seconds\n"
+    "Photos taken: %lu\n"
+    "WiFi status: %s\n"
+    "Last shot latency: %lu ms (%s)\n"
+    "SD queue: %u queued, %u max, %u written, %u failed, %u dropped\n"
+    "SD write: %u KB/s, avg %u ms, slowest %u ms, producer stall %u ms\n"
+    "SD bus: %u-bit (requested %u-bit, %u fallbacks)\n"
+    "Camera profile: %s, %u switches (%u failed), last %u ms, slowest %u ms\n"
+    "Timelapse interval: %lu ms (motion score %u permille, %lu shots with motion)\n"
+    "Duplicate frames skipped: %lu\n"
+    "Tasks: %s\n"
+    "%s",
+    ctime(&now),
+    millis() / 1000,
+    photosCount,
+    WiFi.status() == WL_CONNECTED ? "Connected" : "Disconnected",
+    lastShotLatencyMs, lastShotWarm ? "warm" : "cold",
+    sd_stats.depth, sd_stats.max_depth, sd_stats.written, sd_stats.failed, sd_stats.dropped,
+    sd_writer_stats_bytes_per_s(&sd_stats) / 1024,
+    sd_stats.written ? (unsigned)(sd_stats.write_us / sd_stats.written / 1000) : 0,
+    sd_stats.max_write_us / 1000,
+    (unsigned)(sd_stats.stall_us / 1000),
+    sd_card_bus_width(), sd_card_requested_bus_width(), sd_card_fallbacks(),
+    camera_profile_name(camera_profile_current()), profile_stats.switches, profile_stats.failures,
+    profile_stats.last_switch_us / 1000, profile_stats.max_switch_us / 1000,
+    timelapseIntervalMs, lastMotionScore, motionShots,
+    dedupSkipped,
+    task_stats,
+    stage_stats ? stage_stats : "");
+  free(stage_stats);
+}
 
-    if (now_ts < 1672531200) { // Check if time is likely valid (synced, e.g., after Jan 1, 2023)
-        Serial.println("Time not synced, skipping night sleep check for this cycle.");
-    } else {
-        struct tm timeinfo;
-        localtime_r(&now_ts, &timeinfo);
-
-        int current_hour = timeinfo.tm_hour;
-        int current_minute = timeinfo.tm_min;
-        bool is_currently_night_period = false;
-
-        // Check if current time falls into the night period (e.g., 20:47 to 05:05)
-        if (current_hour > NIGHT_SLEEP_START_HOUR || (current_hour == NIGHT_SLEEP_START_HOUR && current_minute >= NIGHT_SLEEP_START_MINUTE)) {
-            is_currently_night_period = true; // It's after sleep start time today
-        } else if (current_hour < NIGHT_WAKE_UP_HOUR || (current_hour == NIGHT_WAKE_UP_HOUR && current_minute < NIGHT_WAKE_UP_MINUTE)) {
-            is_currently_night_period = true; // It's before wake up time today (past midnight)
-        }
 
-        if (is_currently_night_period) {
-            unsigned long sleep_duration_seconds = 0;
-            time_t current_epoch = mktime(&timeinfo);
-
-            // Target wake up time for today
-            struct tm wake_time_struct = timeinfo; // Copy current time structure
-            wake_time_struct.tm_hour = NIGHT_WAKE_UP_HOUR;
-            wake_time_struct.tm_min = NIGHT_WAKE_UP_MINUTE;
-            wake_time_struct.tm_sec = 0;
-            wake_time_struct.tm_isdst = -1; // Let mktime determine DST for the target wake time
-            time_t wake_epoch_target = mktime(&wake_time_struct);
-
-            if (current_epoch < wake_epoch_target) {
-                // Current time is before today's wake-up time (e.g., 3 AM, wake at 5 AM)
-                sleep_duration_seconds = wake_epoch_target - current_epoch;
-            } else {
-                // Current time is after today's wake-up time (e.g., 9 PM, wake at 5 AM tomorrow)
-                // So, calculate duration until tomorrow's wake-up time
-                wake_time_struct.tm_mday += 1; // Advance to next day
-                // mktime will normalize month/year if tm_mday overflows
-                wake_time_struct.tm_isdst = -1; // Re-evaluate DST for tomorrow
-                wake_epoch_target = mktime(&wake_time_struct);
-                sleep_duration_seconds = wake_epoch_target - current_epoch;
-            }
-
-            // Sanity check: sleep duration should be positive and less than ~24 hours
-            if (sleep_duration_seconds > 0 && sleep_duration_seconds < (25 * 3600)) { // Allow slightly over 24h for DST changes
-                Serial.printf("Night time. Deep sleeping for %lu seconds until approximately %02d:%02d.\n", sleep_duration_seconds, NIGHT_WAKE_UP_HOUR, NIGHT_WAKE_UP_MINUTE);
-                
-                File sleepLog = SD_MMC.open("/sleep_log.txt", FILE_APPEND);
-                if (sleepLog) {
-                    sleepLog.printf("Entering deep sleep at %s", ctime(&current_epoch)); // ctime adds newline
-                    sleepLog.printf("Scheduled to wake at approx. %02d:%02d. Duration: %lu s\n", NIGHT_WAKE_UP_HOUR, NIGHT_WAKE_UP_MINUTE, sleep_duration_seconds);
-                    sleepLog.close();
-                    delay(100); // Brief delay to help ensure log is written
-                }
-                esp_deep_sleep(sleep_duration_seconds * 1000000ULL); // Argument is in microseconds
-                // Note: esp_deep_sleep() does not return. The device will reset.
-            } else {
-                Serial.printf("Calculated night sleep duration (%lu s) is invalid. Proceeding with normal operation.\n", sleep_duration_seconds);
-            }
-        }
-    }
-    // If not night deep sleeping (e.g. daytime, time not synced, or invalid sleep duration), proceed with timelapse/light sleep:
-    unsigned long current_millis = millis();
-    if (current_millis - lastTimelapse >= TIMELAPSE_INTERVAL_MS) {
-      // Time for timelapse
-      lastTimelapse = current_millis; // Update timestamp before capture
-      captureAndSaveTimelapse();
-    } else {
-      // Not time for timelapse yet, consider light sleeping
-      unsigned long time_to_next_capture = (lastTimelapse + TIMELAPSE_INTERVAL_MS) - current_millis;
-      unsigned long max_safe_sleep_ms = (unsigned long)(WDT_TIMEOUT_SECONDS > 5 ? WDT_TIMEOUT_SECONDS - 5 : WDT_TIMEOUT_SECONDS / 2) * 1000;
-      if (max_safe_sleep_ms == 0 && WDT_TIMEOUT_SECONDS > 0) max_safe_sleep_ms = WDT_TIMEOUT_SECONDS * 500;
-      if (max_safe_sleep_ms == 0) max_safe_sleep_ms = 1000;
+// Puts the device into deep sleep until morning during the night period.
+// Does not return then.
+static void checkNightDeepSleep() {
+  time_t now_ts;
+  time(&now_ts);
 
-      unsigned long sleep_duration_ms = min(time_to_next_capture, max_safe_sleep_ms);
+  if (now_ts < 1672531200) { // Check if time is likely valid (synced, e.g., after Jan 1, 2023)
+      Serial.println("Time not synced, skipping night sleep check for this cycle.");
+  } else {
+      struct tm timeinfo;
+      localtime_r(&now_ts, &timeinfo);
+
+      int current_hour = timeinfo.tm_hour;
+      int current_minute = timeinfo.tm_min;
+      bool is_currently_night_period = false;
+
+      // Check if current time falls into the night period (e.g., 20:47 to 05:05)
+      if (current_hour > NIGHT_SLEEP_START_HOUR || (current_hour == NIGHT_SLEEP_START_HOUR && current_minute >= NIGHT_SLEEP_START_MINUTE)) {
+          is_currently_night_period = true; // It's after sleep start time today
+      } else if (current_hour < NIGHT_WAKE_UP_HOUR || (current_hour == NIGHT_WAKE_UP_HOUR && current_minute < NIGHT_WAKE_UP_MINUTE)) {
+          is_currently_night_period = true; // It's before wake up time today (past midnight)
+      }
 
-      if (sleep_duration_ms > 1000) { 
-        Serial.printf("Light sleeping for %lu ms...\n", sleep_duration_ms);
-        esp_sleep_enable_timer_wakeup(sleep_duration_ms * 1000ULL); // us
-        esp_light_sleep_start();
+      if (is_currently_night_period) {
+          unsigned long sleep_duration_seconds = 0;
+          time_t current_epoch = mktime(&timeinfo);
+
+          // Target wake up time for today
+          struct tm wake_time_struct = timeinfo; // Copy current time structure
+          wake_time_struct.tm_hour = NIGHT_WAKE_UP_HOUR;
+          wake_time_struct.tm_min = NIGHT_WAKE_UP_MINUTE;
+          wake_time_struct.tm_sec = 0;
+          wake_time_struct.tm_isdst = -1; // Let mktime determine DST for the target wake time
+          time_t wake_epoch_target = mktime(&wake_time_struct);
+
+          if (current_epoch < wake_epoch_target) {
+              // Current time is before today's wake-up time (e.g., 3 AM, wake at 5 AM)
+              sleep_duration_seconds = wake_epoch_target - current_epoch;
+          } else {
+              // Current time is after today's wake-up time (e.g., 9 PM, wake at 5 AM tomorrow)
+              // So, calculate duration until tomorrow's wake-up time
+              wake_time_struct.tm_mday += 1; // Advance to next day
+              // mktime will normalize month/year if tm_mday overflows
+              wake_time_struct.tm_isdst = -1; // Re-evaluate DST for tomorrow
+              wake_epoch_target = mktime(&wake_time_struct);
+              sleep_duration_seconds = wake_epoch_target - current_epoch;
+          }
+
+          // Sanity check: sleep duration should be positive and less than ~24 hours
+          if (sleep_duration_seconds > 0 && sleep_duration_seconds < (25 * 3600)) { // Allow slightly over 24h for DST changes
+              Serial.printf("Night time. Deep sleeping for %lu seconds until approximately %02d:%02d.\n", sleep_duration_seconds, NIGHT_WAKE_UP_HOUR, NIGHT_WAKE_UP_MINUTE);
+              
+              sd_writer_printf("/sleep_log.txt", SD_WRITE_APPEND,
+                  "Entering deep sleep at %s" // ctime adds newline
+                  "Scheduled to wake at approx. %02d:%02d. Duration: %lu s\n",
+                  ctime(&current_epoch), NIGHT_WAKE_UP_HOUR, NIGHT_WAKE_UP_MINUTE, sleep_duration_seconds);
+#if TIMELAPSE_STORAGE_MODE == _STORAGE_MODE_SEGMENTS
+              timelapse_segment_close(SD_FLUSH_TIMEOUT_MS); // Append the index of the open segment
+#endif
+              if (!sd_writer_flush(SD_FLUSH_TIMEOUT_MS)) { // Queued photos and logs must hit the card first
+                  Serial.println("SD writer did not drain before deep sleep, pending writes are lost.");
+              }
+              esp_deep_sleep(sleep_duration_seconds * 1000000ULL); // Argument is in microseconds
+              // Note: esp_deep_sleep() does not return. The device will reset.
+          } else {
+              Serial.printf("Calculated night sleep duration (%lu s) is invalid. Proceeding with normal operation.\n", sleep_duration_seconds);
+          }
       }
-    }
-  }
-  // End Timelapse and Power Saving Logic
-  
-  // Check WiFi connection periodically only if in focus mode
-  if (focusModeActive && millis() - lastWifiCheck >= WIFI_RECONNECT_INTERVAL) {
-    lastWifiCheck = millis();
-    checkWiFiConnection();
   }
-  
-  // Update heartbeat file periodically
-  if (millis() - lastHeartbeat >= HEARTBEAT_INTERVAL) {
-    lastHeartbeat = millis();
-    updateHeartbeat();
-  }
-  
+}
+
+// Restarts the device once a day, shortly after the night wake-up time
+void checkDailyReset() {
   // Perform a scheduled reset to prevent memory issues
   // New daily reset logic: at sunrise (with offset), if enough time has passed
   time_t current_loop_epoch;
@@ -816,28 +1362,181 @@ void loop() {
 
       if (is_time_for_daily_reset) {
         Serial.printf("Performing scheduled daily reset. Current time: %s", ctime(&current_loop_epoch));
+        // Let a shot in progress reach the writer queue first
+        xEventGroupWaitBits(firmwareEvents, EVENT_CAPTURE_IDLE, pdFALSE, pdTRUE,
+                            pdMS_TO_TICKS(CAPTURE_IDLE_TIMEOUT_MS));
+        esp_task_wdt_reset();
         
-        File resetLog = SD_MMC.open("/resets.txt", FILE_APPEND);
-        if (resetLog) {
-          resetLog.printf("Planned daily reset at %s", ctime(&current_loop_epoch)); // ctime adds newline
-          resetLog.printf("Uptime for this session: %lu seconds.\n", millis() / 1000);
-          resetLog.printf("Photos taken this session: %lu\n", photosCount);
-          resetLog.close();
-        }
+        sd_writer_printf("/resets.txt", SD_WRITE_APPEND,
+          "Planned daily reset at %s" // ctime adds newline
+          "Uptime for this session: %lu seconds.\n"
+          "Photos taken this session: %lu\n",
+          ctime(&current_loop_epoch), millis() / 1000, photosCount);
         
         // Update last_daily_reset.txt with the current time BEFORE restarting
-        File newResetTimeFile = SD_MMC.open("/last_daily_reset.txt", FILE_WRITE);
-        if (newResetTimeFile) {
-            newResetTimeFile.print(current_loop_epoch); // Log the time of this reset
-            newResetTimeFile.close();
+        sd_writer_printf("/last_daily_reset.txt", 0, "%lu", (unsigned long)current_loop_epoch); // Log the time of this reset
+#if TIMELAPSE_STORAGE_MODE == _STORAGE_MODE_SEGMENTS
+        timelapse_segment_close(SD_FLUSH_TIMEOUT_MS); // Append the index of the open segment
+#endif
+
+        if (sd_writer_flush(SD_FLUSH_TIMEOUT_MS)) {
             Serial.println("Updated /last_daily_reset.txt with current time before reset.");
         } else {
-            Serial.println("Failed to open /last_daily_reset.txt for update before reset.");
+            Serial.println("SD writer did not drain before reset, /last_daily_reset.txt may be stale.");
         }
-        
-        delay(1000); // Small delay to help ensure files are written
         ESP.restart();
       }
     }
   }
 }
+
+static void runHeartbeatTask(void *arg) {
+  updateHeartbeat();
+}
+
+static void runDailyResetTask(void *arg) {
+  checkDailyReset();
+}
+
+// Capture task: the timelapse shots, from the end of focus mode on. Light
+// sleep stops both cores, so it is only entered from here, once the web
+// server is gone, and never past the next housekeeping timer. As in
+// captureIdle(), it is not entered while the camera driver is up: with
+// CAMERA_WARM_STANDBY the driver stays initialized between shots, so the
+// task waits with delay() instead and the next shot starts warm.
+static void captureTask(void *arg) {
+  esp_task_wdt_add(NULL);
+  coop_init(&captureScheduler);
+  captureScheduler.idle = captureIdle;
+  while (!(xEventGroupWaitBits(firmwareEvents, EVENT_FOCUS_MODE_DONE, pdFALSE, pdTRUE,
+                               pdMS_TO_TICKS(WDT_TIMEOUT_SECONDS * 500)) & EVENT_FOCUS_MODE_DONE)) {
+    esp_task_wdt_reset();
+  }
+
+  for (;;) {
+    esp_task_wdt_reset();
+    int64_t busy_start = task_monitor_begin();
+    checkNightDeepSleep();
+
+    // If not night deep sleeping (e.g. daytime, time not synced, or invalid sleep duration), proceed with timelapse/light sleep:
+    unsigned long current_millis = millis();
+    if (current_millis - lastTimelapse >= timelapseIntervalMs) {
+      // Time for timelapse
+      lastTimelapse = current_millis; // Update timestamp before capture
+      xEventGroupClearBits(firmwareEvents, EVENT_CAPTURE_IDLE);
+      captureAndSaveTimelapse();
+      xEventGroupSetBits(firmwareEvents, EVENT_CAPTURE_IDLE);
+      task_monitor_end(busy_start);
+      continue;
+    }
+
+    // Not time for timelapse yet, consider light sleeping
+    unsigned long time_to_next_capture = (lastTimelapse + timelapseIntervalMs) - current_millis;
+    unsigned long max_safe_sleep_ms = (unsigned long)(WDT_TIMEOUT_SECONDS > 5 ? WDT_TIMEOUT_SECONDS - 5 : WDT_TIMEOUT_SECONDS / 2) * 1000;
+    if (max_safe_sleep_ms == 0 && WDT_TIMEOUT_SECONDS > 0) max_safe_sleep_ms = WDT_TIMEOUT_SECONDS * 500;
+    if (max_safe_sleep_ms == 0) max_safe_sleep_ms = 1000;
+
+    unsigned long sleep_duration_ms = min(time_to_next_capture, max_safe_sleep_ms);
+    int32_t housekeeping_in_ms = coop_until(__atomic_load_n(&housekeepingWakeMs, __ATOMIC_SEQ_CST), millis());
+    sleep_duration_ms = min(sleep_duration_ms, (unsigned long)max(housekeeping_in_ms, (int32_t)0)); // Wake for the housekeeping timers
+
+    if (sleep_duration_ms > 1000) {
+      bool flushed = sd_writer_flush(SD_FLUSH_TIMEOUT_MS); // Don't suspend the writer task mid-write
+      esp_task_wdt_reset(); // The flush may have used up the margin left for it
+      task_monitor_end(busy_start);
+      if (flushed && !cameraInitialized) {
+        Serial.printf("Light sleeping for %lu ms...\n", sleep_duration_ms);
+        coop_idle_light_sleep(sleep_duration_ms);
+      } else {
+        // The card is still busy, or XCLK and the frame DMA are set up for a
+        // warm shot: stay awake
+        delay(sleep_duration_ms);
+      }
+    } else {
+      // Housekeeping is due or the shot is close: block, the other tasks keep running
+      task_monitor_end(busy_start);
+      delay(min(time_to_next_capture, 1000UL));
+    }
+  }
+}
+
+// Network task: runs focus mode, then stops the web server and WiFi, hands
+// over to the capture task and exits
+static void networkTask(void *arg) {
+  esp_task_wdt_add(NULL);
+  unsigned long lastWifiCheck = millis();
+  while (focusModeActive && millis() < focusModeEndTime) {
+    esp_task_wdt_reset();
+    if (millis() - lastWifiCheck >= WIFI_RECONNECT_INTERVAL) {
+      lastWifiCheck = millis();
+      int64_t busy_start = task_monitor_begin();
+      checkWiFiConnection();
+      task_monitor_end(busy_start);
+    }
+    delay(1000); // Blocks this task only, the HTTP server tasks keep serving
+  }
+
+  if (focusModeActive) {
+    int64_t busy_start = task_monitor_begin();
+    Serial.println("Focus mode duration elapsed.");
+    stopWebServerAndWiFi();
+#if CAMERA_WARM_STANDBY
+    Serial.println("Putting camera into standby after focus mode.");
+    cameraSetStandby(true); // Keep the driver warm for the timelapse shots
+#else
+    Serial.println("De-initializing camera after focus mode.");
+    cameraDeinit(); // De-initialize camera as web server is no longer needed
+#endif
+    focusModeActive = false;
+    task_monitor_end(busy_start);
+  }
+  xEventGroupSetBits(firmwareEvents, EVENT_FOCUS_MODE_DONE);
+
+  esp_task_wdt_delete(NULL);
+  task_monitor_exit();
+  vTaskDelete(NULL);
+}
+
+// Housekeeping task: heartbeat and daily reset timers
+static void housekeepingTask(void *arg) {
+  esp_task_wdt_add(NULL);
+  for (;;) {
+    esp_task_wdt_reset();
+    int64_t busy_start = task_monitor_begin();
+    coop_run_due(&scheduler);
+    task_monitor_end(busy_start);
+    uint32_t idle_ms = min(coop_next_due_ms(&scheduler), (uint32_t)WDT_TIMEOUT_SECONDS * 500); // Wake in time to feed the watchdog
+    __atomic_store_n(&housekeepingWakeMs, millis() + idle_ms, __ATOMIC_SEQ_CST);
+    delay(idle_ms);
+  }
+}
+
+static void startFirmwareTask(TaskFunction_t fn, const char *name, uint32_t stack_size,
+                              BaseType_t core) {
+  TaskHandle_t handle = NULL;
+  if (xTaskCreatePinnedToCore(fn, name, stack_size, NULL, 1, &handle, core) != pdPASS) {
+    Serial.printf("Failed to start the %s task.\n", name);
+    return;
+  }
+  task_monitor_register(handle, name, stack_size);
+}
+
+void startFirmwareTasks() {
+  xEventGroupSetBits(firmwareEvents, EVENT_CAPTURE_IDLE | (focusModeActive ? 0 : EVENT_FOCUS_MODE_DONE));
+
+  coop_init(&scheduler);
+  coop_every(&scheduler, &heartbeatTask, "heartbeat", runHeartbeatTask, NULL,
+             HEARTBEAT_INTERVAL, HEARTBEAT_INTERVAL);
+  coop_every(&scheduler, &dailyResetTask, "daily_reset", runDailyResetTask, NULL,
+             DAILY_RESET_CHECK_INTERVAL_MS, DAILY_RESET_CHECK_INTERVAL_MS);
+
+  startFirmwareTask(housekeepingTask, "housekeeping", HOUSEKEEPING_TASK_STACK, HOUSEKEEPING_TASK_CORE);
+  startFirmwareTask(networkTask, "network", NETWORK_TASK_STACK, NETWORK_TASK_CORE);
+  startFirmwareTask(captureTask, "capture", CAPTURE_TASK_STACK, CAPTURE_TASK_CORE);
+}
+
+// All work runs in the firmware tasks started by setup()
+void loop() {
+  esp_task_wdt_delete(NULL);
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,36 @@
+#include "frame_fingerprint.h"
+
+bool frame_fingerprint_from_thumb(const uint8_t *thumb, uint16_t width,
+                                  uint16_t height, frame_fingerprint_t *out) {
+  const int grid = FRAME_FINGERPRINT_GRID;
+  if (width < grid || height < grid) {
+    return false;
+  }
+  for (int gy = 0; gy < grid; gy++) {
+    uint16_t y0 = gy * height / grid, y1 = (gy + 1) * height / grid;
+    for (int gx = 0; gx < grid; gx++) {
+      uint16_t x0 = gx * width / grid, x1 = (gx + 1) * width / grid;
+      uint32_t sum = 0;
+      for (uint16_t y = y0; y < y1; y++) {
+        const uint8_t *row = thumb + (size_t)y * width;
+        for (uint16_t x = x0; x < x1; x++) {
+          sum += row[x];
+        }
+      }
+      uint32_t count = (uint32_t)(y1 - y0) * (x1 - x0);
+      out->cells[gy * grid + gx] = (sum + count / 2) / count;
+    }
+  }
+  return true;
+}
+
+uint8_t frame_fingerprint_distance(const frame_fingerprint_t *a,
+                                   const frame_fingerprint_t *b) {
+  int max = 0;
+  for (size_t i = 0; i < sizeof(a->cells); i++) {
+    int d = a->cells[i] - b->cells[i];
+    d = d < 0 ? -d : d;
+    max = d > max ? d : max;
+  }
+  return max;
+}
@@ -0,0 +1,19 @@
+#include "frame_quality.h"
+
+void frame_quality_measure(const uint8_t *thumb, uint16_t width,
+                           uint16_t height, uint32_t ac_nonzero,
+                           frame_quality_t *out) {
+  size_t blocks = (size_t)width * height;
+  if (blocks == 0) {
+    *out = {};
+    return;
+  }
+  uint32_t clipped = 0;
+  for (size_t i = 0; i < blocks; i++) {
+    clipped += (thumb[i] <= FRAME_QUALITY_DARK) |
+               (thumb[i] >= FRAME_QUALITY_BRIGHT);
+  }
+  out->detail = (uint64_t)ac_nonzero * 100 / blocks;
+  out->clipped = clipped * 1000 / blocks;
+  out->score = (uint64_t)out->detail * (1000 - out->clipped) / 1000;
+}
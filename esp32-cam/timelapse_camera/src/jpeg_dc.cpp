@@ -0,0 +1,410 @@
+#include "jpeg_dc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Codes up to this long are decoded with one table lookup
+#define HUFF_LOOKAHEAD 8
+
+typedef struct {
+  bool defined;
+  int32_t maxcode[17];   // largest code of each length, -1 if there is none
+  int32_t valoffset[17]; // huffval index of a code minus the code
+  uint8_t lookup_len[1 << HUFF_LOOKAHEAD]; // 0: the code is longer
+  uint8_t lookup_sym[1 << HUFF_LOOKAHEAD];
+  uint8_t huffval[256];
+} huff_table_t;
+
+typedef struct {
+  uint8_t id;
+  uint8_t h, v; // sampling factors
+  uint8_t tq;   // quantization table
+  uint8_t td, ta; // DC and AC Huffman tables of the scan
+  int pred;       // DC predictor
+} component_t;
+
+typedef struct {
+  const uint8_t *p, *end;
+  uint32_t acc; // the low `bits` bits are unread, oldest first
+  int bits;
+  bool marker; // reached a marker (or the end): feeds zeros from here
+} bit_reader_t;
+
+typedef struct {
+  huff_table_t dc[4], ac[4];
+  uint16_t quant_dc[4]; // first (DC) entry of each quantization table
+  component_t comp[4];
+  int ncomp;
+  uint16_t width, height;
+  uint16_t restart_interval;
+} jpeg_t;
+
+static bool build_table(huff_table_t *t, const uint8_t *counts,
+                        const uint8_t *symbols, int total) {
+  memcpy(t->huffval, symbols, total);
+  memset(t->lookup_len, 0, sizeof(t->lookup_len));
+  int32_t code = 0;
+  int k = 0;
+  for (int l = 1; l <= 16; l++) {
+    int n = counts[l - 1];
+    t->maxcode[l] = -1;
+    if (n) {
+      if (code + n > (1 << l)) {
+        return false; // more codes than fit in l bits
+      }
+      t->valoffset[l] = k - code;
+      if (l <= HUFF_LOOKAHEAD) {
+        int shift = HUFF_LOOKAHEAD - l;
+        for (int i = 0; i < n; i++) {
+          int first = (code + i) << shift;
+          for (int j = 0; j < (1 << shift); j++) {
+            t->lookup_len[first + j] = l;
+            t->lookup_sym[first + j] = symbols[k + i];
+          }
+        }
+      }
+      code += n;
+      k += n;
+      t->maxcode[l] = code - 1;
+    }
+    code <<= 1;
+  }
+  t->defined = true;
+  return true;
+}
+
+static void fill(bit_reader_t *br) {
+  while (br->bits <= 24) {
+    uint32_t byte = 0;
+    if (!br->marker && br->p < br->end) {
+      byte = *br->p;
+      if (byte != 0xFF) {
+        br->p++;
+      } else if (br->p + 1 < br->end && br->p[1] == 0x00) {
+        br->p += 2; // stuffed 0xFF
+      } else {
+        br->marker = true;
+        byte = 0;
+      }
+    } else {
+      br->marker = true;
+    }
+    br->acc = (br->acc << 8) | byte;
+    br->bits += 8;
+  }
+}
+
+static inline int take(bit_reader_t *br, int n) {
+  br->bits -= n;
+  return (br->acc >> br->bits) & ((1u << n) - 1);
+}
+
+static int decode(bit_reader_t *br, const huff_table_t *t) {
+  fill(br);
+  uint32_t peek = (br->acc >> (br->bits - HUFF_LOOKAHEAD)) &
+                  ((1u << HUFF_LOOKAHEAD) - 1);
+  int len = t->lookup_len[peek];
+  if (len) {
+    br->bits -= len;
+    return t->lookup_sym[peek];
+  }
+  for (int l = HUFF_LOOKAHEAD + 1; l <= 16; l++) {
+    int32_t code = (br->acc >> (br->bits - l)) & ((1u << l) - 1);
+    if (code <= t->maxcode[l]) {
+      br->bits -= l;
+      return t->huffval[t->valoffset[l] + code];
+    }
+  }
+  return -1;
+}
+
+// Decodes one block, keeping only its DC value and the number of nonzero AC
+// coefficients; the AC values themselves are skipped
+static bool decode_block(jpeg_t *j, bit_reader_t *br, component_t *c,
+                         int *dc, uint32_t *ac_nonzero) {
+  int s = decode(br, &j->dc[c->td]);
+  if (s < 0 || s > 11) {
+    return false;
+  }
+  if (s) {
+    fill(br);
+    int diff = take(br, s);
+    if (diff < (1 << (s - 1))) {
+      diff -= (1 << s) - 1;
+    }
+    c->pred += diff;
+  }
+  *dc = c->pred;
+
+  const huff_table_t *ac = &j->ac[c->ta];
+  uint32_t nonzero = 0;
+  for (int k = 1; k < 64;) {
+    int rs = decode(br, ac);
+    if (rs < 0) {
+      return false;
+    }
+    int r = rs >> 4;
+    s = rs & 15;
+    if (s == 0) {
+      if (r != 15) {
+        break; // end of block
+      }
+      k += 16;
+      continue;
+    }
+    fill(br);
+    br->bits -= s;
+    k += r + 1;
+    nonzero++;
+  }
+  *ac_nonzero += nonzero;
+  return true;
+}
+
+// Skips to just past the next RSTn marker and resets the predictors
+static void restart(jpeg_t *j, bit_reader_t *br) {
+  const uint8_t *p = br->p;
+  while (p + 1 < br->end && !(p[0] == 0xFF && (p[1] & 0xF8) == 0xD0)) {
+    p++;
+  }
+  br->p = p + 2 <= br->end ? p + 2 : br->end;
+  br->acc = 0;
+  br->bits = 0;
+  br->marker = false;
+  for (int i = 0; i < j->ncomp; i++) {
+    j->comp[i].pred = 0;
+  }
+}
+
+static inline uint8_t dc_to_luma(int dc, uint16_t quant) {
+  // The DC coefficient is 8 times the block's level-shifted mean
+  int v = ((dc * quant) >> 3) + 128;
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static bool decode_scan(jpeg_t *j, const uint8_t *s, size_t n,
+                        const uint8_t *data, const uint8_t *end,
+                        jpeg_dc_t *out) {
+  if (n < 1 || s[0] < 1 || s[0] > j->ncomp || n < 4 + 2u * s[0]) {
+    return false;
+  }
+  int ns = s[0];
+  component_t *scan[4];
+  for (int i = 0; i < ns; i++) {
+    scan[i] = NULL;
+    for (int c = 0; c < j->ncomp; c++) {
+      if (j->comp[c].id == s[1 + 2 * i]) {
+        scan[i] = &j->comp[c];
+      }
+    }
+    if (!scan[i]) {
+      return false;
+    }
+    scan[i]->td = s[2 + 2 * i] >> 4;
+    scan[i]->ta = s[2 + 2 * i] & 15;
+    if (scan[i]->td > 3 || scan[i]->ta > 3 || !j->dc[scan[i]->td].defined ||
+        !j->ac[scan[i]->ta].defined) {
+      return false;
+    }
+  }
+
+  // The luma component is the frame's first; its block grid is the thumbnail
+  component_t *luma = &j->comp[0];
+  int hmax = 1, vmax = 1;
+  for (int c = 0; c < j->ncomp; c++) {
+    hmax = j->comp[c].h > hmax ? j->comp[c].h : hmax;
+    vmax = j->comp[c].v > vmax ? j->comp[c].v : vmax;
+  }
+  int tw = ((j->width * luma->h + hmax - 1) / hmax + 7) / 8;
+  int th = ((j->height * luma->v + vmax - 1) / vmax + 7) / 8;
+  if ((size_t)tw * th > out->max_blocks) {
+    return false;
+  }
+  out->width = tw;
+  out->height = th;
+  out->image_width = j->width;
+  out->image_height = j->height;
+  out->ac_nonzero = 0;
+  uint16_t quant = j->quant_dc[luma->tq];
+
+  // A single-component scan is not interleaved: one block per MCU over that
+  // component's own block grid
+  int mcux, mcuy;
+  if (ns == 1) {
+    mcux = ((j->width * scan[0]->h + hmax - 1) / hmax + 7) / 8;
+    mcuy = ((j->height * scan[0]->v + vmax - 1) / vmax + 7) / 8;
+  } else {
+    mcux = (j->width + 8 * hmax - 1) / (8 * hmax);
+    mcuy = (j->height + 8 * vmax - 1) / (8 * vmax);
+  }
+  bool has_luma = false;
+  for (int i = 0; i < ns; i++) {
+    has_luma |= scan[i] == luma;
+  }
+  if (!has_luma) {
+    return false;
+  }
+
+  bit_reader_t br = {data, end, 0, 0, false};
+  uint32_t mcus = 0, total = (uint32_t)mcux * mcuy;
+  for (int my = 0; my < mcuy; my++) {
+    for (int mx = 0; mx < mcux; mx++) {
+      if (j->restart_interval && mcus && mcus % j->restart_interval == 0) {
+        restart(j, &br);
+      }
+      mcus++;
+      for (int i = 0; i < ns; i++) {
+        component_t *c = scan[i];
+        int bh = ns == 1 ? 1 : c->h, bv = ns == 1 ? 1 : c->v;
+        uint32_t ignored = 0;
+        for (int v = 0; v < bv; v++) {
+          for (int h = 0; h < bh; h++) {
+            int dc;
+            if (!decode_block(j, &br, c, &dc,
+                              c == luma ? &out->ac_nonzero : &ignored)) {
+              return false;
+            }
+            int bx = mx * bh + h, by = my * bv + v;
+            if (c == luma && bx < tw && by < th) {
+              out->luma[by * tw + bx] = dc_to_luma(dc, quant);
+            }
+          }
+        }
+      }
+    }
+  }
+  return mcus == total;
+}
+
+static bool parse_sof(jpeg_t *j, const uint8_t *s, size_t n) {
+  if (n < 6 || s[0] != 8) {
+    return false; // 12-bit samples
+  }
+  j->height = s[1] << 8 | s[2];
+  j->width = s[3] << 8 | s[4];
+  j->ncomp = s[5];
+  if (j->width == 0 || j->height == 0 || j->ncomp < 1 || j->ncomp > 4 ||
+      n < 6 + 3u * j->ncomp) {
+    return false;
+  }
+  for (int i = 0; i < j->ncomp; i++) {
+    component_t *c = &j->comp[i];
+    c->id = s[6 + 3 * i];
+    c->h = s[7 + 3 * i] >> 4;
+    c->v = s[7 + 3 * i] & 15;
+    c->tq = s[8 + 3 * i];
+    if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4 || c->tq > 3) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool parse_dqt(jpeg_t *j, const uint8_t *s, size_t n) {
+  while (n > 0) {
+    int precision = s[0] >> 4, id = s[0] & 15;
+    size_t size = precision ? 129 : 65;
+    if (id > 3 || n < size) {
+      return false;
+    }
+    j->quant_dc[id] = precision ? (s[1] << 8 | s[2]) : s[1];
+    s += size;
+    n -= size;
+  }
+  return true;
+}
+
+static bool parse_dht(jpeg_t *j, const uint8_t *s, size_t n) {
+  while (n > 0) {
+    if (n < 17) {
+      return false;
+    }
+    int table_class = s[0] >> 4, id = s[0] & 15;
+    int total = 0;
+    for (int i = 1; i <= 16; i++) {
+      total += s[i];
+    }
+    if (table_class > 1 || id > 3 || total > 256 || n < 17u + total) {
+      return false;
+    }
+    huff_table_t *t = table_class ? &j->ac[id] : &j->dc[id];
+    if (!build_table(t, s + 1, s + 17, total)) {
+      return false;
+    }
+    s += 17 + total;
+    n -= 17 + total;
+  }
+  return true;
+}
+
+static bool parse(jpeg_t *j, const uint8_t *jpeg, size_t len, jpeg_dc_t *out) {
+  const uint8_t *p = jpeg + 2, *end = jpeg + len;
+  bool have_frame = false;
+  while (p + 2 <= end) {
+    if (p[0] != 0xFF) {
+      return false;
+    }
+    uint8_t marker = p[1];
+    if (marker == 0xFF) {
+      p++; // fill byte
+      continue;
+    }
+    p += 2;
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+      continue; // no payload
+    }
+    if (marker == 0xD9 || p + 2 > end) {
+      return false; // no scan
+    }
+    size_t seg = p[0] << 8 | p[1];
+    if (seg < 2 || p + seg > end) {
+      return false;
+    }
+    const uint8_t *s = p + 2;
+    size_t n = seg - 2;
+    bool ok = true;
+    switch (marker) {
+    case 0xC0: // baseline
+    case 0xC1: // extended sequential, Huffman
+      ok = parse_sof(j, s, n);
+      have_frame = ok;
+      break;
+    case 0xC2: case 0xC3: case 0xC5: case 0xC6: case 0xC7:
+    case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+      return false; // progressive, lossless or arithmetic coded
+    case 0xC4:
+      ok = parse_dht(j, s, n);
+      break;
+    case 0xDB:
+      ok = parse_dqt(j, s, n);
+      break;
+    case 0xDD:
+      ok = n >= 2;
+      j->restart_interval = ok ? (s[0] << 8 | s[1]) : 0;
+      break;
+    case 0xDA:
+      return have_frame && decode_scan(j, s, n, p + seg, end, out);
+    default:
+      break; // APPn, COM and the like
+    }
+    if (!ok) {
+      return false;
+    }
+    p += seg;
+  }
+  return false;
+}
+
+bool jpeg_dc_decode(const uint8_t *jpeg, size_t len, jpeg_dc_t *out) {
+  if (len < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+    return false;
+  }
+  // About 7 KB of tables: too much for the stack of the calling task
+  jpeg_t *j = (jpeg_t *)calloc(1, sizeof(jpeg_t));
+  if (!j) {
+    return false;
+  }
+  bool ok = parse(j, jpeg, len, out);
+  free(j);
+  return ok;
+}
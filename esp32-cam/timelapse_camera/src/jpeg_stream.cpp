@@ -0,0 +1,51 @@
+#include "jpeg_stream.h"
+
+#include "img_converters.h"
+#include "sd_writer.h"
+#include "timelapse_segment_format.h"
+
+typedef struct {
+  sd_fd_stream_t stream;
+  uint32_t *crc;
+  const camera_fb_t *fb;
+} fd_sink_t;
+
+// Set by jpeg_stream_cancel(), read by the writer task (only with __atomic_*)
+static const camera_fb_t *cancelled_fb = NULL;
+
+static bool is_cancelled(const camera_fb_t *fb) {
+  return __atomic_load_n(&cancelled_fb, __ATOMIC_SEQ_CST) == fb;
+}
+
+static size_t fd_sink_out(void *arg, size_t index, const void *data,
+                          size_t len) {
+  fd_sink_t *sink = (fd_sink_t *)arg;
+  if (is_cancelled(sink->fb)) {
+    return 0; // the encoder stops at a short write
+  }
+  if (sink->crc) {
+    *sink->crc = segment_crc32(*sink->crc, (const uint8_t *)data, len);
+  }
+  return sd_writer_stream_write(&sink->stream, (const uint8_t *)data, len)
+             ? len
+             : 0;
+}
+
+bool jpeg_stream_to_fd(camera_fb_t *fb, int fd, size_t *len, uint32_t *crc) {
+  fd_sink_t sink;
+  sink.crc = crc;
+  sink.fb = fb;
+  if (crc) {
+    *crc = 0;
+  }
+  sd_writer_stream_begin(&sink.stream, fd);
+  bool encoded = !is_cancelled(fb) &&
+                 frame2jpg_cb(fb, SOFT_JPEG_QUALITY, fd_sink_out, &sink);
+  bool written = sd_writer_stream_end(&sink.stream);
+  *len = sink.stream.total;
+  return encoded && written;
+}
+
+void jpeg_stream_cancel(const camera_fb_t *fb) {
+  __atomic_store_n(&cancelled_fb, fb, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,141 @@
+#include "motion_score.h"
+
+#include <stdlib.h>
+
+bool motion_detector_init(motion_detector_t *det, size_t max_pixels) {
+  det->width = 0;
+  det->height = 0;
+  det->frames = 0;
+  det->max_pixels = max_pixels;
+  det->pixel_threshold = MOTION_PIXEL_THRESHOLD;
+  det->background_shift = MOTION_BACKGROUND_SHIFT;
+  det->background = (uint16_t *)malloc(max_pixels * sizeof(uint16_t));
+  return det->background != NULL;
+}
+
+void motion_detector_free(motion_detector_t *det) {
+  free(det->background);
+  det->background = NULL;
+}
+
+uint32_t motion_sum_u8(const uint8_t *px, size_t n) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += px[i];
+  }
+  return sum;
+}
+
+uint32_t motion_sum_u16(const uint16_t *px, size_t n) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += px[i];
+  }
+  return sum;
+}
+
+uint32_t motion_count_changed(const uint8_t *px, const uint16_t *bg, size_t n,
+                              int32_t offset, int32_t threshold) {
+  uint32_t changed = 0;
+  for (size_t i = 0; i < n; i++) {
+    int32_t d = ((int32_t)px[i] << 4) - bg[i] - offset;
+    int32_t mask = d >> 31; // branch-free abs()
+    changed += ((d ^ mask) - mask) > threshold;
+  }
+  return changed;
+}
+
+void motion_blend(uint16_t *bg, const uint8_t *px, size_t n, int shift) {
+  for (size_t i = 0; i < n; i++) {
+    int32_t d = ((int32_t)px[i] << 4) - bg[i];
+    bg[i] = (uint16_t)(bg[i] + (d >> shift));
+  }
+}
+
+uint16_t motion_detector_update(motion_detector_t *det, const uint8_t *thumb,
+                                uint16_t width, uint16_t height) {
+  size_t n = (size_t)width * height;
+  if (n == 0 || n > det->max_pixels) {
+    return 0;
+  }
+  if (width != det->width || height != det->height || det->frames == 0) {
+    for (size_t i = 0; i < n; i++) {
+      det->background[i] = thumb[i] << 4;
+    }
+    det->width = width;
+    det->height = height;
+    det->frames = 1;
+    return 0;
+  }
+
+  // Mean brightness difference, in background units
+  int32_t offset = (int32_t)(((int64_t)motion_sum_u8(thumb, n) << 4) -
+                             motion_sum_u16(det->background, n)) /
+                   (int32_t)n;
+  uint32_t changed = motion_count_changed(thumb, det->background, n, offset,
+                                          (int32_t)det->pixel_threshold << 4);
+  motion_blend(det->background, thumb, n, det->background_shift);
+  det->frames++;
+  return (uint16_t)(changed * 1000 / n);
+}
+
+static inline uint8_t raw_luma(const uint8_t *p, motion_raw_format_t format) {
+  switch (format) {
+  case MOTION_RAW_YUV422:
+    return p[0];
+  case MOTION_RAW_RGB565: {
+    // Rec. 601 weights on the 5/6/5-bit channels scaled to 8 bits
+    int r = p[0] & 0xf8, g = (p[0] & 0x07) << 5 | (p[1] & 0xe0) >> 3,
+        b = (p[1] & 0x1f) << 3;
+    return (77 * r + 150 * g + 29 * b) >> 8;
+  }
+  default:
+    return p[0];
+  }
+}
+
+bool motion_thumb_from_raw(const uint8_t *buf, uint16_t width, uint16_t height,
+                           motion_raw_format_t format, uint8_t *thumb,
+                           size_t max_pixels, uint16_t *thumb_width,
+                           uint16_t *thumb_height) {
+  uint16_t tw = (width + 7) / 8, th = (height + 7) / 8;
+  if ((size_t)tw * th > max_pixels) {
+    return false;
+  }
+  size_t bpp = format == MOTION_RAW_GRAYSCALE ? 1 : 2;
+  for (uint16_t ty = 0; ty < th; ty++) {
+    for (uint16_t tx = 0; tx < tw; tx++) {
+      uint32_t sum = 0, count = 0;
+      for (uint16_t y = ty * 8; y < ty * 8 + 8 && y < height; y++) {
+        const uint8_t *row = buf + ((size_t)y * width + tx * 8) * bpp;
+        for (uint16_t x = tx * 8; x < tx * 8 + 8 && x < width; x++) {
+          sum += raw_luma(row, format);
+          row += bpp;
+          count++;
+        }
+      }
+      thumb[(size_t)ty * tw + tx] = sum / count;
+    }
+  }
+  *thumb_width = tw;
+  *thumb_height = th;
+  return true;
+}
+
+void motion_rate_init(motion_rate_t *rate, uint32_t min_ms, uint32_t max_ms,
+                      uint16_t threshold) {
+  rate->interval_ms = max_ms;
+  rate->min_ms = min_ms;
+  rate->max_ms = max_ms;
+  rate->threshold = threshold;
+}
+
+uint32_t motion_rate_update(motion_rate_t *rate, uint16_t score) {
+  if (score >= rate->threshold) {
+    rate->interval_ms = rate->min_ms;
+  } else if (score < rate->threshold / 2) {
+    uint32_t next = rate->interval_ms + rate->interval_ms / 2;
+    rate->interval_ms = next < rate->max_ms ? next : rate->max_ms;
+  }
+  return rate->interval_ms;
+}
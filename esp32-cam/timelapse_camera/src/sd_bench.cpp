@@ -0,0 +1,384 @@
+#include "sd_bench.h"
+
+#include "FS.h"
+#include "SD_MMC.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sd_card.h"
+#include "sd_writer.h"
+#include "timelapse_segment.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SD_BENCH_SEQ_PATH SD_BENCH_DIR "/seq.bin"
+#define SD_BENCH_FSYNC_PATH SD_BENCH_DIR "/fsync.txt"
+
+// Room for the sample count of any test
+#define SD_BENCH_MAX_SAMPLES 256
+static_assert(SD_BENCH_SEQ_BYTES / SD_BENCH_SEQ_CHUNK <= SD_BENCH_MAX_SAMPLES &&
+                  SD_BENCH_RANDOM_OPS <= SD_BENCH_MAX_SAMPLES &&
+                  SD_BENCH_OPEN_CLOSE_FILES <= SD_BENCH_MAX_SAMPLES &&
+                  SD_BENCH_FSYNC_OPS <= SD_BENCH_MAX_SAMPLES,
+              "raise SD_BENCH_MAX_SAMPLES");
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+void sd_bench_summarize(uint32_t *samples_us, uint32_t count,
+                        sd_bench_result_t *result) {
+  result->samples = count;
+  if (count == 0) {
+    return;
+  }
+  qsort(samples_us, count, sizeof(uint32_t), compare_u32);
+  // Nearest-rank percentiles
+  result->p50_us = samples_us[(count * 50 + 99) / 100 - 1];
+  result->p90_us = samples_us[(count * 90 + 99) / 100 - 1];
+  result->p99_us = samples_us[(count * 99 + 99) / 100 - 1];
+  result->max_us = samples_us[count - 1];
+}
+
+static void vfs_path(const char *path, char *out, size_t len) {
+  snprintf(out, len, "%s%s", SD_MOUNT_POINT, path);
+}
+
+static uint32_t elapsed_us(int64_t start) {
+  return (uint32_t)(esp_timer_get_time() - start);
+}
+
+static uint32_t rate_per_s(uint64_t units, uint64_t total_us) {
+  return total_us ? (uint32_t)(units * 1000000ULL / total_us) : 0;
+}
+
+// Writes SD_BENCH_SEQ_BYTES to a new file, timing each chunk write
+static void bench_seq_write(uint8_t *buf, uint32_t *samples,
+                            sd_bench_result_t *result) {
+  char path[48];
+  vfs_path(SD_BENCH_SEQ_PATH, path, sizeof(path));
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    return;
+  }
+  uint32_t n = 0;
+  uint64_t total_us = 0;
+  for (uint32_t done = 0; done < SD_BENCH_SEQ_BYTES; done += SD_BENCH_SEQ_CHUNK) {
+    int64_t start = esp_timer_get_time();
+    if (write(fd, buf, SD_BENCH_SEQ_CHUNK) != SD_BENCH_SEQ_CHUNK) {
+      break;
+    }
+    samples[n] = elapsed_us(start);
+    total_us += samples[n++];
+  }
+  int64_t start = esp_timer_get_time();
+  close(fd); // the last sectors and FAT updates land here
+  total_us += elapsed_us(start);
+
+  sd_bench_summarize(samples, n, result);
+  result->rate = rate_per_s((uint64_t)n * SD_BENCH_SEQ_CHUNK / 1024, total_us);
+}
+
+// Rewrites random aligned blocks of the sequential test's file
+static void bench_random_write(uint8_t *buf, uint32_t *samples,
+                               sd_bench_result_t *result) {
+  char path[48];
+  vfs_path(SD_BENCH_SEQ_PATH, path, sizeof(path));
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    return;
+  }
+  uint32_t blocks = SD_BENCH_SEQ_BYTES / SD_BENCH_RANDOM_SIZE;
+  uint32_t n = 0;
+  uint64_t total_us = 0;
+  for (uint32_t i = 0; i < SD_BENCH_RANDOM_OPS; i++) {
+    off_t offset = (off_t)(esp_random() % blocks) * SD_BENCH_RANDOM_SIZE;
+    int64_t start = esp_timer_get_time();
+    if (lseek(fd, offset, SEEK_SET) != offset ||
+        write(fd, buf, SD_BENCH_RANDOM_SIZE) != SD_BENCH_RANDOM_SIZE) {
+      break;
+    }
+    samples[n] = elapsed_us(start);
+    total_us += samples[n++];
+  }
+  close(fd);
+
+  sd_bench_summarize(samples, n, result);
+  result->rate = rate_per_s((uint64_t)n * SD_BENCH_RANDOM_SIZE / 1024, total_us);
+}
+
+// Creates, writes one byte to and closes many small files, then deletes them
+static void bench_open_close(uint8_t *buf, uint32_t *samples,
+                             sd_bench_result_t *result) {
+  char path[48];
+  uint32_t n = 0;
+  uint64_t total_us = 0;
+  for (uint32_t i = 0; i < SD_BENCH_OPEN_CLOSE_FILES; i++) {
+    snprintf(path, sizeof(path), "%s" SD_BENCH_DIR "/f%u.txt", SD_MOUNT_POINT,
+             (unsigned)i);
+    int64_t start = esp_timer_get_time();
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      break;
+    }
+    bool ok = write(fd, buf, 1) == 1;
+    ok = close(fd) == 0 && ok;
+    if (!ok) {
+      break;
+    }
+    samples[n] = elapsed_us(start);
+    total_us += samples[n++];
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s" SD_BENCH_DIR "/f%u.txt", SD_MOUNT_POINT,
+             (unsigned)i);
+    unlink(path);
+  }
+
+  sd_bench_summarize(samples, n, result);
+  result->rate = rate_per_s(n, total_us);
+}
+
+// Appends log-line-sized records, each followed by fsync, like the error and
+// heartbeat logs that must survive a reset
+static void bench_fsync(uint8_t *buf, uint32_t *samples,
+                        sd_bench_result_t *result) {
+  char path[48];
+  vfs_path(SD_BENCH_FSYNC_PATH, path, sizeof(path));
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    return;
+  }
+  uint32_t n = 0;
+  uint64_t total_us = 0;
+  for (uint32_t i = 0; i < SD_BENCH_FSYNC_OPS; i++) {
+    int64_t start = esp_timer_get_time();
+    if (write(fd, buf, SD_BENCH_FSYNC_SIZE) != SD_BENCH_FSYNC_SIZE ||
+        fsync(fd) != 0) {
+      break;
+    }
+    samples[n] = elapsed_us(start);
+    total_us += samples[n++];
+  }
+  close(fd);
+
+  sd_bench_summarize(samples, n, result);
+  result->rate = rate_per_s(n, total_us);
+}
+
+static bool mount(bool one_bit) {
+  SD_MMC.end();
+  vTaskDelay(pdMS_TO_TICKS(100));
+  return SD_MMC.begin(SD_MOUNT_POINT, one_bit);
+}
+
+static void run_mode(uint8_t bus_width, uint8_t *buf, uint32_t *samples,
+                     sd_bench_mode_t *mode) {
+  memset(mode, 0, sizeof(*mode));
+  mode->bus_width = bus_width;
+  mode->mounted = mount(bus_width == 1);
+  if (!mode->mounted) {
+    Serial.printf("SD bench: Card did not mount in %u-bit mode\n", bus_width);
+    return;
+  }
+  SD_MMC.mkdir(SD_BENCH_DIR);
+
+  bench_seq_write(buf, samples, &mode->seq_write);
+  bench_random_write(buf, samples, &mode->random_write);
+  bench_open_close(buf, samples, &mode->open_close);
+  bench_fsync(buf, samples, &mode->fsync);
+
+  SD_MMC.remove(SD_BENCH_SEQ_PATH);
+  SD_MMC.remove(SD_BENCH_FSYNC_PATH);
+  SD_MMC.rmdir(SD_BENCH_DIR);
+  Serial.printf("SD bench: %u-bit seq %u KB/s, random %u KB/s, "
+                "open/close %u/s, fsync p99 %u us\n",
+                bus_width, mode->seq_write.rate, mode->random_write.rate,
+                mode->open_close.rate, mode->fsync.p99_us);
+}
+
+typedef struct {
+  uint8_t bus_modes;
+  sd_bench_report_t *report;
+  SemaphoreHandle_t done; // NULL for a run started by sd_bench_start()
+} bench_ctx_t;
+
+// How long sd_bench_start() waits for room in the SD writer queue
+#define SD_BENCH_QUEUE_TIMEOUT_MS 1000
+
+// Background run: only the writer task touches async_report while it is
+// SD_BENCH_RUNNING, the HTTP handlers only once it is SD_BENCH_DONE
+static uint8_t async_state = SD_BENCH_IDLE;
+static sd_bench_report_t async_report;
+static bench_ctx_t async_ctx;
+
+static bool bench_step(const sd_job_t *job) {
+  bench_ctx_t *ctx = (bench_ctx_t *)job->ctx;
+  sd_bench_report_t *report = ctx->report;
+
+  // The card itself is measured, so write straight from DMA-capable memory
+  uint8_t *buf = (uint8_t *)heap_caps_malloc(
+      SD_BENCH_SEQ_CHUNK, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+  uint32_t *samples =
+      (uint32_t *)malloc(SD_BENCH_MAX_SAMPLES * sizeof(uint32_t));
+  if (!buf || !samples) {
+    Serial.println("SD bench: Not enough memory");
+    heap_caps_free(buf);
+    free(samples);
+    return false;
+  }
+  for (size_t i = 0; i < SD_BENCH_SEQ_CHUNK; i++) {
+    buf[i] = (uint8_t)(i * 31 + (i >> 8));
+  }
+
+  // Each mode remounts the card
+  timelapse_segment_close_now();
+
+  if (ctx->bus_modes & SD_BENCH_BUS_1BIT) {
+    run_mode(1, buf, samples, &report->modes[report->count++]);
+  }
+  if (ctx->bus_modes & SD_BENCH_BUS_4BIT) {
+    run_mode(4, buf, samples, &report->modes[report->count++]);
+  }
+  heap_caps_free(buf);
+  free(samples);
+
+  // Back to the mode the rest of the firmware uses
+  bool remounted = sd_card_remount();
+  if (!remounted) {
+    Serial.println("SD bench: Failed to remount the card");
+  }
+  return remounted;
+}
+
+static void save_report(const sd_bench_report_t *report) {
+  char *json = (char *)malloc(SD_BENCH_JSON_MAX);
+  if (json) {
+    int len = sd_bench_to_json(report, json, SD_BENCH_JSON_MAX);
+    if (len > 0 && len < SD_BENCH_JSON_MAX) {
+      sd_writer_printf(SD_BENCH_RESULT_PATH, 0, "%s\n", json);
+    }
+    free(json);
+  }
+}
+
+static void bench_done(const sd_job_t *job, bool ok) {
+  bench_ctx_t *ctx = (bench_ctx_t *)job->ctx;
+  if (ctx->done) {
+    xSemaphoreGive(ctx->done);
+    return;
+  }
+  ok = ok && ctx->report->count > 0;
+  if (ok) {
+    save_report(ctx->report); // written inline on the writer task
+  }
+  __atomic_store_n(&async_state, ok ? SD_BENCH_DONE : SD_BENCH_FAILED,
+                   __ATOMIC_SEQ_CST);
+}
+
+static sd_job_t bench_job(bench_ctx_t *ctx) {
+  // Run on the writer task, so nothing else touches the card while it is
+  // remounted and measured
+  sd_job_t job = {};
+  strlcpy(job.path, SD_BENCH_DIR, sizeof(job.path));
+  job.write = bench_step;
+  job.done = bench_done;
+  job.ctx = ctx;
+  return job;
+}
+
+bool sd_bench_run(uint8_t bus_modes, sd_bench_report_t *report) {
+  memset(report, 0, sizeof(*report));
+  bench_ctx_t ctx = {bus_modes, report, xSemaphoreCreateBinary()};
+  if (!ctx.done) {
+    return false;
+  }
+
+  sd_job_t job = bench_job(&ctx);
+  bool ok = sd_writer_submit(&job, UINT32_MAX);
+  xSemaphoreTake(ctx.done, portMAX_DELAY); // done is called even if rejected
+  vSemaphoreDelete(ctx.done);
+  if (!ok || report->count == 0) {
+    return false;
+  }
+  save_report(report);
+  return true;
+}
+
+bool sd_bench_start(uint8_t bus_modes) {
+  uint8_t state = __atomic_load_n(&async_state, __ATOMIC_SEQ_CST);
+  if (state == SD_BENCH_RUNNING ||
+      !__atomic_compare_exchange_n(&async_state, &state, SD_BENCH_RUNNING,
+                                   false, __ATOMIC_SEQ_CST,
+                                   __ATOMIC_SEQ_CST)) {
+    return false;
+  }
+  memset(&async_report, 0, sizeof(async_report));
+  async_ctx = {bus_modes, &async_report, NULL};
+  sd_job_t job = bench_job(&async_ctx);
+  // A job rejected by a full queue ends up SD_BENCH_FAILED
+  sd_writer_submit(&job, SD_BENCH_QUEUE_TIMEOUT_MS);
+  return true;
+}
+
+uint8_t sd_bench_status(sd_bench_report_t *report) {
+  uint8_t state = __atomic_load_n(&async_state, __ATOMIC_SEQ_CST);
+  if (state == SD_BENCH_DONE) {
+    *report = async_report;
+  }
+  return state;
+}
+
+static int result_json(const char *name, const char *rate_name,
+                       const sd_bench_result_t *r, char *buf, size_t len) {
+  return snprintf(buf, len,
+                  "\"%s\":{\"samples\":%u,\"p50_us\":%u,\"p90_us\":%u,"
+                  "\"p99_us\":%u,\"max_us\":%u,\"%s\":%u}",
+                  name, r->samples, r->p50_us, r->p90_us, r->p99_us, r->max_us,
+                  rate_name, r->rate);
+}
+
+int sd_bench_to_json(const sd_bench_report_t *report, char *buf, size_t len) {
+  size_t at = 0;
+#define APPEND(expr)                                                           \
+  do {                                                                         \
+    int n = (expr);                                                            \
+    if (n < 0) {                                                               \
+      return n;                                                                \
+    }                                                                          \
+    at += n;                                                                   \
+    if (at >= len) {                                                           \
+      return at;                                                               \
+    }                                                                          \
+  } while (0)
+
+  APPEND(snprintf(buf, len, "{\"modes\":["));
+  for (uint8_t i = 0; i < report->count; i++) {
+    const sd_bench_mode_t *m = &report->modes[i];
+    APPEND(snprintf(buf + at, len - at, "%s{\"bus_width\":%u,\"mounted\":%s",
+                    i ? "," : "", m->bus_width, m->mounted ? "true" : "false"));
+    if (m->mounted) {
+      APPEND(snprintf(buf + at, len - at, ","));
+      APPEND(result_json("seq_write", "kb_per_s", &m->seq_write, buf + at,
+                         len - at));
+      APPEND(snprintf(buf + at, len - at, ","));
+      APPEND(result_json("random_write", "kb_per_s", &m->random_write,
+                         buf + at, len - at));
+      APPEND(snprintf(buf + at, len - at, ","));
+      APPEND(result_json("open_close", "files_per_s", &m->open_close, buf + at,
+                         len - at));
+      APPEND(snprintf(buf + at, len - at, ","));
+      APPEND(result_json("fsync", "ops_per_s", &m->fsync, buf + at, len - at));
+    }
+    APPEND(snprintf(buf + at, len - at, "}"));
+  }
+  APPEND(snprintf(buf + at, len - at, "]}"));
+#undef APPEND
+  return at;
+}
@@ -0,0 +1,45 @@
+#include "sd_card.h"
+
+#include "FS.h"
+#include "SD_MMC.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static uint8_t requested_width = SD_BUS_WIDTH == 4 ? 4 : 1;
+static uint8_t active_width = 0;
+static uint32_t fallbacks = 0;
+
+bool sd_card_mount() {
+  active_width = 0;
+  if (requested_width == 4) {
+    if (SD_MMC.begin(SD_MOUNT_POINT, false)) {
+      active_width = 4;
+      return true;
+    }
+    Serial.println("SD card: 4-bit mount failed, falling back to 1-bit");
+    fallbacks++;
+    SD_MMC.end();
+  }
+  if (SD_MMC.begin(SD_MOUNT_POINT, true)) {
+    active_width = 1;
+    return true;
+  }
+  return false;
+}
+
+bool sd_card_remount() {
+  SD_MMC.end();
+  active_width = 0;
+  vTaskDelay(pdMS_TO_TICKS(500));
+  return sd_card_mount();
+}
+
+void sd_card_set_bus_width(uint8_t bus_width) {
+  requested_width = bus_width == 4 ? 4 : 1;
+}
+
+uint8_t sd_card_requested_bus_width() { return requested_width; }
+
+uint8_t sd_card_bus_width() { return active_width; }
+
+uint32_t sd_card_fallbacks() { return fallbacks; }
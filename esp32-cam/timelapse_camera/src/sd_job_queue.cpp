@@ -0,0 +1,93 @@
+#include "sd_job_queue.h"
+
+#include <string.h>
+
+void sd_job_queue_init(sd_job_queue_t *q, sd_job_t *slots, size_t capacity) {
+  memset(q, 0, sizeof(*q));
+  q->slots = slots;
+  q->capacity = capacity;
+}
+
+bool sd_job_queue_push(sd_job_queue_t *q, const sd_job_t *job) {
+  if (sd_job_queue_full(q)) {
+    return false;
+  }
+  q->slots[(q->head + q->count) % q->capacity] = *job;
+  q->count++;
+  q->stats.depth = q->count;
+  if (q->count > q->stats.max_depth) {
+    q->stats.max_depth = q->count;
+  }
+  return true;
+}
+
+bool sd_job_queue_pop(sd_job_queue_t *q, sd_job_t *out) {
+  if (q->count == 0) {
+    return false;
+  }
+  *out = q->slots[q->head];
+  q->head = (q->head + 1) % q->capacity;
+  q->count--;
+  q->stats.depth = q->count;
+  return true;
+}
+
+bool sd_job_queue_drop_oldest(sd_job_queue_t *q, sd_job_t *out) {
+  for (size_t i = 0; i < q->count; i++) {
+    size_t at = (q->head + i) % q->capacity;
+    if (!q->slots[at].droppable) {
+      continue;
+    }
+    *out = q->slots[at];
+    // Close the gap by moving the newer jobs one slot towards the head
+    for (size_t j = i; j + 1 < q->count; j++) {
+      q->slots[(q->head + j) % q->capacity] =
+          q->slots[(q->head + j + 1) % q->capacity];
+    }
+    q->count--;
+    q->stats.depth = q->count;
+    q->stats.dropped++;
+    return true;
+  }
+  return false;
+}
+
+static bool plain_write(const sd_job_t *job, const sd_fs_ops_t *fs) {
+  void *file = fs->open(job->path, job->append);
+  if (!file) {
+    return false;
+  }
+  size_t written = fs->write(file, job->buf, job->len);
+  fs->close(file);
+  return written == job->len;
+}
+
+bool sd_job_run(const sd_job_t *job, const sd_fs_ops_t *fs,
+                sd_writer_stats_t *stats) {
+  int64_t start = fs->now_us();
+  bool ok = job->write ? job->write(job) : plain_write(job, fs);
+  uint32_t took = (uint32_t)(fs->now_us() - start);
+
+  stats->write_us += took;
+  if (took > stats->max_write_us) {
+    stats->max_write_us = took;
+  }
+  if (ok) {
+    stats->written++;
+    stats->bytes += job->len;
+  } else {
+    stats->failed++;
+  }
+
+  if (job->done) {
+    job->done(job, ok);
+  }
+  return ok;
+}
+
+uint32_t sd_writer_stats_bytes_per_s(const sd_writer_stats_t *stats) {
+  if (stats->write_us == 0) {
+    return 0;
+  }
+  return (uint32_t)(stats->bytes * 1000000ULL / stats->write_us);
+}
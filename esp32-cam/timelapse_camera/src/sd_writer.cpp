@@ -0,0 +1,522 @@
+#include "sd_writer.h"
+
+#include "FS.h"
+#include "SD_MMC.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "jpeg_stream.h"
+#include "task_monitor.h"
+#include "timelapse_segment.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+// Longest time sd_writer_printf() waits for queue space
+#define SD_WRITER_LOG_TIMEOUT_MS 1000
+
+// Writer task stack; raw frames are JPEG-encoded on it
+#define SD_WRITER_STACK_SIZE (4096 + JPEG_ENCODE_STACK_EXTRA)
+
+static sd_job_queue_t queue;
+static SemaphoreHandle_t queue_lock = NULL;
+static SemaphoreHandle_t job_ready = NULL;   // counts queued jobs
+static SemaphoreHandle_t space_freed = NULL; // given whenever a slot frees up
+static TaskHandle_t writer_task = NULL;
+static bool writer_busy = false;
+
+// ---------------------------------------------------------------------------
+// SD_MMC backend. Frame data bypasses Arduino's File (and its stdio buffer):
+// files are opened on the VFS path and written in large pieces from an
+// internal, DMA-capable staging buffer. The SDMMC driver can only DMA from
+// such memory; given a PSRAM or unaligned source it falls back to copying
+// through a one-sector bounce buffer and issuing one command per 512 bytes.
+// Only the writer task writes through it, so one staging buffer is enough.
+// ---------------------------------------------------------------------------
+
+static uint8_t *staging = NULL;
+static int current_fd = -1;
+
+static int64_t fs_now_us() { return esp_timer_get_time(); }
+
+static int open_vfs(const char *path, bool append) {
+  char vfs_path[SD_JOB_PATH_MAX + sizeof(SD_MOUNT_POINT)];
+  snprintf(vfs_path, sizeof(vfs_path), "%s%s", SD_MOUNT_POINT, path);
+  return open(vfs_path, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC),
+              0666);
+}
+
+int sd_writer_open_fd(const char *path, bool append) {
+  int fd = open_vfs(path, append);
+  if (fd >= 0) {
+    return fd;
+  }
+
+  // A failed open usually means the card dropped off the bus: remount once
+  Serial.printf("SD writer: Failed to open %s, attempting SD card remount...\n",
+                path);
+  timelapse_segment_close_now();
+  if (!sd_card_remount()) {
+    Serial.println("SD writer: SD remount failed.");
+    return -1;
+  }
+  Serial.println("SD writer: SD remount successful. Retrying file open...");
+  fd = open_vfs(path, append);
+  if (fd < 0) {
+    Serial.printf("SD writer: Still can't open %s after remount\n", path);
+    // Written directly: going through the queue here could recurse
+    File errorLog = SD_MMC.open("/sd_errors.txt", FILE_APPEND);
+    if (errorLog) {
+      errorLog.printf("SD open failed after remount for file %s\n", path);
+      errorLog.close();
+    }
+  }
+  return fd;
+}
+
+bool sd_writer_write_fd(int fd, const uint8_t *buf, size_t len) {
+  if (!staging) {
+    return write(fd, buf, len) == (ssize_t)len;
+  }
+
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  if (pos < 0) {
+    pos = 0;
+  }
+  while (len > 0) {
+    // The first piece only runs up to the next sector boundary, so all later
+    // pieces start on one and FATFS hands them to the driver as whole-sector
+    // multi-block writes straight from the staging buffer. Placing the data
+    // at the file position's offset within a word keeps the sector-aligned
+    // part of each piece word aligned in memory as well.
+    size_t skew = pos & 3;
+    size_t room = SD_WRITE_STAGING_SIZE - (pos % SD_SECTOR_SIZE);
+    size_t n = len < room ? len : room;
+    memcpy(staging + skew, buf, n);
+    if (write(fd, staging + skew, n) != (ssize_t)n) {
+      return false;
+    }
+    buf += n;
+    len -= n;
+    pos += n;
+  }
+  return true;
+}
+
+// Bytes of staging buffer the stream's next write may fill: up to a sector
+// boundary of the file, like sd_writer_write_fd()'s pieces
+static size_t stream_room(const sd_fd_stream_t *stream) {
+  return SD_WRITE_STAGING_SIZE - (stream->pos % SD_SECTOR_SIZE);
+}
+
+static bool stream_flush(sd_fd_stream_t *stream) {
+  if (stream->used == 0 || !stream->ok) {
+    return stream->ok;
+  }
+  if (write(stream->fd, staging + (stream->pos & 3), stream->used) !=
+      (ssize_t)stream->used) {
+    stream->ok = false;
+  }
+  stream->pos += stream->used;
+  stream->used = 0;
+  return stream->ok;
+}
+
+void sd_writer_stream_begin(sd_fd_stream_t *stream, int fd) {
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  stream->fd = fd;
+  stream->pos = pos > 0 ? pos : 0;
+  stream->used = 0;
+  stream->total = 0;
+  stream->ok = true;
+}
+
+bool sd_writer_stream_write(sd_fd_stream_t *stream, const uint8_t *buf,
+                            size_t len) {
+  if (!stream->ok) {
+    return false;
+  }
+  if (!staging) {
+    stream->ok = write(stream->fd, buf, len) == (ssize_t)len;
+    stream->total += len;
+    return stream->ok;
+  }
+  while (len > 0) {
+    size_t room = stream_room(stream) - stream->used;
+    size_t n = len < room ? len : room;
+    memcpy(staging + (stream->pos & 3) + stream->used, buf, n);
+    stream->used += n;
+    stream->total += n;
+    buf += n;
+    len -= n;
+    if (stream->used == stream_room(stream) && !stream_flush(stream)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool sd_writer_stream_end(sd_fd_stream_t *stream) {
+  return stream_flush(stream);
+}
+
+static void *fs_open(const char *path, bool append) {
+  current_fd = sd_writer_open_fd(path, append);
+  return current_fd >= 0 ? &current_fd : NULL;
+}
+
+static size_t fs_write(void *file, const uint8_t *buf, size_t len) {
+  return sd_writer_write_fd(*(int *)file, buf, len) ? len : 0;
+}
+
+static void fs_close(void *file) { close(*(int *)file); }
+
+static const sd_fs_ops_t sd_mmc_ops = {fs_open, fs_write, fs_close, fs_now_us};
+
+// ---------------------------------------------------------------------------
+// Writer task
+// ---------------------------------------------------------------------------
+
+// Called with queue_lock held
+static void merge_run_stats(const sd_writer_stats_t *run) {
+  queue.stats.written += run->written;
+  queue.stats.failed += run->failed;
+  queue.stats.bytes += run->bytes;
+  queue.stats.write_us += run->write_us;
+  if (run->max_write_us > queue.stats.max_write_us) {
+    queue.stats.max_write_us = run->max_write_us;
+  }
+}
+
+static bool run_job(const sd_job_t *job) {
+  sd_writer_stats_t run = {};
+  bool ok = sd_job_run(job, &sd_mmc_ops, &run);
+  xSemaphoreTake(queue_lock, portMAX_DELAY);
+  merge_run_stats(&run);
+  xSemaphoreGive(queue_lock);
+  return ok;
+}
+
+static void writer_loop(void *arg) {
+  while (true) {
+    xSemaphoreTake(job_ready, portMAX_DELAY);
+
+    sd_job_t job;
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    bool have_job = sd_job_queue_pop(&queue, &job);
+    writer_busy = have_job;
+    xSemaphoreGive(queue_lock);
+    if (!have_job) {
+      continue; // the job was evicted before we got to it
+    }
+    xSemaphoreGive(space_freed);
+
+    int64_t busy_start = task_monitor_begin();
+    run_job(&job);
+    task_monitor_end(busy_start);
+
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    writer_busy = false;
+    xSemaphoreGive(queue_lock);
+  }
+}
+
+bool sd_writer_start() {
+  if (writer_task) {
+    return true;
+  }
+
+  // The job ring is small, but keep it out of internal RAM when PSRAM exists
+  size_t slots_size = SD_WRITER_QUEUE_LEN * sizeof(sd_job_t);
+  sd_job_t *slots = (sd_job_t *)heap_caps_malloc(
+      slots_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (!slots) {
+    slots = (sd_job_t *)malloc(slots_size);
+  }
+  queue_lock = xSemaphoreCreateMutex();
+  job_ready = xSemaphoreCreateCounting(SD_WRITER_QUEUE_LEN * 2, 0);
+  space_freed = xSemaphoreCreateBinary();
+  if (!slots || !queue_lock || !job_ready || !space_freed) {
+    Serial.println("SD writer: Failed to allocate queue");
+    return false;
+  }
+  sd_job_queue_init(&queue, slots, SD_WRITER_QUEUE_LEN);
+
+  // 4 spare bytes let sd_writer_write_fd() shift the data to a word offset
+  staging = (uint8_t *)heap_caps_malloc(SD_WRITE_STAGING_SIZE + 4,
+                                        MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+  if (!staging) {
+    Serial.println("SD writer: No DMA memory for staging, writing unstaged");
+  }
+
+  if (xTaskCreate(writer_loop, "sd_writer", SD_WRITER_STACK_SIZE, NULL, 4,
+                  &writer_task) != pdPASS) {
+    Serial.println("SD writer: Failed to start task");
+    writer_task = NULL;
+    return false;
+  }
+  task_monitor_register(writer_task, "storage", SD_WRITER_STACK_SIZE);
+  return true;
+}
+
+static bool reject(const sd_job_t *job) {
+  if (job->done) {
+    job->done(job, false);
+  }
+  return false;
+}
+
+bool sd_writer_submit(const sd_job_t *job, uint32_t timeout_ms) {
+  if (!writer_task) {
+    // Not started yet: write inline, there is no queue to account it to
+    sd_writer_stats_t run = {};
+    return sd_job_run(job, &sd_mmc_ops, &run);
+  }
+  if (xTaskGetCurrentTaskHandle() == writer_task) {
+    // Called from a done callback: queueing could deadlock on a full queue
+    return run_job(job);
+  }
+
+  int64_t wait_start = esp_timer_get_time();
+  int64_t deadline = wait_start + (int64_t)timeout_ms * 1000;
+
+  xSemaphoreTake(queue_lock, portMAX_DELAY);
+  while (sd_job_queue_full(&queue)) {
+    sd_job_t evicted;
+    if (sd_job_queue_drop_oldest(&queue, &evicted)) {
+      xSemaphoreGive(queue_lock);
+      if (evicted.done) {
+        evicted.done(&evicted, false);
+      }
+      xSemaphoreTake(queue_lock, portMAX_DELAY);
+      continue;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (job->droppable || now >= deadline) {
+      queue.stats.dropped++;
+      queue.stats.stall_us += now - wait_start;
+      xSemaphoreGive(queue_lock);
+      return reject(job);
+    }
+
+    // Back-pressure: wait for the writer to free a slot
+    xSemaphoreGive(queue_lock);
+    uint32_t wait_ms = (uint32_t)((deadline - now) / 1000);
+    xSemaphoreTake(space_freed, pdMS_TO_TICKS(wait_ms < 50 ? wait_ms + 1 : 50));
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+  }
+  sd_job_queue_push(&queue, job);
+  queue.stats.stall_us += esp_timer_get_time() - wait_start;
+  xSemaphoreGive(queue_lock);
+
+  xSemaphoreGive(job_ready);
+  return true;
+}
+
+static void free_text_job(const sd_job_t *job, bool ok) {
+  free((void *)job->buf);
+}
+
+bool sd_writer_printf(const char *path, int flags, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  if (len < 0) {
+    return false;
+  }
+
+  char *text = (char *)malloc(len + 1);
+  if (!text) {
+    return false;
+  }
+  va_start(args, fmt);
+  vsnprintf(text, len + 1, fmt, args);
+  va_end(args);
+
+  sd_job_t job = {};
+  strlcpy(job.path, path, sizeof(job.path));
+  job.buf = (const uint8_t *)text;
+  job.len = len;
+  job.append = flags & SD_WRITE_APPEND;
+  job.droppable = flags & SD_WRITE_DROPPABLE;
+  job.done = free_text_job;
+  return sd_writer_submit(&job, SD_WRITER_LOG_TIMEOUT_MS);
+}
+
+bool sd_writer_flush(uint32_t timeout_ms) {
+  if (!writer_task) {
+    return true;
+  }
+  int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+  while (true) {
+    xSemaphoreTake(queue_lock, portMAX_DELAY);
+    bool idle = queue.count == 0 && !writer_busy;
+    xSemaphoreGive(queue_lock);
+    if (idle) {
+      return true;
+    }
+    if (esp_timer_get_time() >= deadline) {
+      return false;
+    }
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Frame write benchmark
+// ---------------------------------------------------------------------------
+
+typedef struct {
+  uint32_t files;
+  size_t file_size;
+  const uint8_t *data;
+  sd_frame_bench_t *result;
+  SemaphoreHandle_t done;
+} frame_bench_ctx_t;
+
+static bool frame_bench_step(const sd_job_t *job) {
+  frame_bench_ctx_t *ctx = (frame_bench_ctx_t *)job->ctx;
+  sd_frame_bench_t *r = ctx->result;
+  SD_MMC.mkdir(SD_FRAME_BENCH_DIR);
+
+  uint64_t total_us = 0;
+  r->min_us = UINT32_MAX;
+  for (uint32_t i = 0; i < ctx->files; i++) {
+    char path[SD_JOB_PATH_MAX];
+    snprintf(path, sizeof(path), SD_FRAME_BENCH_DIR "/%u.jpg", (unsigned)i);
+
+    int64_t start = esp_timer_get_time();
+    int fd = sd_writer_open_fd(path, false);
+    if (fd < 0) {
+      break;
+    }
+    bool ok = sd_writer_write_fd(fd, ctx->data, ctx->file_size);
+    ok = close(fd) == 0 && ok;
+    uint32_t took = (uint32_t)(esp_timer_get_time() - start);
+    if (!ok) {
+      break;
+    }
+
+    r->files++;
+    total_us += took;
+    r->min_us = took < r->min_us ? took : r->min_us;
+    r->max_us = took > r->max_us ? took : r->max_us;
+  }
+
+  for (uint32_t i = 0; i < r->files; i++) {
+    char path[SD_JOB_PATH_MAX];
+    snprintf(path, sizeof(path), SD_FRAME_BENCH_DIR "/%u.jpg", (unsigned)i);
+    SD_MMC.remove(path);
+  }
+  SD_MMC.rmdir(SD_FRAME_BENCH_DIR);
+
+  if (r->files == 0) {
+    r->min_us = 0;
+    return false;
+  }
+  r->avg_us = total_us / r->files;
+  r->bytes_per_s = (uint32_t)((uint64_t)r->files * ctx->file_size * 1000000ULL /
+                              total_us);
+  return r->files == ctx->files;
+}
+
+static void frame_bench_done(const sd_job_t *job, bool ok) {
+  xSemaphoreGive(((frame_bench_ctx_t *)job->ctx)->done);
+}
+
+bool sd_writer_frame_bench(uint32_t files, size_t file_size,
+                           sd_frame_bench_t *result) {
+  memset(result, 0, sizeof(*result));
+  // Like a real frame, the source lives in PSRAM when there is any
+  uint8_t *data = (uint8_t *)heap_caps_malloc(
+      file_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (!data) {
+    data = (uint8_t *)malloc(file_size);
+  }
+  SemaphoreHandle_t done = xSemaphoreCreateBinary();
+  if (!data || !done) {
+    free(data);
+    if (done) {
+      vSemaphoreDelete(done);
+    }
+    return false;
+  }
+  for (size_t i = 0; i < file_size; i++) {
+    data[i] = (uint8_t)(i * 31 + (i >> 8)); // incompressible enough for FATFS
+  }
+
+  // Run on the writer task, which owns the staging buffer
+  frame_bench_ctx_t ctx = {files, file_size, data, result, done};
+  sd_job_t job = {};
+  strlcpy(job.path, SD_FRAME_BENCH_DIR, sizeof(job.path));
+  job.write = frame_bench_step;
+  job.done = frame_bench_done;
+  job.ctx = &ctx;
+  sd_writer_submit(&job, UINT32_MAX);
+  xSemaphoreTake(done, portMAX_DELAY); // done is called even if rejected
+
+  vSemaphoreDelete(done);
+  free(data);
+  return result->files == files;
+}
+
+// ---------------------------------------------------------------------------
+// Bus width changes
+// ---------------------------------------------------------------------------
+
+// How long sd_writer_start_bus_switch() waits for room in the queue
+#define SD_BUS_SWITCH_QUEUE_TIMEOUT_MS 1000
+
+static uint8_t bus_switch_state = SD_BUS_SWITCH_IDLE;
+
+static bool remount_step(const sd_job_t *job) {
+  sd_card_set_bus_width((uint8_t)(uintptr_t)job->ctx);
+  timelapse_segment_close_now();
+  bool ok = sd_card_remount();
+  Serial.printf("SD writer: Remounted with %u-bit bus (requested %u-bit)\n",
+                sd_card_bus_width(), sd_card_requested_bus_width());
+  return ok;
+}
+
+// Also called for a job the full queue rejected
+static void remount_done(const sd_job_t *job, bool ok) {
+  __atomic_store_n(&bus_switch_state,
+                   ok && sd_card_bus_width() != 0 ? SD_BUS_SWITCH_DONE
+                                                  : SD_BUS_SWITCH_FAILED,
+                   __ATOMIC_SEQ_CST);
+}
+
+bool sd_writer_start_bus_switch(uint8_t bus_width) {
+  uint8_t state = __atomic_load_n(&bus_switch_state, __ATOMIC_SEQ_CST);
+  if (state == SD_BUS_SWITCH_RUNNING ||
+      !__atomic_compare_exchange_n(&bus_switch_state, &state,
+                                   SD_BUS_SWITCH_RUNNING, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    return false;
+  }
+  sd_job_t job = {};
+  strlcpy(job.path, SD_MOUNT_POINT, sizeof(job.path));
+  job.write = remount_step;
+  job.done = remount_done;
+  job.ctx = (void *)(uintptr_t)bus_width;
+  sd_writer_submit(&job, SD_BUS_SWITCH_QUEUE_TIMEOUT_MS);
+  return true;
+}
+
+uint8_t sd_writer_bus_switch_status() {
+  return __atomic_load_n(&bus_switch_state, __ATOMIC_SEQ_CST);
+}
+
+void sd_writer_get_stats(sd_writer_stats_t *stats) {
+  if (!writer_task) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  xSemaphoreTake(queue_lock, portMAX_DELAY);
+  *stats = queue.stats;
+  xSemaphoreGive(queue_lock);
+}
@@ -0,0 +1,195 @@
+#include "stage_timer.h"
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include <stdio.h>
+
+// Indexed by stage_t
+static const char *const stage_names[STAGE_COUNT] = {
+    "pwdn_cycle",
+    "camera_init",
+    "stabilize",
+    "fb_get",
+    "jpeg_encode",
+    "sd_open",
+    "sd_write",
+    "sd_close",
+    "camera_deinit",
+    "shot",
+    "http_index",
+    "http_capture",
+    "http_bmp",
+    "http_status",
+    "http_timelapse",
+    "http_sd_bench",
+    "http_sd_bus",
+    "http_metrics",
+};
+
+static const uint32_t bucket_bounds_us[STAGE_TIMER_BUCKETS] = {
+    100,     200,     500,     1000,     2000,    5000,
+    10000,   20000,   50000,   100000,   200000,  500000,
+    1000000, 2000000, 5000000, 10000000, 20000000,
+};
+
+static stage_timer_stats_t stages[STAGE_COUNT];
+static portMUX_TYPE stages_mux = portMUX_INITIALIZER_UNLOCKED;
+
+const char *stage_timer_name(stage_t stage) {
+  return stage < STAGE_COUNT ? stage_names[stage] : "unknown";
+}
+
+int64_t stage_timer_start() { return esp_timer_get_time(); }
+
+void stage_timer_record(stage_t stage, int64_t start_us) {
+  int64_t took = esp_timer_get_time() - start_us;
+  stage_timer_add(stage, took > UINT32_MAX ? UINT32_MAX : (uint32_t)took);
+}
+
+void stage_timer_add(stage_t stage, uint32_t us) {
+  if (stage >= STAGE_COUNT) {
+    return;
+  }
+  size_t bucket = 0;
+  while (bucket < STAGE_TIMER_BUCKETS && us > bucket_bounds_us[bucket]) {
+    bucket++;
+  }
+  portENTER_CRITICAL(&stages_mux);
+  stage_timer_stats_t *s = &stages[stage];
+  if (s->count == 0 || us < s->min_us) {
+    s->min_us = us;
+  }
+  if (us > s->max_us) {
+    s->max_us = us;
+  }
+  s->count++;
+  s->sum_us += us;
+  s->buckets[bucket]++;
+  portEXIT_CRITICAL(&stages_mux);
+}
+
+void stage_timer_get(stage_t stage, stage_timer_stats_t *stats) {
+  if (stage >= STAGE_COUNT) {
+    *stats = {};
+    return;
+  }
+  portENTER_CRITICAL(&stages_mux);
+  *stats = stages[stage];
+  portEXIT_CRITICAL(&stages_mux);
+}
+
+uint32_t stage_timer_percentile(const stage_timer_stats_t *stats,
+                                uint32_t permille) {
+  if (stats->count == 0) {
+    return 0;
+  }
+  uint32_t rank = ((uint64_t)stats->count * permille + 999) / 1000;
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint32_t below = 0;
+  for (size_t b = 0; b <= STAGE_TIMER_BUCKETS; b++) {
+    uint32_t in_bucket = stats->buckets[b];
+    if (below + in_bucket < rank) {
+      below += in_bucket;
+      continue;
+    }
+    uint32_t lower = b ? bucket_bounds_us[b - 1] : 0;
+    uint32_t upper =
+        b < STAGE_TIMER_BUCKETS ? bucket_bounds_us[b] : stats->max_us;
+    uint32_t us =
+        lower + (uint64_t)(upper - lower) * (rank - below) / in_bucket;
+    if (us < stats->min_us) {
+      us = stats->min_us;
+    }
+    return us > stats->max_us ? stats->max_us : us;
+  }
+  return stats->max_us;
+}
+
+#define METRIC "timelapse_camera_stage"
+
+bool stage_timer_prometheus(stage_timer_write_fn write, void *arg) {
+  char line[256]; // the +Inf bucket, sum and count of a stage go out together
+  stage_timer_stats_t s;
+
+  if (!write(arg, "# HELP " METRIC "_seconds Duration of timelapse shot "
+                  "stages and HTTP handlers.\n"
+                  "# TYPE " METRIC "_seconds histogram\n")) {
+    return false;
+  }
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    stage_timer_get((stage_t)stage, &s);
+    const char *name = stage_names[stage];
+    uint32_t cumulative = 0;
+    for (size_t b = 0; b < STAGE_TIMER_BUCKETS; b++) {
+      cumulative += s.buckets[b];
+      snprintf(line, sizeof(line),
+               METRIC "_seconds_bucket{stage=\"%s\",le=\"%g\"} %u\n", name,
+               bucket_bounds_us[b] / 1e6, cumulative);
+      if (!write(arg, line)) {
+        return false;
+      }
+    }
+    snprintf(line, sizeof(line),
+             METRIC "_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %u\n"
+             METRIC "_seconds_sum{stage=\"%s\"} %.6f\n"
+             METRIC "_seconds_count{stage=\"%s\"} %u\n",
+             name, s.count, name, s.sum_us / 1e6, name, s.count);
+    if (!write(arg, line)) {
+      return false;
+    }
+  }
+
+  // min, p95 and max as gauges, for stages that have samples
+  static const char *const gauges[] = {"min", "p95", "max"};
+  for (size_t g = 0; g < 3; g++) {
+    snprintf(line, sizeof(line), "# TYPE " METRIC "_%s_seconds gauge\n",
+             gauges[g]);
+    if (!write(arg, line)) {
+      return false;
+    }
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+      stage_timer_get((stage_t)stage, &s);
+      if (s.count == 0) {
+        continue;
+      }
+      uint32_t us = g == 0   ? s.min_us
+                    : g == 1 ? stage_timer_percentile(&s, 950)
+                             : s.max_us;
+      snprintf(line, sizeof(line), METRIC "_%s_seconds{stage=\"%s\"} %.6f\n",
+               gauges[g], stage_names[stage], us / 1e6);
+      if (!write(arg, line)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+size_t stage_timer_summary(char *buf, size_t len) {
+  size_t used = 0;
+  buf[0] = '\0';
+  for (int stage = 0; stage < STAGE_COUNT && used < len; stage++) {
+    stage_timer_stats_t s;
+    stage_timer_get((stage_t)stage, &s);
+    if (s.count == 0) {
+      continue;
+    }
+    // Milliseconds with one decimal, SD and HTTP stages are often short
+    uint32_t avg = (uint32_t)(s.sum_us / s.count);
+    uint32_t p95 = stage_timer_percentile(&s, 950);
+    int w = snprintf(buf + used, len - used,
+                     "Stage %s: n=%u min/avg/p95/max "
+                     "%u.%u/%u.%u/%u.%u/%u.%u ms\n",
+                     stage_names[stage], s.count, s.min_us / 1000,
+                     s.min_us / 100 % 10, avg / 1000, avg / 100 % 10,
+                     p95 / 1000, p95 / 100 % 10, s.max_us / 1000,
+                     s.max_us / 100 % 10);
+    if (w < 0) {
+      break;
+    }
+    used += (size_t)w < len - used ? (size_t)w : len - used - 1;
+  }
+  return used;
+}
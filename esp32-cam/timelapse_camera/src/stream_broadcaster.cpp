@@ -0,0 +1,577 @@
+// Fan-out MJPEG broadcaster: one producer task captures each frame once and
+// hands a reference to every connected /stream client. Each client has its own
+// sender task with a single pending slot, so a slow client drops frames instead
+// of stalling the producer or the other viewers.
+#include "stream_broadcaster.h"
+
+#include "camera_profile.h"
+#include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "img_converters.h"
+#include "jpeg_stream.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#endif
+
+#define PART_BOUNDARY "123456789000000000000987654321"
+static const char *_STREAM_RESPONSE =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: multipart/x-mixed-replace;boundary=" PART_BOUNDARY "\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "X-Framerate: 60\r\n"
+    "\r\n";
+// Boundary and part header of one frame, sent in the same write as its body
+static const char *_STREAM_PART = "\r\n--" PART_BOUNDARY "\r\n"
+                                  "Content-Type: image/jpeg\r\nContent-Length: "
+                                  "%u\r\nX-Timestamp: %d.%06d\r\n\r\n";
+// Same for a raw frame, whose length is only known once it is encoded
+static const char *_STREAM_PART_RAW = "\r\n--" PART_BOUNDARY "\r\n"
+                                      "Content-Type: image/jpeg\r\n"
+                                      "X-Timestamp: %d.%06d\r\n\r\n";
+
+// Number of frames averaged by the stream statistics filters
+#define RA_FILTER_SAMPLES 20
+
+// A sender that has not been handed a frame for this long re-checks its state
+#define SENDER_IDLE_TIMEOUT_MS 1000
+
+// The fd belongs to httpd's session until httpd closes that session; its
+// close_fn (stream_broadcaster_close_fn) then leaves the fd open for the sender
+// to close, so the number cannot be reused while a frame is still being
+// written to it. A slot whose sender is gone but whose session is still open
+// stays in use, with task NULL, until close_fn comes for it.
+typedef struct {
+  bool in_use;
+  bool closing;
+  bool released; // httpd closed the session, the fd is the sender's to close
+  httpd_handle_t server;
+  int fd;
+  TaskHandle_t task; // NULL until the sender runs and after it exits
+  stream_frame_t *pending; // newest frame not yet picked up by the sender
+} stream_client_t;
+
+typedef struct {
+  size_t size;  // number of values used for filtering
+  size_t index; // current value index
+  size_t count; // value count
+  int sum;
+  int *values; // array to be filled with values
+} ra_filter_t;
+
+static stream_client_t clients[STREAM_MAX_CLIENTS];
+static SemaphoreHandle_t clients_lock = NULL;
+static TaskHandle_t producer_task = NULL;
+static bool producer_stop = false;
+static stream_frame_t *latest_frame = NULL; // last-good-frame cache
+static uint32_t frame_seq = 0;
+static int raw_frames = 0; // raw frames not yet returned to the driver
+
+static ra_filter_t ra_filter;      // frame-to-frame interval (ms)
+static ra_filter_t ra_send_filter; // time spent sending one frame (ms)
+static stream_stats_t stats;
+
+static ra_filter_t *ra_filter_init(ra_filter_t *filter, size_t sample_size) {
+  memset(filter, 0, sizeof(ra_filter_t));
+
+  filter->values = (int *)malloc(sample_size * sizeof(int));
+  if (!filter->values) {
+    return NULL;
+  }
+  memset(filter->values, 0, sample_size * sizeof(int));
+
+  filter->size = sample_size;
+  return filter;
+}
+
+static int ra_filter_run(ra_filter_t *filter, int value) {
+  if (!filter->values) {
+    return value;
+  }
+  filter->sum -= filter->values[filter->index];
+  filter->values[filter->index] = value;
+  filter->sum += filter->values[filter->index];
+  filter->index++;
+  filter->index = filter->index % filter->size;
+  if (filter->count < filter->size) {
+    filter->count++;
+  }
+  return filter->sum / filter->count;
+}
+
+void stream_frame_retain(stream_frame_t *frame) {
+  __atomic_add_fetch(&frame->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+void stream_frame_release(stream_frame_t *frame) {
+  if (frame && __atomic_sub_fetch(&frame->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+    if (frame->fb) {
+      esp_camera_fb_return(frame->fb);
+      __atomic_sub_fetch(&raw_frames, 1, __ATOMIC_SEQ_CST);
+    }
+    free(frame->buf);
+    free(frame);
+  }
+}
+
+static void *frame_malloc(size_t len) {
+  void *p = heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  return p ? p : malloc(len);
+}
+
+// Grabs one frame and turns it into a shared frame. A JPEG is copied and the
+// driver buffer returned right away, so the sensor can move on while clients
+// are sending. A raw frame is not encoded here: each consumer encodes it
+// straight into its socket, and the driver gets the buffer back afterwards.
+static stream_frame_t *capture_frame() {
+  camera_fb_t *fb = esp_camera_fb_get();
+  if (!fb) {
+    log_e("Camera capture failed");
+    return NULL;
+  }
+
+  stream_frame_t *frame = (stream_frame_t *)calloc(1, sizeof(stream_frame_t));
+  if (!frame) {
+    esp_camera_fb_return(fb);
+    return NULL;
+  }
+  frame->timestamp = fb->timestamp;
+  frame->captured_us = esp_timer_get_time();
+  frame->refs = 1;
+
+  if (fb->format != PIXFORMAT_JPEG) {
+    frame->fb = fb;
+    __atomic_add_fetch(&raw_frames, 1, __ATOMIC_SEQ_CST);
+    frame->part_len = snprintf(frame->part, sizeof(frame->part),
+                               _STREAM_PART_RAW, frame->timestamp.tv_sec,
+                               frame->timestamp.tv_usec);
+    return frame;
+  }
+
+  frame->buf = (uint8_t *)frame_malloc(fb->len);
+  if (frame->buf) {
+    memcpy(frame->buf, fb->buf, fb->len);
+    frame->len = fb->len;
+  }
+  esp_camera_fb_return(fb);
+
+  if (!frame->buf) {
+    free(frame);
+    return NULL;
+  }
+  frame->part_len = snprintf(frame->part, sizeof(frame->part), _STREAM_PART,
+                             frame->len, frame->timestamp.tv_sec,
+                             frame->timestamp.tv_usec);
+  return frame;
+}
+
+// Called with clients_lock held. Numbers the frame and makes it the cached one.
+static void publish_latest(stream_frame_t *frame) {
+  frame->seq = ++frame_seq;
+  stream_frame_retain(frame);
+  stream_frame_release(latest_frame);
+  latest_frame = frame;
+}
+
+// Called with clients_lock held. Decides whether the producer should exit and,
+// if so, clears producer_task under the same lock so a client added right
+// afterwards starts a new producer instead of relying on this one.
+static bool producer_should_exit() {
+  bool active = false;
+  for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    if (clients[i].in_use && !clients[i].closing && clients[i].task) {
+      active = true;
+    }
+  }
+  if (producer_stop || !active) {
+    producer_task = NULL;
+    return true;
+  }
+  return false;
+}
+
+static void producer_loop(void *arg) {
+  // Viewers only aim the camera: stream the smaller, more compressed profile
+  camera_profile_apply(CAMERA_PROFILE_PREVIEW);
+  int64_t last_frame = esp_timer_get_time();
+
+  while (true) {
+    stream_frame_t *frame = capture_frame();
+
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+    if (producer_should_exit()) {
+      xSemaphoreGive(clients_lock);
+      stream_frame_release(frame);
+      break;
+    }
+    if (!frame) {
+      xSemaphoreGive(clients_lock);
+      vTaskDelay(pdMS_TO_TICKS(10));
+      continue;
+    }
+
+    publish_latest(frame);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+      stream_client_t *c = &clients[i];
+      if (!c->in_use || c->closing || !c->task) {
+        continue;
+      }
+      if (c->pending) {
+        // The sender is still busy with an older frame: replace, don't queue
+        stream_frame_release(c->pending);
+        stats.dropped++;
+      }
+      stream_frame_retain(frame);
+      c->pending = frame;
+      xTaskNotifyGive(c->task);
+    }
+    stats.frames++;
+    int64_t fr_end = esp_timer_get_time();
+    stats.avg_frame_ms =
+        ra_filter_run(&ra_filter, (int)((fr_end - last_frame) / 1000));
+    last_frame = fr_end;
+    xSemaphoreGive(clients_lock);
+
+    stream_frame_release(frame);
+  }
+
+  log_i("Stream producer stopped");
+  vTaskDelete(NULL);
+}
+
+static bool send_all(stream_client_t *c, const char *buf, size_t len) {
+  while (len > 0) {
+    int sent = httpd_socket_send(c->server, c->fd, buf, len, 0);
+    if (sent <= 0) {
+      return false;
+    }
+    buf += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+typedef struct {
+  stream_client_t *client;
+  uint32_t calls;
+  size_t len;
+} encode_sink_t;
+
+static size_t encode_to_socket(void *arg, size_t index, const void *data,
+                               size_t len) {
+  encode_sink_t *sink = (encode_sink_t *)arg;
+  sink->calls++;
+  if (!send_all(sink->client, (const char *)data, len)) {
+    return 0;
+  }
+  sink->len += len;
+  return len;
+}
+
+// Sends the part header of a raw frame, then encodes the frame into the
+// socket piece by piece. Returns the number of encoder output pieces sent,
+// 0 on error; *sent is the number of bytes.
+static uint32_t send_raw_frame(stream_client_t *c, stream_frame_t *frame,
+                               size_t *sent) {
+  encode_sink_t sink = {c, 1, frame->part_len};
+  if (!send_all(c, frame->part, frame->part_len) ||
+      !frame2jpg_cb(frame->fb, SOFT_JPEG_QUALITY, encode_to_socket, &sink)) {
+    return 0;
+  }
+  *sent = sink.len;
+  return sink.calls;
+}
+
+// Sends the part header and the JPEG straight from the shared frame buffer
+// with one writev(), so a frame costs a single socket call (more only if the
+// send buffer fills up) and the header never goes out in a segment of its own.
+// Returns the number of socket calls, 0 on error; *sent is the number of bytes.
+static uint32_t send_frame(stream_client_t *c, stream_frame_t *frame,
+                           size_t *sent) {
+  if (frame->fb) {
+    return send_raw_frame(c, frame, sent);
+  }
+  *sent = frame->part_len + frame->len;
+  struct iovec iov[2] = {{frame->part, frame->part_len},
+                         {frame->buf, frame->len}};
+  struct iovec *next = iov;
+  int left = 2;
+  uint32_t calls = 0;
+  while (left > 0) {
+    ssize_t n = writev(c->fd, next, left);
+    calls++;
+    if (n <= 0) {
+      return 0;
+    }
+    // Skip what went out; a partial write leaves the rest for the next call
+    while (left > 0 && (size_t)n >= next->iov_len) {
+      n -= next->iov_len;
+      next++;
+      left--;
+    }
+    if (left > 0) {
+      next->iov_base = (char *)next->iov_base + n;
+      next->iov_len -= n;
+    }
+  }
+  return calls;
+}
+
+static void sender_loop(void *arg) {
+  stream_client_t *c = (stream_client_t *)arg;
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SENDER_IDLE_TIMEOUT_MS));
+
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+    stream_frame_t *frame = c->pending;
+    c->pending = NULL;
+    bool closing = c->closing;
+    xSemaphoreGive(clients_lock);
+
+    if (closing) {
+      stream_frame_release(frame);
+      break;
+    }
+    if (!frame) {
+      continue;
+    }
+
+    int64_t send_start = esp_timer_get_time();
+    size_t sent = 0;
+    uint32_t calls = send_frame(c, frame, &sent);
+    int64_t send_end = esp_timer_get_time();
+    stream_frame_release(frame);
+    if (!calls) {
+      log_i("Stream client on socket %d disconnected", c->fd);
+      break;
+    }
+
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+    stats.avg_send_ms =
+        ra_filter_run(&ra_send_filter, (int)((send_end - send_start) / 1000));
+    stats.frames_sent++;
+    stats.send_calls += calls;
+    stats.bytes_sent += sent;
+    stats.send_us += send_end - send_start;
+    xSemaphoreGive(clients_lock);
+  }
+
+  xSemaphoreTake(clients_lock, portMAX_DELAY);
+  stream_frame_release(c->pending);
+  c->pending = NULL;
+  c->task = NULL;
+  c->closing = true;
+  if (c->released) {
+    close(c->fd);
+    c->in_use = false;
+  } else {
+    // httpd still has the session: have it closed, which ends in close_fn
+    // freeing the slot. Queued under the lock, so the fd cannot have been
+    // closed and reused in between.
+    httpd_sess_trigger_close(c->server, c->fd);
+  }
+  stats.clients--;
+  xSemaphoreGive(clients_lock);
+  vTaskDelete(NULL);
+}
+
+// Called with clients_lock held
+static bool start_producer() {
+  producer_stop = false;
+  if (producer_task) {
+    return true; // already running, it picks up the new client on its next frame
+  }
+  if (xTaskCreatePinnedToCore(producer_loop, "stream_prod", 4096, NULL, 5,
+                              &producer_task,
+                              STREAM_SEND_CORE ? 0 : 1) != pdPASS) {
+    producer_task = NULL;
+    return false;
+  }
+  return true;
+}
+
+void stream_broadcaster_init() {
+  if (clients_lock) {
+    return;
+  }
+  clients_lock = xSemaphoreCreateMutex();
+  ra_filter_init(&ra_filter, RA_FILTER_SAMPLES);
+  ra_filter_init(&ra_send_filter, RA_FILTER_SAMPLES);
+}
+
+esp_err_t stream_broadcaster_add_client(httpd_req_t *req) {
+  xSemaphoreTake(clients_lock, portMAX_DELAY);
+  stream_client_t *c = NULL;
+  for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    if (!clients[i].in_use) {
+      c = &clients[i];
+      break;
+    }
+  }
+  if (!c) {
+    xSemaphoreGive(clients_lock);
+    return ESP_ERR_NO_MEM;
+  }
+
+  // Reserve the slot; the producer skips it until its sender runs
+  memset(c, 0, sizeof(*c));
+  c->server = req->handle;
+  c->fd = httpd_req_to_sockfd(req);
+  c->in_use = true;
+  xSemaphoreGive(clients_lock);
+
+  // Outside the lock, so a slow client cannot hold up the producer and the
+  // other senders. close_fn runs on this same httpd task and cannot free the
+  // slot meanwhile.
+  bool sent = send_all(c, _STREAM_RESPONSE, strlen(_STREAM_RESPONSE));
+
+  xSemaphoreTake(clients_lock, portMAX_DELAY);
+  if (!sent || c->closing) { // lost the client, or stream_broadcaster_stop()
+    c->in_use = false;
+    xSemaphoreGive(clients_lock);
+    return ESP_FAIL;
+  }
+  if (xTaskCreatePinnedToCore(sender_loop, "stream_send",
+                              4096 + JPEG_ENCODE_STACK_EXTRA, c, 5, &c->task,
+                              STREAM_SEND_CORE) != pdPASS) {
+    c->task = NULL;
+    c->in_use = false;
+    xSemaphoreGive(clients_lock);
+    return ESP_ERR_NO_MEM;
+  }
+  stats.clients++;
+  bool producing = start_producer();
+  xSemaphoreGive(clients_lock);
+
+  log_i("Stream client on socket %d added (%u/%d)", c->fd,
+        (unsigned)stats.clients, STREAM_MAX_CLIENTS);
+  return producing ? ESP_OK : ESP_FAIL;
+}
+
+void stream_broadcaster_close_fn(httpd_handle_t hd, int sockfd) {
+  xSemaphoreTake(clients_lock, portMAX_DELAY);
+  for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    stream_client_t *c = &clients[i];
+    if (!c->in_use || c->server != hd || c->fd != sockfd) {
+      continue;
+    }
+    if (c->task) {
+      // The sender may be in the middle of a write: wake it up and let it
+      // close the fd once it is done with it
+      c->closing = true;
+      c->released = true;
+      shutdown(sockfd, SHUT_RDWR);
+      xTaskNotifyGive(c->task);
+      xSemaphoreGive(clients_lock);
+      return;
+    }
+    c->in_use = false; // the sender has already exited
+    break;
+  }
+  xSemaphoreGive(clients_lock);
+  close(sockfd);
+}
+
+void stream_broadcaster_stop() {
+  if (!clients_lock) {
+    return;
+  }
+
+  xSemaphoreTake(clients_lock, portMAX_DELAY);
+  for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    if (clients[i].in_use) {
+      clients[i].closing = true;
+      if (clients[i].task) {
+        xTaskNotifyGive(clients[i].task);
+      }
+    }
+  }
+  producer_stop = true;
+  xSemaphoreGive(clients_lock);
+
+  // Wait for the producer to return its last frame buffer to the driver and for
+  // the senders to let go of the server; a stalled send can take a few seconds.
+  // Raw frames also go back to the driver once a pending /capture.jpg save
+  // has encoded them.
+  for (int i = 0; i < 400; i++) {
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+    bool idle = producer_task == NULL && stats.clients == 0;
+    if (idle) {
+      // Nobody is left to ask for the cached frame
+      stream_frame_release(latest_frame);
+      latest_frame = NULL;
+    }
+    xSemaphoreGive(clients_lock);
+    if (idle && __atomic_load_n(&raw_frames, __ATOMIC_SEQ_CST) == 0) {
+      return;
+    }
+    vTaskDelay(pdMS_TO_TICKS(20));
+  }
+  log_e("Stream broadcaster did not stop in time");
+}
+
+void stream_broadcaster_get_stats(stream_stats_t *out) {
+  if (!clients_lock) {
+    memset(out, 0, sizeof(*out));
+    return;
+  }
+  xSemaphoreTake(clients_lock, portMAX_DELAY);
+  *out = stats;
+  xSemaphoreGive(clients_lock);
+}
+
+stream_frame_t *stream_broadcaster_cached_frame(uint32_t max_age_ms) {
+  stream_frame_t *frame = NULL;
+  xSemaphoreTake(clients_lock, portMAX_DELAY);
+  if (latest_frame && esp_timer_get_time() - latest_frame->captured_us <=
+                          (int64_t)max_age_ms * 1000) {
+    frame = latest_frame;
+    stream_frame_retain(frame);
+  }
+  xSemaphoreGive(clients_lock);
+  return frame;
+}
+
+stream_frame_t *stream_broadcaster_fresh_frame(uint32_t timeout_ms) {
+  xSemaphoreTake(clients_lock, portMAX_DELAY);
+  bool producing = producer_task != NULL;
+  uint32_t after_seq = frame_seq;
+  xSemaphoreGive(clients_lock);
+
+  if (!producing) {
+    // No stream owns the sensor, so a still gets the full archival profile
+    camera_profile_apply(CAMERA_PROFILE_ARCHIVAL);
+    stream_frame_t *frame = capture_frame();
+    if (frame) {
+      xSemaphoreTake(clients_lock, portMAX_DELAY);
+      publish_latest(frame);
+      xSemaphoreGive(clients_lock);
+    }
+    return frame;
+  }
+
+  // A stream owns the sensor: wait for its next frame instead of competing
+  int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+  while (esp_timer_get_time() < deadline) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+    xSemaphoreTake(clients_lock, portMAX_DELAY);
+    stream_frame_t *frame = NULL;
+    if (latest_frame && latest_frame->seq != after_seq) {
+      frame = latest_frame;
+      stream_frame_retain(frame);
+    }
+    xSemaphoreGive(clients_lock);
+    if (frame) {
+      return frame;
+    }
+  }
+  return NULL;
+}
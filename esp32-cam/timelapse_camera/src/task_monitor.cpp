@@ -0,0 +1,138 @@
+#include "task_monitor.h"
+
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include <stdio.h>
+
+typedef struct {
+  TaskHandle_t task;
+  task_monitor_entry_t entry;
+  int64_t registered_us;
+  int64_t exited_us;
+} monitored_task_t;
+
+static monitored_task_t tasks[TASK_MONITOR_MAX_TASKS];
+static size_t task_count = 0;
+static portMUX_TYPE tasks_mux = portMUX_INITIALIZER_UNLOCKED;
+// Held across the high-water mark reads of other tasks and by a task on its
+// way out, so a handle that is still set belongs to a task not yet deleted
+static SemaphoreHandle_t exit_lock = NULL;
+
+void task_monitor_register(TaskHandle_t task, const char *name,
+                           uint32_t stack_size) {
+  if (!task) {
+    return;
+  }
+  if (!exit_lock) {
+    exit_lock = xSemaphoreCreateMutex();
+  }
+  portENTER_CRITICAL(&tasks_mux);
+  if (task_count < TASK_MONITOR_MAX_TASKS) {
+    monitored_task_t *t = &tasks[task_count++];
+    t->task = task;
+    t->entry = {};
+    t->entry.name = name;
+    t->entry.stack_size = stack_size;
+    t->entry.stack_free_min = stack_size;
+    t->entry.running = true;
+    t->registered_us = esp_timer_get_time();
+    t->exited_us = 0;
+  }
+  portEXIT_CRITICAL(&tasks_mux);
+}
+
+// Called with tasks_mux held
+static monitored_task_t *find(TaskHandle_t task) {
+  for (size_t i = 0; i < task_count; i++) {
+    if (tasks[i].task == task && tasks[i].entry.running) {
+      return &tasks[i];
+    }
+  }
+  return NULL;
+}
+
+int64_t task_monitor_begin() { return esp_timer_get_time(); }
+
+void task_monitor_end(int64_t start_us) {
+  int64_t busy = esp_timer_get_time() - start_us;
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  portENTER_CRITICAL(&tasks_mux);
+  monitored_task_t *t = find(self);
+  if (t) {
+    t->entry.busy_us += busy;
+  }
+  portEXIT_CRITICAL(&tasks_mux);
+}
+
+void task_monitor_exit() {
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  // ESP-IDF reports the high-water mark in bytes
+  uint32_t free_min = uxTaskGetStackHighWaterMark(NULL);
+  xSemaphoreTake(exit_lock, portMAX_DELAY);
+  portENTER_CRITICAL(&tasks_mux);
+  monitored_task_t *t = find(self);
+  if (t) {
+    t->entry.stack_free_min = free_min;
+    t->entry.running = false;
+    t->exited_us = esp_timer_get_time();
+    t->task = NULL;
+  }
+  portEXIT_CRITICAL(&tasks_mux);
+  xSemaphoreGive(exit_lock);
+}
+
+size_t task_monitor_snapshot(task_monitor_entry_t *out, size_t max) {
+  if (!exit_lock) {
+    return 0; // nothing registered yet
+  }
+  // High-water marks are read outside the critical section but under
+  // exit_lock, which keeps the tasks whose handles are set from exiting
+  TaskHandle_t handles[TASK_MONITOR_MAX_TASKS];
+  xSemaphoreTake(exit_lock, portMAX_DELAY);
+  portENTER_CRITICAL(&tasks_mux);
+  size_t n = task_count < max ? task_count : max;
+  for (size_t i = 0; i < n; i++) {
+    handles[i] = tasks[i].task;
+  }
+  portEXIT_CRITICAL(&tasks_mux);
+
+  uint32_t free_min[TASK_MONITOR_MAX_TASKS];
+  for (size_t i = 0; i < n; i++) {
+    free_min[i] = handles[i] ? uxTaskGetStackHighWaterMark(handles[i]) : 0;
+  }
+
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&tasks_mux);
+  for (size_t i = 0; i < n; i++) {
+    monitored_task_t *t = &tasks[i];
+    if (t->task && t->task == handles[i]) {
+      t->entry.stack_free_min = free_min[i];
+    }
+    int64_t end = t->entry.running ? now : t->exited_us;
+    int64_t alive = end - t->registered_us;
+    t->entry.busy_permille = alive > 0 ? t->entry.busy_us * 1000 / alive : 0;
+    out[i] = t->entry;
+  }
+  portEXIT_CRITICAL(&tasks_mux);
+  xSemaphoreGive(exit_lock);
+  return n;
+}
+
+void task_monitor_format(char *buf, size_t len) {
+  task_monitor_entry_t entries[TASK_MONITOR_MAX_TASKS];
+  size_t n = task_monitor_snapshot(entries, TASK_MONITOR_MAX_TASKS);
+  size_t used = 0;
+  buf[0] = '\0';
+  for (size_t i = 0; i < n && used < len; i++) {
+    const task_monitor_entry_t *e = &entries[i];
+    int w = snprintf(buf + used, len - used, "%s%s %u/%u B free, busy %u.%u%%%s",
+                     i ? "; " : "", e->name, (unsigned)e->stack_free_min,
+                     (unsigned)e->stack_size, (unsigned)(e->busy_permille / 10),
+                     (unsigned)(e->busy_permille % 10),
+                     e->running ? "" : " (exited)");
+    if (w < 0) {
+      break;
+    }
+    used += w;
+  }
+}
@@ -0,0 +1,222 @@
+#include "timelapse_index.h"
+
+#include "FS.h"
+#include "SD_MMC.h"
+#include "jpeg_stream.h"
+#include "sd_writer.h"
+#include "stage_timer.h"
+#include "timelapse_segment.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Day directory most recently created, e.g. "/2024/05/01"
+static char last_day_dir[16] = "";
+
+// Records known to be in the index file; -1 until it was first opened.
+// Only the writer task appends, so it is the only user of this.
+static int32_t index_records = -1;
+
+void timelapse_file_path(uint32_t epoch, char *path, size_t len) {
+  time_t t = epoch;
+  struct tm timeinfo;
+  localtime_r(&t, &timeinfo);
+  strftime(path, len, "/%Y/%m/%d/%H-%M-%S.jpg", &timeinfo);
+}
+
+void timelapse_index_record_path(const timelapse_index_record_t *record,
+                                 char *path, size_t len) {
+  if (record->flags & TIMELAPSE_INDEX_IN_SEGMENT) {
+    timelapse_segment_path(record->epoch, path, len);
+  } else {
+    timelapse_file_path(record->epoch, path, len);
+  }
+}
+
+// Creates /YYYY, /YYYY/MM and /YYYY/MM/DD for path unless they were created
+// for the previous frame already
+static void ensure_day_dir(const char *path) {
+  const char *day_end = path;
+  for (int slashes = 0; *day_end && slashes < 4; day_end++) {
+    if (*day_end == '/' && ++slashes == 4) {
+      break;
+    }
+  }
+  size_t dir_len = day_end - path;
+  if (dir_len >= sizeof(last_day_dir)) {
+    return;
+  }
+  if (strncmp(last_day_dir, path, dir_len) == 0 &&
+      last_day_dir[dir_len] == '\0') {
+    return;
+  }
+
+  char dir[sizeof(last_day_dir)];
+  for (size_t i = 1; i <= dir_len; i++) {
+    if (i == dir_len || path[i] == '/') {
+      memcpy(dir, path, i);
+      dir[i] = '\0';
+      SD_MMC.mkdir(dir); // fails harmlessly if it exists
+    }
+  }
+  memcpy(last_day_dir, path, dir_len);
+  last_day_dir[dir_len] = '\0';
+}
+
+bool timelapse_file_write(const sd_job_t *job) {
+  ensure_day_dir(job->path);
+  int64_t start = stage_timer_start();
+  int fd = sd_writer_open_fd(job->path, false);
+  if (fd < 0) {
+    last_day_dir[0] = '\0'; // the directory may be gone, recreate it next time
+    return false;
+  }
+  stage_timer_record(STAGE_SD_OPEN, start);
+  start = stage_timer_start();
+  bool ok = sd_writer_write_fd(fd, job->buf, job->len);
+  stage_timer_record(STAGE_SD_WRITE, start);
+  start = stage_timer_start();
+  bool closed = close(fd) == 0;
+  stage_timer_record(STAGE_SD_CLOSE, start);
+  if (!closed || !ok) {
+    return false;
+  }
+  if (!timelapse_index_append(job->epoch, 0, job->len, 0)) {
+    Serial.printf("Index: Failed to index %s\n", job->path);
+  }
+  return true;
+}
+
+bool timelapse_file_encode(const sd_job_t *job) {
+  ensure_day_dir(job->path);
+  int64_t start = stage_timer_start();
+  int fd = sd_writer_open_fd(job->path, false);
+  if (fd < 0) {
+    last_day_dir[0] = '\0';
+    return false;
+  }
+  stage_timer_record(STAGE_SD_OPEN, start);
+  size_t len = 0;
+  start = stage_timer_start();
+  bool ok = jpeg_stream_to_fd((camera_fb_t *)job->ctx, fd, &len, NULL);
+  stage_timer_record(STAGE_JPEG_ENCODE, start);
+  start = stage_timer_start();
+  bool closed = close(fd) == 0;
+  stage_timer_record(STAGE_SD_CLOSE, start);
+  if (!closed || !ok) {
+    return false;
+  }
+  if (!timelapse_index_append(job->epoch, 0, len, 0)) {
+    Serial.printf("Index: Failed to index %s\n", job->path);
+  }
+  return true;
+}
+
+bool timelapse_index_append(uint32_t epoch, uint32_t offset, uint32_t size,
+                            uint32_t flags) {
+  if (!SD_MMC.exists(TIMELAPSE_INDEX_PATH)) {
+    File created = SD_MMC.open(TIMELAPSE_INDEX_PATH, FILE_WRITE);
+    if (!created) {
+      return false;
+    }
+    created.close();
+    index_records = 0;
+  }
+
+  // "r+" instead of append: a record torn by a reset is overwritten rather
+  // than shifting every later record
+  File file = SD_MMC.open(TIMELAPSE_INDEX_PATH, "r+");
+  if (!file) {
+    return false;
+  }
+  if (index_records < 0) {
+    index_records = file.size() / sizeof(timelapse_index_record_t);
+  }
+
+  timelapse_index_record_t record = {epoch, offset, size, flags};
+  bool ok = file.seek(index_records * sizeof(record)) &&
+            file.write((const uint8_t *)&record, sizeof(record)) ==
+                sizeof(record);
+  file.close();
+  if (ok) {
+    index_records++;
+  }
+  return ok;
+}
+
+static uint32_t records_in(File &file) {
+  return file.size() / sizeof(timelapse_index_record_t);
+}
+
+static bool read_record(File &file, uint32_t at,
+                        timelapse_index_record_t *record) {
+  return file.seek(at * sizeof(*record)) &&
+         file.read((uint8_t *)record, sizeof(*record)) == sizeof(*record);
+}
+
+uint32_t timelapse_index_count() {
+  File file = SD_MMC.open(TIMELAPSE_INDEX_PATH, FILE_READ);
+  if (!file) {
+    return 0;
+  }
+  uint32_t count = records_in(file);
+  file.close();
+  return count;
+}
+
+size_t timelapse_index_recent(timelapse_index_record_t *out, size_t max) {
+  File file = SD_MMC.open(TIMELAPSE_INDEX_PATH, FILE_READ);
+  if (!file) {
+    return 0;
+  }
+  uint32_t count = records_in(file);
+  size_t n = count < max ? count : max;
+
+  // One read for the whole tail, then reverse it to newest first
+  size_t got = 0;
+  if (n > 0 && file.seek((count - n) * sizeof(*out))) {
+    got = file.read((uint8_t *)out, n * sizeof(*out)) / sizeof(*out);
+  }
+  file.close();
+  for (size_t i = 0; i < got / 2; i++) {
+    timelapse_index_record_t tmp = out[i];
+    out[i] = out[got - 1 - i];
+    out[got - 1 - i] = tmp;
+  }
+  return got;
+}
+
+size_t timelapse_index_range(uint32_t from, uint32_t to,
+                             timelapse_index_record_t *out, size_t max) {
+  File file = SD_MMC.open(TIMELAPSE_INDEX_PATH, FILE_READ);
+  if (!file) {
+    return 0;
+  }
+
+  // Binary search for the first record with epoch >= from
+  uint32_t lo = 0, hi = records_in(file);
+  uint32_t count = hi;
+  timelapse_index_record_t record;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (!read_record(file, mid, &record)) {
+      file.close();
+      return 0;
+    }
+    if (record.epoch < from) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  size_t n = 0;
+  for (uint32_t at = lo; at < count && n < max; at++) {
+    if (!read_record(file, at, &record) || record.epoch > to) {
+      break;
+    }
+    out[n++] = record;
+  }
+  file.close();
+  return n;
+}
@@ -0,0 +1,224 @@
+#include "timelapse_segment.h"
+
+#include "FS.h"
+#include "SD_MMC.h"
+#include "esp_heap_caps.h"
+#include "jpeg_stream.h"
+#include "sd_writer.h"
+#include "stage_timer.h"
+#include "timelapse_index.h"
+#include "timelapse_segment_format.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int seg_fd = -1;
+static uint32_t seg_size = 0; // bytes in the open segment
+static char seg_path[SD_JOB_PATH_MAX];
+static segment_index_entry_t *seg_index = NULL;
+static uint32_t seg_index_count = 0;
+static bool seg_dir_ready = false;
+
+void timelapse_segment_path(uint32_t epoch, char *path, size_t len) {
+  time_t t = epoch;
+  struct tm timeinfo;
+  localtime_r(&t, &timeinfo);
+#if TIMELAPSE_SEGMENT_ROLL == SEGMENT_ROLL_DAILY
+  strftime(path, len, TIMELAPSE_SEGMENT_DIR "/%Y-%m-%d" SEGMENT_FILE_EXT,
+           &timeinfo);
+#else
+  strftime(path, len, TIMELAPSE_SEGMENT_DIR "/%Y-%m-%d_%H" SEGMENT_FILE_EXT,
+           &timeinfo);
+#endif
+}
+
+static bool write_all(const void *buf, size_t len) {
+  if (!sd_writer_write_fd(seg_fd, (const uint8_t *)buf, len)) {
+    return false;
+  }
+  seg_size += len;
+  return true;
+}
+
+// Appends an index chunk for the frames written since the last one
+static bool write_index() {
+  if (seg_index_count == 0) {
+    return true;
+  }
+  size_t entries_len = seg_index_count * sizeof(segment_index_entry_t);
+
+  segment_index_tail_t tail;
+  tail.count = seg_index_count;
+  tail.chunk_offset = seg_size;
+  tail.magic = SEGMENT_INDEX_TAIL;
+
+  segment_chunk_t header;
+  header.magic = SEGMENT_CHUNK_INDEX;
+  header.epoch = (uint32_t)time(NULL);
+  header.len = entries_len + sizeof(tail);
+  header.crc = segment_crc32(0, (const uint8_t *)seg_index, entries_len);
+  header.crc = segment_crc32(header.crc, (const uint8_t *)&tail, sizeof(tail));
+
+  seg_index_count = 0;
+  bool ok = write_all(&header, sizeof(header)) &&
+            write_all(seg_index, entries_len) && write_all(&tail, sizeof(tail));
+  fsync(seg_fd);
+  return ok;
+}
+
+static void close_segment() {
+  if (!write_index()) {
+    Serial.printf("Segment: Failed to write index of %s\n", seg_path);
+  }
+  close(seg_fd);
+  seg_fd = -1;
+  seg_path[0] = '\0';
+}
+
+static bool open_segment(const char *path) {
+  if (!seg_dir_ready) {
+    SD_MMC.mkdir(TIMELAPSE_SEGMENT_DIR); // fails harmlessly if it exists
+    seg_dir_ready = true;
+  }
+  if (!seg_index) {
+    size_t size = TIMELAPSE_SEGMENT_MAX_INDEX * sizeof(segment_index_entry_t);
+    seg_index = (segment_index_entry_t *)heap_caps_malloc(
+        size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!seg_index) {
+      seg_index = (segment_index_entry_t *)malloc(size);
+    }
+    if (!seg_index) {
+      Serial.println("Segment: No memory for the index, writing frames only");
+    }
+  }
+
+  int64_t start = stage_timer_start();
+  seg_fd = sd_writer_open_fd(path, true);
+  if (seg_fd < 0) {
+    return false;
+  }
+  stage_timer_record(STAGE_SD_OPEN, start);
+  off_t size = lseek(seg_fd, 0, SEEK_END);
+  seg_size = size > 0 ? size : 0;
+  strlcpy(seg_path, path, sizeof(seg_path));
+  seg_index_count = 0;
+  Serial.printf("Segment: Appending to %s (%u bytes)\n", seg_path,
+                (unsigned)seg_size);
+  return true;
+}
+
+// Makes sure job->path is the open segment and its index has room
+static bool begin_frame(const sd_job_t *job) {
+  if (seg_fd >= 0 && strcmp(seg_path, job->path) != 0) {
+    close_segment(); // the hour (or day) rolled over
+  }
+  if (seg_fd < 0 && !open_segment(job->path)) {
+    return false;
+  }
+  if (seg_index_count == TIMELAPSE_SEGMENT_MAX_INDEX && !write_index()) {
+    close_segment();
+    return false;
+  }
+  return true;
+}
+
+// Gives up on a frame chunk that could not be written completely
+static void abandon_frame() {
+  // Readers skip the torn chunk by its CRC; start over with a fresh handle
+  Serial.printf("Segment: Short write to %s\n", seg_path);
+  close(seg_fd);
+  seg_fd = -1;
+  seg_path[0] = '\0';
+}
+
+static void end_frame(const sd_job_t *job, uint32_t offset, uint32_t len) {
+  // Commit the new file size to the directory entry, so a reset or power
+  // loss keeps every frame written so far
+  int64_t start = stage_timer_start();
+  fsync(seg_fd);
+  stage_timer_record(STAGE_SD_CLOSE, start);
+
+  if (seg_index) {
+    segment_index_entry_t *entry = &seg_index[seg_index_count++];
+    entry->epoch = job->epoch;
+    entry->offset = offset;
+    entry->len = len;
+  }
+  if (!timelapse_index_append(job->epoch, offset, len,
+                              TIMELAPSE_INDEX_IN_SEGMENT)) {
+    Serial.printf("Segment: Failed to index frame in %s\n", seg_path);
+  }
+}
+
+bool timelapse_segment_append(const sd_job_t *job) {
+  if (!begin_frame(job)) {
+    return false;
+  }
+
+  segment_chunk_t header;
+  header.magic = SEGMENT_CHUNK_FRAME;
+  header.epoch = job->epoch;
+  header.len = job->len;
+  header.crc = segment_crc32(0, job->buf, job->len);
+
+  uint32_t offset = seg_size;
+  int64_t start = stage_timer_start();
+  if (!write_all(&header, sizeof(header)) || !write_all(job->buf, job->len)) {
+    abandon_frame();
+    return false;
+  }
+  stage_timer_record(STAGE_SD_WRITE, start);
+  end_frame(job, offset, job->len);
+  return true;
+}
+
+bool timelapse_segment_encode(const sd_job_t *job) {
+  if (!begin_frame(job)) {
+    return false;
+  }
+
+  // Length and CRC are only known once the encoder is done: reserve the
+  // header with a magic readers do not accept and fill it in afterwards
+  segment_chunk_t header = {};
+  header.epoch = job->epoch;
+  uint32_t offset = seg_size;
+  if (!write_all(&header, sizeof(header))) {
+    abandon_frame();
+    return false;
+  }
+  size_t len = 0;
+  int64_t start = stage_timer_start();
+  bool ok = jpeg_stream_to_fd((camera_fb_t *)job->ctx, seg_fd, &len,
+                              &header.crc);
+  stage_timer_record(STAGE_JPEG_ENCODE, start);
+  seg_size += len;
+  header.magic = SEGMENT_CHUNK_FRAME;
+  header.len = len;
+  // The FAT VFS's pwrite() writes at offset even though the segment was
+  // opened O_APPEND, and puts the file position back at the end
+  if (!ok || pwrite(seg_fd, &header, sizeof(header), offset) !=
+                 (ssize_t)sizeof(header)) {
+    abandon_frame();
+    return false;
+  }
+  end_frame(job, offset, len);
+  return true;
+}
+
+void timelapse_segment_close_now() {
+  if (seg_fd >= 0) {
+    close_segment();
+  }
+}
+
+static bool close_step(const sd_job_t *job) {
+  timelapse_segment_close_now();
+  return true;
+}
+
+bool timelapse_segment_close(uint32_t timeout_ms) {
+  sd_job_t job = {};
+  strlcpy(job.path, TIMELAPSE_SEGMENT_DIR, sizeof(job.path));
+  job.write = close_step;
+  return sd_writer_submit(&job, timeout_ms);
+}
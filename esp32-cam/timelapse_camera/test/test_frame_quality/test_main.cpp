@@ -0,0 +1,74 @@
+// Host tests of the best-of-burst frame score. Run with: pio test -e native
+#include <string.h>
+#include <unity.h>
+
+#include "frame_quality.h"
+
+// A thumbnail of 8x6 blocks, as jpeg_dc_decode() gives for a small frame
+#define THUMB_W 8
+#define THUMB_H 6
+#define BLOCKS (THUMB_W * THUMB_H)
+
+static uint8_t thumb[BLOCKS];
+
+void setUp(void) { memset(thumb, 128, sizeof(thumb)); }
+
+void tearDown(void) {}
+
+static frame_quality_t measure(uint32_t ac_nonzero) {
+  frame_quality_t q;
+  frame_quality_measure(thumb, THUMB_W, THUMB_H, ac_nonzero, &q);
+  return q;
+}
+
+static void test_detail_is_per_100_blocks(void) {
+  frame_quality_t q = measure(BLOCKS * 12);
+  TEST_ASSERT_EQUAL_UINT32(1200, q.detail);
+  TEST_ASSERT_EQUAL_UINT16(0, q.clipped);
+  TEST_ASSERT_EQUAL_UINT32(1200, q.score);
+}
+
+static void test_sharp_frame_beats_blurred_one(void) {
+  // Blur zeroes out most of the AC coefficients at the same exposure
+  frame_quality_t sharp = measure(BLOCKS * 12);
+  frame_quality_t blurred = measure(BLOCKS * 3);
+  TEST_ASSERT_GREATER_THAN_UINT32(blurred.score, sharp.score);
+}
+
+static void test_well_exposed_frame_beats_clipped_one(void) {
+  frame_quality_t exposed = measure(BLOCKS * 12);
+  // Same detail, but a quarter of the blocks blown out and a quarter black
+  for (int i = 0; i < BLOCKS / 4; i++) {
+    thumb[i] = FRAME_QUALITY_BRIGHT;
+    thumb[BLOCKS - 1 - i] = FRAME_QUALITY_DARK;
+  }
+  frame_quality_t clipped = measure(BLOCKS * 12);
+  TEST_ASSERT_EQUAL_UINT16(500, clipped.clipped);
+  TEST_ASSERT_EQUAL_UINT32(600, clipped.score);
+  TEST_ASSERT_GREATER_THAN_UINT32(clipped.score, exposed.score);
+}
+
+static void test_limits_are_exclusive_of_midtones(void) {
+  thumb[0] = FRAME_QUALITY_DARK + 1;
+  thumb[1] = FRAME_QUALITY_BRIGHT - 1;
+  TEST_ASSERT_EQUAL_UINT16(0, measure(BLOCKS).clipped);
+}
+
+static void test_empty_thumbnail_scores_zero(void) {
+  frame_quality_t q;
+  memset(&q, 0xff, sizeof(q));
+  frame_quality_measure(thumb, 0, THUMB_H, 1000, &q);
+  TEST_ASSERT_EQUAL_UINT32(0, q.detail);
+  TEST_ASSERT_EQUAL_UINT16(0, q.clipped);
+  TEST_ASSERT_EQUAL_UINT32(0, q.score);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_detail_is_per_100_blocks);
+  RUN_TEST(test_sharp_frame_beats_blurred_one);
+  RUN_TEST(test_well_exposed_frame_beats_clipped_one);
+  RUN_TEST(test_limits_are_exclusive_of_midtones);
+  RUN_TEST(test_empty_thumbnail_scores_zero);
+  return UNITY_END();
+}
@@ -0,0 +1,230 @@
+// Host tests of the SD writer's queue and write step against a fake
+// filesystem. Run with: pio test -e native
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "sd_job_queue.h"
+
+#define FAKE_FILE_MAX 256
+
+// In-memory stand-in for the card: one file, a failure switch per call and
+// a clock that advances 100 us per reading
+static struct {
+  char path[SD_JOB_PATH_MAX];
+  uint8_t data[FAKE_FILE_MAX];
+  size_t len;
+  bool appended;
+  int opens;
+  int closes;
+  bool fail_open;
+  size_t write_limit; // bytes a write accepts before coming up short
+  int64_t now;
+} fake;
+
+static int done_calls;
+static bool done_ok;
+
+static void *fake_open(const char *path, bool append) {
+  if (fake.fail_open) {
+    return NULL;
+  }
+  fake.opens++;
+  strncpy(fake.path, path, sizeof(fake.path) - 1);
+  fake.appended = append;
+  if (!append) {
+    fake.len = 0;
+  }
+  return &fake;
+}
+
+static size_t fake_write(void *file, const uint8_t *buf, size_t len) {
+  size_t n = len < fake.write_limit ? len : fake.write_limit;
+  if (n > FAKE_FILE_MAX - fake.len) {
+    n = FAKE_FILE_MAX - fake.len;
+  }
+  memcpy(fake.data + fake.len, buf, n);
+  fake.len += n;
+  return n;
+}
+
+static void fake_close(void *file) { fake.closes++; }
+
+static int64_t fake_now_us() { return fake.now += 100; }
+
+static const sd_fs_ops_t fake_fs = {fake_open, fake_write, fake_close,
+                                    fake_now_us};
+
+static void record_done(const sd_job_t *job, bool ok) {
+  done_calls++;
+  done_ok = ok;
+}
+
+static bool custom_write_ok(const sd_job_t *job) { return true; }
+
+static sd_job_t make_job(const char *path, const char *data, bool droppable) {
+  sd_job_t job;
+  memset(&job, 0, sizeof(job));
+  strncpy(job.path, path, sizeof(job.path) - 1);
+  job.buf = (const uint8_t *)data;
+  job.len = strlen(data);
+  job.droppable = droppable;
+  job.done = record_done;
+  return job;
+}
+
+void setUp(void) {
+  memset(&fake, 0, sizeof(fake));
+  fake.write_limit = FAKE_FILE_MAX;
+  done_calls = 0;
+  done_ok = false;
+}
+
+void tearDown(void) {}
+
+static void test_queue_is_fifo_across_wraparound(void) {
+  sd_job_t slots[3];
+  sd_job_queue_t q;
+  sd_job_queue_init(&q, slots, 3);
+  char path[8];
+  sd_job_t out;
+
+  // Push and pop past the end of the ring a few times
+  for (int i = 0; i < 7; i++) {
+    snprintf(path, sizeof(path), "/%d", i);
+    sd_job_t job = make_job(path, "x", false);
+    TEST_ASSERT_TRUE(sd_job_queue_push(&q, &job));
+    if (i >= 1) {
+      TEST_ASSERT_TRUE(sd_job_queue_pop(&q, &out));
+      snprintf(path, sizeof(path), "/%d", i - 1);
+      TEST_ASSERT_EQUAL_STRING(path, out.path);
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT32(1, q.stats.depth);
+  TEST_ASSERT_EQUAL_UINT32(2, q.stats.max_depth);
+}
+
+static void test_push_fails_when_full(void) {
+  sd_job_t slots[2];
+  sd_job_queue_t q;
+  sd_job_queue_init(&q, slots, 2);
+  sd_job_t job = make_job("/a", "x", false);
+  TEST_ASSERT_TRUE(sd_job_queue_push(&q, &job));
+  TEST_ASSERT_TRUE(sd_job_queue_push(&q, &job));
+  TEST_ASSERT_TRUE(sd_job_queue_full(&q));
+  TEST_ASSERT_FALSE(sd_job_queue_push(&q, &job));
+  TEST_ASSERT_EQUAL_UINT32(2, q.stats.max_depth);
+
+  sd_job_t out;
+  TEST_ASSERT_TRUE(sd_job_queue_pop(&q, &out));
+  TEST_ASSERT_TRUE(sd_job_queue_pop(&q, &out));
+  TEST_ASSERT_FALSE(sd_job_queue_pop(&q, &out));
+}
+
+static void test_drop_oldest_skips_kept_jobs_and_keeps_order(void) {
+  sd_job_t slots[4];
+  sd_job_queue_t q;
+  sd_job_queue_init(&q, slots, 4);
+  sd_job_t index = make_job("/index", "i", false);
+  sd_job_t frame1 = make_job("/frame1", "f", true);
+  sd_job_t frame2 = make_job("/frame2", "f", true);
+  sd_job_queue_push(&q, &index);
+  sd_job_queue_push(&q, &frame1);
+  sd_job_queue_push(&q, &frame2);
+
+  sd_job_t out;
+  TEST_ASSERT_TRUE(sd_job_queue_drop_oldest(&q, &out));
+  TEST_ASSERT_EQUAL_STRING("/frame1", out.path);
+  TEST_ASSERT_EQUAL_UINT32(1, q.stats.dropped);
+  TEST_ASSERT_EQUAL_UINT32(2, q.stats.depth);
+
+  TEST_ASSERT_TRUE(sd_job_queue_pop(&q, &out));
+  TEST_ASSERT_EQUAL_STRING("/index", out.path);
+  TEST_ASSERT_TRUE(sd_job_queue_pop(&q, &out));
+  TEST_ASSERT_EQUAL_STRING("/frame2", out.path);
+
+  // Nothing droppable left
+  sd_job_queue_push(&q, &index);
+  TEST_ASSERT_FALSE(sd_job_queue_drop_oldest(&q, &out));
+  TEST_ASSERT_EQUAL_UINT32(1, q.stats.dropped);
+}
+
+static void test_run_writes_and_counts(void) {
+  sd_writer_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  sd_job_t job = make_job("/frame.jpg", "jpegdata", true);
+
+  TEST_ASSERT_TRUE(sd_job_run(&job, &fake_fs, &stats));
+  TEST_ASSERT_EQUAL_STRING("/frame.jpg", fake.path);
+  TEST_ASSERT_EQUAL_size_t(8, fake.len);
+  TEST_ASSERT_EQUAL_MEMORY("jpegdata", fake.data, 8);
+  TEST_ASSERT_EQUAL_INT(1, fake.closes);
+  TEST_ASSERT_EQUAL_UINT32(1, stats.written);
+  TEST_ASSERT_EQUAL_UINT64(8, stats.bytes);
+  TEST_ASSERT_EQUAL_UINT64(100, stats.write_us);
+  TEST_ASSERT_EQUAL_UINT32(100, stats.max_write_us);
+  TEST_ASSERT_EQUAL_UINT32(80000, sd_writer_stats_bytes_per_s(&stats));
+  TEST_ASSERT_EQUAL_INT(1, done_calls);
+  TEST_ASSERT_TRUE(done_ok);
+}
+
+static void test_run_appends(void) {
+  sd_writer_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  sd_job_t first = make_job("/log.txt", "one,", false);
+  sd_job_t second = make_job("/log.txt", "two", false);
+  second.append = true;
+
+  sd_job_run(&first, &fake_fs, &stats);
+  sd_job_run(&second, &fake_fs, &stats);
+  TEST_ASSERT_TRUE(fake.appended);
+  TEST_ASSERT_EQUAL_size_t(7, fake.len);
+  TEST_ASSERT_EQUAL_MEMORY("one,two", fake.data, 7);
+}
+
+static void test_run_counts_failed_open_and_short_write(void) {
+  sd_writer_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  sd_job_t job = make_job("/frame.jpg", "jpegdata", true);
+
+  fake.fail_open = true;
+  TEST_ASSERT_FALSE(sd_job_run(&job, &fake_fs, &stats));
+  TEST_ASSERT_EQUAL_INT(0, fake.closes);
+  TEST_ASSERT_FALSE(done_ok);
+
+  // A card that fills up mid-frame: the file is still closed
+  fake.fail_open = false;
+  fake.write_limit = 3;
+  TEST_ASSERT_FALSE(sd_job_run(&job, &fake_fs, &stats));
+  TEST_ASSERT_EQUAL_INT(1, fake.closes);
+
+  TEST_ASSERT_EQUAL_UINT32(2, stats.failed);
+  TEST_ASSERT_EQUAL_UINT32(0, stats.written);
+  TEST_ASSERT_EQUAL_UINT64(0, stats.bytes);
+  TEST_ASSERT_EQUAL_INT(2, done_calls);
+}
+
+static void test_run_uses_custom_write_step(void) {
+  sd_writer_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  sd_job_t job = make_job("/segments/a.tls", "frame", true);
+  job.write = custom_write_ok;
+
+  TEST_ASSERT_TRUE(sd_job_run(&job, &fake_fs, &stats));
+  TEST_ASSERT_EQUAL_INT(0, fake.opens); // the fs ops were bypassed
+  TEST_ASSERT_EQUAL_UINT32(1, stats.written);
+  TEST_ASSERT_EQUAL_UINT64(5, stats.bytes);
+  TEST_ASSERT_EQUAL_INT(1, done_calls);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_queue_is_fifo_across_wraparound);
+  RUN_TEST(test_push_fails_when_full);
+  RUN_TEST(test_drop_oldest_skips_kept_jobs_and_keeps_order);
+  RUN_TEST(test_run_writes_and_counts);
+  RUN_TEST(test_run_appends);
+  RUN_TEST(test_run_counts_failed_open_and_short_write);
+  RUN_TEST(test_run_uses_custom_write_step);
+  return UNITY_END();
+}
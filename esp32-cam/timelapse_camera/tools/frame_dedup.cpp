@@ -0,0 +1,127 @@
+// Host-side replay of a corpus of timelapse JPEGs through the camera's
+// duplicate-frame check (src/frame_fingerprint.cpp on thumbnails from
+// src/jpeg_dc.cpp, the same code the firmware runs). Shows which frames the
+// camera would have stored and how much card space the skipped ones save.
+//
+// Build:  make -C tools frame_dedup
+// Usage:  frame_dedup [-d DISTANCE] [-i SECONDS] [-a SECONDS] FRAME.jpg...
+//
+//   -d DISTANCE  largest cell difference, in luma levels, that still counts
+//                as a duplicate (default TIMELAPSE_DEDUP_DISTANCE)
+//   -i SECONDS   time between the frames (default 40)
+//   -a SECONDS   store a frame at least this often (default 600, 0: never)
+//
+// Frames are replayed in the order given. Output is one line per frame: file,
+// distance to the last stored frame, and "stored" or the stored frame it
+// duplicates.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "frame_fingerprint.h"
+#include "jpeg_dc.h"
+
+// Thumbnail room for up to 2048x1536 (QXGA)
+#define MAX_THUMB_PIXELS (256 * 192)
+
+static bool read_file(const char *path, std::vector<uint8_t> *data) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+  uint8_t buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data->insert(data->end(), buf, buf + n);
+  }
+  fclose(f);
+  return true;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: frame_dedup [-d DISTANCE] [-i SECONDS] [-a SECONDS] "
+                  "FRAME.jpg...\n");
+}
+
+int main(int argc, char **argv) {
+  int max_distance = TIMELAPSE_DEDUP_DISTANCE;
+  long interval_s = 40;
+  long max_age_s = 600;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:i:a:")) != -1) {
+    switch (opt) {
+    case 'd':
+      max_distance = atoi(optarg);
+      break;
+    case 'i':
+      interval_s = atol(optarg);
+      break;
+    case 'a':
+      max_age_s = atol(optarg);
+      break;
+    default:
+      usage();
+      return 2;
+    }
+  }
+  if (optind == argc || max_distance < 0 || max_distance > 255 ||
+      interval_s <= 0 || max_age_s < 0) {
+    usage();
+    return 2;
+  }
+
+  std::vector<uint8_t> luma(MAX_THUMB_PIXELS);
+  frame_fingerprint_t stored;
+  const char *stored_path = NULL;
+  long stored_at = 0, now = 0;
+  unsigned kept = 0, skipped = 0, unreadable = 0;
+  unsigned long long kept_bytes = 0, skipped_bytes = 0;
+  for (int i = optind; i < argc; i++, now += interval_s) {
+    std::vector<uint8_t> data;
+    if (!read_file(argv[i], &data)) {
+      unreadable++;
+      continue;
+    }
+    jpeg_dc_t dc = {};
+    dc.luma = luma.data();
+    dc.max_blocks = luma.size();
+    frame_fingerprint_t fingerprint;
+    if (!jpeg_dc_decode(data.data(), data.size(), &dc) ||
+        !frame_fingerprint_from_thumb(dc.luma, dc.width, dc.height,
+                                      &fingerprint)) {
+      // The camera stores what it can't fingerprint
+      fprintf(stderr, "%s: not a baseline JPEG of at least 64x64\n", argv[i]);
+      unreadable++;
+      continue;
+    }
+
+    int distance = 255;
+    if (stored_path && (max_age_s == 0 || now - stored_at < max_age_s)) {
+      distance = frame_fingerprint_distance(&fingerprint, &stored);
+    }
+    if (distance > max_distance) {
+      printf("%s  %3d  stored\n", argv[i], distance);
+      stored = fingerprint;
+      stored_path = argv[i];
+      stored_at = now;
+      kept++;
+      kept_bytes += data.size();
+    } else {
+      printf("%s  %3d  same as %s\n", argv[i], distance, stored_path);
+      skipped++;
+      skipped_bytes += data.size();
+    }
+  }
+  fprintf(stderr,
+          "%u frames stored (%llu KB), %u skipped (%llu KB saved), "
+          "%u unreadable\n",
+          kept, kept_bytes / 1024, skipped, skipped_bytes / 1024, unreadable);
+  return kept + skipped ? 0 : 1;
+}
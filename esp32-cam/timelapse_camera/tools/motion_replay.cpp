@@ -0,0 +1,132 @@
+// Host-side replay of JPEG sequences through the camera's motion scorer
+// (src/motion_score.cpp on thumbnails from src/jpeg_dc.cpp, the same code the
+// firmware runs). Prints each frame's motion score and the timelapse interval
+// it leads to, for tuning the thresholds against recorded footage.
+//
+// Build:  make -C tools motion_replay
+// Usage:  motion_replay [-t PERMILLE] [-p LUMA] [-b SHIFT] [-m MIN_MS]
+//                       [-M MAX_MS] FRAME.jpg...
+//
+//   -t PERMILLE  changed share of the thumbnail that counts as motion
+//                (default MOTION_THRESHOLD_PERMILLE)
+//   -p LUMA      per-pixel luma difference that counts as a change
+//                (default MOTION_PIXEL_THRESHOLD)
+//   -b SHIFT     background update rate, 1/2^SHIFT per frame
+//                (default MOTION_BACKGROUND_SHIFT)
+//   -m MIN_MS    interval while there is motion (default 5000)
+//   -M MAX_MS    interval of a static scene (default 40000)
+//
+// Frames are replayed in the order given, e.g. a shell glob over the
+// YYYY-MM-DD_HH-MM-SS.jpg names segment_extract writes. Output is one line
+// per frame: file, score in permille, motion flag and next interval.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "jpeg_dc.h"
+#include "motion_score.h"
+
+// Thumbnail room for up to 2048x1536 (QXGA)
+#define MAX_THUMB_PIXELS (256 * 192)
+
+static bool read_file(const char *path, std::vector<uint8_t> *data) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+  uint8_t buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data->insert(data->end(), buf, buf + n);
+  }
+  fclose(f);
+  return true;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: motion_replay [-t PERMILLE] [-p LUMA] [-b SHIFT] "
+                  "[-m MIN_MS] [-M MAX_MS] FRAME.jpg...\n");
+}
+
+int main(int argc, char **argv) {
+  int threshold = MOTION_THRESHOLD_PERMILLE;
+  int pixel_threshold = MOTION_PIXEL_THRESHOLD;
+  int background_shift = MOTION_BACKGROUND_SHIFT;
+  long min_ms = 5000;
+  long max_ms = 40000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:p:b:m:M:")) != -1) {
+    switch (opt) {
+    case 't':
+      threshold = atoi(optarg);
+      break;
+    case 'p':
+      pixel_threshold = atoi(optarg);
+      break;
+    case 'b':
+      background_shift = atoi(optarg);
+      break;
+    case 'm':
+      min_ms = atol(optarg);
+      break;
+    case 'M':
+      max_ms = atol(optarg);
+      break;
+    default:
+      usage();
+      return 2;
+    }
+  }
+  if (optind == argc || threshold <= 0 || threshold > 1000 ||
+      pixel_threshold <= 0 || pixel_threshold > 255 || background_shift < 0 ||
+      background_shift > 8 || min_ms <= 0 || max_ms < min_ms) {
+    usage();
+    return 2;
+  }
+
+  motion_detector_t det;
+  if (!motion_detector_init(&det, MAX_THUMB_PIXELS)) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  det.pixel_threshold = pixel_threshold;
+  det.background_shift = background_shift;
+  motion_rate_t rate;
+  motion_rate_init(&rate, min_ms, max_ms, threshold);
+
+  std::vector<uint8_t> luma(MAX_THUMB_PIXELS);
+  unsigned frames = 0, skipped = 0, moving = 0;
+  for (int i = optind; i < argc; i++) {
+    std::vector<uint8_t> data;
+    if (!read_file(argv[i], &data)) {
+      skipped++;
+      continue;
+    }
+    jpeg_dc_t dc = {};
+    dc.luma = luma.data();
+    dc.max_blocks = luma.size();
+    if (!jpeg_dc_decode(data.data(), data.size(), &dc)) {
+      fprintf(stderr, "%s: not a baseline JPEG, skipped\n", argv[i]);
+      skipped++;
+      continue;
+    }
+    uint16_t score = motion_detector_update(&det, dc.luma, dc.width, dc.height);
+    bool motion = score >= threshold;
+    uint32_t interval = motion_rate_update(&rate, score);
+    printf("%s  %4u  %s  %6u ms\n", argv[i], score, motion ? "motion" : "-     ",
+           interval);
+    frames++;
+    moving += motion;
+  }
+  fprintf(stderr, "%u frames, %u with motion, %u skipped\n", frames, moving,
+          skipped);
+  motion_detector_free(&det);
+  return frames ? 0 : 1;
+}
@@ -0,0 +1,356 @@
+// Host-side extractor for timelapse segment files (*.tls) written with
+// TIMELAPSE_STORAGE_MODE=2. Turns segments back into JPEG files and/or one
+// MJPEG AVI.
+//
+// Build:  make -C tools            (or: g++ -std=c++17 -O2 -I../include ...)
+// Usage:  segment_extract [-o DIR] [-a OUT.avi] [-r FPS] [-l] SEGMENT.tls...
+//
+//   -o DIR   write every frame to DIR/YYYY-MM-DD_HH-MM-SS.jpg
+//   -a FILE  write all frames, in the order given, to one MJPEG AVI
+//   -r FPS   AVI frame rate (default 10)
+//   -l       only list the frames
+//
+// Frame names use the host's local time; set TZ to match the camera.
+// Chunks are walked from the start of each file, so segments that were never
+// closed (no trailing index) are read as well. Chunks with a bad length or
+// CRC are reported and skipped.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "timelapse_segment_format.h"
+
+typedef struct {
+  uint32_t epoch;
+  std::vector<uint8_t> jpeg;
+} frame_t;
+
+typedef struct {
+  uint32_t frames;
+  uint32_t indexes;
+  uint32_t corrupt; // chunks skipped because of a bad header or CRC
+} scan_stats_t;
+
+static bool read_file(const char *path, std::vector<uint8_t> *data) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+  uint8_t buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data->insert(data->end(), buf, buf + n);
+  }
+  fclose(f);
+  return true;
+}
+
+// Finds the next frame chunk header after a damaged chunk
+static size_t resync(const std::vector<uint8_t> &data, size_t from) {
+  for (size_t at = from; at + sizeof(segment_chunk_t) <= data.size(); at++) {
+    uint32_t magic;
+    memcpy(&magic, &data[at], sizeof(magic));
+    if (magic == SEGMENT_CHUNK_FRAME || magic == SEGMENT_CHUNK_INDEX) {
+      return at;
+    }
+  }
+  return data.size();
+}
+
+static void scan_segment(const char *path, const std::vector<uint8_t> &data,
+                         std::vector<frame_t> *frames, scan_stats_t *stats) {
+  size_t at = 0;
+  while (at + sizeof(segment_chunk_t) <= data.size()) {
+    segment_chunk_t chunk;
+    memcpy(&chunk, &data[at], sizeof(chunk));
+    const uint8_t *payload = &data[at + sizeof(chunk)];
+    bool known = chunk.magic == SEGMENT_CHUNK_FRAME ||
+                 chunk.magic == SEGMENT_CHUNK_INDEX;
+    bool fits = chunk.len <= data.size() - at - sizeof(chunk);
+
+    if (!known || !fits || segment_crc32(0, payload, chunk.len) != chunk.crc) {
+      fprintf(stderr, "%s: skipping damaged chunk at offset %zu%s\n", path, at,
+              known && !fits ? " (truncated)" : "");
+      stats->corrupt++;
+      at = resync(data, at + 1);
+      continue;
+    }
+
+    if (chunk.magic == SEGMENT_CHUNK_FRAME) {
+      frame_t frame;
+      frame.epoch = chunk.epoch;
+      frame.jpeg.assign(payload, payload + chunk.len);
+      frames->push_back(std::move(frame));
+      stats->frames++;
+    } else {
+      stats->indexes++;
+    }
+    at += sizeof(chunk) + chunk.len;
+  }
+}
+
+static std::string frame_name(uint32_t epoch) {
+  time_t t = epoch;
+  struct tm timeinfo;
+  localtime_r(&t, &timeinfo);
+  char name[32];
+  strftime(name, sizeof(name), "%Y-%m-%d_%H-%M-%S", &timeinfo);
+  return name;
+}
+
+static bool write_jpegs(const char *dir, const std::vector<frame_t> &frames) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+    return false;
+  }
+  std::string last;
+  int repeat = 0;
+  for (const frame_t &frame : frames) {
+    std::string name = frame_name(frame.epoch);
+    // Two frames in the same second get a suffix instead of overwriting
+    repeat = name == last ? repeat + 1 : 0;
+    last = name;
+    if (repeat) {
+      name += "_" + std::to_string(repeat);
+    }
+    std::string path = std::string(dir) + "/" + name + ".jpg";
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f || fwrite(frame.jpeg.data(), 1, frame.jpeg.size(), f) !=
+                  frame.jpeg.size()) {
+      fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+      if (f) {
+        fclose(f);
+      }
+      return false;
+    }
+    fclose(f);
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// MJPEG AVI (AVI 1.0 with an idx1 index, so files are limited to about 2 GB)
+// ---------------------------------------------------------------------------
+
+// Reads the frame size from the JPEG's start-of-frame marker
+static bool jpeg_size(const std::vector<uint8_t> &jpeg, uint16_t *width,
+                      uint16_t *height) {
+  size_t at = 2; // past SOI
+  while (at + 9 < jpeg.size()) {
+    if (jpeg[at] != 0xff) {
+      return false;
+    }
+    uint8_t marker = jpeg[at + 1];
+    uint16_t len = (jpeg[at + 2] << 8) | jpeg[at + 3];
+    if (marker >= 0xc0 && marker <= 0xc3) {
+      *height = (jpeg[at + 5] << 8) | jpeg[at + 6];
+      *width = (jpeg[at + 7] << 8) | jpeg[at + 8];
+      return true;
+    }
+    at += 2 + len;
+  }
+  return false;
+}
+
+static void put32(FILE *f, uint32_t v) { fwrite(&v, 4, 1, f); }
+static void put16(FILE *f, uint16_t v) { fwrite(&v, 2, 1, f); }
+static void put_fourcc(FILE *f, const char *cc) { fwrite(cc, 4, 1, f); }
+
+// Starts a RIFF list or chunk and returns the offset of its size field
+static long begin_chunk(FILE *f, const char *id, const char *list_type) {
+  put_fourcc(f, id);
+  long size_at = ftell(f);
+  put32(f, 0);
+  if (list_type) {
+    put_fourcc(f, list_type);
+  }
+  return size_at;
+}
+
+static void end_chunk(FILE *f, long size_at) {
+  long end = ftell(f);
+  fseek(f, size_at, SEEK_SET);
+  put32(f, (uint32_t)(end - size_at - 4));
+  fseek(f, end, SEEK_SET);
+}
+
+static bool write_avi(const char *path, const std::vector<frame_t> &frames,
+                      uint32_t fps) {
+  uint16_t width = 0, height = 0;
+  if (frames.empty() || !jpeg_size(frames[0].jpeg, &width, &height)) {
+    fprintf(stderr, "%s: no frame with a readable JPEG header\n", path);
+    return false;
+  }
+  uint32_t max_len = 0;
+  for (const frame_t &frame : frames) {
+    if (frame.jpeg.size() > max_len) {
+      max_len = frame.jpeg.size();
+    }
+  }
+
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+  uint32_t count = frames.size();
+
+  long riff = begin_chunk(f, "RIFF", "AVI ");
+  long hdrl = begin_chunk(f, "LIST", "hdrl");
+
+  long avih = begin_chunk(f, "avih", NULL);
+  put32(f, 1000000 / fps); // microseconds per frame
+  put32(f, max_len * fps); // max bytes per second
+  put32(f, 0);             // padding granularity
+  put32(f, 0x10);          // AVIF_HASINDEX
+  put32(f, count);
+  put32(f, 0); // initial frames
+  put32(f, 1); // streams
+  put32(f, max_len);
+  put32(f, width);
+  put32(f, height);
+  for (int i = 0; i < 4; i++) {
+    put32(f, 0);
+  }
+  end_chunk(f, avih);
+
+  long strl = begin_chunk(f, "LIST", "strl");
+  long strh = begin_chunk(f, "strh", NULL);
+  put_fourcc(f, "vids");
+  put_fourcc(f, "MJPG");
+  put32(f, 0); // flags
+  put16(f, 0); // priority
+  put16(f, 0); // language
+  put32(f, 0); // initial frames
+  put32(f, 1); // scale
+  put32(f, fps);
+  put32(f, 0); // start
+  put32(f, count);
+  put32(f, max_len);
+  put32(f, 0xffffffff); // quality: default
+  put32(f, 0);          // sample size: varies
+  put16(f, 0);
+  put16(f, 0);
+  put16(f, width);
+  put16(f, height);
+  end_chunk(f, strh);
+
+  long strf = begin_chunk(f, "strf", NULL);
+  put32(f, 40); // BITMAPINFOHEADER size
+  put32(f, width);
+  put32(f, height);
+  put16(f, 1);  // planes
+  put16(f, 24); // bits per pixel
+  put_fourcc(f, "MJPG");
+  put32(f, (uint32_t)width * height * 3);
+  for (int i = 0; i < 4; i++) {
+    put32(f, 0);
+  }
+  end_chunk(f, strf);
+  end_chunk(f, strl);
+  end_chunk(f, hdrl);
+
+  long movi = begin_chunk(f, "LIST", "movi");
+  long movi_data = movi + 4; // idx1 offsets are relative to the 'movi' tag
+  std::vector<uint32_t> offsets;
+  for (const frame_t &frame : frames) {
+    offsets.push_back((uint32_t)(ftell(f) - movi_data));
+    long chunk = begin_chunk(f, "00dc", NULL);
+    fwrite(frame.jpeg.data(), 1, frame.jpeg.size(), f);
+    end_chunk(f, chunk);
+    if (frame.jpeg.size() & 1) {
+      fputc(0, f); // chunks are word aligned
+    }
+  }
+  end_chunk(f, movi);
+
+  long idx1 = begin_chunk(f, "idx1", NULL);
+  for (size_t i = 0; i < frames.size(); i++) {
+    put_fourcc(f, "00dc");
+    put32(f, 0x10); // AVIIF_KEYFRAME
+    put32(f, offsets[i]);
+    put32(f, frames[i].jpeg.size());
+  }
+  end_chunk(f, idx1);
+  end_chunk(f, riff);
+
+  bool ok = !ferror(f);
+  fclose(f);
+  if (!ok) {
+    fprintf(stderr, "%s: write failed\n", path);
+  }
+  return ok;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: segment_extract [-o DIR] [-a OUT.avi] [-r FPS] [-l] "
+                  "SEGMENT.tls...\n");
+}
+
+int main(int argc, char **argv) {
+  const char *out_dir = NULL;
+  const char *avi_path = NULL;
+  uint32_t fps = 10;
+  bool list = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:a:r:l")) != -1) {
+    switch (opt) {
+    case 'o':
+      out_dir = optarg;
+      break;
+    case 'a':
+      avi_path = optarg;
+      break;
+    case 'r':
+      fps = atoi(optarg);
+      break;
+    case 'l':
+      list = true;
+      break;
+    default:
+      usage();
+      return 2;
+    }
+  }
+  if (optind == argc || fps == 0 || (!out_dir && !avi_path && !list)) {
+    usage();
+    return 2;
+  }
+
+  std::vector<frame_t> frames;
+  scan_stats_t stats = {};
+  for (int i = optind; i < argc; i++) {
+    std::vector<uint8_t> data;
+    if (!read_file(argv[i], &data)) {
+      return 1;
+    }
+    size_t first = frames.size();
+    scan_segment(argv[i], data, &frames, &stats);
+    if (list) {
+      for (size_t j = first; j < frames.size(); j++) {
+        printf("%s  %s  %zu bytes\n", argv[i],
+               frame_name(frames[j].epoch).c_str(), frames[j].jpeg.size());
+      }
+    }
+  }
+  fprintf(stderr, "%u frames, %u index chunks, %u damaged chunks skipped\n",
+          stats.frames, stats.indexes, stats.corrupt);
+
+  if (out_dir && !write_jpegs(out_dir, frames)) {
+    return 1;
+  }
+  if (avi_path && !write_avi(avi_path, frames, fps)) {
+    return 1;
+  }
+  return 0;
+}
@@ -3,8 +3,8 @@
 #include <Adafruit_SGP30.h> // Include SGP30 library
 #include <Adafruit_SGP40.h>
 #include <ESP8266WiFi.h>
-#include <ESP8266HTTPClient.h>
-#include <WiFiClient.h>
+#include "sensor_node.h" // Uploads, I2C scan, WiFi (shared/)
+#include <time.h>
 
 // Define pins for I2C
 #define SDA_PIN 4
@@ -19,14 +19,31 @@ const char* serverUrl = "http://192.168.88.126:5000/data";
 const unsigned long postInterval = 10000; // Post data every 10 seconds
 unsigned long lastPostTime = 0;
 
+// Readings wait in the uploader's queue until the server takes them, so a
+// WiFi or server outage delays them instead of losing them. The newest stay
+// in RAM; with READING_QUEUE_SPILL the older ones move to a LittleFS file,
+// which also survives a reboot.
+#ifndef READING_QUEUE_SPILL
+#define READING_QUEUE_SPILL 1 // 0: RAM only
+#endif
+// The readings of a post go out together as one JSON array. Raise
+// METRICS_BATCH_TICKS to also hold several posts' readings back per request.
+#ifndef METRICS_BATCH_TICKS
+#define METRICS_BATCH_TICKS 1 // Post intervals per request
+#endif
+HttpTransport transport(serverUrl, ssid, password);
+SensorUploader uploader(transport);
+const unsigned long uploadPollInterval = 1000;     // One batch at most per poll
+unsigned long lastUploadPoll = 0;
+const unsigned long uploadStatsInterval = 600000; // Print upload counters every 10 minutes
+unsigned long lastUploadStats = 0;
+
 // Create sensor objects
 Adafruit_SGP40 sgp40;
 Adafruit_SGP30 sgp30; // Add SGP30 sensor object
 
 // Function prototypes
-void scanI2CBus();
 // String detectSensorType(uint8_t address); // Removed unused prototype
-void sendSensorData(const char* sensorName, int sensorValue);
 
 // Global variables for sensor control
 uint8_t detectedSensorAddress = 0x00; // Store detected address (0 if none)
@@ -40,6 +57,12 @@ uint32_t lastMeasurement = 0;
 uint32_t lastBaseline = 0;
 bool readSuccess = false; // Initialize global read success flag
 
+// Devices the I2C scan names
+const i2c_known_device_t knownI2CDevices[] = {
+  {0x58, "SGP30 Address"},
+  {0x59, "SGP40 Address"},
+};
+
 void setup() {
   // Initialize serial communication
   Serial.begin(115200); // Match monitor speed
@@ -57,18 +80,16 @@ void setup() {
   delay(100); // Give I2C time to initialize
 
   // Scan I2C bus to find the sensor address
-  scanI2CBus(); // This will update detectedSensorAddress
+  i2c_scan(Wire, Serial, knownI2CDevices, 2, &detectedSensorAddress);
 
   // Connect to WiFi
-  WiFi.begin(ssid, password);
-  Serial.print("Connecting to WiFi");
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-  }
-  Serial.println();
-  Serial.print("Connected to WiFi, IP address: ");
-  Serial.println(WiFi.localIP());
+  wifi_connect(ssid, password, 0, Serial);
+
+  // Timestamps for the readings; until NTP answers they go out without one
+  configTime(0, 0, "pool.ntp.org");
+
+  // Readings left over from before a restart are sent first
+  sensor_node_begin_queue(uploader, READING_QUEUE_SPILL);
 
   // Initialize the detected sensor
   if (detectedSensorAddress == 0x58) {
@@ -100,6 +121,9 @@ void setup() {
   }
 
   Serial.println("Setup complete. Starting measurements...");
+
+  // Readings per post interval: TVOC and eCO2 from an SGP30, the VOC index from an SGP40
+  uploader.setMinBatch((isSGP30 ? 2 : 1) * METRICS_BATCH_TICKS);
 }
 
 void loop() {
@@ -203,15 +227,15 @@ void loop() {
             Serial.print(TVOC);
             Serial.print(", eCO2=");
             Serial.println(eCO2);
-            // Send SGP30 TVOC data
-            sendSensorData("SGP30_TVOC", TVOC);
-            // Send SGP30 eCO2 data
-            sendSensorData("SGP30_eCO2", eCO2);
+            // Queue SGP30 TVOC data
+            uploader.add("SGP30_TVOC", TVOC, 0);
+            // Queue SGP30 eCO2 data
+            uploader.add("SGP30_eCO2", eCO2, 0);
         } else if (isSGP40) {
             Serial.print("Sending SGP40 data: TVOC="); // Reverted label for serial output
             Serial.println(TVOC); // Remember TVOC holds VOC Index for SGP40
             // Send SGP40 VOC Index data (using the TVOC variable) with the original name
-            sendSensorData("TVOC", TVOC); // Reverted sensor name for data sending
+            uploader.add("TVOC", TVOC, 0); // Reverted sensor name for data sending
             // Do NOT send eCO2 for SGP40
         }
     } else if (!isSGP30 && !isSGP40) {
@@ -220,106 +244,20 @@ void loop() {
         Serial.println("Last read failed, skipping data send.");
     }
   }
-  // Yield to prevent watchdog timer from triggering
-  yield();
-}
-
-// Function to scan I2C bus for devices
-void scanI2CBus() {
-  Serial.println("Scanning I2C bus...");
-  delay(50);
-  
-  byte error, address;
-  int deviceCount = 0;
-  detectedSensorAddress = 0x00; // Reset detected address before scan
-
-  for(address = 1; address < 127; address++) {
-    // delay(10); // Small delay between transmissions for stability - Often not needed
-    Wire.beginTransmission(address);
-    error = Wire.endTransmission();
-    
-    if (error == 0) {
-      Serial.print("Device at 0x");
-      if (address < 16) Serial.print("0");
-      Serial.print(address, HEX);
-
-      if (address == 0x58) {
-        Serial.println(" (SGP30 Address)");
-        detectedSensorAddress = address; // Store detected address
-      } else if (address == 0x59) {
-        Serial.println(" (SGP40 Address)");
-        detectedSensorAddress = address; // Store detected address
-      } else {
-        Serial.println(" (Unknown device)");
-      }
-
-      deviceCount++;
-      // delay(50); // Give serial time to send - Usually not needed
-    }
+  // Send queued readings, one batch per poll while the server answers
+  if (millis() - lastUploadPoll >= uploadPollInterval) {
+    lastUploadPoll = millis();
+    uploader.poll(millis());
   }
-  
-  if (deviceCount == 0) {
-    Serial.println("No I2C devices found!");
-    delay(50);
-  } else {
-    Serial.print("Found ");
-    Serial.print(deviceCount);
-    Serial.println(" device(s)");
-    delay(50);
+  if (millis() - lastUploadStats > uploadStatsInterval) {
+    lastUploadStats = millis();
+    sensor_node_print_stats(Serial, uploader, transport);
   }
+
+  // Yield to prevent watchdog timer from triggering
+  yield();
 }
 
 // Removed detectSensorType function as it's replaced by direct initialization attempts
 
-// Function to send sensor data to the metrics server
-void sendSensorData(const char* sensorName, int sensorValue) {
-  if (WiFi.status() == WL_CONNECTED) {
-    WiFiClient client;
-    HTTPClient http;
-    
-    // Configure the request
-    http.begin(client, serverUrl);
-    http.addHeader("Content-Type", "application/json");
-    
-    // Create JSON payload
-    String payload = "{\"sensor_name\": \"";
-    payload += sensorName;
-    payload += "\", \"sensor_value\": ";
-    payload += sensorValue;
-    payload += "}";
-    
-    // Send the request
-    int httpResponseCode = http.POST(payload);
-    
-    // Check response
-    if (httpResponseCode > 0) {
-      // String response = http.getString(); // Read response only if needed
-      Serial.print(" -> ");
-      Serial.print(sensorName);
-      Serial.print("=");
-      Serial.print(sensorValue);
-      Serial.print(" | HTTP POST ");
-      Serial.print(httpResponseCode);
-      // Serial.println(response); // Uncomment to see full response body
-      if (httpResponseCode == HTTP_CODE_OK) {
-          Serial.println(" OK");
-      } else {
-          Serial.println(" (Non-OK response)");
-      }
-    } else {
-      Serial.print(" -> ");
-      Serial.print(sensorName);
-      Serial.print("=");
-      Serial.print(sensorValue);
-      Serial.print(" | Error sending POST: ");
-      Serial.println(httpResponseCode);
-    }
-    
-    // Free resources
-    http.end();
-  } else {
-    Serial.println("WiFi not connected");
-  }
-}
-
 // The getAbsoluteHumidity function was removed as it's not needed for SGP40
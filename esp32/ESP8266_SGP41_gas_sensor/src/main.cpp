@@ -2,8 +2,8 @@
 #include <Wire.h>
 #include <SensirionI2CSgp41.h>
 #include <ESP8266WiFi.h>
-#include <ESP8266HTTPClient.h>
-#include <WiFiClient.h>
+#include "sensor_node.h" // Uploads, I2C scan, WiFi (shared/)
+#include <time.h>
 
 // Define pins for I2C
 #define SDA_PIN 4
@@ -18,13 +18,30 @@ const char* serverUrl = "http://192.168.88.126:5000/data";
 const unsigned long postInterval = 10000; // Post data every 10 seconds
 unsigned long lastPostTime = 0;
 
+// Readings wait in the uploader's queue until the server takes them, so a
+// WiFi or server outage delays them instead of losing them. The newest stay
+// in RAM; with READING_QUEUE_SPILL the older ones move to a LittleFS file,
+// which also survives a reboot.
+#ifndef READING_QUEUE_SPILL
+#define READING_QUEUE_SPILL 1 // 0: RAM only
+#endif
+// The readings of a post go out together as one JSON array. Raise
+// METRICS_BATCH_TICKS to also hold several posts' readings back per request.
+#ifndef METRICS_BATCH_TICKS
+#define METRICS_BATCH_TICKS 1 // Post intervals per request
+#endif
+HttpTransport transport(serverUrl, ssid, password);
+SensorUploader uploader(transport);
+const unsigned long uploadPollInterval = 1000;     // One batch at most per poll
+unsigned long lastUploadPoll = 0;
+const unsigned long uploadStatsInterval = 600000; // Print upload counters every 10 minutes
+unsigned long lastUploadStats = 0;
+
 // Create sensor object
 SensirionI2CSgp41 sgp41;
 
 // Function prototypes
-void scanI2CBus();
 String detectSensorType(uint8_t address);
-void sendSensorData(const char* sensorName, int sensorValue);
 bool checkI2CConnection();
 
 // Function to check I2C connection
@@ -54,6 +71,12 @@ uint32_t lastMeasurement = 0;
 uint32_t lastBaseline = 0;
 uint16_t conditioning_s = 10; // Initial conditioning period in seconds
 
+// Devices the I2C scan names
+const i2c_known_device_t knownI2CDevices[] = {
+  {0x58, "SGP30 sensor"},
+  {0x59, "Possible SGP30 alternate address"},
+};
+
 void setup() {
   // Initialize serial communication
   Serial.begin(9600);
@@ -90,18 +113,17 @@ void setup() {
   }
   
   // Scan I2C bus to see what devices are connected
-  scanI2CBus();
+  i2c_scan(Wire, Serial, knownI2CDevices, 2, NULL);
   
   // Connect to WiFi
-  WiFi.begin(ssid, password);
-  Serial.print("Connecting to WiFi");
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-  }
-  Serial.println();
-  Serial.print("Connected to WiFi, IP address: ");
-  Serial.println(WiFi.localIP());
+  wifi_connect(ssid, password, 0, Serial);
+
+  // Timestamps for the readings; until NTP answers they go out without one
+  configTime(0, 0, "pool.ntp.org");
+
+  // Readings left over from before a restart are sent first
+  sensor_node_begin_queue(uploader, READING_QUEUE_SPILL);
+  uploader.setMinBatch(2 * METRICS_BATCH_TICKS);
 
   // Initialize SGP41 sensor
   Serial.println("Initializing SGP41 sensor...");
@@ -336,62 +358,26 @@ void loop() {
     
     // Only send if we have valid readings
     if (sensorWorking) {
-      // Send VOC Index data
-      sendSensorData("VOC", TVOC);
+      // Queue VOC Index data
+      uploader.add("VOC", TVOC, 0);
       
-      // Send NOx Index data
-      sendSensorData("NOx", eCO2);
-      
-      Serial.println("Data sent to metrics server");
+      // Queue NOx Index data
+      uploader.add("NOx", eCO2, 0);
     }
   }
   
-  // Yield to prevent watchdog timer from triggering
-  yield();
-}
-
-// Function to scan I2C bus for devices
-void scanI2CBus() {
-  Serial.println("Scanning I2C bus...");
-  delay(50);
-  
-  byte error, address;
-  int deviceCount = 0;
-  
-  // The SGP30 should be at address 0x58
-  for(address = 1; address < 127; address++) {
-    delay(10); // Small delay between transmissions for stability
-    
-    Wire.beginTransmission(address);
-    error = Wire.endTransmission();
-    
-    if (error == 0) {
-      Serial.print("Device at 0x");
-      if (address < 16) Serial.print("0");
-      Serial.print(address, HEX);
-      
-      if (address == 0x58) {
-        Serial.println(" (SGP30 sensor)");
-      } else if (address == 0x59) {
-        Serial.println(" (Possible SGP30 alternate address)");
-      } else {
-        Serial.println(" (Unknown device)");
-      }
-      
-      deviceCount++;
-      delay(50); // Give serial time to send
-    }
+  // Send queued readings, one batch per poll while the server answers
+  if (millis() - lastUploadPoll >= uploadPollInterval) {
+    lastUploadPoll = millis();
+    uploader.poll(millis());
   }
-  
-  if (deviceCount == 0) {
-    Serial.println("No I2C devices found!");
-    delay(50);
-  } else {
-    Serial.print("Found ");
-    Serial.print(deviceCount);
-    Serial.println(" device(s)");
-    delay(50);
+  if (millis() - lastUploadStats > uploadStatsInterval) {
+    lastUploadStats = millis();
+    sensor_node_print_stats(Serial, uploader, transport);
   }
+  
+  // Yield to prevent watchdog timer from triggering
+  yield();
 }
 
 // Simplified function to detect SGP40/41 sensor
@@ -453,42 +439,4 @@ String detectSensorType(uint8_t address) {
   return type;
 }
 
-// Function to send sensor data to the metrics server
-void sendSensorData(const char* sensorName, int sensorValue) {
-  if (WiFi.status() == WL_CONNECTED) {
-    WiFiClient client;
-    HTTPClient http;
-    
-    // Configure the request
-    http.begin(client, serverUrl);
-    http.addHeader("Content-Type", "application/json");
-    
-    // Create JSON payload
-    String payload = "{\"sensor_name\": \"";
-    payload += sensorName;
-    payload += "\", \"sensor_value\": ";
-    payload += sensorValue;
-    payload += "}";
-    
-    // Send the request
-    int httpResponseCode = http.POST(payload);
-    
-    // Check response
-    if (httpResponseCode > 0) {
-      String response = http.getString();
-      Serial.print("HTTP Response code: ");
-      Serial.println(httpResponseCode);
-      // Serial.println(response); // Uncomment to see full response
-    } else {
-      Serial.print("Error on sending POST: ");
-      Serial.println(httpResponseCode);
-    }
-    
-    // Free resources
-    http.end();
-  } else {
-    Serial.println("WiFi not connected");
-  }
-}
-
 // The getAbsoluteHumidity function was removed as it's not needed for SGP40
@@ -2,8 +2,9 @@
 #include <SensirionI2CScd4x.h> // Use SCD4x library
 #include <Wire.h>
 #include <ESP8266WiFi.h>       // For WiFi connectivity
-#include <ESP8266HTTPClient.h> // For making HTTP requests
-#include <WiFiClient.h>        // Required for HTTPClient
+#include "coop_scheduler.h"    // Cooperative timers (shared/)
+#include "sensor_node.h"       // Uploads, I2C scan, WiFi (shared/)
+#include <time.h>
 
 // Define pins for ESP8266 I2C
 #define SDA_PIN D2  // GPIO4
@@ -22,52 +23,57 @@ const char* serverUrl = "http://192.168.88.126:5000/data";
 const unsigned long postInterval = 10000; // Post data every 10 seconds
 unsigned long lastPostTime = 0;
 
-// Function prototypes
-void connectToWiFi();
-void sendSensorData(const char* sensorName, float sensorValue); // Updated prototype
+// Readings wait in the uploader's queue until the server takes them, so a
+// WiFi or server outage delays them instead of losing them. The newest stay
+// in RAM; with READING_QUEUE_SPILL the older ones move to a LittleFS file,
+// which also survives a reboot.
+#ifndef READING_QUEUE_SPILL
+#define READING_QUEUE_SPILL 1 // 0: RAM only
+#endif
+// The readings of a measurement go out together as one JSON array. Raise
+// METRICS_BATCH_TICKS to also hold several measurements back per POST.
+#ifndef METRICS_BATCH_TICKS
+#define METRICS_BATCH_TICKS 1 // Measurements per POST
+#endif
+HttpTransport transport(serverUrl, ssid, password);
+SensorUploader uploader(transport);
+const unsigned long uploadPollInterval = 1000;     // One batch at most per poll
+const unsigned long uploadStatsInterval = 600000; // Print upload counters every 10 minutes
+
+// SCD4x behind the shared driver interface: ready() is the data-ready flag,
+// read() gives CO2, temperature and humidity in that order
+class Scd4xDriver : public SensorDriver {
+public:
+  const char* name() const override { return "SCD4x"; }
+  bool begin() override;
+  bool ready() override;
+  size_t read(sensor_reading_t* out, size_t max) override;
+};
+Scd4xDriver scd4xDriver;
 
 // Flag to track sensor stabilization
 bool sensorStabilized = false;
 
-void scanI2C() {
-  Serial.println("Scanning I2C bus...");
-  byte error, address;
-  int nDevices = 0;
-
-  for (address = 1; address < 127; address++) {
-    Wire.beginTransmission(address);
-    error = Wire.endTransmission();
-
-    if (error == 0) {
-      Serial.print("I2C device found at address 0x");
-      if (address < 16) Serial.print("0");
-      Serial.print(address, HEX);
-      Serial.print(" (");
-      if (address == 0x62) { // SCD4x address
-        Serial.println("Expected SCD4x)");
-      } else if (address == 0x59) {
-        Serial.println("Detected 0x59 - THIS IS NOT THE EXPECTED SCD4x ADDRESS!)");
-      } else {
-         Serial.println("Unknown device)");
-      }
-      nDevices++;
-    } else if (error == 4) {
-      Serial.print("Unknown error at address 0x");
-      if (address < 16) Serial.print("0");
-      Serial.println(address, HEX);
-    }
-    // Ignore other error codes (2:NACK addr, 3:NACK data) as they mean no device responded
-  }
-
-  if (nDevices == 0) {
-    Serial.println("No I2C devices found");
-  } else {
-    Serial.print("Found ");
-    Serial.print(nDevices);
-    Serial.println(" device(s)");
-  }
-  Serial.println("I2C scan complete");
-}
+// The SCD4x produces a measurement every 5 seconds in periodic mode. The read
+// task falls due on that beat and then polls the sensor's data-ready flag, so
+// it follows the sensor instead of sleeping a fixed 6 seconds per loop.
+const unsigned long measurementInterval = 5000;
+const unsigned long dataReadyPollInterval = 500;
+coop_scheduler_t scheduler;
+coop_task_t measurementTask;
+coop_task_t uploadTask;
+coop_task_t uploadStatsTask;
+
+bool measurementReady(void* arg);
+void readMeasurement(void* arg);
+void pollUploads(void* arg);
+void printUploadStats(void* arg);
+
+// Devices the I2C scan names
+const i2c_known_device_t knownI2CDevices[] = {
+  {0x62, "Expected SCD4x"},
+  {0x59, "Detected 0x59 - THIS IS NOT THE EXPECTED SCD4x ADDRESS!"},
+};
 
 void setup() {
   Serial.begin(115200);
@@ -80,12 +86,107 @@ void setup() {
   Wire.setClock(100000); // Lower I2C clock speed to 100kHz for stability
 
   // Scan I2C bus
-  scanI2C();
+  i2c_scan(Wire, Serial, knownI2CDevices, 2, NULL);
 
   // Give sensor extra time to power up
   Serial.println("Waiting for sensor to initialize...");
   delay(1000); 
 
+  // Probe, configure and start the sensor
+  scd4xDriver.begin();
+
+  Serial.println("Waiting for first measurement... (takes approx. 5 seconds)");
+
+  // Connect to WiFi
+  wifi_connect(ssid, password, 0, Serial);
+
+  // Timestamps for the readings; until NTP answers they go out without one
+  configTime(0, 0, "pool.ntp.org");
+
+  // Readings left over from before a restart are sent first
+  sensor_node_begin_queue(uploader, READING_QUEUE_SPILL);
+  uploader.setMinBatch(3 * METRICS_BATCH_TICKS);
+
+  coop_init(&scheduler);
+  coop_every(&scheduler, &measurementTask, "measurement", readMeasurement, NULL,
+             measurementInterval, 0);
+  coop_set_ready(&measurementTask, measurementReady, dataReadyPollInterval);
+  coop_every(&scheduler, &uploadTask, "upload", pollUploads, NULL,
+             uploadPollInterval, 0);
+  coop_every(&scheduler, &uploadStatsTask, "upload_stats", printUploadStats,
+             NULL, uploadStatsInterval, uploadStatsInterval);
+}
+
+
+void loop() {
+  // Runs the measurement task when the sensor has data and the upload task
+  // every second, idling (delay(), which lets the WiFi stack run) in between
+  coop_loop(&scheduler);
+}
+
+// Ready check for the measurement task: the sensor's data-ready flag
+bool measurementReady(void* arg) {
+  return scd4xDriver.ready();
+}
+
+// Measurement task: reads the measurement the sensor flagged as ready
+void readMeasurement(void* arg) {
+  sensor_reading_t readings[SENSOR_DRIVER_READINGS_MAX];
+  size_t count = scd4xDriver.read(readings, SENSOR_DRIVER_READINGS_MAX);
+  if (count > 0) { // A failed read is logged by the driver
+    uint16_t co2 = (uint16_t)readings[0].value;
+    float temperature = readings[1].value;
+    float humidity = readings[2].value;
+    // Print results regardless of CO2 value for debugging stabilization
+    if (co2 == 0) {
+        if (sensorStabilized) {
+             Serial.print("CO2: 0 ppm (Warning: Reading 0 after stabilization!)");
+        } else {
+             Serial.print("CO2: 0 ppm (Stabilizing?)");
+        }
+    } else {
+        Serial.print("CO2:");
+        Serial.print(co2);
+        Serial.print("ppm");
+    }
+    Serial.print("\t");
+    Serial.print("Temperature:");
+    Serial.print(temperature, 1); // Print with 1 decimal place
+    Serial.print("°C\t");
+    Serial.print("Humidity:");
+    Serial.print(humidity, 1); // Print with 1 decimal place
+    Serial.println("%RH");
+
+    // Check if sensor has provided its first valid reading
+    if (!sensorStabilized && co2 > 0) {
+        sensorStabilized = true;
+        Serial.println("Sensor stabilized: First valid CO2 reading received.");
+    }
+
+    // Send data to server periodically ONLY after stabilization
+    if (sensorStabilized && (millis() - lastPostTime > postInterval)) {
+      lastPostTime = millis();
+      // Queue the metrics; the upload task sends them in one request
+      uploader.add(readings, count);
+    } else if (!sensorStabilized) {
+      Serial.println("Sensor not yet stabilized, skipping data send.");
+    }
+  }
+}
+
+// Upload task: sends one queued batch if the server is reachable
+void pollUploads(void* arg) {
+  uploader.poll(millis());
+}
+
+// Connect versus request time of the uploads so far, and the queue backlog
+void printUploadStats(void* arg) {
+  sensor_node_print_stats(Serial, uploader, transport);
+}
+
+// Sensor start-up: checks the sensor answers at 0x62, then starts periodic
+// measurement with automatic self-calibration off
+bool Scd4xDriver::begin() {
   // Initialize SCD4x library, providing the I2C address
   scd4x.begin(Wire, 0x62); // Pass Wire object and the I2C address
 
@@ -169,39 +270,11 @@ void setup() {
   } else {
      Serial.println("Skipping Sensor Initialization (Serial Number, Measurement Start, ASC) due to communication failure at 0x62.");
   }
-
-  Serial.println("Waiting for first measurement... (takes approx. 5 seconds)");
-
-  // Connect to WiFi
-  connectToWiFi();
-}
-
-// Function to connect to WiFi
-void connectToWiFi() {
-  Serial.print("Connecting to WiFi: ");
-  Serial.println(ssid);
-  WiFi.begin(ssid, password);
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-  }
-  Serial.println("\nWiFi connected!");
-  Serial.print("IP address: ");
-  Serial.println(WiFi.localIP());
+  return scd4x_found;
 }
 
-
-void loop() {
-  // Wait slightly longer than the 5-second sensor interval to ensure data readiness
-  delay(6000); 
-
-  uint16_t co2 = 0;
-  float temperature = 0.0f;
-  float humidity = 0.0f;
+bool Scd4xDriver::ready() {
   bool isDataReady = false;
-
-  // Check if data is ready
-  Serial.println("Checking if sensor data is ready...");
   error = scd4x.getDataReadyStatus(isDataReady);
   if (error) {
     Serial.print("Error checking data ready status. Code: ");
@@ -209,15 +282,19 @@ void loop() {
     Serial.print(" Message: ");
     errorToString(error, errorMessage, 256);
     Serial.println(errorMessage);
-    return; // Skip measurement if error
+    return false; // Check again on the next poll
   }
+  return isDataReady;
+}
 
-  if (!isDataReady) {
-     Serial.println("Sensor data not ready yet. Skipping read attempt.");
-    return; // No new data available
-  }
+size_t Scd4xDriver::read(sensor_reading_t* out, size_t max) {
+  uint16_t co2 = 0;
+  float temperature = 0.0f;
+  float humidity = 0.0f;
 
-  // Data is ready, attempt to read measurement
+  if (max < 3) {
+    return 0;
+  }
   Serial.println("Sensor data ready. Reading measurement...");
   error = scd4x.readMeasurement(co2, temperature, humidity);
   if (error) {
@@ -226,98 +303,11 @@ void loop() {
     Serial.print(" Message: ");
     errorToString(error, errorMessage, 256);
     Serial.println(errorMessage);
-    // Note: We might still attempt to post old data if postInterval is met below,
-    // depending on desired behavior. Current logic proceeds. Consider adding 'return;' here
-    // if you want to skip posting entirely on read error.
-  } else {
-    Serial.println("Measurement read successfully.");
-    // Print results regardless of CO2 value for debugging stabilization
-    if (co2 == 0) {
-        if (sensorStabilized) {
-             Serial.print("CO2: 0 ppm (Warning: Reading 0 after stabilization!)");
-        } else {
-             Serial.print("CO2: 0 ppm (Stabilizing?)");
-        }
-    } else {
-        Serial.print("CO2:");
-        Serial.print(co2);
-        Serial.print("ppm");
-    }
-    Serial.print("\t");
-    Serial.print("Temperature:");
-    Serial.print(temperature, 1); // Print with 1 decimal place
-    Serial.print("°C\t");
-    Serial.print("Humidity:");
-    Serial.print(humidity, 1); // Print with 1 decimal place
-    Serial.println("%RH");
-
-    // Check if sensor has provided its first valid reading
-    if (!sensorStabilized && co2 > 0) {
-        sensorStabilized = true;
-        Serial.println("Sensor stabilized: First valid CO2 reading received.");
-    }
-
-    // Send data to server periodically ONLY after stabilization
-    if (sensorStabilized && (millis() - lastPostTime > postInterval)) {
-      lastPostTime = millis();
-      // Send each metric separately
-      sendSensorData("CO2", (float)co2); // Cast co2 (uint16_t) to float for the function
-      sendSensorData("Temperature", temperature);
-      sendSensorData("Humidity", humidity);
-      Serial.println("Sensor data sent to server.");
-    } else if (!sensorStabilized) {
-      Serial.println("Sensor not yet stabilized, skipping data send.");
-    }
-  }
-
-  // Yield to allow background processes (like WiFi) to run
-  yield();
-}
-
-// Function to send a single sensor reading to the metrics server
-void sendSensorData(const char* sensorName, float sensorValue) {
-  if (WiFi.status() == WL_CONNECTED) {
-    WiFiClient client;
-    HTTPClient http;
-
-    // Configure the request
-    // Serial.print("Connecting to server: "); // Reduce serial noise
-    // Serial.println(serverUrl);
-    http.begin(client, serverUrl);
-    http.addHeader("Content-Type", "application/json");
-
-    // Create JSON payload for a single metric
-    String payload = "{";
-    payload += "\"sensor_name\": \"" + String(sensorName) + "\",";
-    // Format float value with 1 decimal place
-    payload += "\"sensor_value\": " + String(sensorValue, 1);
-    payload += "}";
-
-    Serial.print("Sending payload: ");
-    Serial.println(payload);
-
-    // Send the request
-    int httpResponseCode = http.POST(payload);
-
-    // Check response
-    if (httpResponseCode > 0) {
-      // String response = http.getString(); // Read response only if needed
-      Serial.print("HTTP Response code: ");
-      Serial.println(httpResponseCode);
-      // Serial.println(response);
-    } else {
-      Serial.print("Error on sending POST for ");
-      Serial.print(sensorName);
-      Serial.print(": ");
-      Serial.println(httpResponseCode);
-      Serial.printf("[HTTP] POST... failed, error: %s\n", http.errorToString(httpResponseCode).c_str());
-    }
-
-    // Free resources
-    http.end();
-  } else {
-    Serial.println("WiFi not connected, cannot send data.");
-    // Optional: try to reconnect?
-    // connectToWiFi(); // Be careful about blocking the loop here
+    return 0;
   }
+  Serial.println("Measurement read successfully.");
+  out[0] = {"CO2", (float)co2, 0};
+  out[1] = {"Temperature", temperature, 1};
+  out[2] = {"Humidity", humidity, 1};
+  return 3;
 }
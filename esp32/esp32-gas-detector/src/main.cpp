@@ -1,4 +1,5 @@
-#include "network_utils.h"
+#include "coop_scheduler.h" // Cooperative timers (shared/)
+#include "sensor_node.h"    // Uploader, WiFi (shared/)
 #include <Arduino.h>
 
 // Define MQ135 sensor pin
@@ -25,8 +26,47 @@
 const String SERVER_URL =
     "http://" + String(SERVER_IP) + ":" + String(SERVER_PORT) + "/data";
 
-// Create network utilities instance
-NetworkUtils network(WIFI_SSID, WIFI_PASSWORD, SERVER_URL.c_str());
+// Readings are queued and sent from the upload task; the queue spills to
+// LittleFS while the server cannot be reached
+HttpTransport transport(SERVER_URL.c_str(), WIFI_SSID, WIFI_PASSWORD);
+SensorUploader uploader(transport);
+
+// MQ135 analog output, scaled down by 10 and rounded
+class Mq135Driver : public SensorDriver {
+public:
+  const char *name() const override { return "MQ135"; }
+
+  bool begin() override {
+    pinMode(MQ135_PIN_AO, INPUT);
+    return true;
+  }
+
+  size_t read(sensor_reading_t *out, size_t max) override {
+    if (max < 1) {
+      return 0;
+    }
+    int rawAnalog = analogRead(MQ135_PIN_AO);
+    out[0] = {"AirQuality", (float)round(rawAnalog / 10.0), 0};
+    return 1;
+  }
+};
+
+Mq135Driver mq135;
+
+// Sensor warm-up and reading interval
+#define WARM_UP_MS 5000
+#define READING_INTERVAL_MS 5000
+#define UPLOAD_POLL_INTERVAL_MS 1000    // One batch at most per poll
+#define UPLOAD_STATS_INTERVAL_MS 300000 // Print upload timings every 5 minutes
+
+coop_scheduler_t scheduler;
+coop_task_t readingTask;
+coop_task_t uploadTask;
+coop_task_t uploadStatsTask;
+
+void readSensor(void *arg);
+void pollUploads(void *arg);
+void printUploadStats(void *arg);
 
 void setup() {
   // Initialize serial communication
@@ -41,36 +81,48 @@ void setup() {
   Serial.println(SERVER_URL);
 
   // Initialize analog pin
-  pinMode(MQ135_PIN_AO, INPUT);
+  mq135.begin();
 
   // Always attempt to connect to WiFi
-  if (!network.connectToWiFi()) {
-    Serial.println("Failed to connect to WiFi. Continuing in offline mode.");
+  if (!wifi_connect(WIFI_SSID, WIFI_PASSWORD, 10000, Serial)) {
+    Serial.println("Continuing in offline mode.");
   }
 
+  // Timestamps for the readings, which may wait in the queue for a while;
+  // until NTP answers they go out without one
+  configTime(0, 0, "pool.ntp.org");
+  sensor_node_begin_queue(uploader, true);
+
   Serial.println("MQ135 sensor initialized!");
   Serial.println("Waiting 5 seconds for sensor warm-up...");
-  delay(5000);
-  Serial.println("Starting sensor readings...");
-}
 
-void loop() {
-  // Read raw analog value
-  int rawAnalog = analogRead(MQ135_PIN_AO);
+  // The first reading waits out the warm-up; loop() idles until then
+  coop_init(&scheduler);
+  coop_every(&scheduler, &readingTask, "reading", readSensor, NULL,
+             READING_INTERVAL_MS, WARM_UP_MS);
+  coop_every(&scheduler, &uploadTask, "upload", pollUploads, NULL,
+             UPLOAD_POLL_INTERVAL_MS, 0);
+  coop_every(&scheduler, &uploadStatsTask, "upload_stats", printUploadStats,
+             NULL, UPLOAD_STATS_INTERVAL_MS, UPLOAD_STATS_INTERVAL_MS);
+}
 
-  // Convert to integer value (rounding)
-  int sensorValue = round(rawAnalog / 10.0); // Round the result
+void loop() { coop_loop(&scheduler); }
 
-  // Post data to server only if SERVER_URL is set
+// Reading task: one MQ135 sample, queued for the upload task
+void readSensor(void *arg) {
+  // Queue data for the server only if SERVER_URL is set
   if (SERVER_URL.length() > 0) {
-    if (!network.postSensorData("AirQuality", sensorValue)) {
-      Serial.println("Failed to post sensor data");
-    }
+    uploader.addFrom(mq135);
   } else {
     Serial.print("Raw Value: ");
-    Serial.println(rawAnalog);
+    Serial.println(analogRead(MQ135_PIN_AO));
   }
+}
+
+// Upload task: sends one queued batch if the server is reachable
+void pollUploads(void *arg) { uploader.poll(millis()); }
 
-  // Wait 5 seconds before next reading
-  delay(5000);
+// Connect versus request time of the uploads so far, and the queue backlog
+void printUploadStats(void *arg) {
+  sensor_node_print_stats(Serial, uploader, transport);
 }
@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+"""Local stand-in for the metrics server the sensor firmwares post to.
+
+Accepts POST /data with either payload the firmwares send:
+
+  {"sensor_name": "CO2", "sensor_value": 412}            one reading (old)
+  [{"sensor_name": "CO2", "sensor_value": 412, "ts": 1718000000}, ...]
+                                                          a batch (metrics_batch.h)
+
+A reading without "ts" is stamped with the time it arrived. Readings sent
+from a firmware's store-and-forward queue (reading_queue.h) carry a "seq";
+one that arrives again, because a batch was resent after its reply was lost,
+is counted as a duplicate and not stored twice. Each accepted reading is
+printed, and appended to --csv if given. HTTP/1.1 with keep-alive,
+like the production server, so the firmware's http_keepalive client reuses
+its connection here too.
+
+Deduplication keys on (peer, name, seq, ts), and only readings that carry
+both seq and ts take part. seq alone is not unique: a queue without a flash
+spill numbers from 0 again after every reboot, and so does one whose spill
+was lost. The sent ts tells those readings apart. A reading sent before the
+clock was set has no ts and is always stored; a resend of it is a
+duplicate the server cannot recognise. The production server should apply
+the same rule.
+
+  GET /data?name=CO2&n=20   newest readings, newest first
+  GET /stats                request, batch, duplicate and connection counters
+
+Usage: metrics_server.py [--host 0.0.0.0] [--port 5000] [--csv FILE]
+Point a firmware's serverUrl at http://<this machine>:5000/data.
+"""
+
+import argparse
+import collections
+import csv
+import json
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+MAX_BODY = 64 * 1024
+MAX_KEPT = 10000
+MAX_SEEN = 100000  # (peer, name, seq, ts) keys remembered for deduplication
+
+
+class Store:
+    def __init__(self, csv_path):
+        self.lock = threading.Lock()
+        self.readings = collections.deque(maxlen=MAX_KEPT)
+        self.stats = collections.Counter()
+        self.seen = collections.OrderedDict()
+        self.csv = open(csv_path, "a", newline="") if csv_path else None
+
+    def is_duplicate(self, key):
+        """Remembers key; True if it was already there. Call with lock held."""
+        if key in self.seen:
+            return True
+        self.seen[key] = None
+        if len(self.seen) > MAX_SEEN:
+            self.seen.popitem(last=False)
+        return False
+
+    def add(self, readings, batched, peer):
+        """Stores the readings that are new; returns how many were duplicates."""
+        duplicates = 0
+        with self.lock:
+            self.stats["requests"] += 1
+            self.stats["batched_requests" if batched else "single_requests"] += 1
+            for r in readings:
+                key = r.pop("key")
+                if key and self.is_duplicate((peer,) + key):
+                    duplicates += 1
+                    continue
+                self.stats["readings"] += 1
+                self.readings.append(r)
+                print("%s %s %-16s %s" % (time.strftime("%H:%M:%S", time.localtime(r["ts"])),
+                                          peer, r["sensor_name"], r["sensor_value"]))
+                if self.csv:
+                    csv.writer(self.csv).writerow([r["ts"], peer, r["sensor_name"], r["sensor_value"]])
+            if self.csv:
+                self.csv.flush()
+            self.stats["duplicates"] += duplicates
+        return duplicates
+
+    def count(self, key):
+        with self.lock:
+            self.stats[key] += 1
+
+
+def parse_reading(item, now):
+    """Returns the reading as a dict, or None if it does not follow the schema."""
+    if not isinstance(item, dict):
+        return None
+    name = item.get("sensor_name")
+    value = item.get("sensor_value")
+    sent_ts = item.get("ts")
+    ts = now if sent_ts is None else sent_ts
+    seq = item.get("seq")
+    if not isinstance(name, str) or not name:
+        return None
+    if value is not None and (isinstance(value, bool) or not isinstance(value, (int, float))):
+        return None
+    if isinstance(ts, bool) or not isinstance(ts, int) or ts < 0:
+        return None
+    if seq is not None and (isinstance(seq, bool) or not isinstance(seq, int) or seq < 0):
+        return None
+    # The sent ts, not the arrival stamp, tells a resend apart from a
+    # reading after a reboot that restarted seq; without one there is no
+    # telling, so the reading is kept
+    key = (name, seq, sent_ts) if seq is not None and sent_ts is not None else None
+    return {"sensor_name": name, "sensor_value": value, "ts": ts, "key": key}
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    store = None
+
+    def setup(self):
+        super().setup()
+        self.store.count("connections")
+
+    def reply(self, status, body):
+        data = json.dumps(body).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_POST(self):
+        if urlparse(self.path).path != "/data":
+            return self.reply(404, {"error": "not found"})
+        length = int(self.headers.get("Content-Length") or 0)
+        if length <= 0 or length > MAX_BODY:
+            self.close_connection = True
+            return self.reply(400, {"error": "missing or oversized body"})
+        try:
+            payload = json.loads(self.rfile.read(length))
+        except ValueError:
+            self.store.count("bad_requests")
+            return self.reply(400, {"error": "invalid JSON"})
+
+        batched = isinstance(payload, list)
+        items = payload if batched else [payload]
+        now = int(time.time())
+        readings = [parse_reading(item, now) for item in items]
+        accepted = [r for r in readings if r]
+        rejected = len(readings) - len(accepted)
+        if not accepted:
+            self.store.count("bad_requests")
+            return self.reply(400, {"error": "no valid reading", "rejected": rejected})
+        duplicates = self.store.add(accepted, batched, self.client_address[0])
+        self.reply(200, {"accepted": len(accepted) - duplicates,
+                         "duplicates": duplicates, "rejected": rejected})
+
+    def do_GET(self):
+        url = urlparse(self.path)
+        if url.path == "/stats":
+            with self.store.lock:
+                return self.reply(200, dict(self.store.stats))
+        if url.path == "/data":
+            query = parse_qs(url.query)
+            name = query.get("name", [None])[0]
+            n = int(query.get("n", ["20"])[0])
+            with self.store.lock:
+                rows = [r for r in reversed(self.store.readings)
+                        if name is None or r["sensor_name"] == name][:n]
+            return self.reply(200, rows)
+        self.reply(404, {"error": "not found"})
+
+    def log_message(self, fmt, *args):
+        pass  # readings are printed by Store.add()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=5000)
+    parser.add_argument("--csv", help="append accepted readings to this file")
+    args = parser.parse_args()
+
+    Handler.store = Store(args.csv)
+    server = ThreadingHTTPServer((args.host, args.port), Handler)
+    server.daemon_threads = True
+    print("Listening on http://%s:%d/data" % (args.host, args.port), file=sys.stderr)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,224 @@
+// Host-side soak of the sensor firmwares' upload path (shared/sensor_node's
+// SensorUploader on reading_queue, metrics_batch and json_writer, the same
+// code the firmware runs). Feeds it simulated days of readings through
+// periodic server outages and counts every heap allocation made meanwhile:
+// the payloads are built in fixed buffers, so after start-up the count
+// should stay at zero however long the soak runs.
+//
+// Build:  make -C tools payload_soak
+// Usage:  payload_soak [-d DAYS] [-i SECONDS] [-o MINUTES] [-e HOURS]
+//                      [-s SLOTS] [-b]
+//
+//   -d DAYS     simulated run time (default 30)
+//   -i SECONDS  time between measurements (default 5)
+//   -o MINUTES  length of each server outage (default 20, 0: none)
+//   -e HOURS    time from one outage to the next (default 6)
+//   -s SLOTS    readings the spill holds, in memory here instead of the
+//               LittleFS file (default 2048, 0: RAM queue only)
+//   -b          also build each reading's payload the way the firmwares used
+//               to, concatenating strings, for comparison
+//
+// Each measurement queues three readings (CO2, Temperature, Humidity, as on
+// the SCD4x node) and the uploader is polled once a second, as the upload
+// task does. Counts come from wrapping malloc and friends, which needs glibc;
+// std::string in -b allocates less often than Arduino's String, so its count
+// is a lower bound of what the old code cost. Host times say nothing about
+// the ESP8266's, only about how they compare.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "sensor_uploader.h"
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+static bool counting;
+static unsigned long allocations;
+
+extern "C" void *malloc(size_t size) {
+  allocations += counting;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+  allocations += counting;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+  allocations += counting;
+  return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr) { __libc_free(ptr); }
+
+// Stands in for HttpTransport: down during the outages, otherwise answering
+// every batch with 200 after checking it is a JSON array
+class SimulatedServer : public UploadTransport {
+public:
+  uint32_t nowMs = 0;
+  uint32_t outageMs = 0;
+  uint32_t everyMs = 1;
+  unsigned long bytes = 0;
+  unsigned long malformed = 0;
+
+  bool connected() override {
+    return outageMs == 0 || nowMs % everyMs >= outageMs;
+  }
+
+  int post(const char *json, size_t len) override {
+    bytes += len;
+    if (len < 2 || json[0] != '[' || json[len - 1] != ']' ||
+        strlen(json) != len) {
+      malformed++;
+    }
+    return 200;
+  }
+};
+
+// In-memory spill store, allocated before the soak starts
+static uint8_t *spill_store;
+static size_t spill_size;
+
+static bool spill_read(void *ctx, uint32_t offset, void *buf, size_t len) {
+  if (offset + len > spill_size) {
+    return false;
+  }
+  memcpy(buf, spill_store + offset, len);
+  return true;
+}
+
+static bool spill_write(void *ctx, uint32_t offset, const void *buf,
+                        size_t len) {
+  if (offset + len > spill_size) {
+    return false;
+  }
+  memcpy(spill_store + offset, buf, len);
+  return true;
+}
+
+// The payload as the firmwares concatenated it before metrics_batch
+static size_t legacy_payload(const char *name, float value) {
+  std::string payload = "{\"sensor_name\": \"";
+  payload += name;
+  payload += "\", \"sensor_value\": ";
+  payload += std::to_string((int)value);
+  payload += "}";
+  return payload.length();
+}
+
+static double seconds_since(const timespec &start) {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-d DAYS] [-i SECONDS] [-o MINUTES] [-e HOURS] "
+          "[-s SLOTS] [-b]\n",
+          argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  double days = 30;
+  unsigned interval_s = 5;
+  unsigned outage_min = 20;
+  unsigned every_h = 6;
+  unsigned spill_slots = 2048;
+  bool legacy = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:i:o:e:s:b")) != -1) {
+    switch (opt) {
+    case 'd':
+      days = atof(optarg);
+      break;
+    case 'i':
+      interval_s = (unsigned)atoi(optarg);
+      break;
+    case 'o':
+      outage_min = (unsigned)atoi(optarg);
+      break;
+    case 'e':
+      every_h = (unsigned)atoi(optarg);
+      break;
+    case 's':
+      spill_slots = (unsigned)atoi(optarg);
+      break;
+    case 'b':
+      legacy = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (days <= 0 || interval_s == 0 || every_h == 0 ||
+      outage_min * 60 >= every_h * 3600) {
+    usage(argv[0]);
+  }
+
+  static SimulatedServer server;
+  static SensorUploader uploader(server);
+  server.outageMs = outage_min * 60000;
+  server.everyMs = every_h * 3600000;
+  static reading_queue_spill_t spill = {spill_read, spill_write, NULL,
+                                        spill_slots};
+  spill_size = 64 + spill_slots * sizeof(reading_queue_entry_t); // + header
+  spill_store = (uint8_t *)calloc(1, spill_size);
+  uploader.begin(spill_slots ? &spill : NULL);
+  uploader.setMinBatch(3);
+
+  // Simulated milliseconds; uint32_t wraps after 49 days, as millis() does
+  uint64_t end_ms = (uint64_t)(days * 86400000.0);
+  unsigned long measurements = 0;
+  unsigned long legacy_bytes = 0;
+  timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  counting = true;
+  for (uint64_t t = 0; t < end_ms; t += 1000) {
+    server.nowMs = (uint32_t)t;
+    if (t % (interval_s * 1000) == 0) {
+      sensor_reading_t readings[3] = {{"CO2", 412.0f + t % 97, 0},
+                                      {"Temperature", 21.4f, 1},
+                                      {"Humidity", 48.25f, 1}};
+      uploader.add(readings, 3);
+      if (legacy) {
+        for (const sensor_reading_t &r : readings) {
+          legacy_bytes += legacy_payload(r.name, r.value);
+        }
+      }
+      measurements++;
+    }
+    uploader.poll((uint32_t)t);
+  }
+  counting = false;
+  double took = seconds_since(start);
+
+  const sensor_uploader_stats_t &stats = uploader.stats();
+  char summary[192];
+  uploader.summary(summary, sizeof(summary));
+  printf("%.1f simulated days, %lu measurements, %lu bytes posted\n", days,
+         measurements, server.bytes);
+  printf("%s\n", summary);
+  printf("heap allocations during the soak: %lu\n", allocations);
+  if (legacy) {
+    printf("(of which the string-built payloads, %lu bytes)\n", legacy_bytes);
+  }
+  if (measurements > 0) {
+    printf("%.0f ns per reading on this host\n",
+           took * 1e9 / (measurements * 3));
+  }
+  if (server.malformed) {
+    printf("%lu malformed batches\n", server.malformed);
+  }
+  return server.malformed || stats.failures ? 1 : 0;
+}
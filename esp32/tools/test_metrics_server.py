@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""Tests of metrics_server.py: payload parsing, deduplication of resent
+readings, and the HTTP endpoints over one kept-open connection.
+
+Usage: python3 test_metrics_server.py (or make -C tools check)
+"""
+
+import contextlib
+import http.client
+import io
+import json
+import threading
+import unittest
+from http.server import ThreadingHTTPServer
+
+import metrics_server
+from metrics_server import Handler, Store, parse_reading
+
+NOW = 1718000000
+
+
+def reading(name="CO2", value=412, ts=NOW, seq=None):
+    item = {"sensor_name": name, "sensor_value": value}
+    if ts is not None:
+        item["ts"] = ts
+    if seq is not None:
+        item["seq"] = seq
+    return item
+
+
+class ParseReadingTest(unittest.TestCase):
+    def test_batch_reading(self):
+        r = parse_reading(reading(seq=7), NOW + 5)
+        self.assertEqual(r, {"sensor_name": "CO2", "sensor_value": 412,
+                             "ts": NOW, "key": ("CO2", 7, NOW)})
+
+    def test_missing_ts_is_stamped_on_arrival(self):
+        r = parse_reading(reading(ts=None), NOW + 5)
+        self.assertEqual(r["ts"], NOW + 5)
+        self.assertIsNone(r["key"])
+
+    def test_seq_without_ts_is_not_deduplicated(self):
+        self.assertIsNone(parse_reading(reading(ts=None, seq=3), NOW)["key"])
+
+    def test_rejects_schema_violations(self):
+        self.assertIsNone(parse_reading([], NOW))
+        self.assertIsNone(parse_reading(reading(name=""), NOW))
+        self.assertIsNone(parse_reading(reading(value=True), NOW))
+        self.assertIsNone(parse_reading(reading(value="412"), NOW))
+        self.assertIsNone(parse_reading(reading(ts=-1), NOW))
+        self.assertIsNone(parse_reading(reading(ts=1.5), NOW))
+        self.assertIsNone(parse_reading(reading(seq=-1), NOW))
+        self.assertIsNone(parse_reading(reading(seq=False), NOW))
+
+    def test_null_value_is_accepted(self):
+        self.assertIsNone(parse_reading(reading(value=None), NOW)["sensor_value"])
+
+
+class StoreTest(unittest.TestCase):
+    def setUp(self):
+        self.store = Store(None)
+
+    def add(self, items, peer="10.0.0.2"):
+        with contextlib.redirect_stdout(io.StringIO()):
+            return self.store.add([parse_reading(i, NOW) for i in items], True, peer)
+
+    def test_resent_batch_is_counted_as_duplicates(self):
+        batch = [reading(seq=i, ts=NOW + i) for i in range(5)]
+        self.assertEqual(self.add(batch), 0)
+        self.assertEqual(self.add(batch), 5)
+        self.assertEqual(len(self.store.readings), 5)
+        self.assertEqual(self.store.stats["duplicates"], 5)
+
+    def test_restarted_seq_with_a_later_ts_is_kept(self):
+        # A RAM-only queue numbers from 0 again after a reboot
+        self.add([reading(seq=0, ts=NOW)])
+        self.assertEqual(self.add([reading(seq=0, ts=NOW + 60)]), 0)
+        self.assertEqual(len(self.store.readings), 2)
+
+    def test_restarted_seq_without_ts_is_kept(self):
+        # No clock yet: every boot sends seq 0, 1, ... without ts
+        self.add([reading(seq=0, ts=None), reading(seq=1, ts=None)])
+        self.assertEqual(self.add([reading(seq=0, ts=None)]), 0)
+        self.assertEqual(len(self.store.readings), 3)
+
+    def test_peers_are_deduplicated_apart(self):
+        self.add([reading(seq=1)], peer="10.0.0.2")
+        self.assertEqual(self.add([reading(seq=1)], peer="10.0.0.3"), 0)
+
+    def test_seen_keys_are_bounded(self):
+        saved = metrics_server.MAX_SEEN
+        metrics_server.MAX_SEEN = 3
+        try:
+            self.add([reading(seq=i) for i in range(4)])
+            self.assertEqual(len(self.store.seen), 3)
+            self.assertEqual(self.add([reading(seq=0)]), 0)  # forgotten
+        finally:
+            metrics_server.MAX_SEEN = saved
+
+
+class ServerTest(unittest.TestCase):
+    def setUp(self):
+        Handler.store = Store(None)
+        self.server = ThreadingHTTPServer(("127.0.0.1", 0), Handler)
+        self.server.daemon_threads = True
+        self.thread = threading.Thread(target=self.server.serve_forever)
+        self.thread.start()
+        self.conn = http.client.HTTPConnection("127.0.0.1", self.server.server_port,
+                                               timeout=5)
+        self.stdout = contextlib.redirect_stdout(io.StringIO())
+        self.stdout.__enter__()
+
+    def tearDown(self):
+        self.stdout.__exit__(None, None, None)
+        self.conn.close()
+        self.server.shutdown()
+        self.server.server_close()
+        self.thread.join()
+
+    def request(self, method, path, body=None):
+        data = None if body is None else json.dumps(body).encode()
+        headers = {"Content-Type": "application/json"} if data else {}
+        self.conn.request(method, path, data, headers)
+        response = self.conn.getresponse()
+        return response.status, json.loads(response.read())
+
+    def test_batch_resend_and_stats_over_one_connection(self):
+        batch = [reading("CO2", 412, seq=10), reading("Temperature", 21.4, seq=11)]
+        self.assertEqual(self.request("POST", "/data", batch),
+                         (200, {"accepted": 2, "duplicates": 0, "rejected": 0}))
+        self.assertEqual(self.request("POST", "/data", batch),
+                         (200, {"accepted": 0, "duplicates": 2, "rejected": 0}))
+        self.assertEqual(self.request("POST", "/data", reading(ts=None))[0], 200)
+
+        status, stats = self.request("GET", "/stats")
+        self.assertEqual(status, 200)
+        self.assertEqual(stats["connections"], 1)
+        self.assertEqual(stats["requests"], 3)
+        self.assertEqual(stats["batched_requests"], 2)
+        self.assertEqual(stats["single_requests"], 1)
+        self.assertEqual(stats["readings"], 3)
+        self.assertEqual(stats["duplicates"], 2)
+
+        status, rows = self.request("GET", "/data?name=CO2&n=1")
+        self.assertEqual(status, 200)
+        self.assertEqual(len(rows), 1)
+        self.assertEqual(rows[0]["sensor_name"], "CO2")
+
+    def test_invalid_readings(self):
+        status, body = self.request("POST", "/data", [reading(name=""), reading()])
+        self.assertEqual((status, body["accepted"], body["rejected"]), (200, 1, 1))
+        status, body = self.request("POST", "/data", [{"sensor_name": 1}])
+        self.assertEqual((status, body["rejected"]), (400, 1))
+        self.assertEqual(self.request("POST", "/other", [reading()])[0], 404)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,234 @@
+#ifndef COOP_SCHEDULER_H
+#define COOP_SCHEDULER_H
+
+// Cooperative timers for the Arduino firmwares in this repo (ESP32 and
+// ESP8266). Periodic work is registered as tasks instead of being paced by
+// delay() in loop(), and a wait inside a task -- a sensor powering up, a
+// measurement becoming ready -- keeps running the other tasks that fall due
+// meanwhile instead of blocking them:
+//
+//   static coop_scheduler_t scheduler;
+//   static coop_task_t readTask;
+//
+//   void setup() {
+//     coop_init(&scheduler);
+//     coop_every(&scheduler, &readTask, "read", readSensor, NULL, 5000, 0);
+//     coop_set_ready(&readTask, sensorDataReady, 500); // poll before running
+//   }
+//   void loop() { coop_loop(&scheduler); }
+//
+// Between tasks the scheduler idles through a hook, delay() by default, which
+// yields to the network stack and, on the ESP32, lets FreeRTOS run other
+// tasks. coop_idle_light_sleep() light-sleeps instead for sketches that keep
+// WiFi off while idle.
+//
+// Tasks run from whoever calls coop_run_due(), coop_wait() or coop_loop(),
+// never from an interrupt, so they need no locking among themselves. A task
+// is never re-entered: waits inside a task skip that task. The scheduler
+// itself is not locked either: on the ESP32, only the FreeRTOS task that runs
+// it may call any of these functions, including coop_wait() and
+// coop_next_due_ms().
+//
+// Times are millis() based and wrap-safe. Header-only: every sketch that uses
+// it owns its scheduler and tasks.
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#if defined(ESP32)
+#include "esp_sleep.h"
+#endif
+
+// Shortest idle period worth a light sleep; shorter ones use delay()
+#ifndef COOP_LIGHT_SLEEP_MIN_MS
+#define COOP_LIGHT_SLEEP_MIN_MS 50
+#endif
+
+#define COOP_NEVER UINT32_MAX
+
+typedef void (*coop_run_fn)(void *arg);
+typedef bool (*coop_ready_fn)(void *arg);
+typedef void (*coop_idle_fn)(uint32_t ms);
+
+typedef struct coop_task {
+  const char *name;
+  coop_run_fn run;
+  coop_ready_fn ready; // NULL: runs when due; else polled once due
+  void *arg;
+  uint32_t period_ms;  // 0: one-shot
+  uint32_t poll_ms;    // re-check interval while ready() is false
+  uint32_t due_ms;     // millis() of the next run or poll
+  bool active;
+  bool running;
+  uint32_t runs;
+  struct coop_task *next;
+} coop_task_t;
+
+typedef struct {
+  coop_task_t *tasks;
+  coop_idle_fn idle;
+} coop_scheduler_t;
+
+static inline void coop_idle_delay(uint32_t ms) { delay(ms); }
+
+#if defined(ESP32)
+// Light sleep for idle periods of COOP_LIGHT_SLEEP_MIN_MS and longer. The
+// radio and peripheral clocks stop, so only for sketches with WiFi off and no
+// transfer in flight.
+static inline void coop_idle_light_sleep(uint32_t ms) {
+  if (ms < COOP_LIGHT_SLEEP_MIN_MS) {
+    delay(ms);
+    return;
+  }
+  esp_sleep_enable_timer_wakeup((uint64_t)ms * 1000);
+  esp_light_sleep_start();
+}
+#endif
+
+// Signed distance from now to t, correct across the millis() wrap
+static inline int32_t coop_until(uint32_t t, uint32_t now) {
+  return (int32_t)(t - now);
+}
+
+static inline void coop_init(coop_scheduler_t *sched) {
+  sched->tasks = NULL;
+  sched->idle = coop_idle_delay;
+}
+
+// Registers a task that first runs first_delay_ms from now, then every
+// period_ms (0: once). A task may be registered only once.
+static inline void coop_every(coop_scheduler_t *sched, coop_task_t *task,
+                              const char *name, coop_run_fn run, void *arg,
+                              uint32_t period_ms, uint32_t first_delay_ms) {
+  task->name = name;
+  task->run = run;
+  task->ready = NULL;
+  task->arg = arg;
+  task->period_ms = period_ms;
+  task->poll_ms = 0;
+  task->due_ms = millis() + first_delay_ms;
+  task->active = true;
+  task->running = false;
+  task->runs = 0;
+  task->next = sched->tasks;
+  sched->tasks = task;
+}
+
+// One-shot task, run delay_ms from now
+static inline void coop_after(coop_scheduler_t *sched, coop_task_t *task,
+                              const char *name, coop_run_fn run, void *arg,
+                              uint32_t delay_ms) {
+  coop_every(sched, task, name, run, arg, 0, delay_ms);
+}
+
+// Once due, the task runs only when ready(arg) is true, re-checking every
+// poll_ms until it is. The period counts from the run, so a task paced by a
+// sensor's data-ready flag follows the sensor instead of drifting against it.
+static inline void coop_set_ready(coop_task_t *task, coop_ready_fn ready,
+                                  uint32_t poll_ms) {
+  task->ready = ready;
+  task->poll_ms = poll_ms ? poll_ms : 1;
+}
+
+// (Re)arms a task to run delay_ms from now; also revives a finished one-shot
+static inline void coop_start(coop_task_t *task, uint32_t delay_ms) {
+  task->due_ms = millis() + delay_ms;
+  task->active = true;
+}
+
+static inline void coop_stop(coop_task_t *task) { task->active = false; }
+
+// Milliseconds until the next task falls due, 0 if one is due already,
+// COOP_NEVER if none is active
+static inline uint32_t coop_next_due_ms(const coop_scheduler_t *sched) {
+  uint32_t now = millis();
+  uint32_t next = COOP_NEVER;
+  for (const coop_task_t *t = sched->tasks; t; t = t->next) {
+    if (!t->active || t->running) {
+      continue;
+    }
+    int32_t wait = coop_until(t->due_ms, now);
+    if (wait <= 0) {
+      return 0;
+    }
+    if ((uint32_t)wait < next) {
+      next = wait;
+    }
+  }
+  return next;
+}
+
+// Runs every task that is due and ready. Returns the number run.
+static inline int coop_run_due(coop_scheduler_t *sched) {
+  int ran = 0;
+  for (coop_task_t *t = sched->tasks; t; t = t->next) {
+    uint32_t now = millis();
+    if (!t->active || t->running || coop_until(t->due_ms, now) > 0) {
+      continue;
+    }
+    if (t->ready && !t->ready(t->arg)) {
+      t->due_ms = now + t->poll_ms;
+      continue;
+    }
+    t->running = true;
+    if (t->period_ms) {
+      t->due_ms = now + t->period_ms;
+    } else {
+      t->active = false;
+    }
+    t->run(t->arg);
+    t->running = false;
+    t->runs++;
+    ran++;
+  }
+  return ran;
+}
+
+// Waits ms, running tasks that fall due meanwhile and idling in between
+static inline void coop_wait(coop_scheduler_t *sched, uint32_t ms) {
+  uint32_t end = millis() + ms;
+  for (;;) {
+    coop_run_due(sched);
+    int32_t left = coop_until(end, millis());
+    if (left <= 0) {
+      return;
+    }
+    uint32_t idle = coop_next_due_ms(sched);
+    sched->idle(idle < (uint32_t)left ? idle : (uint32_t)left);
+  }
+}
+
+// Waits until ready(arg) is true, checking every poll_ms, for at most
+// timeout_ms (COOP_NEVER: no limit). Tasks keep running meanwhile. Returns
+// whether ready() came true.
+static inline bool coop_wait_until(coop_scheduler_t *sched,
+                                   coop_ready_fn ready, void *arg,
+                                   uint32_t poll_ms, uint32_t timeout_ms) {
+  uint32_t start = millis();
+  while (!ready(arg)) {
+    uint32_t waited = millis() - start;
+    if (timeout_ms != COOP_NEVER && waited >= timeout_ms) {
+      return false;
+    }
+    uint32_t step = poll_ms;
+    if (timeout_ms != COOP_NEVER && timeout_ms - waited < step) {
+      step = timeout_ms - waited;
+    }
+    coop_wait(sched, step);
+  }
+  return true;
+}
+
+// Body of loop(): runs what is due, then idles until the next task
+static inline void coop_loop(coop_scheduler_t *sched) {
+  coop_run_due(sched);
+  uint32_t idle = coop_next_due_ms(sched);
+  if (idle == COOP_NEVER) {
+    idle = 1000;
+  }
+  if (idle > 0) {
+    sched->idle(idle);
+  }
+}
+
+#endif
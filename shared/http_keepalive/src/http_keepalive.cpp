@@ -0,0 +1,355 @@
+#include "http_keepalive.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Splits "http://host[:port][/path]"; path points into url
+static bool parse_url(const char *url, char *host, size_t host_len,
+                      uint16_t *port, const char **path) {
+  static const char scheme[] = "http://";
+  if (strncmp(url, scheme, sizeof(scheme) - 1) != 0) {
+    return false;
+  }
+  const char *p = url + sizeof(scheme) - 1;
+  size_t n = strcspn(p, ":/");
+  if (n == 0 || n >= host_len) {
+    return false;
+  }
+  memcpy(host, p, n);
+  host[n] = '\0';
+  p += n;
+  *port = 80;
+  if (*p == ':') {
+    char *end;
+    unsigned long value = strtoul(p + 1, &end, 10);
+    if (end == p + 1 || value == 0 || value > 65535) {
+      return false;
+    }
+    *port = (uint16_t)value;
+    p = end;
+  }
+  if (*p != '\0' && *p != '/') {
+    return false;
+  }
+  *path = *p ? p : "/";
+  return true;
+}
+
+static bool timed_out(uint32_t deadline) {
+  return (int32_t)(millis() - deadline) >= 0;
+}
+
+// Reads one header line without its CRLF; longer lines are cut to fit. On
+// failure line holds what arrived of it.
+static bool read_line(WiFiClient &client, char *line, size_t len,
+                      uint32_t deadline) {
+  size_t used = 0;
+  for (;;) {
+    int ch = client.read();
+    if (ch < 0) {
+      if (!client.connected() || timed_out(deadline)) {
+        line[used] = '\0';
+        return false;
+      }
+      delay(1);
+      continue;
+    }
+    if (ch == '\n') {
+      if (used > 0 && line[used - 1] == '\r') {
+        used--;
+      }
+      line[used] = '\0';
+      return true;
+    }
+    if (used + 1 < len) {
+      line[used++] = (char)ch;
+    }
+  }
+}
+
+// Discards n bytes; SIZE_MAX reads until the server closes
+static bool skip(WiFiClient &client, size_t n, uint32_t deadline) {
+  uint8_t buf[64];
+  while (n > 0) {
+    int avail = client.available();
+    if (avail <= 0) {
+      if (!client.connected()) {
+        return n == SIZE_MAX;
+      }
+      if (timed_out(deadline)) {
+        return false;
+      }
+      delay(1);
+      continue;
+    }
+    size_t want = n < sizeof(buf) ? n : sizeof(buf);
+    int got = client.read(buf, want < (size_t)avail ? want : (size_t)avail);
+    if (got > 0 && n != SIZE_MAX) {
+      n -= got;
+    }
+  }
+  return true;
+}
+
+static bool skip_chunked(WiFiClient &client, uint32_t deadline) {
+  char line[32];
+  for (;;) {
+    if (!read_line(client, line, sizeof(line), deadline)) {
+      return false;
+    }
+    size_t size = strtoul(line, NULL, 16);
+    if (size == 0) {
+      break;
+    }
+    if (!skip(client, size, deadline) ||
+        !read_line(client, line, sizeof(line), deadline)) {
+      return false;
+    }
+  }
+  // Trailers, up to the empty line
+  do {
+    if (!read_line(client, line, sizeof(line), deadline)) {
+      return false;
+    }
+  } while (line[0] != '\0');
+  return true;
+}
+
+HttpKeepAlive::HttpKeepAlive() : _timeoutMs(HTTP_KEEPALIVE_TIMEOUT_MS) {
+  for (size_t i = 0; i < HTTP_KEEPALIVE_POOL_SIZE; i++) {
+    _pool[i].host[0] = '\0';
+    _pool[i].port = 0;
+    _pool[i].lastUsedMs = 0;
+  }
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+HttpKeepAlive::Connection *HttpKeepAlive::connectionFor(const char *host,
+                                                        uint16_t port) {
+  Connection *lru = &_pool[0];
+  for (size_t i = 0; i < HTTP_KEEPALIVE_POOL_SIZE; i++) {
+    Connection *conn = &_pool[i];
+    if (conn->port == port && strcmp(conn->host, host) == 0) {
+      return conn;
+    }
+    if (conn->host[0] == '\0') {
+      lru = conn;
+      break;
+    }
+    if ((int32_t)(conn->lastUsedMs - lru->lastUsedMs) < 0) {
+      lru = conn;
+    }
+  }
+  lru->client.stop();
+  strlcpy(lru->host, host, sizeof(lru->host));
+  lru->port = port;
+  return lru;
+}
+
+bool HttpKeepAlive::open(Connection *conn) {
+  conn->client.stop();
+  uint32_t start = micros();
+#if defined(ESP8266)
+  conn->client.setTimeout(_timeoutMs); // also bounds connect()
+  bool connected = conn->client.connect(conn->host, conn->port);
+#else
+  // The ESP32 core's connect() otherwise waits its own default of ~3 s
+  bool connected = conn->client.connect(conn->host, conn->port, _timeoutMs);
+#endif
+  if (!connected) {
+    return false;
+  }
+  uint32_t took = micros() - start;
+  conn->client.setNoDelay(true); // requests go out in one write anyway
+  _stats.connects++;
+  _stats.connect_us += took;
+  if (took > _stats.max_connect_us) {
+    _stats.max_connect_us = took;
+  }
+  return true;
+}
+
+// One request and response on conn. *retry is set when a reused connection
+// turned out to be closed by the server before any of the response arrived,
+// which is safe to try again on a fresh one. A timeout is not: the server may
+// still be handling the request.
+int HttpKeepAlive::exchange(Connection *conn, const char *path,
+                            const char *contentType, const uint8_t *body,
+                            size_t len, bool *retry) {
+  *retry = false;
+  bool reused = conn->client.connected() &&
+                millis() - conn->lastUsedMs < HTTP_KEEPALIVE_IDLE_MS;
+  if (reused) {
+    _stats.reuses++;
+  } else if (!open(conn)) {
+    return HTTP_KEEPALIVE_ERROR_CONNECT;
+  }
+
+  // Headers and, when it fits, the body in a single write: one segment for
+  // the typical reading
+  char request[512];
+  int head = snprintf(request, sizeof(request),
+                      "POST %s HTTP/1.1\r\n"
+                      "Host: %s:%u\r\n"
+                      "Content-Type: %s\r\n"
+                      "Content-Length: %u\r\n"
+                      "Connection: keep-alive\r\n\r\n",
+                      path, conn->host, conn->port, contentType,
+                      (unsigned)len);
+  if (head < 0 || (size_t)head >= sizeof(request)) {
+    return HTTP_KEEPALIVE_ERROR_URL;
+  }
+  uint32_t start = micros();
+  bool sent;
+  if (head + len <= sizeof(request)) {
+    memcpy(request + head, body, len);
+    sent = conn->client.write((const uint8_t *)request, head + len) ==
+           head + len;
+  } else {
+    sent = conn->client.write((const uint8_t *)request, head) == (size_t)head &&
+           conn->client.write(body, len) == len;
+  }
+  if (!sent) {
+    *retry = reused && !conn->client.connected();
+    conn->client.stop();
+    return HTTP_KEEPALIVE_ERROR_SEND;
+  }
+
+  uint32_t deadline = millis() + _timeoutMs;
+  char line[128];
+  if (!read_line(conn->client, line, sizeof(line), deadline)) {
+    *retry = reused && !conn->client.connected() && line[0] == '\0';
+    conn->client.stop();
+    return HTTP_KEEPALIVE_ERROR_READ;
+  }
+  if (strncmp(line, "HTTP/1.", 7) != 0 || strlen(line) < 12) {
+    conn->client.stop();
+    return HTTP_KEEPALIVE_ERROR_READ;
+  }
+  bool keep = line[7] == '1'; // HTTP/1.0 closes unless told otherwise
+  int status = atoi(line + 9);
+
+  size_t content_length = SIZE_MAX;
+  bool chunked = false;
+  for (;;) {
+    if (!read_line(conn->client, line, sizeof(line), deadline)) {
+      conn->client.stop();
+      return HTTP_KEEPALIVE_ERROR_READ;
+    }
+    if (line[0] == '\0') {
+      break;
+    }
+    char *value = strchr(line, ':');
+    if (!value) {
+      continue;
+    }
+    *value++ = '\0';
+    while (*value == ' ') {
+      value++;
+    }
+    if (strcasecmp(line, "Content-Length") == 0) {
+      content_length = strtoul(value, NULL, 10);
+    } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+      chunked = strcasecmp(value, "chunked") == 0;
+    } else if (strcasecmp(line, "Connection") == 0) {
+      keep = strcasecmp(value, "close") != 0;
+    }
+  }
+  uint32_t took = micros() - start;
+  _stats.request_us += took;
+  if (took > _stats.max_request_us) {
+    _stats.max_request_us = took;
+  }
+
+  bool body_read;
+  if (status == 204 || status == 304) {
+    body_read = true;
+  } else if (chunked) {
+    body_read = skip_chunked(conn->client, deadline);
+  } else if (content_length != SIZE_MAX) {
+    body_read = skip(conn->client, content_length, deadline);
+  } else {
+    keep = false; // the body runs until the server closes
+    body_read = skip(conn->client, SIZE_MAX, deadline);
+  }
+  if (!keep || !body_read) {
+    conn->client.stop();
+  }
+  conn->lastUsedMs = millis();
+  return status;
+}
+
+int HttpKeepAlive::post(const char *url, const char *contentType,
+                        const uint8_t *body, size_t len) {
+  char host[HTTP_KEEPALIVE_HOST_MAX];
+  uint16_t port;
+  const char *path;
+  if (!parse_url(url, host, sizeof(host), &port, &path)) {
+    _stats.failures++;
+    return HTTP_KEEPALIVE_ERROR_URL;
+  }
+  Connection *conn = connectionFor(host, port);
+  bool retry;
+  int code = exchange(conn, path, contentType, body, len, &retry);
+  if (code < 0 && retry) {
+    _stats.retries++;
+    code = exchange(conn, path, contentType, body, len, &retry);
+  }
+  if (code > 0) {
+    _stats.requests++;
+  } else {
+    _stats.failures++;
+  }
+  return code;
+}
+
+int HttpKeepAlive::post(const char *url, const char *contentType,
+                        const char *body) {
+  return post(url, contentType, (const uint8_t *)body, strlen(body));
+}
+
+int HttpKeepAlive::post(const char *url, const char *contentType,
+                        const String &body) {
+  return post(url, contentType, (const uint8_t *)body.c_str(), body.length());
+}
+
+void HttpKeepAlive::closeAll() {
+  for (size_t i = 0; i < HTTP_KEEPALIVE_POOL_SIZE; i++) {
+    _pool[i].client.stop();
+  }
+}
+
+void HttpKeepAlive::printStats(Print &out) const {
+  uint32_t connect_avg =
+      _stats.connects ? (uint32_t)(_stats.connect_us / _stats.connects) : 0;
+  uint32_t request_avg =
+      _stats.requests ? (uint32_t)(_stats.request_us / _stats.requests) : 0;
+  out.printf("HTTP keep-alive: %u requests, %u failed, %u connects, "
+             "%u reused, %u retried; connect avg %u.%u ms, max %u.%u ms; "
+             "request avg %u.%u ms, max %u.%u ms\n",
+             (unsigned)_stats.requests, (unsigned)_stats.failures,
+             (unsigned)_stats.connects, (unsigned)_stats.reuses,
+             (unsigned)_stats.retries, (unsigned)(connect_avg / 1000),
+             (unsigned)(connect_avg / 100 % 10),
+             (unsigned)(_stats.max_connect_us / 1000),
+             (unsigned)(_stats.max_connect_us / 100 % 10),
+             (unsigned)(request_avg / 1000), (unsigned)(request_avg / 100 % 10),
+             (unsigned)(_stats.max_request_us / 1000),
+             (unsigned)(_stats.max_request_us / 100 % 10));
+}
+
+const char *HttpKeepAlive::errorToString(int code) {
+  switch (code) {
+  case HTTP_KEEPALIVE_ERROR_URL:
+    return "invalid URL";
+  case HTTP_KEEPALIVE_ERROR_CONNECT:
+    return "connection refused";
+  case HTTP_KEEPALIVE_ERROR_SEND:
+    return "connection lost while sending";
+  case HTTP_KEEPALIVE_ERROR_READ:
+    return "no response";
+  default:
+    return code > 0 ? "HTTP status" : "unknown error";
+  }
+}
@@ -0,0 +1,111 @@
+#ifndef HTTP_KEEPALIVE_H
+#define HTTP_KEEPALIVE_H
+
+// Keep-alive HTTP/1.1 POST client for the sensor firmwares (ESP32 and
+// ESP8266). HTTPClient opens a TCP connection for every request and closes it
+// afterwards, so each reading of a few dozen bytes pays for a handshake and a
+// teardown on top of the request itself. HttpKeepAlive keeps a small pool of
+// open connections, one per server, sends each request on the open one and
+// reconnects by itself when the server has dropped it:
+//
+//   static HttpKeepAlive uploader;
+//
+//   int code = uploader.post(serverUrl, "application/json", payload);
+//   if (code > 0) {
+//     // HTTP status
+//   } else {
+//     Serial.println(HttpKeepAlive::errorToString(code));
+//   }
+//
+// Only plain http:// URLs. The response is read up to the end of its headers
+// and its body skipped. The counters tell the time spent opening connections
+// apart from the time spent on requests.
+
+#include <Arduino.h>
+#include <stdint.h>
+
+#if defined(ESP8266)
+#include <ESP8266WiFi.h>
+#else
+#include <WiFi.h>
+#endif
+
+// Servers kept connected at once; the least recently used one makes room
+#ifndef HTTP_KEEPALIVE_POOL_SIZE
+#define HTTP_KEEPALIVE_POOL_SIZE 2
+#endif
+
+// A connection idle for longer is reopened instead of reused, as the server
+// has most likely timed it out by then
+#ifndef HTTP_KEEPALIVE_IDLE_MS
+#define HTTP_KEEPALIVE_IDLE_MS 30000
+#endif
+
+// Default limit for connecting and for each response; see setTimeout()
+#ifndef HTTP_KEEPALIVE_TIMEOUT_MS
+#define HTTP_KEEPALIVE_TIMEOUT_MS 5000
+#endif
+
+#define HTTP_KEEPALIVE_HOST_MAX 64
+
+// Negative results of post()
+#define HTTP_KEEPALIVE_ERROR_URL -1     // not an http://host[:port]/path URL
+#define HTTP_KEEPALIVE_ERROR_CONNECT -2 // TCP connect failed
+#define HTTP_KEEPALIVE_ERROR_SEND -3    // connection lost while sending
+#define HTTP_KEEPALIVE_ERROR_READ -4    // no valid response in time
+
+typedef struct {
+  uint32_t requests;       // answered with an HTTP status
+  uint32_t failures;       // ended with an error instead
+  uint32_t connects;       // TCP connections opened
+  uint32_t reuses;         // requests sent on an already open connection
+  uint32_t retries;        // requests resent after a reused connection broke
+  uint64_t connect_us;     // total time spent connecting
+  uint64_t request_us;     // total time from sending to the end of the headers
+  uint32_t max_connect_us;
+  uint32_t max_request_us;
+} http_keepalive_stats_t;
+
+class HttpKeepAlive {
+public:
+  HttpKeepAlive();
+
+  // POSTs body to url. Returns the HTTP status, or a negative
+  // HTTP_KEEPALIVE_ERROR_* value.
+  int post(const char *url, const char *contentType, const uint8_t *body,
+           size_t len);
+  int post(const char *url, const char *contentType, const char *body);
+  int post(const char *url, const char *contentType, const String &body);
+
+  // Closes every pooled connection, e.g. before WiFi goes down
+  void closeAll();
+
+  // Limit for connecting and for each response, HTTP_KEEPALIVE_TIMEOUT_MS
+  // unless set. A post() that has to resend on a fresh connection can take
+  // up to twice that for each.
+  void setTimeout(uint32_t ms) { _timeoutMs = ms; }
+
+  const http_keepalive_stats_t &stats() const { return _stats; }
+  void printStats(Print &out) const;
+
+  static const char *errorToString(int code);
+
+private:
+  struct Connection {
+    WiFiClient client;
+    char host[HTTP_KEEPALIVE_HOST_MAX];
+    uint16_t port;
+    uint32_t lastUsedMs;
+  };
+
+  Connection *connectionFor(const char *host, uint16_t port);
+  bool open(Connection *conn);
+  int exchange(Connection *conn, const char *path, const char *contentType,
+               const uint8_t *body, size_t len, bool *retry);
+
+  Connection _pool[HTTP_KEEPALIVE_POOL_SIZE];
+  uint32_t _timeoutMs;
+  http_keepalive_stats_t _stats;
+};
+
+#endif
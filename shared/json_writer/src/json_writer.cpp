@@ -0,0 +1,206 @@
+#include "json_writer.h"
+
+#include <math.h>
+#include <string.h>
+
+// 2^53: below it a double holds every integer, so a float scaled by up to
+// 10^6 is exact (24-bit mantissa times 5^6 < 2^14) and so is its rounding
+#define EXACT_LIMIT 9007199254740992.0
+
+static const uint32_t pow10_table[JSON_WRITER_DECIMALS_MAX + 1] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000};
+
+// Appends n bytes if they fit along with the NUL, otherwise nothing
+static bool append(json_writer_t *out, const char *s, size_t n) {
+  if (out->overflow || out->len + n >= out->size) {
+    out->overflow = true;
+    return false;
+  }
+  memcpy(out->buf + out->len, s, n);
+  out->len += n;
+  out->buf[out->len] = '\0';
+  return true;
+}
+
+// Writes the digits of value backwards from end; returns the first one
+static char *format_digits(char *end, uint64_t value) {
+  do {
+    *--end = (char)('0' + value % 10);
+    value /= 10;
+  } while (value);
+  return end;
+}
+
+// Bytes c takes inside a JSON string
+static size_t escaped_length(unsigned char c) {
+  switch (c) {
+  case '"':
+  case '\\':
+  case '\b':
+  case '\f':
+  case '\n':
+  case '\r':
+  case '\t':
+    return 2;
+  default:
+    return c < 0x20 ? 6 : 1; // \u00XX
+  }
+}
+
+void json_writer_init(json_writer_t *out, char *buf, size_t size) {
+  out->buf = buf;
+  out->size = size;
+  json_writer_truncate(out, 0);
+}
+
+void json_writer_truncate(json_writer_t *out, size_t len) {
+  out->len = len;
+  out->buf[len] = '\0';
+  out->overflow = false;
+}
+
+bool json_write_raw(json_writer_t *out, const char *s) {
+  return append(out, s, strlen(s));
+}
+
+bool json_write_string(json_writer_t *out, const char *s) {
+  const unsigned char *p;
+  size_t n = 2; // quotes
+  for (p = (const unsigned char *)s; *p; p++) {
+    n += escaped_length(*p);
+  }
+  if (out->overflow || out->len + n >= out->size) {
+    out->overflow = true;
+    return false;
+  }
+
+  static const char hex[] = "0123456789abcdef";
+  char *d = out->buf + out->len;
+  *d++ = '"';
+  for (p = (const unsigned char *)s; *p; p++) {
+    unsigned char c = *p;
+    if (escaped_length(c) == 1) {
+      *d++ = (char)c;
+      continue;
+    }
+    *d++ = '\\';
+    switch (c) {
+    case '"':
+    case '\\':
+      *d++ = (char)c;
+      break;
+    case '\b':
+      *d++ = 'b';
+      break;
+    case '\f':
+      *d++ = 'f';
+      break;
+    case '\n':
+      *d++ = 'n';
+      break;
+    case '\r':
+      *d++ = 'r';
+      break;
+    case '\t':
+      *d++ = 't';
+      break;
+    default:
+      *d++ = 'u';
+      *d++ = '0';
+      *d++ = '0';
+      *d++ = hex[c >> 4];
+      *d++ = hex[c & 0xf];
+      break;
+    }
+  }
+  *d++ = '"';
+  *d = '\0';
+  out->len += n;
+  return true;
+}
+
+bool json_write_uint(json_writer_t *out, uint32_t value) {
+  char text[10];
+  char *end = text + sizeof(text);
+  char *start = format_digits(end, value);
+  return append(out, start, end - start);
+}
+
+bool json_write_int(json_writer_t *out, int32_t value) {
+  char text[11];
+  char *end = text + sizeof(text);
+  uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+  char *start = format_digits(end, magnitude);
+  if (value < 0) {
+    *--start = '-';
+  }
+  return append(out, start, end - start);
+}
+
+// Seven significant digits, all a float has: [-]d.ddddddeN. Only values
+// of 1e9 and more get here, so the exponent is positive.
+static bool write_exponent(json_writer_t *out, float value) {
+  double magnitude = fabs((double)value);
+  int exponent = (int)floor(log10(magnitude));
+  uint32_t digits = (uint32_t)llround(magnitude / pow(10.0, exponent) * 1e6);
+  if (digits >= 10000000) { // rounded up to the next power of ten
+    digits /= 10;
+    exponent++;
+  }
+  char mantissa[7];
+  format_digits(mantissa + sizeof(mantissa), digits);
+
+  char text[20];
+  size_t n = 0;
+  if (value < 0) {
+    text[n++] = '-';
+  }
+  text[n++] = mantissa[0];
+  text[n++] = '.';
+  memcpy(text + n, mantissa + 1, 6);
+  n += 6;
+  text[n++] = 'e';
+  char power[3];
+  char *end = power + sizeof(power);
+  char *start = format_digits(end, (uint64_t)exponent);
+  memcpy(text + n, start, end - start);
+  n += end - start;
+  return append(out, text, n);
+}
+
+bool json_write_fixed(json_writer_t *out, float value, uint8_t decimals) {
+  if (!isfinite(value)) {
+    return json_write_raw(out, "null");
+  }
+  if (decimals > JSON_WRITER_DECIMALS_MAX) {
+    decimals = JSON_WRITER_DECIMALS_MAX;
+  }
+  double scaled = fabs((double)value) * pow10_table[decimals];
+  if (scaled >= EXACT_LIMIT) {
+    return write_exponent(out, value);
+  }
+
+  // Round half to even, as printf does with a value exactly halfway
+  uint64_t units = (uint64_t)scaled;
+  double rest = scaled - (double)units;
+  if (rest > 0.5 || (rest == 0.5 && (units & 1))) {
+    units++;
+  }
+
+  char text[24]; // 16 digits, the point, a sign
+  char *end = text + sizeof(text);
+  char *start = end;
+  bool negative = value < 0 && units > 0;
+  for (uint8_t i = 0; i < decimals; i++) {
+    *--start = (char)('0' + units % 10);
+    units /= 10;
+  }
+  if (decimals > 0) {
+    *--start = '.';
+  }
+  start = format_digits(start, units);
+  if (negative) {
+    *--start = '-';
+  }
+  return append(out, start, end - start);
+}
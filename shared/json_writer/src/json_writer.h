@@ -0,0 +1,72 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+// Appends JSON tokens to a buffer the caller owns, without touching the heap.
+// Payloads built from Arduino Strings or JSONVar allocate for every reading,
+// and even snprintf("%f") goes through the C library's float conversion,
+// which keeps its scratch numbers on the heap; on a node that runs for weeks
+// that splinters the ESP8266's small heap. Here the numbers are formatted by
+// hand: integers, and floats as fixed-point with a given number of decimals,
+// rounded as printf rounds them.
+//
+//   static char buf[256];
+//   json_writer_t out;
+//   json_writer_init(&out, buf, sizeof(buf));
+//   json_write_raw(&out, "{\"sensor_name\":");
+//   json_write_string(&out, name);
+//   json_write_raw(&out, ",\"sensor_value\":");
+//   json_write_fixed(&out, 21.44f, 1);
+//   json_write_raw(&out, "}");
+//   if (json_writer_overflowed(&out)) { ... }
+//
+// A write either appends all of its token or nothing. Once one did not fit
+// the writer stays overflowed and ignores further writes, so a sequence can
+// be checked once at the end and undone with json_writer_truncate(). The
+// buffer holds a NUL-terminated string at all times.
+//
+// Plain C++ without Arduino dependencies, so it builds and runs on a host.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Most decimals json_write_fixed() writes; more are cut to this
+#ifndef JSON_WRITER_DECIMALS_MAX
+#define JSON_WRITER_DECIMALS_MAX 6
+#endif
+
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t len; // excluding the terminating NUL
+  bool overflow;
+} json_writer_t;
+
+// Starts an empty string in buf, which holds size bytes (at least 1)
+void json_writer_init(json_writer_t *out, char *buf, size_t size);
+
+// Cuts the output back to its first len bytes, e.g. to undo a partly written
+// value after an overflow, and clears the overflow
+void json_writer_truncate(json_writer_t *out, size_t len);
+
+// Appends s as is: punctuation and keys that need no escaping
+bool json_write_raw(json_writer_t *out, const char *s);
+
+// Appends s as a quoted JSON string, escaping quotes, backslashes and control
+// characters. Other bytes, UTF-8 included, are copied unchanged.
+bool json_write_string(json_writer_t *out, const char *s);
+
+bool json_write_uint(json_writer_t *out, uint32_t value);
+bool json_write_int(json_writer_t *out, int32_t value);
+
+// Appends value with the given number of decimals, as "%.*f" would, except
+// that a value rounding to zero loses its minus sign. A value that is not
+// finite is written as null; one too large for exact fixed-point (value
+// times 10^decimals of 2^53, about 9e15, or more) in exponent notation with
+// seven significant digits, e.g. 1.000000e10.
+bool json_write_fixed(json_writer_t *out, float value, uint8_t decimals);
+
+static inline bool json_writer_overflowed(const json_writer_t *out) {
+  return out->overflow;
+}
+
+#endif
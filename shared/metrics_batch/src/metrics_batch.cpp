@@ -0,0 +1,77 @@
+#include "metrics_batch.h"
+
+#include <time.h>
+
+// Earlier times mean the clock was never set
+#define METRICS_BATCH_MIN_EPOCH 1672531200 // 2023-01-01
+
+void metrics_batch_init(metrics_batch_t *batch, char *buf, size_t size) {
+  json_writer_init(&batch->out, buf, size);
+  metrics_batch_clear(batch);
+}
+
+void metrics_batch_clear(metrics_batch_t *batch) {
+  batch->count = 0;
+  batch->ticks = 0;
+  json_writer_truncate(&batch->out, 0);
+#if !METRICS_BATCH_LEGACY
+  json_write_raw(&batch->out, "[]");
+#endif
+}
+
+bool metrics_batch_add(metrics_batch_t *batch, const char *name, float value,
+                       uint8_t decimals, uint32_t ts) {
+  return metrics_batch_add_seq(batch, name, value, decimals, ts, 0);
+}
+
+bool metrics_batch_add_seq(metrics_batch_t *batch, const char *name,
+                           float value, uint8_t decimals, uint32_t ts,
+                           uint32_t seq) {
+  json_writer_t *out = &batch->out;
+  size_t before = out->len;
+#if METRICS_BATCH_LEGACY
+  if (batch->count > 0) {
+    return false;
+  }
+#else
+  if (before == 0) {
+    return false; // the buffer could not even hold "[]"
+  }
+  // Overwrite the closing bracket and put it back after the new reading
+  json_writer_truncate(out, before - 1);
+  if (batch->count > 0) {
+    json_write_raw(out, ",");
+  }
+#endif
+  json_write_raw(out, "{\"sensor_name\":");
+  json_write_string(out, name);
+  json_write_raw(out, ",\"sensor_value\":");
+  json_write_fixed(out, value, decimals);
+  if (ts) {
+    json_write_raw(out, ",\"ts\":");
+    json_write_uint(out, ts);
+  }
+  if (seq) {
+    json_write_raw(out, ",\"seq\":");
+    json_write_uint(out, seq);
+  }
+  json_write_raw(out, "}");
+#if !METRICS_BATCH_LEGACY
+  json_write_raw(out, "]");
+#endif
+  if (json_writer_overflowed(out)) {
+    // Undo the partial write
+    json_writer_truncate(out, before);
+#if !METRICS_BATCH_LEGACY
+    out->buf[before - 1] = ']';
+#endif
+    return false;
+  }
+  batch->count++;
+  return true;
+}
+
+uint32_t metrics_batch_now() {
+  time_t now = time(NULL);
+  return now >= METRICS_BATCH_MIN_EPOCH ? (uint32_t)now : 0;
+}
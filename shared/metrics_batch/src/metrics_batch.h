@@ -0,0 +1,79 @@
+#ifndef METRICS_BATCH_H
+#define METRICS_BATCH_H
+
+// Batched readings for the /data endpoint. Instead of one POST per metric,
+// the readings of a tick -- and optionally of several ticks -- go out as one
+// JSON array:
+//
+//   [{"sensor_name":"CO2","sensor_value":412,"ts":1718000000},
+//    {"sensor_name":"Temperature","sensor_value":21.4,"ts":1718000000}]
+//
+// The server keeps accepting the single object the firmwares used to send,
+// {"sensor_name":...,"sensor_value":...}, so boards on old and new firmware
+// report side by side; esp32/tools/metrics_server.py is a local stand-in that
+// takes both. ts is the reading's Unix time, left out while the clock is not
+// set, in which case the server stamps the reading on arrival. Readings
+// queued through an outage (reading_queue.h) also carry a "seq".
+//
+// The batch is built in place in a buffer the sketch owns and is valid JSON
+// after every add:
+//
+//   static char buf[512];
+//   static metrics_batch_t batch;
+//   metrics_batch_init(&batch, buf, sizeof(buf));
+//   metrics_batch_add(&batch, "CO2", co2, 0, metrics_batch_now());
+//   uploader.post(url, "application/json", metrics_batch_json(&batch));
+//
+// Built with json_writer.h: adding a reading takes no heap, and sensor names
+// are escaped as JSON strings.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "json_writer.h"
+
+// 1: every batch holds a single reading, sent as the bare object older
+// servers expect, i.e. one POST per reading as before
+#ifndef METRICS_BATCH_LEGACY
+#define METRICS_BATCH_LEGACY 0
+#endif
+
+typedef struct {
+  json_writer_t out;
+  uint16_t count; // readings in the batch
+  uint16_t ticks; // ticks ended with metrics_batch_end_tick()
+} metrics_batch_t;
+
+void metrics_batch_init(metrics_batch_t *batch, char *buf, size_t size);
+void metrics_batch_clear(metrics_batch_t *batch);
+
+// Appends a reading with the given number of decimals; ts 0 leaves the
+// timestamp out. A value that is not finite is sent as null. Returns false,
+// leaving the batch as it was, when the reading does not fit.
+bool metrics_batch_add(metrics_batch_t *batch, const char *name, float value,
+                       uint8_t decimals, uint32_t ts);
+
+// The same with the reading's sequence number as "seq", by which the server
+// recognises a reading it already has when a batch is sent again; seq 0
+// leaves it out
+bool metrics_batch_add_seq(metrics_batch_t *batch, const char *name,
+                           float value, uint8_t decimals, uint32_t ts,
+                           uint32_t seq);
+
+// Marks the end of a tick's readings
+static inline void metrics_batch_end_tick(metrics_batch_t *batch) {
+  batch->ticks++;
+}
+
+static inline const char *metrics_batch_json(const metrics_batch_t *batch) {
+  return batch->out.buf;
+}
+
+static inline size_t metrics_batch_length(const metrics_batch_t *batch) {
+  return batch->out.len;
+}
+
+// Unix time for ts, or 0 while the clock has not been set (e.g. by NTP)
+uint32_t metrics_batch_now();
+
+#endif
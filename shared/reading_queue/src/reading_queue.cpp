@@ -0,0 +1,227 @@
+#include "reading_queue.h"
+
+#include <string.h>
+
+#define SPILL_MAGIC 0x52514832 // "RQH2"
+
+// At offset 0 of the spill store, followed by the slots
+typedef struct {
+  uint32_t magic;
+  uint32_t entry_size;
+  uint32_t slots;
+  uint32_t head;
+  uint32_t count;
+  uint32_t seq_reserved;
+  uint32_t last_seq; // newest reading spilled when the header was written
+} spill_header_t;
+
+static uint32_t slot_offset(uint32_t slot) {
+  return sizeof(spill_header_t) + slot * sizeof(reading_queue_entry_t);
+}
+
+static void save_header(reading_queue_t *queue) {
+  const reading_queue_spill_t *spill = queue->spill;
+  spill_header_t header = {SPILL_MAGIC,        sizeof(reading_queue_entry_t),
+                           spill->slots,       queue->spill_head,
+                           queue->spill_count, queue->seq_reserved,
+                           queue->spill_last_seq};
+  spill->write(spill->ctx, 0, &header, sizeof(header));
+  queue->spill_unsaved = 0;
+}
+
+// Wrap-safe a > b for sequence numbers
+static bool seq_after(uint32_t a, uint32_t b) { return (int32_t)(a - b) > 0; }
+
+// Readings spilled after the header was last written take the slots from
+// the header's tail on, and each is newer than any the header knew of, while
+// every other slot holds an older reading. A number at or past seq_reserved
+// was never handed out, so that slot is not one of them either.
+static void recover_unsaved(reading_queue_t *queue, uint32_t seq_reserved) {
+  const reading_queue_spill_t *spill = queue->spill;
+  uint32_t tail = (queue->spill_head + queue->spill_count) % spill->slots;
+  uint32_t newest_seq = queue->spill_last_seq;
+  uint32_t newest_slot = 0;
+  uint32_t found = 0;
+  for (; found < spill->slots; found++) {
+    uint32_t slot = (tail + found) % spill->slots;
+    reading_queue_entry_t entry;
+    if (!spill->read(spill->ctx, slot_offset(slot), &entry, sizeof(entry)) ||
+        !seq_after(entry.seq, queue->spill_last_seq) ||
+        !seq_after(seq_reserved, entry.seq)) {
+      break;
+    }
+    if (seq_after(entry.seq, newest_seq)) {
+      newest_seq = entry.seq;
+      newest_slot = slot;
+    }
+  }
+  if (found == 0) {
+    return;
+  }
+  if (found == spill->slots) {
+    // Every slot was rewritten, some more than once: the oldest reading is
+    // the one after the newest
+    queue->spill_head = (newest_slot + 1) % spill->slots;
+    queue->spill_count = spill->slots;
+  } else {
+    // Appends to a full spill overwrote its oldest readings
+    uint32_t count = queue->spill_count + found;
+    if (count > spill->slots) {
+      queue->spill_head =
+          (queue->spill_head + count - spill->slots) % spill->slots;
+      count = spill->slots;
+    }
+    queue->spill_count = count;
+  }
+  queue->spill_last_seq = newest_seq;
+}
+
+// The spill's readings are unreadable: give them up rather than block the
+// newer ones behind them
+static void drop_spill(reading_queue_t *queue) {
+  queue->dropped += queue->spill_count;
+  queue->spill_head = 0;
+  queue->spill_count = 0;
+  save_header(queue);
+}
+
+static void spill_append(reading_queue_t *queue,
+                         const reading_queue_entry_t *entry) {
+  const reading_queue_spill_t *spill = queue->spill;
+  if (queue->spill_count == spill->slots) {
+    queue->spill_head = (queue->spill_head + 1) % spill->slots;
+    queue->spill_count--;
+    queue->dropped++;
+  }
+  uint32_t slot = (queue->spill_head + queue->spill_count) % spill->slots;
+  if (!spill->write(spill->ctx, slot_offset(slot), entry, sizeof(*entry))) {
+    queue->dropped++;
+    return;
+  }
+  queue->spill_count++;
+  queue->spilled++;
+  queue->spill_last_seq = entry->seq;
+  if (++queue->spill_unsaved >= READING_QUEUE_HEADER_EVERY) {
+    save_header(queue);
+  }
+}
+
+void reading_queue_init(reading_queue_t *queue, reading_queue_entry_t *ram,
+                        uint16_t ram_slots, const reading_queue_spill_t *spill) {
+  memset(queue, 0, sizeof(*queue));
+  queue->ram = ram;
+  queue->ram_slots = ram_slots;
+  queue->spill = spill && spill->slots ? spill : NULL;
+  queue->next_seq = 1; // 0 means "no seq" in a batch
+
+  if (!queue->spill) {
+    return;
+  }
+  spill_header_t header;
+  bool ours = spill->read(spill->ctx, 0, &header, sizeof(header)) &&
+              header.magic == SPILL_MAGIC &&
+              header.entry_size == sizeof(reading_queue_entry_t);
+  // Numbers up to seq_reserved may have been used before the reboot. Even a
+  // resized spill, which starts empty, keeps numbering past them, so its
+  // stale slots never look newer than what is spilled next.
+  if (ours && header.seq_reserved > 0) {
+    queue->next_seq = header.seq_reserved;
+  }
+  if (ours && header.slots == spill->slots && header.head < header.slots &&
+      header.count <= header.slots) {
+    queue->spill_head = header.head;
+    queue->spill_count = header.count;
+    queue->spill_last_seq = header.last_seq;
+    recover_unsaved(queue, header.seq_reserved);
+  } else {
+    // Starting empty: whatever the slots hold is older than what comes next
+    queue->spill_last_seq = queue->next_seq - 1;
+  }
+  queue->seq_reserved = queue->next_seq;
+  save_header(queue);
+}
+
+uint32_t reading_queue_push(reading_queue_t *queue, const char *name,
+                            float value, uint8_t decimals, uint32_t ts) {
+  uint32_t seq = queue->next_seq++;
+  if (queue->next_seq == 0) {
+    queue->next_seq = 1;
+  }
+  if (queue->spill && seq >= queue->seq_reserved) {
+    queue->seq_reserved = seq + READING_QUEUE_SEQ_BLOCK;
+    save_header(queue);
+  }
+
+  if (queue->ram_count == queue->ram_slots) {
+    // Make room by moving the oldest reading out of RAM
+    const reading_queue_entry_t *oldest = &queue->ram[queue->ram_head];
+    if (queue->spill) {
+      spill_append(queue, oldest);
+    } else {
+      queue->dropped++;
+    }
+    queue->ram_head = (queue->ram_head + 1) % queue->ram_slots;
+    queue->ram_count--;
+  }
+
+  reading_queue_entry_t *entry =
+      &queue->ram[(queue->ram_head + queue->ram_count) % queue->ram_slots];
+  entry->seq = seq;
+  entry->ts = ts;
+  entry->value = value;
+  entry->decimals = decimals;
+  strncpy(entry->name, name, sizeof(entry->name) - 1);
+  entry->name[sizeof(entry->name) - 1] = '\0';
+  queue->ram_count++;
+  return seq;
+}
+
+size_t reading_queue_peek(reading_queue_t *queue, reading_queue_entry_t *out,
+                          size_t max) {
+  size_t n = 0;
+  const reading_queue_spill_t *spill = queue->spill;
+  // The spill holds the oldest readings
+  for (uint32_t i = 0; i < queue->spill_count && n < max; i++) {
+    uint32_t slot = (queue->spill_head + i) % spill->slots;
+    if (!spill->read(spill->ctx, slot_offset(slot), &out[n], sizeof(out[n]))) {
+      drop_spill(queue);
+      n = 0;
+      break;
+    }
+    n++;
+  }
+  for (uint16_t i = 0; i < queue->ram_count && n < max; i++) {
+    out[n++] = queue->ram[(queue->ram_head + i) % queue->ram_slots];
+  }
+  return n;
+}
+
+void reading_queue_pop(reading_queue_t *queue, size_t n) {
+  if (n > 0 && queue->spill_count > 0) {
+    uint32_t k = n < queue->spill_count ? n : queue->spill_count;
+    queue->spill_head = (queue->spill_head + k) % queue->spill->slots;
+    queue->spill_count -= k;
+    n -= k;
+    save_header(queue);
+  }
+  uint16_t k = n < queue->ram_count ? n : queue->ram_count;
+  queue->ram_head = (queue->ram_head + k) % queue->ram_slots;
+  queue->ram_count -= k;
+}
+
+size_t reading_queue_fill_batch(reading_queue_t *queue,
+                                metrics_batch_t *batch) {
+  reading_queue_entry_t entries[READING_QUEUE_BATCH_MAX];
+  size_t n = reading_queue_peek(queue, entries, READING_QUEUE_BATCH_MAX);
+  metrics_batch_clear(batch);
+  size_t added = 0;
+  while (added < n) {
+    const reading_queue_entry_t *e = &entries[added];
+    if (!metrics_batch_add_seq(batch, e->name, e->value, e->decimals, e->ts,
+                               e->seq)) {
+      break;
+    }
+    added++;
+  }
+  return added;
+}
@@ -0,0 +1,132 @@
+#ifndef READING_QUEUE_H
+#define READING_QUEUE_H
+
+// Store-and-forward queue for sensor readings. Every reading is queued with a
+// sequence number and its timestamp, and the queue is drained oldest first
+// whenever the metrics server can be reached; while WiFi or the server is
+// down the readings wait instead of being lost:
+//
+//   static reading_queue_entry_t ram[64];
+//   static reading_queue_t queue;
+//   reading_queue_init(&queue, ram, 64, NULL);
+//
+//   reading_queue_push(&queue, "CO2", co2, 0, metrics_batch_now());
+//   while (reading_queue_size(&queue) > 0) {
+//     size_t n = reading_queue_fill_batch(&queue, &batch);
+//     int code = n ? client.post(url, "application/json",
+//                                metrics_batch_json(&batch)) : 0;
+//     if (code < 200 || code >= 300) {
+//       break; // try again with the next reading
+//     }
+//     reading_queue_pop(&queue, n);
+//   }
+//
+// The RAM ring holds the newest readings. Given a spill store -- a LittleFS
+// file through reading_queue_littlefs.h, or memory in a host test -- the
+// readings the ring has no room for move there instead of being dropped;
+// when that is full too, the oldest reading goes. The spill also keeps the
+// sequence counter across reboots, so the numbers keep rising and the server
+// can drop a reading it already has when a batch is resent after its reply
+// was lost.
+//
+// Plain C++ without Arduino dependencies, so it builds and runs on a host
+// with a simulated network and store.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics_batch.h"
+
+// Longest sensor name kept, including the terminating NUL
+#ifndef READING_QUEUE_NAME_MAX
+#define READING_QUEUE_NAME_MAX 16
+#endif
+
+// Sequence numbers reserved in the spill header at a time; after a reboot
+// numbering resumes past the reserved block, so a flash write every this many
+// readings keeps the numbers rising
+#ifndef READING_QUEUE_SEQ_BLOCK
+#define READING_QUEUE_SEQ_BLOCK 256
+#endif
+
+// Readings spilled between two writes of the spill header. The header is
+// also written on every pop; readings spilled since the last write are found
+// again after a reboot by their sequence numbers, so a spilled reading costs
+// one flash write instead of two.
+#ifndef READING_QUEUE_HEADER_EVERY
+#define READING_QUEUE_HEADER_EVERY 32
+#endif
+
+// Readings looked at per reading_queue_fill_batch()
+#ifndef READING_QUEUE_BATCH_MAX
+#define READING_QUEUE_BATCH_MAX 16
+#endif
+
+typedef struct {
+  uint32_t seq;
+  uint32_t ts; // Unix time, 0 if the clock was not set
+  float value;
+  uint8_t decimals;
+  char name[READING_QUEUE_NAME_MAX];
+} reading_queue_entry_t;
+
+// Backing storage for the spill: a header followed by slots entries. read and
+// write move len bytes at offset and return false on failure.
+typedef struct {
+  bool (*read)(void *ctx, uint32_t offset, void *buf, size_t len);
+  bool (*write)(void *ctx, uint32_t offset, const void *buf, size_t len);
+  void *ctx;
+  uint32_t slots;
+} reading_queue_spill_t;
+
+typedef struct {
+  reading_queue_entry_t *ram;
+  uint16_t ram_slots;
+  uint16_t ram_head;
+  uint16_t ram_count;
+
+  const reading_queue_spill_t *spill; // NULL: RAM only
+  uint32_t spill_head;
+  uint32_t spill_count;
+  uint32_t spill_last_seq; // newest reading ever spilled, 0 if none
+  uint32_t spill_unsaved;  // readings spilled since the header was written
+
+  uint32_t next_seq;
+  uint32_t seq_reserved; // first number not yet reserved in the spill header
+
+  uint32_t spilled; // readings moved from RAM to the spill
+  uint32_t dropped; // readings lost to a full queue or a failing store
+} reading_queue_t;
+
+// ram holds ram_slots entries. A spill keeps the queue found in its header,
+// e.g. readings from before a reboot, plus any readings spilled after the
+// header was last written; a header that does not match starts the spill
+// empty, with numbering going on from it if it was a resized spill.
+void reading_queue_init(reading_queue_t *queue, reading_queue_entry_t *ram,
+                        uint16_t ram_slots, const reading_queue_spill_t *spill);
+
+// Queues a reading and returns its sequence number. The name is cut to
+// READING_QUEUE_NAME_MAX - 1 characters.
+uint32_t reading_queue_push(reading_queue_t *queue, const char *name,
+                            float value, uint8_t decimals, uint32_t ts);
+
+// Copies up to max of the oldest readings to out, oldest first. Returns the
+// number copied, fewer than queued when the spill cannot be read (its
+// readings are then dropped).
+size_t reading_queue_peek(reading_queue_t *queue, reading_queue_entry_t *out,
+                          size_t max);
+
+// Removes the n oldest readings, once they have been delivered
+void reading_queue_pop(reading_queue_t *queue, size_t n);
+
+static inline uint32_t reading_queue_size(const reading_queue_t *queue) {
+  return queue->spill_count + queue->ram_count;
+}
+
+// Clears batch and fills it with as many of the oldest readings as fit, with
+// their seq. Returns the number added, to be popped once the server has the
+// batch; 0 only when the queue is empty or the batch buffer cannot hold a
+// single reading.
+size_t reading_queue_fill_batch(reading_queue_t *queue, metrics_batch_t *batch);
+
+#endif
@@ -0,0 +1,51 @@
+#include "reading_queue_littlefs.h"
+
+#include <FS.h>
+#include <LittleFS.h>
+
+static File spill_file;
+
+static bool spill_read(void *ctx, uint32_t offset, void *buf, size_t len) {
+  return spill_file.seek(offset) &&
+         spill_file.read((uint8_t *)buf, len) == len;
+}
+
+static bool spill_write(void *ctx, uint32_t offset, const void *buf,
+                        size_t len) {
+  if (!spill_file.seek(offset) ||
+      spill_file.write((const uint8_t *)buf, len) != len) {
+    return false;
+  }
+  spill_file.flush(); // commit to flash, the point of the spill
+  return true;
+}
+
+bool reading_queue_littlefs_open(reading_queue_spill_t *spill, const char *path,
+                                 uint32_t slots) {
+  spill->read = spill_read;
+  spill->write = spill_write;
+  spill->ctx = NULL;
+  spill->slots = 0;
+
+#if defined(ESP8266)
+  bool mounted = LittleFS.begin(); // formats on failure by default
+#else
+  bool mounted = LittleFS.begin(true);
+#endif
+  if (!mounted) {
+    return false;
+  }
+  if (!LittleFS.exists(path)) {
+    File created = LittleFS.open(path, "w");
+    if (!created) {
+      return false;
+    }
+    created.close();
+  }
+  spill_file = LittleFS.open(path, "r+");
+  if (!spill_file) {
+    return false;
+  }
+  spill->slots = slots;
+  return true;
+}
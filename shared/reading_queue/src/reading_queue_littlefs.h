@@ -0,0 +1,22 @@
+#ifndef READING_QUEUE_LITTLEFS_H
+#define READING_QUEUE_LITTLEFS_H
+
+// Spill store for reading_queue.h in a LittleFS file, so readings queued
+// during a long outage outlive the RAM ring and a reboot:
+//
+//   static reading_queue_spill_t spill;
+//   reading_queue_littlefs_open(&spill, "/readings.q", 2048);
+//   reading_queue_init(&queue, ram, 64, &spill);
+//
+// The file takes slots * 32 bytes of flash plus a small header. One spill
+// file per firmware.
+
+#include "reading_queue.h"
+
+// Mounts LittleFS, formatting it if it does not mount, and opens or creates
+// the spill file. On failure returns false and leaves spill with no slots,
+// which reading_queue_init() treats as RAM only.
+bool reading_queue_littlefs_open(reading_queue_spill_t *spill, const char *path,
+                                 uint32_t slots);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef SENSOR_DRIVER_H
+#define SENSOR_DRIVER_H
+
+// Interface between a sensor and the rest of a sensor node. A driver wraps
+// one sensor library and hands out its measurement as named readings, so
+// the upload path is the same for every firmware:
+//
+//   class Mq135Driver : public SensorDriver {
+//   public:
+//     const char *name() const override { return "MQ135"; }
+//     bool begin() override { pinMode(34, INPUT); return true; }
+//     size_t read(sensor_reading_t *out, size_t max) override {
+//       out[0] = {"AirQuality", (float)analogRead(34), 0};
+//       return 1;
+//     }
+//   };
+//
+// No Arduino dependencies, so drivers can be faked on a host.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Most readings one measurement of a driver may produce
+#ifndef SENSOR_DRIVER_READINGS_MAX
+#define SENSOR_DRIVER_READINGS_MAX 8
+#endif
+
+typedef struct {
+  const char *name; // metric name on the server, e.g. "CO2"
+  float value;
+  uint8_t decimals; // sent with this many decimals
+} sensor_reading_t;
+
+class SensorDriver {
+public:
+  virtual ~SensorDriver() {}
+
+  // Short sensor name for logs
+  virtual const char *name() const = 0;
+
+  // Brings the sensor up; false if it does not respond
+  virtual bool begin() = 0;
+
+  // Whether a new measurement can be read without waiting, e.g. the
+  // sensor's data-ready flag. Polled; must not block.
+  virtual bool ready() { return true; }
+
+  // Reads the measurement into out (room for max readings). Returns the
+  // number of readings, 0 if the measurement failed.
+  virtual size_t read(sensor_reading_t *out, size_t max) = 0;
+};
+
+#endif
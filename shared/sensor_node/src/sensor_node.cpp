@@ -0,0 +1,148 @@
+#include "sensor_node.h"
+
+#if defined(ESP8266)
+#include <ESP8266WiFi.h>
+#else
+#include <WiFi.h>
+#endif
+
+int i2c_scan(TwoWire &wire, Print &log, const i2c_known_device_t *known,
+             size_t known_count, uint8_t *known_found) {
+  log.println("Scanning I2C bus...");
+  int found = 0;
+  if (known_found) {
+    *known_found = 0;
+  }
+  for (uint8_t address = 1; address < 127; address++) {
+    wire.beginTransmission(address);
+    uint8_t error = wire.endTransmission();
+    if (error == 4) {
+      log.printf("Unknown error at address 0x%02X\n", address);
+      continue;
+    }
+    if (error != 0) {
+      continue; // 2, 3: nothing answered at this address
+    }
+    const char *label = "Unknown device";
+    for (size_t i = 0; i < known_count; i++) {
+      if (known[i].address == address) {
+        label = known[i].label;
+        if (known_found) {
+          *known_found = address;
+        }
+        break;
+      }
+    }
+    log.printf("Device at 0x%02X (%s)\n", address, label);
+    found++;
+  }
+  if (found == 0) {
+    log.println("No I2C devices found!");
+  } else {
+    log.printf("Found %d device(s)\n", found);
+  }
+  return found;
+}
+
+bool wifi_connect(const char *ssid, const char *password, uint32_t timeout_ms,
+                  Print &log) {
+  log.print("Connecting to WiFi: ");
+  log.println(ssid);
+  WiFi.begin(ssid, password);
+  uint32_t start = millis();
+  while (WiFi.status() != WL_CONNECTED) {
+    if (timeout_ms && millis() - start >= timeout_ms) {
+      log.println("\nFailed to connect to WiFi");
+      return false;
+    }
+    delay(500);
+    log.print(".");
+  }
+  log.println("\nWiFi connected!");
+  log.print("IP address: ");
+  log.println(WiFi.localIP());
+  return true;
+}
+
+void sensor_node_begin_queue(SensorUploader &uploader, bool spill, Print &log) {
+  static reading_queue_spill_t littlefs;
+  bool spilling = false;
+  if (spill) {
+    spilling = reading_queue_littlefs_open(&littlefs, "/readings.q",
+                                           SENSOR_NODE_SPILL_SLOTS);
+    if (!spilling) {
+      log.println("LittleFS unavailable, queueing readings in RAM only");
+    }
+  }
+  uploader.begin(spilling ? &littlefs : NULL);
+  log.printf("%lu readings queued from before the restart\n",
+             (unsigned long)uploader.queued());
+}
+
+void sensor_node_print_stats(Print &out, const SensorUploader &uploader,
+                             const HttpTransport &transport) {
+  char line[192];
+  transport.http().printStats(out);
+  uploader.summary(line, sizeof(line));
+  out.println(line);
+  sensor_node_print_heap(out);
+}
+
+void sensor_node_print_heap(Print &out) {
+#if defined(ESP8266)
+  out.printf("Heap: %lu free, largest block %lu, %u%% fragmented\n",
+             (unsigned long)ESP.getFreeHeap(),
+             (unsigned long)ESP.getMaxFreeBlockSize(),
+             (unsigned)ESP.getHeapFragmentation());
+#else
+  out.printf("Heap: %lu free, largest block %lu, lowest free %lu\n",
+             (unsigned long)ESP.getFreeHeap(),
+             (unsigned long)ESP.getMaxAllocHeap(),
+             (unsigned long)ESP.getMinFreeHeap());
+#endif
+}
+
+HttpTransport::HttpTransport(const char *url, const char *ssid,
+                             const char *password, Print *log)
+    : _url(url), _ssid(ssid), _password(password), _log(log),
+      _wasConnected(true), _lastReconnectMs(0) {
+  _http.setTimeout(SENSOR_NODE_HTTP_TIMEOUT_MS);
+}
+
+bool HttpTransport::connected() {
+  if (WiFi.status() == WL_CONNECTED) {
+    _wasConnected = true;
+    return true;
+  }
+  // The WiFi driver reconnects by itself; a fresh begin() now and then
+  // covers a connection that was never made
+  if (_wasConnected || millis() - _lastReconnectMs >= SENSOR_NODE_RECONNECT_MS) {
+    if (_log) {
+      _log->println("WiFi not connected, reconnecting in the background");
+    }
+    _wasConnected = false;
+    _lastReconnectMs = millis();
+    _http.closeAll();
+    WiFi.begin(_ssid, _password);
+  }
+  return false;
+}
+
+int HttpTransport::post(const char *json, size_t len) {
+#if SENSOR_NODE_LOG_PAYLOADS
+  if (_log) {
+    _log->print("Sending payload: ");
+    _log->println(json);
+  }
+#endif
+  int code = _http.post(_url, "application/json", (const uint8_t *)json, len);
+  if (_log) {
+    if (code > 0) {
+      _log->printf("HTTP Response code: %d\n", code);
+    } else {
+      _log->printf("[HTTP] POST... failed, error: %d (%s)\n", code,
+                   HttpKeepAlive::errorToString(code));
+    }
+  }
+  return code;
+}
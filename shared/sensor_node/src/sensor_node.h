@@ -0,0 +1,107 @@
+#ifndef SENSOR_NODE_H
+#define SENSOR_NODE_H
+
+// Shared pieces of the sensor firmwares (ESP32 and ESP8266), which used to
+// carry their own copies: I2C bus scan, WiFi connect, and the upload path --
+// SensorUploader (sensor_uploader.h) over HttpTransport, a kept-open HTTP
+// connection (http_keepalive.h) that reconnects WiFi in the background:
+//
+//   static HttpTransport transport(serverUrl, WIFI_SSID, WIFI_PASSWORD);
+//   static SensorUploader uploader(transport);
+//
+//   void setup() {
+//     static const i2c_known_device_t known[] = {{0x62, "SCD4x"}};
+//     i2c_scan(Wire, Serial, known, 1, NULL);
+//     wifi_connect(WIFI_SSID, WIFI_PASSWORD, 0, Serial);
+//     configTime(0, 0, "pool.ntp.org"); // timestamps for the readings
+//     sensor_node_begin_queue(uploader, true);
+//   }
+
+#include <Arduino.h>
+#include <Wire.h>
+
+#include "http_keepalive.h"
+#include "reading_queue_littlefs.h"
+#include "sensor_driver.h"
+#include "sensor_uploader.h"
+
+// Least time between WiFi reconnect attempts while the link is down
+#ifndef SENSOR_NODE_RECONNECT_MS
+#define SENSOR_NODE_RECONNECT_MS 30000
+#endif
+
+// HttpTransport's limit for connecting and for the server's response,
+// shorter than HTTP_KEEPALIVE_TIMEOUT_MS so that a slow or silent server
+// stalls the measurement loop for about a second, not five. A metrics
+// server on the LAN answers well within it.
+#ifndef SENSOR_NODE_HTTP_TIMEOUT_MS
+#define SENSOR_NODE_HTTP_TIMEOUT_MS 1000
+#endif
+
+// 1: HttpTransport logs every JSON payload it posts, up to
+// SENSOR_UPLOADER_PAYLOAD_MAX bytes per request. For debugging only.
+#ifndef SENSOR_NODE_LOG_PAYLOADS
+#define SENSOR_NODE_LOG_PAYLOADS 0
+#endif
+
+// Readings a LittleFS spill holds, 32 bytes each: 64 KB, about three hours
+// of two readings every 10 s
+#ifndef SENSOR_NODE_SPILL_SLOTS
+#define SENSOR_NODE_SPILL_SLOTS 2048
+#endif
+
+typedef struct {
+  uint8_t address;
+  const char *label; // printed next to the address
+} i2c_known_device_t;
+
+// Probes addresses 1-126 and logs each device that answers, labelled from
+// known. Returns the number of devices found; *known_found, if given, gets
+// the address of the last known device found, or 0.
+int i2c_scan(TwoWire &wire, Print &log, const i2c_known_device_t *known,
+             size_t known_count, uint8_t *known_found);
+
+// Connects to WiFi, waiting up to timeout_ms (0: until connected). Returns
+// whether the connection is up; if not, the WiFi driver keeps trying.
+bool wifi_connect(const char *ssid, const char *password, uint32_t timeout_ms,
+                  Print &log);
+
+// Opens the uploader's queue, spilling to LittleFS if spill is set and the
+// file system mounts, and logs the readings left from before a restart
+void sensor_node_begin_queue(SensorUploader &uploader, bool spill,
+                             Print &log = Serial);
+
+// HTTP counters, queue counters and the heap (sensor_node_print_heap()),
+// one line each
+class HttpTransport;
+void sensor_node_print_stats(Print &out, const SensorUploader &uploader,
+                             const HttpTransport &transport);
+
+// Free heap and its largest free block. Over a soak of days the block
+// should hold steady; one shrinking while the free total does not means
+// the heap is fragmenting.
+void sensor_node_print_heap(Print &out);
+
+// UploadTransport over a kept-open HTTP connection. Logs each request and
+// its outcome to log, if given.
+class HttpTransport : public UploadTransport {
+public:
+  HttpTransport(const char *url, const char *ssid, const char *password,
+                Print *log = &Serial);
+
+  bool connected() override;
+  int post(const char *json, size_t len) override;
+
+  const HttpKeepAlive &http() const { return _http; }
+
+private:
+  const char *_url;
+  const char *_ssid;
+  const char *_password;
+  Print *_log;
+  bool _wasConnected;
+  uint32_t _lastReconnectMs;
+  HttpKeepAlive _http;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "sensor_uploader.h"
+
+#include <stdio.h>
+#include <string.h>
+
+SensorUploader::SensorUploader(UploadTransport &transport)
+    : _transport(transport), _minBatch(1), _retryDelayMs(0), _retryAtMs(0) {
+  memset(&_stats, 0, sizeof(_stats));
+  metrics_batch_init(&_batch, _payload, sizeof(_payload));
+  reading_queue_init(&_queue, _ram, SENSOR_UPLOADER_RAM_SLOTS, NULL);
+}
+
+void SensorUploader::begin(const reading_queue_spill_t *spill) {
+  reading_queue_init(&_queue, _ram, SENSOR_UPLOADER_RAM_SLOTS, spill);
+}
+
+void SensorUploader::add(const char *name, float value, uint8_t decimals) {
+  reading_queue_push(&_queue, name, value, decimals, metrics_batch_now());
+}
+
+void SensorUploader::add(const sensor_reading_t *readings, size_t count) {
+  uint32_t ts = metrics_batch_now(); // one measurement, one timestamp
+  for (size_t i = 0; i < count; i++) {
+    reading_queue_push(&_queue, readings[i].name, readings[i].value,
+                       readings[i].decimals, ts);
+  }
+}
+
+size_t SensorUploader::addFrom(SensorDriver &driver) {
+  if (!driver.ready()) {
+    return 0;
+  }
+  sensor_reading_t readings[SENSOR_DRIVER_READINGS_MAX];
+  size_t count = driver.read(readings, SENSOR_DRIVER_READINGS_MAX);
+  if (count > SENSOR_DRIVER_READINGS_MAX) {
+    count = SENSOR_DRIVER_READINGS_MAX;
+  }
+  add(readings, count);
+  return count;
+}
+
+int SensorUploader::poll(uint32_t nowMs) {
+  if (queued() < _minBatch) {
+    return 0;
+  }
+  if (_retryDelayMs && (int32_t)(nowMs - _retryAtMs) < 0) {
+    return 0; // backing off after a failure
+  }
+  if (!_transport.connected()) {
+    _stats.offline++;
+    return 0;
+  }
+  size_t count = reading_queue_fill_batch(&_queue, &_batch);
+  if (count == 0) {
+    return 0;
+  }
+  int code = _transport.post(metrics_batch_json(&_batch),
+                             metrics_batch_length(&_batch));
+  bool ok = code >= 200 && code < 300;
+  // Any other 4xx is the payload's fault and would be rejected again; a 5xx,
+  // timeout (408), rate limit (429) or no response at all is worth a retry
+  bool refused = code >= 400 && code < 500 && code != 408 && code != 429;
+  if (ok || refused) {
+    reading_queue_pop(&_queue, count);
+    _stats.batches++;
+    if (ok) {
+      _stats.delivered += count;
+    } else {
+      _stats.rejected += count;
+    }
+    _retryDelayMs = 0;
+  } else {
+    _stats.failures++;
+    _retryDelayMs = _retryDelayMs ? _retryDelayMs * 2 : SENSOR_UPLOADER_RETRY_MIN_MS;
+    if (_retryDelayMs > SENSOR_UPLOADER_RETRY_MAX_MS) {
+      _retryDelayMs = SENSOR_UPLOADER_RETRY_MAX_MS;
+    }
+    _retryAtMs = nowMs + _retryDelayMs;
+  }
+  return code;
+}
+
+size_t SensorUploader::summary(char *buf, size_t len) const {
+  int n = snprintf(buf, len,
+                   "Uploads: %lu batches, %lu readings delivered, %lu rejected, "
+                   "%lu failed, %lu offline; queue %lu waiting, %lu spilled, "
+                   "%lu dropped",
+                   (unsigned long)_stats.batches, (unsigned long)_stats.delivered,
+                   (unsigned long)_stats.rejected, (unsigned long)_stats.failures,
+                   (unsigned long)_stats.offline, (unsigned long)queued(),
+                   (unsigned long)_queue.spilled, (unsigned long)_queue.dropped);
+  if (n < 0) {
+    buf[0] = '\0';
+    return 0;
+  }
+  return (size_t)n < len ? (size_t)n : len - 1;
+}
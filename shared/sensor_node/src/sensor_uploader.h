@@ -0,0 +1,122 @@
+#ifndef SENSOR_UPLOADER_H
+#define SENSOR_UPLOADER_H
+
+// Uploader of a sensor node: readings are queued (reading_queue.h) and sent
+// to the metrics server in batches (metrics_batch.h) from poll(), which
+// returns straight away when there is nothing to do, WiFi is down or the
+// server failed recently. When a batch is due, poll() makes the request
+// synchronously: it blocks until the server answers or the transport's
+// timeout runs out (SENSOR_NODE_HTTP_TIMEOUT_MS for HttpTransport, for the
+// connect and again for the response). A sketch calls it from a timer or a
+// cooperative task, about once a second, as long as its measurements
+// tolerate that. Not on every loop(): the offline counter counts polls.
+//
+//   static HttpTransport transport(serverUrl, ssid, password);
+//   static SensorUploader uploader(transport);
+//
+//   void setup() { uploader.begin(NULL); }
+//   void loop() {
+//     uploader.addFrom(driver); // when it is time for a measurement
+//     if (millis() - lastPoll >= 1000) {
+//       lastPoll = millis();
+//       uploader.poll(millis());
+//     }
+//   }
+//
+// One poll() sends at most one batch, so a call takes no longer than one
+// request, resent at most once on a fresh connection. A batch leaves the queue once the server answers 2xx, or 4xx for a
+// payload it will never accept. After a request without a response, a 5xx,
+// 408 or 429 the batch stays queued and the uploader backs off, doubling the
+// wait from SENSOR_UPLOADER_RETRY_MIN_MS up to SENSOR_UPLOADER_RETRY_MAX_MS.
+//
+// The payload buffer and the RAM queue are members, allocated once with the
+// uploader. No Arduino dependencies: the network is behind UploadTransport,
+// and HttpTransport (sensor_node.h) is the one the firmwares use.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics_batch.h"
+#include "reading_queue.h"
+#include "sensor_driver.h"
+
+#ifndef SENSOR_UPLOADER_RAM_SLOTS
+#define SENSOR_UPLOADER_RAM_SLOTS 64
+#endif
+
+#ifndef SENSOR_UPLOADER_PAYLOAD_MAX
+#define SENSOR_UPLOADER_PAYLOAD_MAX 1024
+#endif
+
+#ifndef SENSOR_UPLOADER_RETRY_MIN_MS
+#define SENSOR_UPLOADER_RETRY_MIN_MS 2000
+#endif
+
+#ifndef SENSOR_UPLOADER_RETRY_MAX_MS
+#define SENSOR_UPLOADER_RETRY_MAX_MS 60000
+#endif
+
+class UploadTransport {
+public:
+  virtual ~UploadTransport() {}
+
+  // Whether a request can be made now. Must not block; may start a
+  // reconnect in the background.
+  virtual bool connected() = 0;
+
+  // POSTs a JSON payload. Returns the HTTP status, or a negative value when
+  // no response came.
+  virtual int post(const char *json, size_t len) = 0;
+};
+
+typedef struct {
+  uint32_t batches;   // batches taken off the queue: answered 2xx or 4xx
+  uint32_t delivered; // readings in batches answered with a 2xx status
+  uint32_t rejected;  // readings in batches refused with a 4xx status
+  uint32_t failures;  // requests kept for a retry: no response, 5xx, 408, 429
+  uint32_t offline;   // polls that found the transport down
+} sensor_uploader_stats_t;
+
+class SensorUploader {
+public:
+  explicit SensorUploader(UploadTransport &transport);
+
+  // Opens the queue; spill may be NULL for RAM only
+  void begin(const reading_queue_spill_t *spill);
+
+  // Queues one reading, timestamped now if the clock is set
+  void add(const char *name, float value, uint8_t decimals);
+  void add(const sensor_reading_t *readings, size_t count);
+
+  // Queues a measurement of driver if it is ready. Returns the number of
+  // readings queued; 0 if not ready or the measurement failed.
+  size_t addFrom(SensorDriver &driver);
+
+  // Sends the oldest queued readings once at least minBatch are waiting
+  // (default 1), e.g. to send every other measurement in one request
+  void setMinBatch(uint16_t readings) { _minBatch = readings ? readings : 1; }
+
+  // Sends at most one batch if one is due. Returns the HTTP status of the
+  // request, a negative value if it failed, or 0 if nothing was sent.
+  int poll(uint32_t nowMs);
+
+  uint32_t queued() const { return reading_queue_size(&_queue); }
+  const reading_queue_t &queue() const { return _queue; }
+  const sensor_uploader_stats_t &stats() const { return _stats; }
+
+  // One line of counters, NUL-terminated; returns its length
+  size_t summary(char *buf, size_t len) const;
+
+private:
+  UploadTransport &_transport;
+  reading_queue_entry_t _ram[SENSOR_UPLOADER_RAM_SLOTS];
+  reading_queue_t _queue;
+  char _payload[SENSOR_UPLOADER_PAYLOAD_MAX];
+  metrics_batch_t _batch;
+  uint16_t _minBatch;
+  uint32_t _retryDelayMs; // 0 while requests succeed
+  uint32_t _retryAtMs;
+  sensor_uploader_stats_t _stats;
+};
+
+#endif
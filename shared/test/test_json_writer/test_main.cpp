@@ -0,0 +1,193 @@
+// Host tests of the fixed-buffer JSON writer: string escaping, integer and
+// fixed-point formatting against printf, and overflow handling.
+// Run with: pio test -e native
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "json_writer.h"
+
+static char buf[64];
+static json_writer_t out;
+
+void setUp(void) { json_writer_init(&out, buf, sizeof(buf)); }
+
+void tearDown(void) {}
+
+static const char *fixed(float value, uint8_t decimals) {
+  json_writer_truncate(&out, 0);
+  TEST_ASSERT_TRUE(json_write_fixed(&out, value, decimals));
+  return buf;
+}
+
+static void test_string_escaping(void) {
+  TEST_ASSERT_TRUE(json_write_string(&out, "a\"b\\c/"));
+  TEST_ASSERT_EQUAL_STRING("\"a\\\"b\\\\c/\"", buf);
+
+  json_writer_truncate(&out, 0);
+  json_write_string(&out, "\b\f\n\r\t");
+  TEST_ASSERT_EQUAL_STRING("\"\\b\\f\\n\\r\\t\"", buf);
+
+  json_writer_truncate(&out, 0);
+  json_write_string(&out, "\x01\x1f\x7f");
+  TEST_ASSERT_EQUAL_STRING("\"\\u0001\\u001f\x7f\"", buf);
+
+  // UTF-8 is copied as is
+  json_writer_truncate(&out, 0);
+  json_write_string(&out, "\xc2\xb5g/m\xc2\xb3");
+  TEST_ASSERT_EQUAL_STRING("\"\xc2\xb5g/m\xc2\xb3\"", buf);
+
+  json_writer_truncate(&out, 0);
+  json_write_string(&out, "");
+  TEST_ASSERT_EQUAL_STRING("\"\"", buf);
+  TEST_ASSERT_EQUAL_size_t(2, out.len);
+}
+
+static void test_integers(void) {
+  json_write_uint(&out, 0);
+  json_write_raw(&out, ",");
+  json_write_uint(&out, UINT32_MAX);
+  json_write_raw(&out, ",");
+  json_write_int(&out, -1);
+  json_write_raw(&out, ",");
+  json_write_int(&out, INT32_MIN);
+  json_write_raw(&out, ",");
+  json_write_int(&out, INT32_MAX);
+  TEST_ASSERT_EQUAL_STRING("0,4294967295,-1,-2147483648,2147483647", buf);
+}
+
+static void test_fixed_point(void) {
+  TEST_ASSERT_EQUAL_STRING("412", fixed(412, 0));
+  TEST_ASSERT_EQUAL_STRING("21.4", fixed(21.44f, 1));
+  TEST_ASSERT_EQUAL_STRING("21.440", fixed(21.44f, 3));
+  TEST_ASSERT_EQUAL_STRING("0.05", fixed(0.05f, 2));
+  TEST_ASSERT_EQUAL_STRING("-3.25", fixed(-3.25f, 2));
+  TEST_ASSERT_EQUAL_STRING("0.000001", fixed(0.000001f, 6));
+  // More decimals than JSON_WRITER_DECIMALS_MAX are cut
+  TEST_ASSERT_EQUAL_STRING("1.234568", fixed(1.23456789f, 9));
+}
+
+static void test_round_half_to_even(void) {
+  // Exactly halfway in binary, so printf rounds them to the even digit
+  TEST_ASSERT_EQUAL_STRING("0", fixed(0.5f, 0));
+  TEST_ASSERT_EQUAL_STRING("2", fixed(1.5f, 0));
+  TEST_ASSERT_EQUAL_STRING("2", fixed(2.5f, 0));
+  TEST_ASSERT_EQUAL_STRING("4", fixed(3.5f, 0));
+  TEST_ASSERT_EQUAL_STRING("-2", fixed(-2.5f, 0));
+  TEST_ASSERT_EQUAL_STRING("0.12", fixed(0.125f, 2));
+  TEST_ASSERT_EQUAL_STRING("0.38", fixed(0.375f, 2));
+  TEST_ASSERT_EQUAL_STRING("48.2", fixed(48.25f, 1));
+  // Not halfway: 0.15f is a little above 0.15
+  TEST_ASSERT_EQUAL_STRING("0.2", fixed(0.15f, 1));
+}
+
+static void test_zero_has_no_sign(void) {
+  TEST_ASSERT_EQUAL_STRING("0", fixed(-0.0f, 0));
+  TEST_ASSERT_EQUAL_STRING("0", fixed(-0.4f, 0));
+  TEST_ASSERT_EQUAL_STRING("0.00", fixed(-0.004f, 2));
+  TEST_ASSERT_EQUAL_STRING("-0.01", fixed(-0.006f, 2));
+}
+
+static void test_not_finite_is_null(void) {
+  TEST_ASSERT_EQUAL_STRING("null", fixed(NAN, 2));
+  TEST_ASSERT_EQUAL_STRING("null", fixed(INFINITY, 0));
+  TEST_ASSERT_EQUAL_STRING("null", fixed(-INFINITY, 0));
+}
+
+static void test_exponent_fallback(void) {
+  // Scaled past 2^53 the value goes out with a float's 7 significant digits
+  TEST_ASSERT_EQUAL_STRING("1.000000e10", fixed(1e10f, 6));
+  TEST_ASSERT_EQUAL_STRING("-1.234568e20", fixed(-1.2345678e20f, 0));
+  TEST_ASSERT_EQUAL_STRING("3.402823e38", fixed(3.4028235e38f, 0));
+  // 1e11f is 99999997952, whose mantissa rounds up to the next power of ten
+  TEST_ASSERT_EQUAL_STRING("1.000000e11", fixed(1e11f, 6));
+  // Below the limit it is still fixed-point, every digit as printf has it
+  TEST_ASSERT_EQUAL_STRING("4503599627370496", fixed(4503599627370496.0f, 0));
+  TEST_ASSERT_EQUAL_STRING("8999999815811072", fixed(9e15f, 0));
+}
+
+static void test_matches_printf(void) {
+  // Pseudo-random floats over many magnitudes, every number of decimals
+  uint32_t state = 12345;
+  char expected[64];
+  for (int i = 0; i < 20000; i++) {
+    state = state * 1103515245 + 12345;
+    float mantissa = (float)(state >> 8) / (1 << 24) * 2 - 1;
+    float value = ldexpf(mantissa, (int)(state % 40) - 20);
+    uint8_t decimals = state % (JSON_WRITER_DECIMALS_MAX + 1);
+    int n = snprintf(expected, sizeof(expected), "%.*f", decimals,
+                     (double)value);
+    if (strspn(expected, "-0.") == (size_t)n && expected[0] == '-') {
+      memmove(expected, expected + 1, n); // the writer drops the sign of 0
+    }
+    TEST_ASSERT_EQUAL_STRING(expected, fixed(value, decimals));
+  }
+}
+
+static void test_writes_are_all_or_nothing(void) {
+  char small[8];
+  json_writer_init(&out, small, sizeof(small));
+  TEST_ASSERT_TRUE(json_write_raw(&out, "[1,"));
+  TEST_ASSERT_FALSE(json_write_string(&out, "long"));
+  TEST_ASSERT_EQUAL_STRING("[1,", small);
+  TEST_ASSERT_TRUE(json_writer_overflowed(&out));
+
+  json_writer_init(&out, small, sizeof(small));
+  TEST_ASSERT_TRUE(json_write_raw(&out, "[1,"));
+  TEST_ASSERT_FALSE(json_write_fixed(&out, 123.456f, 2));
+  TEST_ASSERT_EQUAL_STRING("[1,", small);
+}
+
+static void test_overflow_is_sticky(void) {
+  char small[8];
+  json_writer_init(&out, small, sizeof(small));
+  TEST_ASSERT_TRUE(json_write_raw(&out, "1234567")); // fills it, NUL included
+  TEST_ASSERT_FALSE(json_write_uint(&out, 8));
+  // Once overflowed, even a write that would fit is refused
+  TEST_ASSERT_FALSE(json_write_raw(&out, ""));
+  TEST_ASSERT_TRUE(json_writer_overflowed(&out));
+  TEST_ASSERT_EQUAL_STRING("1234567", small);
+  TEST_ASSERT_EQUAL_size_t(7, out.len);
+}
+
+static void test_truncate_rolls_back(void) {
+  char small[8];
+  json_writer_init(&out, small, sizeof(small));
+  json_write_raw(&out, "[1");
+  size_t mark = out.len;
+  json_write_raw(&out, ",");
+  json_write_int(&out, -1000000); // does not fit
+  TEST_ASSERT_TRUE(json_writer_overflowed(&out));
+
+  json_writer_truncate(&out, mark);
+  TEST_ASSERT_FALSE(json_writer_overflowed(&out));
+  TEST_ASSERT_EQUAL_STRING("[1", small);
+  TEST_ASSERT_TRUE(json_write_raw(&out, "]"));
+  TEST_ASSERT_EQUAL_STRING("[1]", small);
+}
+
+static void test_one_byte_buffer_holds_the_empty_string(void) {
+  char tiny[1];
+  json_writer_init(&out, tiny, sizeof(tiny));
+  TEST_ASSERT_EQUAL_STRING("", tiny);
+  TEST_ASSERT_FALSE(json_write_raw(&out, "0"));
+  TEST_ASSERT_EQUAL_STRING("", tiny);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_string_escaping);
+  RUN_TEST(test_integers);
+  RUN_TEST(test_fixed_point);
+  RUN_TEST(test_round_half_to_even);
+  RUN_TEST(test_zero_has_no_sign);
+  RUN_TEST(test_not_finite_is_null);
+  RUN_TEST(test_exponent_fallback);
+  RUN_TEST(test_matches_printf);
+  RUN_TEST(test_writes_are_all_or_nothing);
+  RUN_TEST(test_overflow_is_sticky);
+  RUN_TEST(test_truncate_rolls_back);
+  RUN_TEST(test_one_byte_buffer_holds_the_empty_string);
+  return UNITY_END();
+}
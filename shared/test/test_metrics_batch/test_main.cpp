@@ -0,0 +1,105 @@
+// Host tests of the /data payload builder: the array format, optional fields,
+// and that a reading that does not fit leaves the batch as it was.
+// Run with: pio test -e native
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "metrics_batch.h"
+
+static char buf[256];
+static metrics_batch_t batch;
+
+void setUp(void) { metrics_batch_init(&batch, buf, sizeof(buf)); }
+
+void tearDown(void) {}
+
+static void test_empty_batch_is_an_empty_array(void) {
+  TEST_ASSERT_EQUAL_STRING("[]", metrics_batch_json(&batch));
+  TEST_ASSERT_EQUAL_size_t(2, metrics_batch_length(&batch));
+  TEST_ASSERT_EQUAL_UINT16(0, batch.count);
+}
+
+static void test_readings_with_ts_and_seq(void) {
+  TEST_ASSERT_TRUE(metrics_batch_add(&batch, "CO2", 412, 0, 1718000000));
+  TEST_ASSERT_TRUE(metrics_batch_add_seq(&batch, "Temperature", 21.44f, 1,
+                                         1718000000, 7));
+  TEST_ASSERT_EQUAL_STRING(
+      "[{\"sensor_name\":\"CO2\",\"sensor_value\":412,\"ts\":1718000000},"
+      "{\"sensor_name\":\"Temperature\",\"sensor_value\":21.4,"
+      "\"ts\":1718000000,\"seq\":7}]",
+      metrics_batch_json(&batch));
+  TEST_ASSERT_EQUAL_size_t(strlen(buf), metrics_batch_length(&batch));
+  TEST_ASSERT_EQUAL_UINT16(2, batch.count);
+}
+
+static void test_zero_ts_and_seq_are_left_out(void) {
+  metrics_batch_add_seq(&batch, "CO2", 412, 0, 0, 0);
+  TEST_ASSERT_EQUAL_STRING("[{\"sensor_name\":\"CO2\",\"sensor_value\":412}]",
+                           metrics_batch_json(&batch));
+}
+
+static void test_name_is_escaped_and_nan_is_null(void) {
+  metrics_batch_add(&batch, "a\"b", NAN, 2, 0);
+  TEST_ASSERT_EQUAL_STRING(
+      "[{\"sensor_name\":\"a\\\"b\",\"sensor_value\":null}]",
+      metrics_batch_json(&batch));
+}
+
+static void test_reading_that_does_not_fit_is_undone(void) {
+  char small[100];
+  metrics_batch_init(&batch, small, sizeof(small));
+  TEST_ASSERT_TRUE(metrics_batch_add(&batch, "CO2", 412, 0, 1718000000));
+  char before[sizeof(small)];
+  strcpy(before, small);
+
+  TEST_ASSERT_FALSE(metrics_batch_add(&batch, "Temperature", 21.4f, 1,
+                                      1718000000));
+  TEST_ASSERT_EQUAL_STRING(before, small);
+  TEST_ASSERT_EQUAL_size_t(strlen(before), metrics_batch_length(&batch));
+  TEST_ASSERT_EQUAL_UINT16(1, batch.count);
+
+  // Not stuck: a reading that fits is still taken
+  TEST_ASSERT_TRUE(metrics_batch_add(&batch, "T", 1, 0, 0));
+  TEST_ASSERT_EQUAL_STRING(
+      "[{\"sensor_name\":\"CO2\",\"sensor_value\":412,\"ts\":1718000000},"
+      "{\"sensor_name\":\"T\",\"sensor_value\":1}]",
+      small);
+}
+
+static void test_buffer_too_small_for_the_brackets(void) {
+  char tiny[2];
+  metrics_batch_init(&batch, tiny, sizeof(tiny));
+  TEST_ASSERT_FALSE(metrics_batch_add(&batch, "CO2", 412, 0, 0));
+  TEST_ASSERT_EQUAL_UINT16(0, batch.count);
+  TEST_ASSERT_EQUAL_size_t(0, metrics_batch_length(&batch));
+}
+
+static void test_clear_starts_over(void) {
+  metrics_batch_add(&batch, "CO2", 412, 0, 0);
+  metrics_batch_end_tick(&batch);
+  TEST_ASSERT_EQUAL_UINT16(1, batch.ticks);
+  metrics_batch_clear(&batch);
+  TEST_ASSERT_EQUAL_STRING("[]", metrics_batch_json(&batch));
+  TEST_ASSERT_EQUAL_UINT16(0, batch.count);
+  TEST_ASSERT_EQUAL_UINT16(0, batch.ticks);
+}
+
+static void test_now_once_the_clock_is_set(void) {
+  // The host clock is set; before that it would be 0
+  TEST_ASSERT_TRUE(metrics_batch_now() >= 1672531200);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_batch_is_an_empty_array);
+  RUN_TEST(test_readings_with_ts_and_seq);
+  RUN_TEST(test_zero_ts_and_seq_are_left_out);
+  RUN_TEST(test_name_is_escaped_and_nan_is_null);
+  RUN_TEST(test_reading_that_does_not_fit_is_undone);
+  RUN_TEST(test_buffer_too_small_for_the_brackets);
+  RUN_TEST(test_clear_starts_over);
+  RUN_TEST(test_now_once_the_clock_is_set);
+  return UNITY_END();
+}
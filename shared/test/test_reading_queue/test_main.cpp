@@ -0,0 +1,274 @@
+// Host tests of the store-and-forward queue: RAM ring, spill to a simulated
+// flash store, and what survives a reboot.
+// Run with: pio test -e native
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "reading_queue.h"
+
+#define RAM_SLOTS 4
+#define SPILL_SLOTS 8
+
+// In-memory stand-in for the LittleFS file, with failure switches
+static struct {
+  uint8_t data[64 + SPILL_SLOTS * sizeof(reading_queue_entry_t)];
+  bool fail_read;
+  bool fail_write;
+  int header_writes;
+} store;
+
+static bool store_read(void *ctx, uint32_t offset, void *buf, size_t len) {
+  if (store.fail_read || offset + len > sizeof(store.data)) {
+    return false;
+  }
+  memcpy(buf, store.data + offset, len);
+  return true;
+}
+
+static bool store_write(void *ctx, uint32_t offset, const void *buf,
+                        size_t len) {
+  if (store.fail_write || offset + len > sizeof(store.data)) {
+    return false;
+  }
+  memcpy(store.data + offset, buf, len);
+  store.header_writes += offset == 0;
+  return true;
+}
+
+static const reading_queue_spill_t spill = {store_read, store_write, NULL,
+                                            SPILL_SLOTS};
+
+static reading_queue_entry_t ram[RAM_SLOTS];
+static reading_queue_t queue;
+
+void setUp(void) {
+  memset(&store, 0, sizeof(store));
+  memset(ram, 0, sizeof(ram));
+}
+
+void tearDown(void) {}
+
+static void push(int n) {
+  for (int i = 0; i < n; i++) {
+    reading_queue_push(&queue, "CO2", 400.0f + i, 0, 1718000000);
+  }
+}
+
+// Checks that the queue holds the readings numbered first, first + 1, ...
+static void assert_seqs(uint32_t first, size_t count) {
+  reading_queue_entry_t out[RAM_SLOTS + SPILL_SLOTS];
+  TEST_ASSERT_EQUAL_UINT32(count, reading_queue_size(&queue));
+  TEST_ASSERT_EQUAL_size_t(count, reading_queue_peek(&queue, out, count));
+  for (size_t i = 0; i < count; i++) {
+    TEST_ASSERT_EQUAL_UINT32(first + i, out[i].seq);
+  }
+}
+
+static void test_ram_only_keeps_the_newest(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, NULL);
+  TEST_ASSERT_EQUAL_UINT32(1, reading_queue_push(&queue, "CO2", 412, 0, 0));
+  push(RAM_SLOTS + 1);
+  assert_seqs(3, RAM_SLOTS);
+  TEST_ASSERT_EQUAL_UINT32(2, queue.dropped);
+  TEST_ASSERT_EQUAL_UINT32(0, queue.spilled);
+}
+
+static void test_entry_fields(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, NULL);
+  reading_queue_push(&queue, "a_rather_long_sensor_name", 21.4f, 1, 1718000000);
+  reading_queue_entry_t e;
+  TEST_ASSERT_EQUAL_size_t(1, reading_queue_peek(&queue, &e, 1));
+  TEST_ASSERT_EQUAL_STRING("a_rather_long_s", e.name); // cut to fit
+  TEST_ASSERT_EQUAL_FLOAT(21.4f, e.value);
+  TEST_ASSERT_EQUAL_UINT8(1, e.decimals);
+  TEST_ASSERT_EQUAL_UINT32(1718000000, e.ts);
+}
+
+static void test_overflow_spills_oldest_first(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  push(RAM_SLOTS + 6);
+  TEST_ASSERT_EQUAL_UINT32(6, queue.spill_count);
+  TEST_ASSERT_EQUAL_UINT32(6, queue.spilled);
+  TEST_ASSERT_EQUAL_UINT32(0, queue.dropped);
+  assert_seqs(1, RAM_SLOTS + 6);
+}
+
+static void test_full_spill_drops_the_oldest(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  push(RAM_SLOTS + SPILL_SLOTS + 3);
+  TEST_ASSERT_EQUAL_UINT32(3, queue.dropped);
+  assert_seqs(4, RAM_SLOTS + SPILL_SLOTS);
+}
+
+static void test_pop_across_spill_and_ram(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  push(RAM_SLOTS + 3);
+  reading_queue_pop(&queue, 5); // the 3 spilled and 2 from RAM
+  TEST_ASSERT_EQUAL_UINT32(0, queue.spill_count);
+  assert_seqs(6, 2);
+  reading_queue_pop(&queue, 10);
+  TEST_ASSERT_EQUAL_UINT32(0, reading_queue_size(&queue));
+}
+
+static void test_spill_survives_a_reboot(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  push(RAM_SLOTS + 6);
+  reading_queue_pop(&queue, 2);
+
+  // Reboot: RAM is gone, the store is not
+  memset(ram, 0, sizeof(ram));
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  assert_seqs(3, 4);
+
+  // Numbering resumes past anything used before the reboot
+  uint32_t seq = reading_queue_push(&queue, "CO2", 1, 0, 0);
+  TEST_ASSERT_TRUE(seq > RAM_SLOTS + 6);
+}
+
+static void test_seq_keeps_rising_over_reboots(void) {
+  uint32_t last = 0;
+  for (int boot = 0; boot < 3; boot++) {
+    reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+    for (int i = 0; i < READING_QUEUE_SEQ_BLOCK + 10; i++) {
+      uint32_t seq = reading_queue_push(&queue, "CO2", 1, 0, 0);
+      TEST_ASSERT_TRUE(seq > last);
+      last = seq;
+      reading_queue_pop(&queue, 1);
+    }
+  }
+  // The header is written once per block of numbers, not per reading
+  TEST_ASSERT_TRUE(store.header_writes < 3 * READING_QUEUE_SEQ_BLOCK);
+}
+
+static void test_resized_store_starts_empty(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  push(RAM_SLOTS + 3);
+
+  reading_queue_spill_t other = spill;
+  other.slots = SPILL_SLOTS - 1; // e.g. resized by a firmware update
+  reading_queue_init(&queue, ram, RAM_SLOTS, &other);
+  TEST_ASSERT_EQUAL_UINT32(0, reading_queue_size(&queue));
+  // Numbering goes on, above the readings left in the old slots
+  TEST_ASSERT_TRUE(reading_queue_push(&queue, "CO2", 1, 0, 0) > RAM_SLOTS + 3);
+}
+
+static void test_foreign_store_starts_over(void) {
+  memset(store.data, 0xa5, sizeof(store.data));
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  TEST_ASSERT_EQUAL_UINT32(0, reading_queue_size(&queue));
+  TEST_ASSERT_EQUAL_UINT32(1, reading_queue_push(&queue, "CO2", 1, 0, 0));
+}
+
+static void test_header_is_not_written_per_reading(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  int before = store.header_writes;
+  push(RAM_SLOTS + 2 * READING_QUEUE_HEADER_EVERY);
+  // One for the block of sequence numbers, one per HEADER_EVERY spilled
+  TEST_ASSERT_EQUAL_INT(1 + 2, store.header_writes - before);
+}
+
+static void test_unsaved_spill_survives_a_reboot(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  push(RAM_SLOTS + 5); // 5 spilled, none of them in the header yet
+
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  assert_seqs(1, 5);
+  TEST_ASSERT_EQUAL_UINT32(1 + READING_QUEUE_SEQ_BLOCK,
+                           reading_queue_push(&queue, "CO2", 1, 0, 0));
+}
+
+static void test_overwritten_spill_survives_a_reboot(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  // The spill fills and wraps around its oldest readings, unsaved
+  push(RAM_SLOTS + SPILL_SLOTS + 3);
+
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  assert_seqs(4, SPILL_SLOTS);
+}
+
+static void test_unsaved_spill_over_saved_readings(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  push(RAM_SLOTS + 6);
+  reading_queue_pop(&queue, 1); // writes the header: 5 spilled
+  // 5 more spill, the last two over the oldest saved ones
+  push(5);
+
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  assert_seqs(4, SPILL_SLOTS);
+}
+
+static void test_popped_slots_stay_popped_over_a_reboot(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  push(RAM_SLOTS + 6);
+  reading_queue_pop(&queue, RAM_SLOTS + 6);
+  push(RAM_SLOTS + 2); // spilled past the six popped ones, unsaved
+
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  assert_seqs(RAM_SLOTS + 7, 2);
+}
+
+static void test_unreadable_spill_is_dropped(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  push(RAM_SLOTS + 3);
+  store.fail_read = true;
+  reading_queue_entry_t out[RAM_SLOTS + SPILL_SLOTS];
+  TEST_ASSERT_EQUAL_size_t(RAM_SLOTS, reading_queue_peek(&queue, out, 16));
+  TEST_ASSERT_EQUAL_UINT32(4, out[0].seq);
+  TEST_ASSERT_EQUAL_UINT32(3, queue.dropped);
+  TEST_ASSERT_EQUAL_UINT32(RAM_SLOTS, reading_queue_size(&queue));
+}
+
+static void test_failed_spill_write_is_dropped(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  store.fail_write = true;
+  push(RAM_SLOTS + 2);
+  TEST_ASSERT_EQUAL_UINT32(2, queue.dropped);
+  TEST_ASSERT_EQUAL_UINT32(0, queue.spilled);
+  assert_seqs(3, RAM_SLOTS);
+}
+
+static void test_fill_batch(void) {
+  reading_queue_init(&queue, ram, RAM_SLOTS, &spill);
+  push(RAM_SLOTS + 2);
+
+  char buf[512];
+  metrics_batch_t batch;
+  metrics_batch_init(&batch, buf, sizeof(buf));
+  TEST_ASSERT_EQUAL_size_t(RAM_SLOTS + 2,
+                           reading_queue_fill_batch(&queue, &batch));
+  const char *first = "[{\"sensor_name\":\"CO2\",\"sensor_value\":400,"
+                      "\"ts\":1718000000,\"seq\":1},";
+  TEST_ASSERT_EQUAL_STRING_LEN(first, buf, strlen(first));
+  // Filling does not remove anything
+  TEST_ASSERT_EQUAL_UINT32(RAM_SLOTS + 2, reading_queue_size(&queue));
+
+  // A small buffer takes as many readings as fit
+  char small[150];
+  metrics_batch_init(&batch, small, sizeof(small));
+  TEST_ASSERT_EQUAL_size_t(2, reading_queue_fill_batch(&queue, &batch));
+  TEST_ASSERT_EQUAL_UINT16(2, batch.count);
+  TEST_ASSERT_EQUAL_size_t(strlen(small), metrics_batch_length(&batch));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_ram_only_keeps_the_newest);
+  RUN_TEST(test_entry_fields);
+  RUN_TEST(test_overflow_spills_oldest_first);
+  RUN_TEST(test_full_spill_drops_the_oldest);
+  RUN_TEST(test_pop_across_spill_and_ram);
+  RUN_TEST(test_spill_survives_a_reboot);
+  RUN_TEST(test_seq_keeps_rising_over_reboots);
+  RUN_TEST(test_resized_store_starts_empty);
+  RUN_TEST(test_foreign_store_starts_over);
+  RUN_TEST(test_header_is_not_written_per_reading);
+  RUN_TEST(test_unsaved_spill_survives_a_reboot);
+  RUN_TEST(test_overwritten_spill_survives_a_reboot);
+  RUN_TEST(test_unsaved_spill_over_saved_readings);
+  RUN_TEST(test_popped_slots_stay_popped_over_a_reboot);
+  RUN_TEST(test_unreadable_spill_is_dropped);
+  RUN_TEST(test_failed_spill_write_is_dropped);
+  RUN_TEST(test_fill_batch);
+  return UNITY_END();
+}
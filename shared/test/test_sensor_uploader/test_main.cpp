@@ -0,0 +1,264 @@
+// Host tests of SensorUploader against a simulated network: batching,
+// backoff, and what happens to a batch for each kind of answer.
+// Run with: pio test -e native
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "sensor_uploader.h"
+
+// Stands in for HttpTransport: up or down, answering every post with code
+class FakeTransport : public UploadTransport {
+public:
+  bool up = true;
+  int code = 200;
+  int posts = 0;
+  size_t readings = 0; // in the last post
+  char last[SENSOR_UPLOADER_PAYLOAD_MAX];
+
+  bool connected() override { return up; }
+
+  int post(const char *json, size_t len) override {
+    posts++;
+    memcpy(last, json, len);
+    last[len] = '\0';
+    readings = 0;
+    for (const char *p = json; (p = strstr(p, "\"sensor_name\"")); p++) {
+      readings++;
+    }
+    return code;
+  }
+};
+
+static FakeTransport *net;
+static SensorUploader *uploader;
+
+void setUp(void) {
+  net = new FakeTransport();
+  uploader = new SensorUploader(*net);
+  uploader->begin(NULL);
+}
+
+void tearDown(void) {
+  delete uploader;
+  delete net;
+}
+
+static void add_readings(int n) {
+  for (int i = 0; i < n; i++) {
+    uploader->add("CO2", 400.0f + i, 0);
+  }
+}
+
+static void test_nothing_queued_sends_nothing(void) {
+  TEST_ASSERT_EQUAL_INT(0, uploader->poll(0));
+  TEST_ASSERT_EQUAL_INT(0, net->posts);
+}
+
+static void test_min_batch_holds_readings_back(void) {
+  uploader->setMinBatch(3);
+  add_readings(2);
+  TEST_ASSERT_EQUAL_INT(0, uploader->poll(0));
+  TEST_ASSERT_EQUAL_INT(0, net->posts);
+
+  add_readings(1);
+  TEST_ASSERT_EQUAL_INT(200, uploader->poll(0));
+  TEST_ASSERT_EQUAL_size_t(3, net->readings);
+  TEST_ASSERT_EQUAL_UINT32(0, uploader->queued());
+  TEST_ASSERT_EQUAL_UINT32(3, uploader->stats().delivered);
+  TEST_ASSERT_EQUAL_UINT32(1, uploader->stats().batches);
+}
+
+static void test_offline_keeps_readings(void) {
+  net->up = false;
+  add_readings(2);
+  TEST_ASSERT_EQUAL_INT(0, uploader->poll(0));
+  TEST_ASSERT_EQUAL_INT(0, net->posts);
+  TEST_ASSERT_EQUAL_UINT32(1, uploader->stats().offline);
+  TEST_ASSERT_EQUAL_UINT32(2, uploader->queued());
+
+  net->up = true;
+  TEST_ASSERT_EQUAL_INT(200, uploader->poll(1));
+  TEST_ASSERT_EQUAL_UINT32(0, uploader->queued());
+}
+
+static void test_one_batch_per_poll(void) {
+  // A batch holds as many readings as READING_QUEUE_BATCH_MAX and the
+  // payload buffer allow
+  add_readings(20);
+  uploader->poll(0);
+  TEST_ASSERT_EQUAL_INT(1, net->posts);
+  size_t first = net->readings;
+  TEST_ASSERT_TRUE(first > 0 && first <= READING_QUEUE_BATCH_MAX);
+  TEST_ASSERT_EQUAL_UINT32(20 - first, uploader->queued());
+
+  uploader->poll(0);
+  TEST_ASSERT_EQUAL_INT(2, net->posts);
+  TEST_ASSERT_EQUAL_size_t(20 - first, net->readings);
+  TEST_ASSERT_EQUAL_UINT32(0, uploader->queued());
+}
+
+static void test_backoff_doubles_up_to_the_limit(void) {
+  net->code = -1; // no response
+  add_readings(1);
+  uint32_t now = 1000;
+  uint32_t delay = SENSOR_UPLOADER_RETRY_MIN_MS;
+  int posts = 0;
+  for (int i = 0; i < 10; i++) {
+    TEST_ASSERT_EQUAL_INT(-1, uploader->poll(now));
+    TEST_ASSERT_EQUAL_INT(++posts, net->posts);
+    // Nothing is sent until the delay has passed
+    TEST_ASSERT_EQUAL_INT(0, uploader->poll(now + delay - 1));
+    TEST_ASSERT_EQUAL_INT(posts, net->posts);
+    now += delay;
+    delay *= 2;
+    if (delay > SENSOR_UPLOADER_RETRY_MAX_MS) {
+      delay = SENSOR_UPLOADER_RETRY_MAX_MS;
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT32(10, uploader->stats().failures);
+  TEST_ASSERT_EQUAL_UINT32(1, uploader->queued());
+
+  // The first answer ends the backoff
+  net->code = 200;
+  TEST_ASSERT_EQUAL_INT(200, uploader->poll(now));
+  add_readings(1);
+  TEST_ASSERT_EQUAL_INT(200, uploader->poll(now));
+  TEST_ASSERT_EQUAL_UINT32(2, uploader->stats().delivered);
+}
+
+static void test_backoff_across_millis_wrap(void) {
+  net->code = -1;
+  add_readings(1);
+  uint32_t now = UINT32_MAX - 500;
+  uploader->poll(now);
+  TEST_ASSERT_EQUAL_INT(0, uploader->poll(now + 1000)); // wrapped, still early
+  net->code = 200;
+  now += SENSOR_UPLOADER_RETRY_MIN_MS;
+  TEST_ASSERT_EQUAL_INT(200, uploader->poll(now));
+}
+
+static void test_server_error_keeps_the_batch(void) {
+  add_readings(3);
+  net->code = 503;
+  TEST_ASSERT_EQUAL_INT(503, uploader->poll(0));
+  TEST_ASSERT_EQUAL_UINT32(3, uploader->queued());
+  TEST_ASSERT_EQUAL_UINT32(1, uploader->stats().failures);
+  TEST_ASSERT_EQUAL_UINT32(0, uploader->stats().rejected);
+  TEST_ASSERT_EQUAL_UINT32(0, uploader->stats().batches);
+
+  // Resent whole after the backoff, with the same sequence numbers
+  char first[SENSOR_UPLOADER_PAYLOAD_MAX];
+  strcpy(first, net->last);
+  net->code = 200;
+  TEST_ASSERT_EQUAL_INT(0, uploader->poll(1));
+  TEST_ASSERT_EQUAL_INT(200, uploader->poll(SENSOR_UPLOADER_RETRY_MIN_MS));
+  TEST_ASSERT_EQUAL_STRING(first, net->last);
+  TEST_ASSERT_EQUAL_UINT32(3, uploader->stats().delivered);
+  TEST_ASSERT_EQUAL_UINT32(0, uploader->queued());
+}
+
+static void test_timeout_and_rate_limit_keep_the_batch(void) {
+  add_readings(2);
+  net->code = 429;
+  uploader->poll(0);
+  TEST_ASSERT_EQUAL_UINT32(2, uploader->queued());
+  net->code = 408;
+  uploader->poll(SENSOR_UPLOADER_RETRY_MIN_MS);
+  TEST_ASSERT_EQUAL_UINT32(2, uploader->queued());
+  TEST_ASSERT_EQUAL_UINT32(2, uploader->stats().failures);
+}
+
+static void test_client_error_drops_the_batch(void) {
+  add_readings(3);
+  net->code = 400;
+  TEST_ASSERT_EQUAL_INT(400, uploader->poll(0));
+  TEST_ASSERT_EQUAL_UINT32(0, uploader->queued());
+  TEST_ASSERT_EQUAL_UINT32(3, uploader->stats().rejected);
+  TEST_ASSERT_EQUAL_UINT32(0, uploader->stats().delivered);
+  TEST_ASSERT_EQUAL_UINT32(1, uploader->stats().batches);
+  TEST_ASSERT_EQUAL_UINT32(0, uploader->stats().failures);
+
+  // No backoff after an answer
+  net->code = 201;
+  add_readings(1);
+  TEST_ASSERT_EQUAL_INT(201, uploader->poll(0));
+  TEST_ASSERT_EQUAL_UINT32(1, uploader->stats().delivered);
+}
+
+static void test_full_ram_queue_drops_the_oldest(void) {
+  net->up = false;
+  add_readings(SENSOR_UPLOADER_RAM_SLOTS + 36);
+  uploader->poll(0);
+  TEST_ASSERT_EQUAL_UINT32(SENSOR_UPLOADER_RAM_SLOTS, uploader->queued());
+  TEST_ASSERT_EQUAL_UINT32(36, uploader->queue().dropped);
+
+  // What is left goes out oldest first, numbered on from the dropped ones
+  net->up = true;
+  uploader->poll(1);
+  TEST_ASSERT_NOT_NULL(strstr(net->last, "\"seq\":37}"));
+  for (int i = 0; i < 10 && uploader->queued(); i++) {
+    uploader->poll(1);
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, uploader->queued());
+  TEST_ASSERT_EQUAL_UINT32(SENSOR_UPLOADER_RAM_SLOTS,
+                           uploader->stats().delivered);
+}
+
+static void test_add_from_driver(void) {
+  class TwoReadings : public SensorDriver {
+  public:
+    bool isReady = false;
+    const char *name() const override { return "fake"; }
+    bool begin() override { return true; }
+    bool ready() override { return isReady; }
+    size_t read(sensor_reading_t *out, size_t max) override {
+      out[0] = {"Temperature", 21.4f, 1};
+      out[1] = {"Humidity", 48.25f, 1};
+      return 2;
+    }
+  } driver;
+
+  TEST_ASSERT_EQUAL_size_t(0, uploader->addFrom(driver));
+  driver.isReady = true;
+  TEST_ASSERT_EQUAL_size_t(2, uploader->addFrom(driver));
+  uploader->poll(0);
+  TEST_ASSERT_NOT_NULL(strstr(net->last, "\"sensor_value\":21.4,"));
+  TEST_ASSERT_NOT_NULL(strstr(net->last, "\"sensor_value\":48.2,"));
+}
+
+static void test_summary(void) {
+  add_readings(2);
+  uploader->poll(0);
+  net->code = 500;
+  add_readings(1);
+  uploader->poll(0);
+  char line[192];
+  size_t len = uploader->summary(line, sizeof(line));
+  TEST_ASSERT_EQUAL_size_t(strlen(line), len);
+  TEST_ASSERT_EQUAL_STRING("Uploads: 1 batches, 2 readings delivered, "
+                           "0 rejected, 1 failed, 0 offline; queue 1 waiting, "
+                           "0 spilled, 0 dropped",
+                           line);
+
+  char small[16];
+  TEST_ASSERT_EQUAL_size_t(15, uploader->summary(small, sizeof(small)));
+  TEST_ASSERT_EQUAL_STRING("Uploads: 1 batc", small);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_nothing_queued_sends_nothing);
+  RUN_TEST(test_min_batch_holds_readings_back);
+  RUN_TEST(test_offline_keeps_readings);
+  RUN_TEST(test_one_batch_per_poll);
+  RUN_TEST(test_backoff_doubles_up_to_the_limit);
+  RUN_TEST(test_backoff_across_millis_wrap);
+  RUN_TEST(test_server_error_keeps_the_batch);
+  RUN_TEST(test_timeout_and_rate_limit_keep_the_batch);
+  RUN_TEST(test_client_error_drops_the_batch);
+  RUN_TEST(test_full_ram_queue_drops_the_oldest);
+  RUN_TEST(test_add_from_driver);
+  RUN_TEST(test_summary);
+  return UNITY_END();
+}